@@ -2,10 +2,18 @@
 #define CYMCALC_H
 
 #include <gmp.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
 #include <string.h>
 #include <stdlib.h>
 #include <math.h>
 
+#ifdef CYMCALC_THREADS
+#include <pthread.h>
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -33,10 +41,36 @@ typedef enum {
     FUNC_LOG
 } FuncType;
 
+// CYMCALC_INDEX32 halves hash-cons slots, memo tables and index buffers. It
+// costs no range: free_list is int, so an arena never exceeds 2^31 nodes.
+// sizeof(Expr) is 48 either way: the union is bounded by the inline mpq_t, so
+// narrower links only leave more of it unused.
+// Print an index with "%" EXPR_PRI_INDEX.
+#ifdef CYMCALC_INDEX32
+typedef uint32_t ExprIndex;
+#define EXPR_PRI_INDEX PRIu32
+#else
 typedef size_t ExprIndex;
+#define EXPR_PRI_INDEX "zu"
+#endif
+
+// Expr.flags, set by the constructors
+#define EXPR_META_CONST 0x1  // no symbols below
+#define EXPR_META_POLY  0x2  // numbers and symbols under +, * and ^ by naturals
 
+// type, used, flags, depth and degree share the first word; the union is
+// bounded by mpq_t. The metadata fields describe the whole subtree and are
+// filled in once, when the node is built. A number is always one node and one
+// term, so its last word holds the cached double instead of the shape.
 typedef struct {
-    ExprType type;
+    uint8_t type;     // ExprType, a byte to leave room for the metadata
+
+    // For arena bookkeeping
+    bool used;
+
+    uint8_t flags;    // EXPR_META_*
+    uint16_t depth;   // 1 for a leaf, saturates
+    uint16_t degree;  // total degree under EXPR_META_POLY, saturates
 
     union {
         // EXPR_NUMBER
@@ -67,18 +101,154 @@ typedef struct {
 
     } data;
 
-    // For arena bookkeeping
-    bool used;
+    union {
+        // EXPR_NUMBER: mpq_get_d of the value, NAN until first asked for
+        double approx;
+
+        // every other type, read through expr_meta_size/expr_meta_terms
+        struct {
+            uint32_t size;    // nodes of the tree, shared subtrees counted each time; saturates
+            uint32_t terms;   // under EXPR_META_POLY, bound on the terms of the expansion; saturates
+        } shape;
+    } meta;
 
 } Expr;
 
+#ifndef MAX_EXPR_COUNT
 #define MAX_EXPR_COUNT 10000
-#define INVALID_INDEX ((size_t)-1)
+#endif
+
+// GMP temporaries kept initialized in every arena
+#ifndef EXPR_SCRATCH_COUNT
+#define EXPR_SCRATCH_COUNT 16
+#endif
+#define INVALID_INDEX ((ExprIndex)-1)
+
+// Lock-free open-addressing table of canonical nodes keyed by structural
+// hash. Attached to an arena it makes the constructors return the existing
+// index for a structurally equal node, so concurrent workers building into
+// that arena converge on one index per distinct subexpression. Freeing a
+// node tombstones its entry; expr_arena_clear empties the table.
+typedef struct {
+    ExprIndex* slots;  // INVALID_INDEX marks an empty slot, EXPR_HASHCONS_TOMBSTONE a freed one
+    size_t mask;       // capacity - 1, capacity is a power of two
+} ExprHashCons;
+#define EXPR_HASHCONS_TOMBSTONE ((ExprIndex)-2)
+
+// Immutable copy of an arena that any number of threads may read without
+// synchronization. Node indices are preserved, so an index obtained from the
+// frozen arena names the same expression in the snapshot.
+typedef struct {
+    Expr* pool;                    // MAX_EXPR_COUNT nodes, never modified
+} ExprSnapshot;
+
+// Where an arena gets the memory it owns outside its node array: symbol and
+// variable names, and under CYMCALC_GMP_POOL the chunks holding number limbs.
+// free receives the size given to alloc. Zeroed members mean malloc/free.
+typedef struct {
+    void* (*alloc)(void* ctx, size_t size);
+    void (*free)(void* ctx, void* p, size_t size);
+    void* ctx;
+} ExprAllocator;
+
+#ifdef CYMCALC_GMP_POOL
+typedef struct ExprGmpPool ExprGmpPool;
+#endif
+
+#ifdef CYMCALC_STATS
+// Algorithms whose calls and recursion depth are counted
+typedef enum {
+    EXPR_ALGO_SIMPLIFY,
+    EXPR_ALGO_DIFFERENTIATE,
+    EXPR_ALGO_INTEGRATE,
+    EXPR_ALGO_SUBSTITUTE,
+    EXPR_ALGO_EVAL,
+    EXPR_ALGO_EXPAND,
+    EXPR_ALGO_NORMAL,
+    EXPR_ALGO_SERIES,
+    EXPR_ALGO_COUNT
+} ExprAlgo;
+
+// Activity counters of one arena. Every level of a recursive algorithm is a
+// call; depth is the nesting open right now. A concurrent arena sums all
+// threads, so its depths mix workers.
+typedef struct {
+    size_t nodes_allocated;
+    size_t nodes_freed;
+    size_t nodes_peak;               // high-water mark of nodes in use
+    size_t gmp_bytes;                // limb bytes held by number nodes
+    size_t gmp_bytes_peak;
+    size_t calls[EXPR_ALGO_COUNT];
+    size_t depth[EXPR_ALGO_COUNT];
+    size_t max_depth[EXPR_ALGO_COUNT];
+    size_t equal_calls;              // expr_equal, recursive calls included
+    size_t equal_deep;               // calls that had to look inside the nodes
+    size_t hashcons_hits;
+    size_t hashcons_misses;
+    size_t approx_hits;              // cached doubles of number nodes
+    size_t approx_misses;
+} ExprStats;
+#endif
+
+#ifdef CYMCALC_PROFILE_RULES
+// Rewrites of expr_simplify told apart by the rule profiler
+typedef enum {
+    EXPR_RULE_ADD_NUMBERS,     // n + m
+    EXPR_RULE_ADD_ZERO,        // 0 + x, x + 0
+    EXPR_RULE_ADD_SWAP,        // x + n → n + x
+    EXPR_RULE_ADD_COLLECT,     // a*x + b*x → (a+b)*x
+    EXPR_RULE_MUL_NUMBERS,     // n * m
+    EXPR_RULE_MUL_ONE,         // 1 * x
+    EXPR_RULE_MUL_ZERO,        // 0 * x
+    EXPR_RULE_MUL_SWAP,        // x * n → n * x
+    EXPR_RULE_MUL_COEFF,       // n * (m * x) → (n*m) * x
+    EXPR_RULE_MUL_DISTRIBUTE,  // n * (x + y) → n*x + n*y
+    EXPR_RULE_MUL_SQUARE,      // x * x → x^2
+    EXPR_RULE_MUL_POW_MERGE,   // x^a * x^b → x^(a+b)
+    EXPR_RULE_POW_ZERO,        // x^0
+    EXPR_RULE_POW_ONE,         // x^1
+    EXPR_RULE_POW_ZERO_BASE,   // 0^x
+    EXPR_RULE_POW_ONE_BASE,    // 1^x
+    EXPR_RULE_EXPAND,          // polynomial subtree handed to expr_expand
+    EXPR_RULE_DIFF,            // unevaluated derivative resolved
+    EXPR_RULE_INT,             // unevaluated integral resolved
+    EXPR_RULE_COUNT
+} ExprRule;
+
+// Per rule: how often it fired, nodes allocated and wall time while it ran.
+// Nodes and total time include the rules it triggered; self time does not.
+typedef struct {
+    size_t hits[EXPR_RULE_COUNT];
+    size_t nodes[EXPR_RULE_COUNT];
+    uint64_t total_ns[EXPR_RULE_COUNT];
+    uint64_t self_ns[EXPR_RULE_COUNT];
+} ExprRuleProfile;
+#endif
 
 typedef struct {
     Expr pool[MAX_EXPR_COUNT];
     int free_list[MAX_EXPR_COUNT]; // indices of free slots
     int free_count;                // number of free slots available
+
+    bool error;                    // expr_at was handed an index that is not a node
+    Expr invalid;                  // what expr_at returns for it, the symbol <invalid>
+    ExprHashCons* hashcons;        // canonical node table, NULL when not sharing
+    bool concurrent;               // constructors may run on several threads
+    const ExprSnapshot* base;      // read-only nodes visible through this arena
+    ExprAllocator allocator;       // names and limb chunks, malloc by default
+#ifdef CYMCALC_GMP_POOL
+    ExprGmpPool* gmp;              // limbs of the number nodes, NULL before install
+#endif
+    mpq_t scratch_q[EXPR_SCRATCH_COUNT]; // lent out by expr_scratch_q
+    mpz_t scratch_z[EXPR_SCRATCH_COUNT]; // lent out by expr_scratch_z
+    int scratch_q_top;             // number of rationals currently lent
+    int scratch_z_top;             // number of integers currently lent
+#ifdef CYMCALC_STATS
+    ExprStats stats;               // zeroed by expr_arena_init
+#endif
+#ifdef CYMCALC_PROFILE_RULES
+    ExprRuleProfile rules;         // zeroed by expr_arena_init
+#endif
 } ExprArena;
 
 
@@ -87,7 +257,7 @@ typedef struct {
 //-----------------------------------------------
 
 ExprIndex expr_number(ExprArena* arena, char* num_str);
-ExprIndex expr_number_mpq(ExprArena* arena, const mpq_t value);
+ExprIndex expr_number_mpq(ExprArena* arena, mpq_srcptr value);
 ExprIndex expr_symbol(ExprArena* arena, char* name);
 ExprIndex expr_add(ExprArena* arena, ExprIndex left, ExprIndex right);
 ExprIndex expr_mul(ExprArena* arena, ExprIndex left, ExprIndex right);
@@ -115,9 +285,75 @@ ExprIndex expr_arena_alloc(ExprArena* arena);
 
 void expr_arena_free(ExprArena* arena, ExprIndex e);
 void expr_arena_init(ExprArena* arena);
+// Frees every node; the arena stays ready for new ones
+void expr_arena_clear(ExprArena* arena);
+// Frees every node and what it owns. The arena can be reused after
+// expr_arena_init; the struct itself belongs to the caller.
+void expr_arena_destroy(ExprArena* arena);
+// Must follow expr_arena_init, before the first node is made. Names are
+// allocated by whichever thread builds the node, so the allocator of a
+// concurrent arena must be thread-safe.
+void expr_arena_set_allocator(ExprArena* arena, const ExprAllocator* allocator);
+
+// Borrow an initialized temporary from the arena and hand it back, in LIFO
+// order, once done. Its value on entry is unspecified. Keeps internal
+// routines from paying an init/clear pair per call; past
+// EXPR_SCRATCH_COUNT, or on a concurrent arena, a fresh value is lent.
+mpq_ptr expr_scratch_q(ExprArena* arena);
+void expr_scratch_q_release(ExprArena* arena, mpq_ptr q);
+mpz_ptr expr_scratch_z(ExprArena* arena);
+void expr_scratch_z_release(ExprArena* arena, mpz_ptr z);
+
+#ifdef CYMCALC_GMP_POOL
+// Installs GMP memory functions that take the limbs of each arena's number
+// nodes from size-classed pools owned by that arena, so clearing or
+// destroying an arena drops them in bulk instead of one free per number.
+// Other GMP values keep using malloc (behind a small header). Must run
+// before any other GMP allocation in the process; arenas initialized
+// earlier keep using malloc.
+void expr_gmp_pool_install(void);
+#endif
+
+#ifdef CYMCALC_STATS
+void expr_stats_reset(ExprArena* arena);
+// Table of the counters, one per line
+void expr_stats_print(const ExprArena* arena, FILE* out);
+#endif
+
+#ifdef CYMCALC_PROFILE_RULES
+void expr_rules_reset(ExprArena* arena);
+// Table of the simplifier rules that fired, by descending self time
+void expr_rules_print(const ExprArena* arena, FILE* out);
+#endif
+
+#ifdef CYMCALC_TRACE
+// Records begin/end events of the outermost simplify, differentiate,
+// integrate, substitute, eval_numeric, expand, normal and series calls of
+// each thread, and of every derivative or integral resolved while
+// simplifying, with the arena's node count at each end. Events are
+// buffered in memory and written to path in Chrome trace-event JSON by
+// expr_trace_stop, or at exit.
+void expr_trace_start(const char* path);
+void expr_trace_stop(void);
+#endif
+
+// Hash-consing. The table holds indices for a single arena and is sized for
+// MAX_EXPR_COUNT nodes. Once shared, any number of threads may call the
+// constructors on the arena; freeing nodes must not overlap with them.
+void expr_hashcons_init(ExprHashCons* table);
+void expr_hashcons_free(ExprHashCons* table);
+void expr_arena_share(ExprArena* arena, ExprHashCons* table); // NULL detaches
 
+// Snapshots. An overlay is a private arena layered on a snapshot: indices of
+// snapshot nodes resolve to the snapshot, new nodes are allocated from the
+// indices the snapshot leaves free, so overlay expressions can freely point
+// into the shared model. The snapshot must outlive its overlays.
+ExprSnapshot* expr_snapshot_freeze(ExprArena* arena);
+void expr_snapshot_free(ExprSnapshot* snapshot);
+void expr_arena_init_overlay(ExprArena* overlay, const ExprSnapshot* base);
 
-Expr* expr_copy(const Expr* e);
+// Deep copy of e from src into dst. Subexpressions shared in src stay shared.
+ExprIndex expr_copy(ExprArena* dst, ExprArena* src, ExprIndex e);
 
 //-----------------------------------------------
 // Core Operations
@@ -132,6 +368,14 @@ ExprIndex expr_simplify(ExprArena* arena, const ExprIndex e);
 // Returns new expression with substituted values.
 ExprIndex expr_substitute(ExprArena* arena, ExprIndex e, const char* symbol, const char* value_str);
 
+// Taylor expansion of e in var around point up to (var - point)^order,
+// computed with truncated power series per node, O(order^2) each. sin, cos,
+// exp, log and powers use their differential recurrences. Only symbolic
+// coefficients and the result take arena nodes. Returns INVALID_INDEX where
+// no Taylor series exists (poles, log 0) or for unevaluated derivative and
+// integral nodes.
+ExprIndex expr_series(ExprArena* arena, ExprIndex e, const char* var, ExprIndex point, size_t order);
+
 double expr_eval_numeric(ExprArena* arena, ExprIndex e);
 
 Expr* expr_eval(const Expr* e,
@@ -139,6 +383,31 @@ Expr* expr_eval(const Expr* e,
                 const char* value_str);
 
 
+//-----------------------------------------------
+// Accessors
+//-----------------------------------------------
+
+// Each exits with a message when idx is not a node of the expected kind,
+// except expr_at: for an index that is not a node at all (INVALID_INDEX, out
+// of range or freed) it sets arena->error and returns the symbol <invalid>,
+// so a failed batch job is reported instead of ending the process.
+Expr* expr_at(ExprArena* arena, ExprIndex idx);
+ExprType expr_type(ExprArena* arena, ExprIndex idx);
+ExprIndex expr_left(ExprArena* arena, ExprIndex idx);   // ADD, MUL, POW
+ExprIndex expr_right(ExprArena* arena, ExprIndex idx);
+mpq_t* expr_value(ExprArena* arena, ExprIndex idx);     // NUMBER
+double expr_value_d(ExprArena* arena, ExprIndex idx);   // NUMBER, cached
+char* expr_name(ExprArena* arena, ExprIndex idx);       // SYMBOL
+FuncType expr_ftype(ExprArena* arena, ExprIndex idx);   // FUNC
+ExprIndex expr_arg(ExprArena* arena, ExprIndex idx);
+
+// Subtree metadata kept on every node, O(1)
+size_t expr_size(ExprArena* arena, ExprIndex idx);
+unsigned expr_depth(ExprArena* arena, ExprIndex idx);
+bool expr_is_const(ExprArena* arena, ExprIndex idx);
+bool expr_is_poly(ExprArena* arena, ExprIndex idx);
+long expr_degree(ExprArena* arena, ExprIndex idx);      // -1 unless expr_is_poly
+
 //-----------------------------------------------
 // Printing
 //-----------------------------------------------
@@ -146,7 +415,431 @@ Expr* expr_eval(const Expr* e,
 // Print to string in infix notation.
 // The returned string is heap-allocated. Caller must free it.
 void expr_print(ExprArena* arena, ExprIndex idx);
-char* expr_to_string(const Expr* e);
+char* expr_to_string(ExprArena* arena, ExprIndex idx);
+
+//-----------------------------------------------
+// Dense univariate polynomials
+//-----------------------------------------------
+
+// p(x) = (coeffs[0] + coeffs[1]*x + ... + coeffs[len-1]*x^(len-1)) / den
+// Coefficients are integers over one positive common denominator so that
+// products run on integers: schoolbook for short operands and Kronecker
+// substitution (one big GMP multiplication, Toom/FFT based as it grows)
+// above that.
+typedef struct {
+    mpz_t* coeffs;
+    size_t len;        // 0 for the zero polynomial, coeffs[len-1] != 0 otherwise
+    size_t capacity;
+    mpz_t den;
+} ExprPoly;
+
+void expr_poly_init(ExprPoly* p);
+void expr_poly_clear(ExprPoly* p);
+void expr_poly_set(ExprPoly* dst, const ExprPoly* src);
+void expr_poly_set_coeff(ExprPoly* p, size_t i, const mpq_t c);
+void expr_poly_get_coeff(mpq_t c, const ExprPoly* p, size_t i);
+long expr_poly_degree(const ExprPoly* p); // -1 for the zero polynomial
+
+// Outputs may alias inputs.
+void expr_poly_add(ExprPoly* r, const ExprPoly* a, const ExprPoly* b);
+void expr_poly_sub(ExprPoly* r, const ExprPoly* a, const ExprPoly* b);
+void expr_poly_mul(ExprPoly* r, const ExprPoly* a, const ExprPoly* b);
+void expr_poly_pow_ui(ExprPoly* r, const ExprPoly* a, unsigned long n);
+
+// a = q*b + r with deg r < deg b. q or r may be NULL. Returns false if b is 0.
+bool expr_poly_divrem(ExprPoly* q, ExprPoly* r, const ExprPoly* a, const ExprPoly* b);
+
+// q = a/b when b divides a. Large operands are divided as single integers
+// via Kronecker substitution. Returns false (q untouched) otherwise.
+bool expr_poly_divexact(ExprPoly* q, const ExprPoly* a, const ExprPoly* b);
+
+// Conversion from an expression that is a polynomial in var with rational
+// coefficients (numbers, var, +, * and non-negative integer powers).
+// Returns false and leaves p unspecified for anything else.
+bool expr_to_poly(ExprPoly* p, ExprArena* arena, ExprIndex e, const char* var);
+ExprIndex expr_from_poly(ExprArena* arena, const ExprPoly* p, const char* var);
+
+//-----------------------------------------------
+// Sparse multivariate polynomials
+//-----------------------------------------------
+
+// Exponents are packed EXPR_MPOLY_FIELDS per 64-bit word, the top bit of
+// each field is a guard that catches overflow on multiplication and borrow
+// on division. vars[0] lives in the highest field of word 0, so comparing
+// words in order gives lex order.
+#define EXPR_MPOLY_FIELD_BITS 16
+#define EXPR_MPOLY_FIELDS (64 / EXPR_MPOLY_FIELD_BITS)
+#define EXPR_MPOLY_MAX_EXP ((1ul << (EXPR_MPOLY_FIELD_BITS - 1)) - 1)
+
+typedef struct {
+    char** vars;
+    size_t nvars;
+    size_t words;      // words per monomial
+} ExprMPolyRing;
+
+// Terms are kept in strictly decreasing monomial order with integer
+// coefficients over one positive common denominator, as in ExprPoly.
+typedef struct {
+    const ExprMPolyRing* ring;
+    uint64_t* exps;    // len * ring->words
+    mpz_t* coeffs;
+    size_t len;
+    size_t capacity;
+    mpz_t den;
+} ExprMPoly;
+
+void expr_mpoly_ring_init(ExprMPolyRing* ring, const char* const* vars, size_t nvars);
+// Ring over every symbol in e, sorted by name.
+void expr_mpoly_ring_from_expr(ExprMPolyRing* ring, ExprArena* arena, ExprIndex e);
+void expr_mpoly_ring_clear(ExprMPolyRing* ring);
+
+void expr_mpoly_init(ExprMPoly* p, const ExprMPolyRing* ring);
+void expr_mpoly_clear(ExprMPoly* p);
+void expr_mpoly_set(ExprMPoly* dst, const ExprMPoly* src);
+
+// Operands must share a ring. Outputs may alias inputs. mul and pow use a
+// heap merge of the partial products (Johnson) and return false, leaving r
+// untouched, if an exponent would exceed EXPR_MPOLY_MAX_EXP.
+void expr_mpoly_add(ExprMPoly* r, const ExprMPoly* a, const ExprMPoly* b);
+void expr_mpoly_sub(ExprMPoly* r, const ExprMPoly* a, const ExprMPoly* b);
+bool expr_mpoly_mul(ExprMPoly* r, const ExprMPoly* a, const ExprMPoly* b);
+bool expr_mpoly_pow_ui(ExprMPoly* r, const ExprMPoly* a, unsigned long n);
+
+// q = a/b when b divides a, false (q untouched) otherwise.
+bool expr_mpoly_divexact(ExprMPoly* q, const ExprMPoly* a, const ExprMPoly* b);
+
+// Same contract as expr_to_poly, with every symbol required to be in the ring.
+bool expr_to_mpoly(ExprMPoly* p, ExprArena* arena, ExprIndex e);
+ExprIndex expr_from_mpoly(ExprArena* arena, const ExprMPoly* p);
+
+// Fully expanded and collected form of a polynomial expression, terms in
+// decreasing lex order of the sorted symbols. INVALID_INDEX if e is not a
+// polynomial. expr_simplify routes polynomial subtrees of at least
+// EXPR_MPOLY_SIMPLIFY_THRESHOLD nodes through here, unless the node metadata
+// bounds the expansion above EXPR_MPOLY_SIMPLIFY_MAX_TERMS terms or beyond
+// the arena's free slots.
+ExprIndex expr_expand(ExprArena* arena, ExprIndex e);
+
+#ifndef EXPR_MPOLY_SIMPLIFY_THRESHOLD
+#define EXPR_MPOLY_SIMPLIFY_THRESHOLD 64
+#endif
+#ifndef EXPR_MPOLY_SIMPLIFY_MAX_TERMS
+#define EXPR_MPOLY_SIMPLIFY_MAX_TERMS 4096
+#endif
+
+// Greatest common divisor, normalized to a primitive integer polynomial with
+// positive leading coefficient (0 only if both inputs are 0). Uses the
+// heuristic GCD (evaluate at a large integer, recurse, interpolate, check
+// by division), with Euclid's algorithm as the fallback for one variable.
+// Returns false if the heuristic gives up on a multivariate input.
+bool expr_mpoly_gcd(ExprMPoly* g, const ExprMPoly* a, const ExprMPoly* b);
+
+// Rational function num/den kept in normal form: gcd(num, den) = 1 and den
+// is a primitive integer polynomial with positive leading coefficient, so
+// equal functions have equal representations.
+typedef struct {
+    ExprMPoly num;
+    ExprMPoly den;
+} ExprRatFunc;
+
+void expr_ratfunc_init(ExprRatFunc* r, const ExprMPolyRing* ring);
+void expr_ratfunc_clear(ExprRatFunc* r);
+
+// Outputs may alias inputs. div fails on a zero divisor, pow on a negative
+// power of zero.
+void expr_ratfunc_add(ExprRatFunc* r, const ExprRatFunc* a, const ExprRatFunc* b);
+void expr_ratfunc_sub(ExprRatFunc* r, const ExprRatFunc* a, const ExprRatFunc* b);
+void expr_ratfunc_mul(ExprRatFunc* r, const ExprRatFunc* a, const ExprRatFunc* b);
+bool expr_ratfunc_div(ExprRatFunc* r, const ExprRatFunc* a, const ExprRatFunc* b);
+bool expr_ratfunc_pow_si(ExprRatFunc* r, const ExprRatFunc* a, long n);
+
+// Numbers, ring symbols, +, * and integer powers (negative ones included).
+bool expr_to_ratfunc(ExprRatFunc* r, ExprArena* arena, ExprIndex e);
+ExprIndex expr_from_ratfunc(ExprArena* arena, const ExprRatFunc* r);
+
+// Normal form of a rational expression as num * den^(-1), or just num or
+// den^(-1) when the other is 1. INVALID_INDEX if e is not a rational function
+// of its symbols.
+ExprIndex expr_normal(ExprArena* arena, ExprIndex e);
+
+//-----------------------------------------------
+// Matrices
+//-----------------------------------------------
+
+// Row-major matrix of expressions. The entries live in the arena, the
+// matrix only owns the index array.
+typedef struct {
+    size_t rows;
+    size_t cols;
+    ExprIndex* data;
+} ExprMatrix;
+
+// Zero matrix.
+void expr_matrix_init(ExprMatrix* m, ExprArena* arena, size_t rows, size_t cols);
+void expr_matrix_clear(ExprMatrix* m);
+ExprIndex expr_matrix_get(const ExprMatrix* m, size_t i, size_t j);
+void expr_matrix_set(ExprMatrix* m, size_t i, size_t j, ExprIndex e);
+
+// Entries must be rational functions of their symbols. Elimination is
+// fraction-free (Bareiss) over ExprMPoly, and results come back in
+// expr_normal form. det returns INVALID_INDEX for a non-square or
+// non-rational matrix. solve and inverse initialize x (a^-1 b) and inv,
+// and return false without touching them if a is singular.
+ExprIndex expr_matrix_det(ExprArena* arena, const ExprMatrix* a);
+bool expr_matrix_solve(ExprArena* arena, ExprMatrix* x, const ExprMatrix* a, const ExprMatrix* b);
+bool expr_matrix_inverse(ExprArena* arena, ExprMatrix* inv, const ExprMatrix* a);
+
+//-----------------------------------------------
+// Compiled evaluation
+//-----------------------------------------------
+
+typedef enum {
+    EXPR_OP_CONST,
+    EXPR_OP_VAR,
+    EXPR_OP_ADD,
+    EXPR_OP_MUL,
+    EXPR_OP_POW,
+    EXPR_OP_POWI,
+    EXPR_OP_SIN,
+    EXPR_OP_COS,
+    EXPR_OP_EXP,
+    EXPR_OP_LOG
+} ExprOp;
+
+// Instruction i writes slot i. a and b are operand slots, or the variable
+// number for EXPR_OP_VAR; value is the constant or the integer exponent.
+typedef struct {
+    ExprOp op;
+    size_t a;
+    size_t b;
+    double value;
+} ExprInstr;
+
+// Straight-line program computing several expressions at once. Compiling
+// follows the hash-consed DAG, so subexpressions shared between outputs
+// (f and f', the components of a system) are evaluated once.
+typedef struct {
+    ExprInstr* code;
+    size_t len;
+    size_t capacity;
+    size_t nvars;
+    size_t* outputs;   // slot of each output
+    size_t noutputs;
+    double* regs;      // one per instruction
+    double* lanes;     // len * EXPR_TAPE_LANES, allocated by the first batch evaluation
+} ExprTape;
+
+#ifndef EXPR_TAPE_LANES
+#define EXPR_TAPE_LANES 64
+#endif
+
+// Returns false if an output uses a symbol outside vars or an unevaluated
+// derivative or integral. NULL entries in vars are placeholders that match
+// no symbol. The tape does not reference the arena afterwards.
+bool expr_tape_compile(ExprTape* t, ExprArena* arena, const ExprIndex* outputs, size_t noutputs,
+                       const char* const* vars, size_t nvars);
+void expr_tape_clear(ExprTape* t);
+// out[k] = outputs[k] at vars = x.
+void expr_tape_eval(ExprTape* t, const double* x, double* out);
+// count points at once in structure-of-arrays layout: x[v * count + j] is
+// variable v of point j, out[k * count + j] output k. Runs each instruction
+// over EXPR_TAPE_LANES points at a time, so dispatch is paid per block and
+// the inner loops vectorize.
+void expr_tape_eval_batch(ExprTape* t, const double* x, size_t count, double* out);
+
+//-----------------------------------------------
+// Root finding
+//-----------------------------------------------
+
+#ifndef EXPR_ROOT_MAX_ITER
+#define EXPR_ROOT_MAX_ITER 100
+#endif
+
+// Root of e in var, with f and f' compiled onto one tape. Without a bracket
+// this is damped Newton from x0; with bracket = {lo, hi}, where f changes
+// sign, Newton steps that leave the bracket or converge too slowly fall
+// back to bisection. Converged when the step is below tol * (1 + |x|).
+bool expr_find_root(ExprArena* arena, ExprIndex e, const char* var, double x0, const double* bracket,
+                    double tol, double* root);
+
+// The same equation solved for each value of the symbol param, compiling
+// once. Failed entries are NAN; returns how many converged.
+size_t expr_find_roots(ExprArena* arena, ExprIndex e, const char* var, const char* param,
+                       const double* params, size_t count, double x0, const double* bracket,
+                       double tol, double* roots);
+
+//-----------------------------------------------
+// Ordinary differential equations
+//-----------------------------------------------
+
+#ifndef EXPR_ODE_MAX_STEPS
+#define EXPR_ODE_MAX_STEPS 100000
+#endif
+
+// y' = f(t, y) with f given as expressions in the state symbols and
+// optionally the time symbol. f is compiled once onto one tape, and f,
+// df/dt and the symbolic Jacobian onto a second one for the implicit solver.
+typedef struct {
+    size_t n;
+    ExprTape rhs;      // vars (t, y_0 .. y_{n-1}), outputs f
+    ExprTape jac;      // same vars, outputs f, df/dt, J row-major
+    double* x;
+    double* work;
+    size_t* pivots;
+    size_t steps;      // accepted and rejected steps of the last integration
+    size_t rejected;
+} ExprODE;
+
+// time may be NULL for an autonomous system. Fails like expr_tape_compile.
+bool expr_ode_init(ExprODE* ode, ExprArena* arena, const ExprIndex* rhs, const char* const* states, size_t n,
+                   const char* time);
+void expr_ode_clear(ExprODE* ode);
+
+// Integrate from t0 to t1 (either direction), updating y in place. Steps
+// are controlled by the weighted RMS error with weights atol + rtol*|y|.
+// Return false if the step size underflows or EXPR_ODE_MAX_STEPS is hit,
+// leaving y at the last accepted point.
+//
+// rk45: explicit Dormand-Prince 5(4), for non-stiff problems.
+// rosenbrock: linearly implicit 2(3) method of ode23s using the exact
+// Jacobian, for stiff problems.
+bool expr_ode_rk45(ExprODE* ode, double t0, double t1, double* y, double rtol, double atol);
+bool expr_ode_rosenbrock(ExprODE* ode, double t0, double t1, double* y, double rtol, double atol);
+
+// count trajectories stepped together with one shared step size, each
+// stage a single batched tape evaluation. y[i * count + j] is state i of
+// trajectory j.
+bool expr_ode_rk45_batch(ExprODE* ode, double t0, double t1, double* y, size_t count, double rtol, double atol);
+
+//-----------------------------------------------
+// Least-squares fitting
+//-----------------------------------------------
+
+#ifndef EXPR_FIT_MAX_ITER
+#define EXPR_FIT_MAX_ITER 200
+#endif
+
+// Observations y[i] of a model at rows of data: data[c][i] is the value of
+// the symbol columns[c] in row i. Columns are read in place.
+typedef struct {
+    const char* const* columns;
+    const double* const* data;
+    size_t ncolumns;
+    const double* y;
+    size_t rows;
+} ExprDataset;
+
+// Levenberg-Marquardt minimization of sum (model - y)^2 over the parameter
+// symbols, starting from and updating p. The model and its symbolic
+// gradient are compiled onto one tape, and each iteration is a single
+// streaming pass over the rows accumulating J^T J, J^T r and the cost in
+// SIMD blocks, without materializing the Jacobian. Returns true when the
+// step, or the largest decrease a Gauss-Newton step could still achieve
+// relative to the cost, falls below tol; false when the cost is not finite
+// or the model cannot be differentiated.
+bool expr_fit(ExprArena* arena, ExprIndex model, const char* const* params, size_t nparams,
+              const ExprDataset* data, double* p, double tol);
+
+#ifdef CYMCALC_THREADS
+//-----------------------------------------------
+// Parallelism (define CYMCALC_THREADS, link with pthreads)
+//-----------------------------------------------
+
+// Unit of work for the pool. Embed it as the first member of a larger struct
+// and recover the struct inside run.
+typedef struct ExprTask {
+    void (*run)(struct ExprTask* task);
+    int done;
+} ExprTask;
+
+#define EXPR_DEQUE_SIZE 1024
+
+// Chase-Lev work-stealing deque: the owner pushes and pops at bottom,
+// thieves take from top.
+typedef struct {
+    ExprTask* tasks[EXPR_DEQUE_SIZE];
+    long top;
+    long bottom;
+} ExprDeque;
+
+typedef struct {
+    int worker_count;          // including the thread calling expr_pool_run
+    pthread_t* threads;
+    ExprDeque* deques;
+    int active;                // nonzero while expr_pool_run is in progress
+    int stop;
+    pthread_mutex_t lock;      // only used to park idle workers
+    pthread_cond_t wake;
+    ExprArena* arenas;         // per-worker arenas for batch jobs, allocated on first use
+    ExprIndex* copy_memo;      // per-worker scratch for expr_copy, MAX_EXPR_COUNT entries each
+} ExprPool;
+
+// workers <= 0 uses one worker per online CPU.
+void expr_pool_init(ExprPool* pool, int workers);
+void expr_pool_destroy(ExprPool* pool);
+
+// Runs root on the calling thread with the pool's workers stealing the tasks
+// it spawns. Only one thread may drive a pool at a time.
+void expr_pool_run(ExprPool* pool, ExprTask* root);
+
+// Fork/join from inside a running task. spawn runs the task inline if the
+// worker's deque is full; join executes other tasks while it waits.
+void expr_pool_spawn(ExprPool* pool, ExprTask* task);
+void expr_pool_join(ExprPool* pool, ExprTask* task);
+
+// Index of the worker executing the current task, -1 outside the pool.
+int expr_pool_worker_index(void);
+
+// Subtrees smaller than this are simplified sequentially.
+#ifndef EXPR_PARALLEL_THRESHOLD
+#define EXPR_PARALLEL_THRESHOLD 256
+#endif
+
+// Same result as expr_simplify, with the operands of large ADD, MUL and POW
+// nodes simplified in parallel. The arena is switched to concurrent
+// allocation for the duration of the call.
+ExprIndex expr_simplify_parallel(ExprPool* pool, ExprArena* arena, ExprIndex e);
+
+// expr_fit with each pass split over the pool in chunks of at least
+// EXPR_FIT_CHUNK rows. Partial sums are combined in a fixed order.
+#ifndef EXPR_FIT_CHUNK
+#define EXPR_FIT_CHUNK 8192
+#endif
+bool expr_fit_parallel(ExprPool* pool, ExprArena* arena, ExprIndex model, const char* const* params,
+                       size_t nparams, const ExprDataset* data, double* p, double tol);
+
+// Batch jobs. Each job is copied from the source arena into the arena of
+// the worker that claims it, so workers never touch shared mutable state.
+typedef enum {
+    EXPR_JOB_SIMPLIFY,
+    EXPR_JOB_DIFFERENTIATE,
+    EXPR_JOB_INTEGRATE
+} ExprJobOp;
+
+// Job options
+#define EXPR_JOB_SIMPLIFY_RESULT 1u  // simplify the derivative / antiderivative
+#define EXPR_JOB_SERIALIZE       2u  // hand the result to the callback as a string
+
+typedef struct {
+    ExprIndex expr;      // index in the source arena
+    ExprJobOp op;
+    const char* var;     // differentiation / integration variable
+    unsigned options;
+    void* user;
+} ExprJob;
+
+// Runs on the worker that processed the job. result is INVALID_INDEX if the
+// operation could not be resolved. Both result (in arena) and text are only
+// valid during the call, the worker arena is cleared right after it, so the
+// callback must not free nodes of it.
+typedef void (*ExprJobCallback)(const ExprJob* job, ExprArena* arena,
+                                ExprIndex result, const char* text, void* ctx);
+
+// Processes all jobs and returns when every callback has run. The source
+// arena is only read and must not be modified during the call.
+void expr_batch_run(ExprPool* pool, ExprArena* source, const ExprJob* jobs, size_t count,
+                    ExprJobCallback done, void* ctx);
+#endif
 
 #ifdef __cplusplus
 }
@@ -156,1414 +849,6807 @@ char* expr_to_string(const Expr* e);
 
 #ifdef CYMCALC_IMPLEMENTATION
 
-void expr_arena_init(ExprArena* arena) {
-    arena->free_count = MAX_EXPR_COUNT;
-    for (size_t i = 0; i < MAX_EXPR_COUNT; i++) {
-        arena->pool[i].used = false;
-        arena->free_list[i] = MAX_EXPR_COUNT - 1 - i;  // Reverse order free list for better locality
-    }
-}
+//-----------------------------------------------
+// Allocation
+//-----------------------------------------------
 
-ExprIndex expr_arena_alloc(ExprArena* arena) {
-    if (arena->free_count == 0) {
-        fprintf(stderr, "ExprArena out of memory!\n");
+static void* expr_mem_alloc(const ExprAllocator* allocator, size_t size) {
+    void* p = allocator && allocator->alloc ? allocator->alloc(allocator->ctx, size) : malloc(size);
+    if (!p) {
+        fprintf(stderr, "Out of memory\n");
         exit(1);
     }
-    size_t index = arena->free_list[--arena->free_count];
-    Expr* e = &arena->pool[index];
-    e->used = true;
-    // Clear or init union fields if needed (especially mpq_t)
-    memset(&e->data, 0, sizeof(e->data));
-    return index;
+    return p;
 }
 
-void expr_arena_free(ExprArena* arena, ExprIndex index) {
-    if (index == INVALID_INDEX || !arena->pool[index].used) return;
-    Expr* e = &arena->pool[index];
-    // Free internal allocated data depending on type:
-    switch (e->type) {
-        case EXPR_NUMBER:
-            mpq_clear(e->data.value);
-            break;
-        case EXPR_SYMBOL:
-            free(e->data.name);
-            break;
-        case EXPR_DIFF:
-            free(e->data.diff.var);
-            break;
-        case EXPR_INT:
-            free(e->data.integral.var);
-            break;
-        default:
-            break;
-    }
-    e->used = false;
-    arena->free_list[arena->free_count++] = index;
+static void expr_mem_free(const ExprAllocator* allocator, void* p, size_t size) {
+    if (!p) return;
+    if (allocator && allocator->free) allocator->free(allocator->ctx, p, size);
+    else free(p);
 }
 
-void expr_arena_clear(ExprArena* arena) {
-    for (size_t i = 0; i < MAX_EXPR_COUNT; i++) {
-        if (arena->pool[i].used) {
-            expr_arena_free(arena, i);
-        }
-    }
+static char* expr_mem_strdup(const ExprAllocator* allocator, const char* s) {
+    size_t size = strlen(s) + 1;
+    char* copy = (char*)expr_mem_alloc(allocator, size);
+    memcpy(copy, s, size);
+    return copy;
 }
 
-Expr* expr_at(ExprArena* arena, ExprIndex index) {
-    if (index == INVALID_INDEX || index >= MAX_EXPR_COUNT || !arena->pool[index].used) {
-        printf("error out of range expr index %d\n",index);
-        exit(1);
-        //return NULL;
-    }
-    return &arena->pool[index];
+static void expr_mem_strfree(const ExprAllocator* allocator, char* s) {
+    if (s) expr_mem_free(allocator, s, strlen(s) + 1);
 }
 
-ExprIndex expr_number(ExprArena* arena, char* num_str) {
-    ExprIndex idx = expr_arena_alloc(arena);
-    Expr* num_expr = expr_at(arena,idx);
-    num_expr->type = EXPR_NUMBER;
+#ifdef CYMCALC_GMP_POOL
+//-----------------------------------------------
+// GMP limb pools
+//-----------------------------------------------
 
-    mpq_init(num_expr->data.value);
-    mpq_t num;
-    mpq_init(num);
+// Every block handed to GMP starts with a 16-byte header naming its pool,
+// NULL for blocks from malloc, so free and realloc can route them. Small
+// blocks come from power-of-two size classes carved out of chunks; large
+// ones are malloc'd individually and kept on a list so the pool can still
+// drop them in bulk.
+#define EXPR_GMP_HEADER 16
+#define EXPR_GMP_MIN_SHIFT 4
+#define EXPR_GMP_CLASSES 9     // 16 .. 4096 bytes
+#define EXPR_GMP_MAX_SMALL (1ul << (EXPR_GMP_MIN_SHIFT + EXPR_GMP_CLASSES - 1))
+#ifndef EXPR_GMP_CHUNK
+#define EXPR_GMP_CHUNK (64 * 1024)
+#endif
 
-    if (mpq_set_str(num, num_str, 10) != 0) {
-        fprintf(stderr, "Invalid rational string: %s\n", num_str);
-        exit(1);
+typedef struct ExprGmpLarge {
+    struct ExprGmpLarge* next;
+    struct ExprGmpLarge* prev;
+    size_t bytes;                  // whole block, for the allocator
+    size_t pad;
+} ExprGmpLarge;
+
+typedef struct ExprGmpChunk {
+    struct ExprGmpChunk* next;
+    size_t pad;
+} ExprGmpChunk;
+
+struct ExprGmpPool {
+    void* free[EXPR_GMP_CLASSES];  // free blocks, linked through their payload
+    ExprGmpChunk* chunks;          // all chunks, the current one first
+    ExprGmpChunk* spare;           // chunks kept by a reset, not yet reused
+    char* bump;
+    char* end;
+    ExprGmpLarge large;            // sentinel of the large block list
+    const ExprAllocator* allocator; // the owning arena's, for chunks and large blocks
+    bool lock;
+};
+
+static bool expr_gmp_installed = false;
+static __thread ExprGmpPool* expr_gmp_current = NULL;
+
+static inline void expr_gmp_lock(ExprGmpPool* pool) {
+#ifdef CYMCALC_THREADS
+    while (__atomic_test_and_set(&pool->lock, __ATOMIC_ACQUIRE)) {
     }
-    mpq_canonicalize(num);
-    mpq_set(num_expr->data.value, num);
-    mpq_clear(num);
+#else
+    (void)pool;
+#endif
+}
 
-    return idx;
+static inline void expr_gmp_unlock(ExprGmpPool* pool) {
+#ifdef CYMCALC_THREADS
+    __atomic_clear(&pool->lock, __ATOMIC_RELEASE);
+#else
+    (void)pool;
+#endif
 }
 
-ExprIndex expr_symbol(ExprArena* arena, char* name) {
-    ExprIndex idx = expr_arena_alloc(arena);
-    Expr* sym_expr = expr_at(arena,idx);
-    sym_expr->type = EXPR_SYMBOL;
-    sym_expr->data.name = strdup(name);
-    if (!sym_expr->data.name) {
+static inline ExprGmpPool** expr_gmp_owner(void* p) {
+    return (ExprGmpPool**)((char*)p - EXPR_GMP_HEADER);
+}
+
+static inline unsigned expr_gmp_class(size_t size) {
+    unsigned c = 0;
+    while ((size_t)1 << (c + EXPR_GMP_MIN_SHIFT) < size) c++;
+    return c;
+}
+
+static ExprGmpPool* expr_gmp_pool_new(const ExprAllocator* allocator) {
+    ExprGmpPool* pool = (ExprGmpPool*)calloc(1, sizeof(ExprGmpPool));
+    if (!pool) {
         fprintf(stderr, "Out of memory\n");
         exit(1);
     }
-    return idx;
+    pool->large.next = pool->large.prev = &pool->large;
+    pool->allocator = allocator;
+    return pool;
 }
 
-ExprIndex expr_add(ExprArena* arena, ExprIndex left, ExprIndex right) {
-    ExprIndex idx = expr_arena_alloc(arena);
-    Expr* add_expr = expr_at(arena,idx);
-    add_expr->type = EXPR_ADD;
+static void* expr_gmp_pool_alloc(ExprGmpPool* pool, size_t size) {
+    char* block;
+    if (!pool) {
+        block = (char*)malloc(size + EXPR_GMP_HEADER);
+        if (!block) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        *(ExprGmpPool**)block = NULL;
+        return block + EXPR_GMP_HEADER;
+    }
 
-    add_expr->data.binop.left  = left;
-    add_expr->data.binop.right = right;
+    expr_gmp_lock(pool);
+    if (size > EXPR_GMP_MAX_SMALL) {
+        size_t bytes = sizeof(ExprGmpLarge) + EXPR_GMP_HEADER + size;
+        ExprGmpLarge* l = (ExprGmpLarge*)expr_mem_alloc(pool->allocator, bytes);
+        l->bytes = bytes;
+        l->next = pool->large.next;
+        l->prev = &pool->large;
+        l->next->prev = l;
+        pool->large.next = l;
+        block = (char*)(l + 1);
+    } else {
+        unsigned c = expr_gmp_class(size);
+        size_t bytes = ((size_t)1 << (c + EXPR_GMP_MIN_SHIFT)) + EXPR_GMP_HEADER;
+        if (pool->free[c]) {
+            block = (char*)pool->free[c] - EXPR_GMP_HEADER;
+            pool->free[c] = *(void**)pool->free[c];
+        } else {
+            if ((size_t)(pool->end - pool->bump) < bytes) {
+                ExprGmpChunk* chunk = pool->spare;
+                if (chunk) {
+                    pool->spare = chunk->next;
+                } else {
+                    chunk = (ExprGmpChunk*)expr_mem_alloc(pool->allocator, EXPR_GMP_CHUNK);
+                }
+                chunk->next = pool->chunks;
+                pool->chunks = chunk;
+                pool->bump = (char*)(chunk + 1);
+                pool->end = (char*)chunk + EXPR_GMP_CHUNK;
+            }
+            block = pool->bump;
+            pool->bump += bytes;
+        }
+    }
+    expr_gmp_unlock(pool);
+    *(ExprGmpPool**)block = pool;
+    return block + EXPR_GMP_HEADER;
+}
 
-    return idx;
+static void expr_gmp_pool_free(void* p, size_t size) {
+    ExprGmpPool* pool = *expr_gmp_owner(p);
+    if (!pool) {
+        free((char*)p - EXPR_GMP_HEADER);
+        return;
+    }
+    expr_gmp_lock(pool);
+    if (size > EXPR_GMP_MAX_SMALL) {
+        ExprGmpLarge* l = (ExprGmpLarge*)((char*)p - EXPR_GMP_HEADER) - 1;
+        l->prev->next = l->next;
+        l->next->prev = l->prev;
+        expr_mem_free(pool->allocator, l, l->bytes);
+    } else {
+        unsigned c = expr_gmp_class(size);
+        *(void**)p = pool->free[c];
+        pool->free[c] = p;
+    }
+    expr_gmp_unlock(pool);
 }
 
-ExprIndex expr_mul(ExprArena* arena, ExprIndex left, ExprIndex right) {
-    ExprIndex idx = expr_arena_alloc(arena);
-    Expr* mul_expr= expr_at(arena,idx);
+// Drops every block at once. Chunks are kept for reuse.
+static void expr_gmp_pool_reset(ExprGmpPool* pool) {
+    for (ExprGmpLarge* l = pool->large.next; l != &pool->large;) {
+        ExprGmpLarge* next = l->next;
+        expr_mem_free(pool->allocator, l, l->bytes);
+        l = next;
+    }
+    pool->large.next = pool->large.prev = &pool->large;
+    while (pool->chunks) {
+        ExprGmpChunk* next = pool->chunks->next;
+        pool->chunks->next = pool->spare;
+        pool->spare = pool->chunks;
+        pool->chunks = next;
+    }
+    memset(pool->free, 0, sizeof(pool->free));
+    pool->bump = pool->end = NULL;
+}
 
-    mul_expr->type = EXPR_MUL;
+static void expr_gmp_pool_destroy(ExprGmpPool* pool) {
+    expr_gmp_pool_reset(pool);
+    while (pool->spare) {
+        ExprGmpChunk* next = pool->spare->next;
+        expr_mem_free(pool->allocator, pool->spare, EXPR_GMP_CHUNK);
+        pool->spare = next;
+    }
+    free(pool);
+}
 
-    mul_expr->data.binop.left  = left;
-    mul_expr->data.binop.right = right;
+static void* expr_gmp_alloc(size_t size) {
+    return expr_gmp_pool_alloc(expr_gmp_current, size);
+}
 
-    return idx;
+static void* expr_gmp_realloc(void* p, size_t old_size, size_t new_size) {
+    ExprGmpPool* pool = *expr_gmp_owner(p);
+    if (!pool) {
+        char* block = (char*)realloc((char*)p - EXPR_GMP_HEADER, new_size + EXPR_GMP_HEADER);
+        if (!block) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        return block + EXPR_GMP_HEADER;
+    }
+    // stays in the pool that owns it
+    void* q = expr_gmp_pool_alloc(pool, new_size);
+    memcpy(q, p, old_size < new_size ? old_size : new_size);
+    expr_gmp_pool_free(p, old_size);
+    return q;
 }
 
-ExprIndex expr_pow(ExprArena* arena, ExprIndex base, ExprIndex exponent) {
-    ExprIndex idx = expr_arena_alloc(arena);
-    Expr* pow_expr= expr_at(arena,idx);
+void expr_gmp_pool_install(void) {
+    mp_set_memory_functions(expr_gmp_alloc, expr_gmp_realloc, expr_gmp_pool_free);
+    expr_gmp_installed = true;
+}
+#endif // CYMCALC_GMP_POOL
 
-    pow_expr->type = EXPR_POW;
+//-----------------------------------------------
+// Statistics
+//-----------------------------------------------
 
-    pow_expr->data.binop.left  = base;
-    pow_expr->data.binop.right = exponent;
+#ifdef CYMCALC_STATS
+#define EXPR_STAT_ADD(arena, field, n) __atomic_add_fetch(&((ExprArena*)(arena))->stats.field, (size_t)(n), __ATOMIC_RELAXED)
+#define EXPR_STAT_SUB(arena, field, n) __atomic_sub_fetch(&((ExprArena*)(arena))->stats.field, (size_t)(n), __ATOMIC_RELAXED)
+#define EXPR_STAT_MAX(arena, field, v) expr_stats_max(&((ExprArena*)(arena))->stats.field, (size_t)(v))
 
-    return idx;
+static void expr_stats_max(size_t* peak, size_t v) {
+    size_t cur = __atomic_load_n(peak, __ATOMIC_RELAXED);
+    while (v > cur && !__atomic_compare_exchange_n(peak, &cur, v, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
 }
 
-ExprIndex expr_func(ExprArena* arena,FuncType f, ExprIndex arg) {
-    ExprIndex idx = expr_arena_alloc(arena);
-    Expr* fun_expr = expr_at(arena,idx);
+typedef struct {
+    ExprStats* stats;
+    ExprAlgo algo;
+} ExprStatsScope;
+
+static inline ExprStatsScope expr_stats_enter(ExprStats* stats, ExprAlgo algo) {
+    ExprStatsScope scope = {stats, algo};
+    __atomic_add_fetch(&stats->calls[algo], 1, __ATOMIC_RELAXED);
+    expr_stats_max(&stats->max_depth[algo], __atomic_add_fetch(&stats->depth[algo], 1, __ATOMIC_RELAXED));
+    return scope;
+}
 
-    fun_expr->type = EXPR_FUNC;
+static inline void expr_stats_leave(ExprStatsScope* scope) {
+    __atomic_sub_fetch(&scope->stats->depth[scope->algo], 1, __ATOMIC_RELAXED);
+}
 
-    switch (f) {
-        case FUNC_SIN: break;
-        case FUNC_COS: break;
-        case FUNC_EXP: break;
-        case FUNC_LOG: break;
-        default:
-            fprintf(stderr, "Unknown function type: %d\n", f);
-            exit(1);
-    }
-    fun_expr->data.func.func = f;
-    fun_expr->data.func.arg  = arg;
+// Counts a call of algo for the rest of the enclosing block
+#define EXPR_STATS_SCOPE(arena, algo) \
+    __attribute__((cleanup(expr_stats_leave))) ExprStatsScope expr_stats_scope = expr_stats_enter(&(arena)->stats, (algo))
 
-    return idx;
+// Limb bytes held by a number node
+static size_t expr_stats_number_bytes(const Expr* e) {
+    return (size_t)(mpq_numref(e->data.value)->_mp_alloc + mpq_denref(e->data.value)->_mp_alloc) * sizeof(mp_limb_t);
 }
 
-ExprIndex expr_diff(ExprArena* arena, ExprIndex f, const char* var) {
-    //if (!(false) || !var) return NULL;
-    ExprIndex idx = expr_arena_alloc(arena);
-    Expr* e = expr_at(arena,idx);
-    e->type = EXPR_DIFF;
-    e->data.diff.inner = f;
-    e->data.diff.var = strdup(var);
-    return idx;
+void expr_stats_reset(ExprArena* arena) {
+    size_t live = arena->stats.gmp_bytes;
+    memset(&arena->stats, 0, sizeof(arena->stats));
+    arena->stats.gmp_bytes = live;
+    arena->stats.gmp_bytes_peak = live;
+    arena->stats.nodes_peak = MAX_EXPR_COUNT - (size_t)arena->free_count;
 }
 
-ExprIndex expr_int(ExprArena* arena, ExprIndex f, const char* var) {
-    //if (!(false) || !var) return NULL;
-    ExprIndex idx = expr_arena_alloc(arena);
-    Expr* e = expr_at(arena,idx);
-    e->type = EXPR_INT;
-    e->data.diff.inner = f;
-    e->data.diff.var = strdup(var);
-    return idx;
+void expr_stats_print(const ExprArena* arena, FILE* out) {
+    static const char* names[EXPR_ALGO_COUNT] = {
+        "simplify", "differentiate", "integrate", "substitute", "eval_numeric", "expand", "normal", "series"
+    };
+    const ExprStats* s = &arena->stats;
+    fprintf(out, "nodes allocated    %zu\n", s->nodes_allocated);
+    fprintf(out, "nodes freed        %zu\n", s->nodes_freed);
+    fprintf(out, "nodes peak         %zu of %d\n", s->nodes_peak, MAX_EXPR_COUNT);
+    fprintf(out, "gmp bytes          %zu (peak %zu)\n", s->gmp_bytes, s->gmp_bytes_peak);
+    for (int i = 0; i < EXPR_ALGO_COUNT; i++) {
+        if (!s->calls[i]) continue;
+        fprintf(out, "%-18s %zu calls, max depth %zu\n", names[i], s->calls[i], s->max_depth[i]);
+    }
+    fprintf(out, "expr_equal         %zu calls, %zu deep\n", s->equal_calls, s->equal_deep);
+    const size_t hits[2] = {s->hashcons_hits, s->approx_hits};
+    const size_t misses[2] = {s->hashcons_misses, s->approx_misses};
+    const char* caches[2] = {"hashcons", "cached doubles"};
+    for (int i = 0; i < 2; i++) {
+        size_t total = hits[i] + misses[i];
+        fprintf(out, "%-18s %zu/%zu hits (%.1f%%)\n", caches[i], hits[i], total,
+                total ? 100.0 * (double)hits[i] / (double)total : 0.0);
+    }
 }
+#else
+#define EXPR_STAT_ADD(arena, field, n) ((void)0)
+#define EXPR_STAT_SUB(arena, field, n) ((void)0)
+#define EXPR_STAT_MAX(arena, field, v) ((void)0)
+#define EXPR_STATS_SCOPE(arena, algo) ((void)0)
+#endif // CYMCALC_STATS
 
-void expr_print(ExprArena* arena, ExprIndex idx) {
-    Expr* e = expr_at(arena, idx);
-    if (!e) {
-        printf("<null>");
-        return;
-    }
-    switch (e->type) {
-        case EXPR_NUMBER:
-            gmp_printf("%Qd", e->data.value);
-            break;
-        case EXPR_SYMBOL:
-            printf("%s", e->data.name);
-            break;
-        case EXPR_ADD:
-            printf("(");
-            expr_print(arena, e->data.binop.left);
-            printf(" + ");
-            expr_print(arena, e->data.binop.right);
-            printf(")");
-            break;
-        case EXPR_MUL:
-            printf("(");
-            expr_print(arena, e->data.binop.left);
-            printf(" * ");
-            expr_print(arena, e->data.binop.right);
-            printf(")");
-            break;
-        case EXPR_POW:
-            printf("(");
-            expr_print(arena, e->data.binop.left);
-            printf(" ^ ");
-            expr_print(arena, e->data.binop.right);
-            printf(")");
-            break;
-        case EXPR_FUNC:
-            switch (e->data.func.func) {
-                case FUNC_SIN: printf("sin"); break;
-                case FUNC_COS: printf("cos"); break;
-                case FUNC_EXP: printf("exp"); break;
-                case FUNC_LOG: printf("log"); break;
-                default:
-                    fprintf(stderr, "Unknown function type: %d\n", e->data.func.func);
-                    exit(1);
-            }
-            printf("(");
-            expr_print(arena, e->data.func.arg);
-            printf(")");
-            break;
-        case EXPR_DIFF:
-        {
-            const char* var = e->data.diff.var;
+//-----------------------------------------------
+// Rule profiler
+//-----------------------------------------------
 
-            printf("d/d%s", var);
-            printf("(");
-            expr_print(arena, e->data.diff.inner);
-            printf(")");
-            break;
-        }
-        case EXPR_INT:
-        {
-            const char* var = e->data.integral.var;
-            printf( "∫");
-            printf("(");
-            expr_print(arena, e->data.integral.inner);
-            printf(")");
-            printf( "d%s",var);
-            break;
-        }
-        default:
-            printf("<expr_type_%d>", e->type);
-    }
+#if defined(CYMCALC_PROFILE_RULES) || defined(CYMCALC_TRACE)
+#include <time.h>
+
+static uint64_t expr_clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
 }
+#endif
 
-static inline char* concat(char* s1, const char* s2) {
-    size_t len1 = strlen(s1);
-    size_t len2 = strlen(s2);
-    char* result = malloc(len1 + len2 + 1);
-    memcpy(result, s1, len1);
-    memcpy(result + len1, s2, len2 + 1);
-    free(s1);
-    return result;
+#ifdef CYMCALC_PROFILE_RULES
+// One open rule application. Frames live on the stack of the thread that
+// runs the rule and link to the rule that triggered them.
+typedef struct ExprRuleFrame {
+    struct ExprRuleFrame* parent;
+    ExprArena* arena;
+    ExprRule rule;
+    int free_count;       // arena free_count when the rule started
+    uint64_t start;
+    uint64_t nested;      // time spent in rules it triggered
+} ExprRuleFrame;
+
+static __thread ExprRuleFrame* expr_rule_top = NULL;
+
+static inline ExprRuleFrame expr_rule_enter(ExprArena* arena, ExprRule rule) {
+    ExprRuleFrame frame = {expr_rule_top, arena, rule, arena->free_count, expr_clock_ns(), 0};
+    return frame;
 }
-/*
-char* expr_to_string_impl(char* string, const Expr* e) {
-    const size_t len = strlen(string);
-    switch(e->type)
-    {
-        case EXPR_NUMBER: {
-            char* num_str = mpq_get_str(NULL, 10, e->data.value);
-            string = concat(string, num_str);
-            free(num_str);
-            break;
-        }
 
-        case EXPR_SYMBOL: {
-            string = concat(string, e->data.name);
-            break;
-        }
+static inline void expr_rule_leave(ExprRuleFrame* frame) {
+    uint64_t elapsed = expr_clock_ns() - frame->start;
+    ExprRuleProfile* p = &frame->arena->rules;
+    int free_count = frame->arena->free_count;
+    size_t nodes = frame->free_count > free_count ? (size_t)(frame->free_count - free_count) : 0;
+    __atomic_add_fetch(&p->hits[frame->rule], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&p->nodes[frame->rule], nodes, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&p->total_ns[frame->rule], elapsed, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&p->self_ns[frame->rule], elapsed - frame->nested, __ATOMIC_RELAXED);
+    if (frame->parent) frame->parent->nested += elapsed;
+    expr_rule_top = frame->parent;
+}
 
-        case EXPR_ADD: {
-            string = concat(string, "(");
-            string = expr_to_string_impl(string, e->data.binop.left);
-            string = concat(string, " + ");
-            string = expr_to_string_impl(string, e->data.binop.right);
-            string = concat(string, ")");
-            break;
-        }
+// Profiles rule for the rest of the enclosing block
+#define EXPR_RULE_SCOPE(arena, rule) \
+    __attribute__((cleanup(expr_rule_leave))) ExprRuleFrame expr_rule_frame = expr_rule_enter((arena), (rule)); \
+    expr_rule_top = &expr_rule_frame
 
-        case EXPR_MUL: {
-            string = concat(string, "(");
-            string = expr_to_string_impl(string, e->data.binop.left);
-            string = concat(string, " * ");
-            string = expr_to_string_impl(string, e->data.binop.right);
-            string = concat(string, ")");
-            break;
-        }
+void expr_rules_reset(ExprArena* arena) {
+    memset(&arena->rules, 0, sizeof(arena->rules));
+}
 
-        case EXPR_POW: {
-            string = concat(string, "(");
-            string = expr_to_string_impl(string, e->data.binop.left);
-            string = concat(string, " ^ ");
-            string = expr_to_string_impl(string, e->data.binop.right);
-            string = concat(string, ")");
-            break;
-        }
+void expr_rules_print(const ExprArena* arena, FILE* out) {
+    static const char* names[EXPR_RULE_COUNT] = {
+        "add numbers", "add zero", "add swap", "add collect",
+        "mul numbers", "mul one", "mul zero", "mul swap", "mul coefficients", "mul distribute",
+        "mul square", "mul power merge",
+        "pow zero", "pow one", "pow zero base", "pow one base",
+        "expand", "diff", "int"
+    };
+    const ExprRuleProfile* p = &arena->rules;
+    int order[EXPR_RULE_COUNT];
+    int n = 0;
+    for (int i = 0; i < EXPR_RULE_COUNT; i++) {
+        if (!p->hits[i]) continue;
+        int j = n++;
+        for (; j > 0 && p->self_ns[order[j - 1]] < p->self_ns[i]; j--) order[j] = order[j - 1];
+        order[j] = i;
+    }
+    fprintf(out, "%-18s %10s %10s %10s %12s %12s\n", "rule", "hits", "nodes", "nodes/hit", "total ms", "self ms");
+    for (int k = 0; k < n; k++) {
+        int i = order[k];
+        fprintf(out, "%-18s %10zu %10zu %10.1f %12.3f %12.3f\n", names[i], p->hits[i], p->nodes[i],
+                (double)p->nodes[i] / (double)p->hits[i], 1e-6 * (double)p->total_ns[i], 1e-6 * (double)p->self_ns[i]);
+    }
+}
+#else
+#define EXPR_RULE_SCOPE(arena, rule) ((void)0)
+#endif // CYMCALC_PROFILE_RULES
 
-        case EXPR_FUNC: {
-            const char* fname = NULL;
-            switch (e->data.func.func) {
-                case FUNC_SIN: fname = "sin"; break;
-                case FUNC_COS: fname = "cos"; break;
-                case FUNC_EXP: fname = "exp"; break;
-                case FUNC_LOG: fname = "log"; break;
-                default:
-                    fprintf(stderr, "Unknown function type: %d\n", e->data.func.func);
-                    exit(1);
+//-----------------------------------------------
+// Tracing
+//-----------------------------------------------
+
+#ifdef CYMCALC_TRACE
+typedef enum {
+    EXPR_TRACE_SIMPLIFY,
+    EXPR_TRACE_DIFFERENTIATE,
+    EXPR_TRACE_INTEGRATE,
+    EXPR_TRACE_SUBSTITUTE,
+    EXPR_TRACE_EVAL,
+    EXPR_TRACE_EXPAND,
+    EXPR_TRACE_NORMAL,
+    EXPR_TRACE_SERIES,
+    // traced at every nesting level from here on
+    EXPR_TRACE_DIFF,
+    EXPR_TRACE_INT,
+    EXPR_TRACE_PHASES
+} ExprTracePhase;
+
+static const char* expr_trace_names[EXPR_TRACE_PHASES] = {
+    "simplify", "differentiate", "integrate", "substitute", "eval_numeric",
+    "expand", "normal", "series", "resolve diff", "resolve integral"
+};
+
+typedef struct {
+    uint64_t ts;          // ns since expr_trace_start
+    size_t nodes;         // nodes in use in the arena
+    uint32_t tid;
+    unsigned char phase;
+    char ph;              // 'B' or 'E'
+} ExprTraceEvent;
+
+static struct {
+    ExprTraceEvent* events;
+    size_t count;
+    size_t capacity;
+    char* path;
+    uint64_t origin;
+    bool on;
+    bool lock;
+    bool registered;      // atexit flush installed
+} expr_trace;
+
+static uint32_t expr_trace_next_tid = 0;
+static __thread uint32_t expr_trace_tid = 0;
+static __thread int expr_trace_depth[EXPR_TRACE_PHASES];
+
+static void expr_trace_emit(char ph, ExprTracePhase phase, const ExprArena* arena) {
+    ExprTraceEvent ev;
+    if (!expr_trace_tid) expr_trace_tid = __atomic_add_fetch(&expr_trace_next_tid, 1, __ATOMIC_RELAXED);
+    ev.nodes = MAX_EXPR_COUNT - (size_t)arena->free_count;
+    ev.tid = expr_trace_tid;
+    ev.phase = (unsigned char)phase;
+    ev.ph = ph;
+    while (__atomic_test_and_set(&expr_trace.lock, __ATOMIC_ACQUIRE)) {}
+    if (expr_trace.on) {
+        ev.ts = expr_clock_ns() - expr_trace.origin;
+        if (expr_trace.count == expr_trace.capacity) {
+            expr_trace.capacity = expr_trace.capacity ? 2 * expr_trace.capacity : 4096;
+            expr_trace.events = (ExprTraceEvent*)realloc(expr_trace.events, expr_trace.capacity * sizeof(ExprTraceEvent));
+            if (!expr_trace.events) {
+                fprintf(stderr, "Out of memory\n");
+                exit(1);
             }
-            string = concat(string, fname);
-            string = concat(string, "(");
-            string = expr_to_string_impl(string, e->data.func.arg);
-            string = concat(string, ")");
-            break;
         }
-        
-        case EXPR_DIFF: {
-            char* inner_str = expr_to_string(e->data.diff.inner);
-            const char* var = e->data.diff.var;
+        expr_trace.events[expr_trace.count++] = ev;
+    }
+    __atomic_clear(&expr_trace.lock, __ATOMIC_RELEASE);
+}
 
-            char* result = malloc(strlen(inner_str) + strlen(var) + 32);
-            sprintf(result, "d/d%s(%s)", var, inner_str);
+typedef struct {
+    const ExprArena* arena;
+    ExprTracePhase phase;
+    bool counted;         // depth was raised on entry
+    bool emitted;         // a begin event was written
+} ExprTraceScope;
+
+static inline ExprTraceScope expr_trace_enter(const ExprArena* arena, ExprTracePhase phase) {
+    ExprTraceScope scope = {arena, phase, false, false};
+    if (!__atomic_load_n(&expr_trace.on, __ATOMIC_RELAXED)) return scope;
+    scope.counted = true;
+    if (expr_trace_depth[phase]++ == 0 || phase >= EXPR_TRACE_DIFF) {
+        expr_trace_emit('B', phase, arena);
+        scope.emitted = true;
+    }
+    return scope;
+}
 
-            free(inner_str);
-            return result;
-        }
+static inline void expr_trace_leave(ExprTraceScope* scope) {
+    if (scope->counted) expr_trace_depth[scope->phase]--;
+    if (scope->emitted) expr_trace_emit('E', scope->phase, scope->arena);
+}
 
-        case EXPR_INT: {
-            char* inner_str = expr_to_string(e->data.integral.inner);
-            const char* var = e->data.integral.var;
-            char* result = malloc(strlen(inner_str) + strlen(var) + 16);
-            sprintf(result, "∫ %s d%s", inner_str, var);
-            free(inner_str);
-            return result;
-            break;
+// Traces phase for the rest of the enclosing block
+#define EXPR_TRACE_SCOPE(arena, phase) \
+    __attribute__((cleanup(expr_trace_leave))) ExprTraceScope expr_trace_scope = expr_trace_enter((arena), (phase))
+
+void expr_trace_stop(void) {
+    while (__atomic_test_and_set(&expr_trace.lock, __ATOMIC_ACQUIRE)) {}
+    bool was_on = expr_trace.on;
+    expr_trace.on = false;
+    __atomic_clear(&expr_trace.lock, __ATOMIC_RELEASE);
+    if (!was_on) return;
+
+    FILE* out = fopen(expr_trace.path, "w");
+    if (!out) {
+        fprintf(stderr, "Could not open trace file %s\n", expr_trace.path);
+    } else {
+        fprintf(out, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+        for (size_t i = 0; i < expr_trace.count; i++) {
+            const ExprTraceEvent* ev = &expr_trace.events[i];
+            fprintf(out, "%s{\"name\": \"%s\", \"cat\": \"cymcalc\", \"ph\": \"%c\", \"ts\": %.3f, "
+                    "\"pid\": 1, \"tid\": %u, \"args\": {\"nodes\": %zu}}",
+                    i ? ",\n" : "", expr_trace_names[ev->phase], ev->ph, 1e-3 * (double)ev->ts, ev->tid, ev->nodes);
         }
-
-        default:
-            fprintf(stderr, "Unknown expression type in conversion to string: %d.\n",e->type);
-            exit(1);
+        fprintf(out, "\n]}\n");
+        fclose(out);
     }
-    return string;
+    free(expr_trace.events);
+    free(expr_trace.path);
+    expr_trace.events = NULL;
+    expr_trace.path = NULL;
+    expr_trace.count = 0;
+    expr_trace.capacity = 0;
 }
 
-
-char* expr_to_string(const Expr* e) {
-    char* s=malloc(1);
-    s[0] = '\0';
-    return expr_to_string_impl(a, s, e);
+void expr_trace_start(const char* path) {
+    expr_trace_stop();
+    expr_trace.path = strdup(path);
+    expr_trace.origin = expr_clock_ns();
+    if (!expr_trace.registered) {
+        atexit(expr_trace_stop);
+        expr_trace.registered = true;
+    }
+    __atomic_store_n(&expr_trace.on, true, __ATOMIC_RELEASE);
 }
-*/
+#else
+#define EXPR_TRACE_SCOPE(arena, phase) ((void)0)
+#endif // CYMCALC_TRACE
 
-ExprType expr_type(ExprArena* arena, ExprIndex idx) {
-    return (expr_at(arena,idx))->type;
+// Every slot not taken by a base node is free, in reverse order for better locality
+static void expr_arena_reset_free_list(ExprArena* arena) {
+    arena->free_count = 0;
+    for (size_t i = 0; i < MAX_EXPR_COUNT; i++) {
+        size_t index = MAX_EXPR_COUNT - 1 - i;
+        if (!arena->base || !arena->base->pool[index].used) arena->free_list[arena->free_count++] = index;
+    }
 }
 
-FuncType expr_ftype(ExprArena* arena, ExprIndex idx) {
-    Expr* e = expr_at(arena, idx);
-    if (!e || e->type != EXPR_FUNC) {
-        fprintf(stderr, "expr_value: not a function\n");
-        exit(1);
+void expr_arena_init(ExprArena* arena) {
+    for (size_t i = 0; i < MAX_EXPR_COUNT; i++) arena->pool[i].used = false;
+    arena->error = false;
+    memset(&arena->invalid, 0, sizeof(arena->invalid));
+    arena->invalid.type = EXPR_SYMBOL;
+    arena->invalid.used = true;
+    arena->invalid.flags = EXPR_META_POLY;
+    arena->invalid.depth = 1;
+    arena->invalid.degree = 1;
+    arena->invalid.meta.shape.size = 1;
+    arena->invalid.meta.shape.terms = 1;
+    arena->invalid.data.name = (char*)"<invalid>";
+    arena->hashcons = NULL;
+    arena->concurrent = false;
+    arena->base = NULL;
+    expr_arena_reset_free_list(arena);
+    memset(&arena->allocator, 0, sizeof(arena->allocator));
+#ifdef CYMCALC_GMP_POOL
+    arena->gmp = expr_gmp_installed ? expr_gmp_pool_new(&arena->allocator) : NULL;
+#endif
+    for (size_t i = 0; i < EXPR_SCRATCH_COUNT; i++) {
+        mpq_init(arena->scratch_q[i]);
+        mpz_init(arena->scratch_z[i]);
     }
-    return e->data.func.func;
+    arena->scratch_q_top = 0;
+    arena->scratch_z_top = 0;
+#ifdef CYMCALC_STATS
+    memset(&arena->stats, 0, sizeof(arena->stats));
+#endif
+#ifdef CYMCALC_PROFILE_RULES
+    memset(&arena->rules, 0, sizeof(arena->rules));
+#endif
 }
 
-ExprIndex expr_arg(ExprArena* arena, ExprIndex idx) {
-    Expr* e = expr_at(arena, idx);
-    if (!e || e->type != EXPR_FUNC) {
-        fprintf(stderr, "expr_value: not a function\n");
+ExprIndex expr_arena_alloc(ExprArena* arena) {
+    int slot;
+    if (arena->concurrent) {
+        slot = __atomic_sub_fetch(&arena->free_count, 1, __ATOMIC_ACQ_REL);
+    } else {
+        slot = arena->free_count - 1;
+        if (slot >= 0) arena->free_count = slot;
+    }
+    if (slot < 0) {
+        fprintf(stderr, "ExprArena out of memory!\n");
         exit(1);
     }
-    return e->data.func.arg;
+    size_t index = arena->free_list[slot];
+    Expr* e = &arena->pool[index];
+    e->used = true;
+    EXPR_STAT_ADD(arena, nodes_allocated, 1);
+    EXPR_STAT_MAX(arena, nodes_peak, MAX_EXPR_COUNT - slot);
+    // Clear or init union fields if needed (especially mpq_t)
+    memset(&e->data, 0, sizeof(e->data));
+    return index;
 }
 
-mpq_t* expr_value(ExprArena* arena, ExprIndex idx) {
-    Expr* e = expr_at(arena, idx);
-    if (!e || e->type != EXPR_NUMBER) {
-        fprintf(stderr, "expr_value: not a number\n");
-        exit(1);
+// allocator is NULL for snapshot nodes, whose names come from malloc
+static void expr_release_data(const ExprAllocator* allocator, Expr* e) {
+    // Free internal allocated data depending on type:
+    switch (e->type) {
+        case EXPR_NUMBER:
+            mpq_clear(e->data.value);
+            break;
+        case EXPR_SYMBOL:
+            expr_mem_strfree(allocator, e->data.name);
+            break;
+        case EXPR_DIFF:
+            expr_mem_strfree(allocator, e->data.diff.var);
+            break;
+        case EXPR_INT:
+            expr_mem_strfree(allocator, e->data.integral.var);
+            break;
+        default:
+            break;
     }
-    return &e->data.value;
+    e->used = false;
 }
 
-char* expr_name(ExprArena* arena, ExprIndex idx) {
-    Expr* e = expr_at(arena, idx);
-    if (!e || e->type != EXPR_SYMBOL) {
-        fprintf(stderr, "expr_value: not a number\n");
-        exit(1);
+static void expr_arena_release(ExprArena* arena, ExprIndex index) {
+#ifdef CYMCALC_STATS
+    EXPR_STAT_ADD(arena, nodes_freed, 1);
+    if (arena->pool[index].type == EXPR_NUMBER) EXPR_STAT_SUB(arena, gmp_bytes, expr_stats_number_bytes(&arena->pool[index]));
+#endif
+    expr_release_data(&arena->allocator, &arena->pool[index]);
+}
+
+static void expr_hashcons_forget(ExprArena* arena, ExprIndex index);
+
+void expr_arena_free(ExprArena* arena, ExprIndex index) {
+    if (index == INVALID_INDEX || !arena->pool[index].used) return;
+    expr_hashcons_forget(arena, index);
+    expr_arena_release(arena, index);
+    arena->free_list[arena->free_count++] = index;
+}
+
+// Release ahead of a pool reset: number limbs go with expr_gmp_pool_reset.
+static void expr_arena_drop(ExprArena* arena, ExprIndex index) {
+#ifdef CYMCALC_GMP_POOL
+    if (arena->gmp && arena->pool[index].type == EXPR_NUMBER) {
+#ifdef CYMCALC_STATS
+        EXPR_STAT_ADD(arena, nodes_freed, 1);
+        EXPR_STAT_SUB(arena, gmp_bytes, expr_stats_number_bytes(&arena->pool[index]));
+#endif
+        arena->pool[index].used = false;
+        return;
     }
-    return e->data.name;
+#endif
+    expr_arena_release(arena, index);
 }
 
-ExprIndex expr_left(ExprArena* arena, ExprIndex idx) {
-    Expr* e = expr_at(arena, idx);
-    if (!e || (e->type != EXPR_MUL && e->type != EXPR_ADD && e->type != EXPR_POW)) {
-        fprintf(stderr, "expr_value: not a binop %d \n", e->type);
-        exit(1);
+void expr_arena_clear(ExprArena* arena) {
+    for (size_t i = 0; i < MAX_EXPR_COUNT; i++) {
+        if (arena->pool[i].used) expr_arena_drop(arena, i);
     }
-    return e->data.binop.left;
+#ifdef CYMCALC_GMP_POOL
+    if (arena->gmp) expr_gmp_pool_reset(arena->gmp);
+#endif
+    if (arena->hashcons) {
+        memset(arena->hashcons->slots, 0xff, (arena->hashcons->mask + 1) * sizeof(ExprIndex));
+    }
+    // rebuilt rather than appended to, which also reclaims the nodes
+    // expr_hashcons_insert dropped without recycling
+    expr_arena_reset_free_list(arena);
 }
 
-ExprIndex expr_right(ExprArena* arena, ExprIndex idx) {
-    Expr* e = expr_at(arena, idx);
-    if (!e || e->type != EXPR_MUL && e->type != EXPR_ADD && e->type != EXPR_POW) {
-        fprintf(stderr, "expr_value: not a binop %d \n", e->type);
-        exit(1);
+// Empties an arena that was empty at free_count == mark, in time proportional
+// to the nodes allocated since. Slots popped since mark are still recorded
+// above free_count, so this only holds while nothing was freed in between.
+// Arenas without a hash-cons table only.
+static void expr_arena_rewind(ExprArena* arena, int mark) {
+    for (int p = arena->free_count; p < mark; p++) {
+        ExprIndex index = arena->free_list[p];
+        if (arena->pool[index].used) expr_arena_drop(arena, index);
     }
-    return e->data.binop.right;
+#ifdef CYMCALC_GMP_POOL
+    if (arena->gmp) expr_gmp_pool_reset(arena->gmp);
+#endif
+    arena->free_count = mark;
 }
 
-ExprIndex expr_add_numbers(ExprArena* arena, ExprIndex a_idx, ExprIndex b_idx) {
-    Expr* a = expr_at(arena, a_idx);
-    Expr* b = expr_at(arena, b_idx);
-    if (!a || !b || a->type != EXPR_NUMBER || b->type != EXPR_NUMBER) {
-        fprintf(stderr, "expr_add_numbers: operands must be EXPR_NUMBER\n");
-        exit(1);
+void expr_arena_destroy(ExprArena* arena) {
+    expr_arena_clear(arena);
+#ifdef CYMCALC_GMP_POOL
+    if (arena->gmp) expr_gmp_pool_destroy(arena->gmp);
+    arena->gmp = NULL;
+#endif
+    for (size_t i = 0; i < EXPR_SCRATCH_COUNT; i++) {
+        mpq_clear(arena->scratch_q[i]);
+        mpz_clear(arena->scratch_z[i]);
     }
+    arena->scratch_q_top = 0;
+    arena->scratch_z_top = 0;
+}
 
-    ExprIndex result_idx = expr_arena_alloc(arena);
-    Expr* result = expr_at(arena, result_idx);
-    result->type = EXPR_NUMBER;
-    mpq_init(result->data.value);
-    mpq_add(result->data.value, a->data.value, b->data.value);
-    return result_idx;
+void expr_arena_set_allocator(ExprArena* arena, const ExprAllocator* allocator) {
+    if (allocator) arena->allocator = *allocator;
+    else memset(&arena->allocator, 0, sizeof(arena->allocator));
 }
 
-ExprIndex expr_mul_numbers(ExprArena* arena, ExprIndex a_idx, ExprIndex b_idx) {
-    Expr* a = expr_at(arena, a_idx);
-    Expr* b = expr_at(arena, b_idx);
-    if (!a || !b || a->type != EXPR_NUMBER || b->type != EXPR_NUMBER) {
-        fprintf(stderr, "expr_mul_numbers: operands must be EXPR_NUMBER\n");
+//-----------------------------------------------
+// Scratch values
+//-----------------------------------------------
+
+// Workers of a concurrent arena cannot share the stack, so they get their own.
+mpq_ptr expr_scratch_q(ExprArena* arena) {
+    if (!arena->concurrent && arena->scratch_q_top < EXPR_SCRATCH_COUNT) {
+        return arena->scratch_q[arena->scratch_q_top++];
+    }
+    mpq_ptr q = (mpq_ptr)malloc(sizeof(mpq_t));
+    if (!q) {
+        fprintf(stderr, "Out of memory\n");
         exit(1);
     }
+    mpq_init(q);
+    return q;
+}
 
-    ExprIndex result_idx = expr_arena_alloc(arena);
-    Expr* result = expr_at(arena, result_idx);
-    result->type = EXPR_NUMBER;
-    mpq_init(result->data.value);
-    mpq_mul(result->data.value, a->data.value, b->data.value);
-    return result_idx;
+void expr_scratch_q_release(ExprArena* arena, mpq_ptr q) {
+    if (q >= arena->scratch_q[0] && q < arena->scratch_q[0] + EXPR_SCRATCH_COUNT) {
+        arena->scratch_q_top--;
+        return;
+    }
+    mpq_clear(q);
+    free(q);
 }
 
-/*Expr* expr_pow_numbers(const Expr* a, const Expr* b) {
-    Expr* result = malloc(sizeof(Expr));
-    result->type = EXPR_NUMBER;
-    result->refcount = 1;
-    mpq_init(result->data.value);
-    mpq_pow(result->data.value, a->data.value, b->data.value);
-    return result;
-}*/
-
-const char* func_type_name(FuncType f) {
-    switch (f) {
-        case FUNC_SIN: return "sin";
-        case FUNC_COS: return "cos";
-        case FUNC_EXP: return "exp";
-        case FUNC_LOG: return "log";
-        default:       return "unknown_func";
+mpz_ptr expr_scratch_z(ExprArena* arena) {
+    if (!arena->concurrent && arena->scratch_z_top < EXPR_SCRATCH_COUNT) {
+        return arena->scratch_z[arena->scratch_z_top++];
+    }
+    mpz_ptr z = (mpz_ptr)malloc(sizeof(mpz_t));
+    if (!z) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
     }
+    mpz_init(z);
+    return z;
 }
 
-void expr_print_tree_impl(ExprArena* a, ExprIndex idx, int indent, const char* prefix) {
-    Expr *e = expr_at(a, idx);
-    if (!e) {
-        printf("%*s%s(NULL)\n", indent, "", prefix);
+void expr_scratch_z_release(ExprArena* arena, mpz_ptr z) {
+    if (z >= arena->scratch_z[0] && z < arena->scratch_z[0] + EXPR_SCRATCH_COUNT) {
+        arena->scratch_z_top--;
         return;
     }
+    mpz_clear(z);
+    free(z);
+}
 
-    char buf[256];
-    const char* label = "???";
+//-----------------------------------------------
+// Hash-consing
+//-----------------------------------------------
 
-    switch (e->type) {
+// Structural key of a node about to be constructed. Children are compared by
+// index, which is exact as long as they were built through the same table.
+typedef struct {
+    ExprType type;
+    ExprIndex left;     // binop left, function argument
+    ExprIndex right;    // binop right
+    FuncType func;
+    mpq_srcptr value;
+    const char* name;
+    uint64_t hash;
+} ExprKey;
+
+static inline uint64_t expr_hash_mix(uint64_t h, uint64_t v) {
+    v *= 0xff51afd7ed558ccdULL;
+    v ^= v >> 33;
+    h ^= v;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    return h ^ (h >> 29);
+}
+
+static uint64_t expr_hash_mpz(uint64_t h, mpz_srcptr z) {
+    size_t n = mpz_size(z);
+    h = expr_hash_mix(h, (uint64_t)(int64_t)mpz_sgn(z));
+    for (size_t i = 0; i < n; i++) {
+        h = expr_hash_mix(h, (uint64_t)mpz_getlimbn(z, i));
+    }
+    return h;
+}
+
+static void expr_key_finish(ExprKey* key) {
+    uint64_t h = expr_hash_mix(0x9e3779b97f4a7c15ULL, (uint64_t)key->type);
+    switch (key->type) {
         case EXPR_NUMBER:
-            gmp_snprintf(buf, sizeof(buf), "NUMBER: %Qd", e->data.value);
-            label = buf;
+            h = expr_hash_mpz(h, mpq_numref(key->value));
+            h = expr_hash_mpz(h, mpq_denref(key->value));
             break;
-
         case EXPR_SYMBOL:
-            snprintf(buf, sizeof(buf), "SYMBOL: %s", e->data.name);
-            label = buf;
+            // FNV-1a over the name
+            for (const char* c = key->name; *c; c++) {
+                h = (h ^ (unsigned char)*c) * 0x100000001b3ULL;
+            }
+            h = expr_hash_mix(h, 0);
             break;
-
-        case EXPR_ADD:
-            label = "ADD";
+        case EXPR_FUNC:
+            h = expr_hash_mix(h, (uint64_t)key->func);
+            h = expr_hash_mix(h, (uint64_t)key->left);
             break;
-
-        case EXPR_MUL:
-            label = "MUL";
+        default:
+            h = expr_hash_mix(h, (uint64_t)key->left);
+            h = expr_hash_mix(h, (uint64_t)key->right);
             break;
+    }
+    key->hash = h;
+}
 
-        case EXPR_POW:
-            label = "POW";
-            break;
+static ExprKey expr_key_binop(ExprType type, ExprIndex left, ExprIndex right) {
+    ExprKey key;
+    memset(&key, 0, sizeof(key));
+    key.type = type;
+    key.left = left;
+    key.right = right;
+    expr_key_finish(&key);
+    return key;
+}
+
+static ExprKey expr_key_func(FuncType f, ExprIndex arg) {
+    ExprKey key;
+    memset(&key, 0, sizeof(key));
+    key.type = EXPR_FUNC;
+    key.func = f;
+    key.left = arg;
+    expr_key_finish(&key);
+    return key;
+}
 
+static ExprKey expr_key_number(mpq_srcptr value) {
+    ExprKey key;
+    memset(&key, 0, sizeof(key));
+    key.type = EXPR_NUMBER;
+    key.value = value;
+    expr_key_finish(&key);
+    return key;
+}
+
+static ExprKey expr_key_symbol(const char* name) {
+    ExprKey key;
+    memset(&key, 0, sizeof(key));
+    key.type = EXPR_SYMBOL;
+    key.name = name;
+    expr_key_finish(&key);
+    return key;
+}
+
+static bool expr_key_matches(const ExprArena* arena, const ExprKey* key, ExprIndex idx) {
+    const Expr* e = &arena->pool[idx];
+    if (arena->base && arena->base->pool[idx].used) e = &arena->base->pool[idx];
+    if (!e->used || e->type != key->type) return false;
+    switch (key->type) {
+        case EXPR_NUMBER:
+            return mpq_equal(e->data.value, key->value) != 0;
+        case EXPR_SYMBOL:
+            return strcmp(e->data.name, key->name) == 0;
         case EXPR_FUNC:
-            snprintf(buf, sizeof(buf), "FUNC: %s", func_type_name(e->data.func.func));
-            label = buf;
-            break;
+            return e->data.func.func == key->func && e->data.func.arg == key->left;
+        default:
+            return e->data.binop.left == key->left && e->data.binop.right == key->right;
+    }
+}
 
-        case EXPR_DIFF:
-            snprintf(buf, sizeof(buf), "DIFF w.r.t. %s", e->data.diff.var);
-            label = buf;
-            break;
+void expr_hashcons_init(ExprHashCons* table) {
+    size_t capacity = 1;
+    while (capacity < 2 * (size_t)MAX_EXPR_COUNT) capacity <<= 1;
+    table->slots = (ExprIndex*)malloc(capacity * sizeof(ExprIndex));
+    if (!table->slots) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    memset(table->slots, 0xff, capacity * sizeof(ExprIndex));
+    table->mask = capacity - 1;
+}
 
-        case EXPR_INT:
-            snprintf(buf, sizeof(buf), "INTEGRAL w.r.t. %s", e->data.integral.var);
-            label = buf;
-            break;
+void expr_hashcons_free(ExprHashCons* table) {
+    free(table->slots);
+    table->slots = NULL;
+    table->mask = 0;
+}
+
+void expr_arena_share(ExprArena* arena, ExprHashCons* table) {
+    arena->hashcons = table;
+    arena->concurrent = table != NULL;
+}
+
+// Returns the canonical index for key, or INVALID_INDEX if there is none yet.
+static ExprIndex expr_hashcons_lookup(const ExprArena* arena, const ExprKey* key) {
+    const ExprHashCons* table = arena->hashcons;
+    if (!table) return INVALID_INDEX;
+    for (size_t i = 0, pos = key->hash & table->mask; i <= table->mask; i++, pos = (pos + 1) & table->mask) {
+        ExprIndex cur = __atomic_load_n(&table->slots[pos], __ATOMIC_ACQUIRE);
+        if (cur == INVALID_INDEX) break;
+        if (cur == EXPR_HASHCONS_TOMBSTONE) continue;
+        if (expr_key_matches(arena, key, cur)) {
+            EXPR_STAT_ADD(arena, hashcons_hits, 1);
+            return cur;
+        }
     }
+    EXPR_STAT_ADD(arena, hashcons_misses, 1);
+    return INVALID_INDEX;
+}
 
-    printf("%*s%s%s\n", indent, "", prefix, label);
+// Publishes the freshly built node fresh under key. If another thread won the
+// race for the same structure, fresh is dropped and the winner returned. The
+// dropped slot is not recycled because other threads may be allocating;
+// expr_arena_clear reclaims it.
+static ExprIndex expr_hashcons_insert(ExprArena* arena, const ExprKey* key, ExprIndex fresh) {
+    ExprHashCons* table = arena->hashcons;
+    if (!table) return fresh;
+    for (size_t i = 0, pos = key->hash & table->mask; i <= table->mask; i++, pos = (pos + 1) & table->mask) {
+        ExprIndex cur = INVALID_INDEX;
+        if (__atomic_compare_exchange_n(&table->slots[pos], &cur, fresh, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return fresh;
+        }
+        if (cur == EXPR_HASHCONS_TOMBSTONE) {
+            // alone in the arena the lookup just missed, so key is nowhere
+            // further along the chain; workers might race for the same slot
+            if (!arena->concurrent) {
+                table->slots[pos] = fresh;
+                return fresh;
+            }
+            continue;
+        }
+        if (expr_key_matches(arena, key, cur)) {
+#ifdef CYMCALC_STATS
+            if (arena->pool[fresh].type == EXPR_NUMBER) EXPR_STAT_SUB(arena, gmp_bytes, expr_stats_number_bytes(&arena->pool[fresh]));
+#endif
+            expr_release_data(&arena->allocator, &arena->pool[fresh]);
+            return cur;
+        }
+    }
+    // Table exhausted by stale entries, keep the node unshared
+    return fresh;
+}
 
-    // Recurse on children
+// Tombstones the entry of a node about to be freed, so no lookup matches the
+// slot once it is reused. Probe chains through the entry stay intact.
+static void expr_hashcons_forget(ExprArena* arena, ExprIndex index) {
+    ExprHashCons* table = arena->hashcons;
+    if (!table) return;
+    const Expr* e = &arena->pool[index];
+    ExprKey key;
     switch (e->type) {
+        case EXPR_NUMBER:
+            key = expr_key_number(e->data.value);
+            break;
+        case EXPR_SYMBOL:
+            key = expr_key_symbol(e->data.name);
+            break;
+        case EXPR_FUNC:
+            key = expr_key_func(e->data.func.func, e->data.func.arg);
+            break;
         case EXPR_ADD:
         case EXPR_MUL:
         case EXPR_POW:
-            expr_print_tree_impl(a, e->data.binop.left, indent + 4, "├── ");
-            expr_print_tree_impl(a, e->data.binop.right, indent + 4, "└── ");
+            key = expr_key_binop((ExprType)e->type, e->data.binop.left, e->data.binop.right);
             break;
+        default:
+            return;
+    }
+    for (size_t i = 0, pos = key.hash & table->mask; i <= table->mask; i++, pos = (pos + 1) & table->mask) {
+        ExprIndex cur = __atomic_load_n(&table->slots[pos], __ATOMIC_ACQUIRE);
+        if (cur == INVALID_INDEX) return;
+        if (cur == index) {
+            __atomic_store_n(&table->slots[pos], EXPR_HASHCONS_TOMBSTONE, __ATOMIC_RELEASE);
+            return;
+        }
+    }
+}
 
-        case EXPR_FUNC:
-            expr_print_tree_impl(a, e->data.func.arg, indent + 4, "└── ");
-            break;
+//-----------------------------------------------
+// Snapshots
+//-----------------------------------------------
 
-        case EXPR_DIFF:
-            expr_print_tree_impl(a, e->data.diff.inner, indent + 4, "└── ");
-            break;
+ExprSnapshot* expr_snapshot_freeze(ExprArena* arena) {
+    ExprSnapshot* snapshot = (ExprSnapshot*)malloc(sizeof(ExprSnapshot));
+    Expr* pool = (Expr*)calloc(MAX_EXPR_COUNT, sizeof(Expr));
+    if (!snapshot || !pool) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < MAX_EXPR_COUNT; i++) {
+        const Expr* src = &arena->pool[i];
+        if (arena->base && arena->base->pool[i].used) src = &arena->base->pool[i];
+        if (!src->used) continue;
+
+        Expr* dst = &pool[i];
+        *dst = *src;
+        switch (src->type) {
+            case EXPR_NUMBER:
+                mpq_init(dst->data.value);
+                mpq_set(dst->data.value, src->data.value);
+                // readers never write to the shared pool
+                dst->meta.approx = mpq_get_d(dst->data.value);
+                break;
+            case EXPR_SYMBOL:
+                dst->data.name = strdup(src->data.name);
+                break;
+            case EXPR_DIFF:
+                dst->data.diff.var = strdup(src->data.diff.var);
+                break;
+            case EXPR_INT:
+                dst->data.integral.var = strdup(src->data.integral.var);
+                break;
+            default:
+                break;
+        }
+    }
+    snapshot->pool = pool;
+    return snapshot;
+}
 
-        case EXPR_INT:
-            expr_print_tree_impl(a, e->data.integral.inner, indent + 4, "└── ");
-            break;
+void expr_snapshot_free(ExprSnapshot* snapshot) {
+    if (!snapshot) return;
+    for (size_t i = 0; i < MAX_EXPR_COUNT; i++) {
+        if (snapshot->pool[i].used) expr_release_data(NULL, &snapshot->pool[i]);
+    }
+    free(snapshot->pool);
+    free(snapshot);
+}
 
-        default:
-            break;  // Nothing to recurse on
+void expr_arena_init_overlay(ExprArena* overlay, const ExprSnapshot* base) {
+    expr_arena_init(overlay);
+    overlay->base = base;
+    expr_arena_reset_free_list(overlay);
+}
+
+Expr* expr_at(ExprArena* arena, ExprIndex index) {
+    if (arena->base && index < MAX_EXPR_COUNT && arena->base->pool[index].used) {
+        return &arena->base->pool[index];
+    }
+    if (index == INVALID_INDEX || index >= MAX_EXPR_COUNT || !arena->pool[index].used) {
+        __atomic_store_n(&arena->error, true, __ATOMIC_RELAXED);
+        return &arena->invalid;
     }
+    return &arena->pool[index];
 }
 
-void expr_print_tree(ExprArena* a, ExprIndex e) {
-    expr_print_tree_impl(a, e, 0, "");
+//-----------------------------------------------
+// Node metadata
+//-----------------------------------------------
+
+static inline uint32_t expr_meta_sat32(uint64_t n) {
+    return n > UINT32_MAX ? UINT32_MAX : (uint32_t)n;
 }
 
+static inline uint16_t expr_meta_sat16(uint64_t n) {
+    return n > UINT16_MAX ? UINT16_MAX : (uint16_t)n;
+}
 
-ExprIndex expr_simplify(ExprArena* a, ExprIndex idx) {
-    //if (!e) return NULL;
-    Expr* e = expr_at(a,idx);
-    switch (e->type) {
+// Monomials of a t-term sum raised to n, C(t+n-1, n); saturates
+static uint32_t expr_meta_pow_terms(uint32_t t, mpz_srcptr n) {
+    if (t <= 1 || mpz_sgn(n) == 0) return 1;
+    if (mpz_cmp_ui(n, UINT32_MAX) > 0) return UINT32_MAX;
+    uint64_t m = (uint64_t)t - 1 + mpz_get_ui(n);
+    uint64_t k = mpz_get_ui(n) < (unsigned long)t - 1 ? mpz_get_ui(n) : (uint64_t)t - 1;
+    double c = 1.0;
+    for (uint64_t i = 1; i <= k && c <= (double)UINT32_MAX; i++) c = c * (double)(m - k + i) / (double)i;
+    return c > (double)UINT32_MAX ? UINT32_MAX : (uint32_t)(c + 0.5);
+}
 
-        case EXPR_NUMBER:
-        case EXPR_SYMBOL:
-            return idx;
+// A number's last word holds its double, not the shape
+static inline uint32_t expr_meta_size(const Expr* e) {
+    return e->type == EXPR_NUMBER ? 1 : e->meta.shape.size;
+}
 
-        case EXPR_ADD: {
-            ExprIndex left = expr_simplify(a, e->data.binop.left);
-            ExprIndex right = expr_simplify(a, e->data.binop.right);
+static inline uint32_t expr_meta_terms(const Expr* e) {
+    return e->type == EXPR_NUMBER ? 1 : e->meta.shape.terms;
+}
 
-            // number + number → number
-            if (expr_type(a,left) == EXPR_NUMBER && expr_type(a,right) == EXPR_NUMBER) {
-                ExprIndex result = expr_add_numbers(a, left, right);
-                //expr_release(left);
-                //expr_release(right);
-                return result;
-            }
+// NULL for an index that names no node; such a child makes the parent opaque
+static const Expr* expr_meta_child(const ExprArena* a, ExprIndex idx) {
+    if (idx == INVALID_INDEX || idx >= MAX_EXPR_COUNT) return NULL;
+    if (a->base && a->base->pool[idx].used) return &a->base->pool[idx];
+    return a->pool[idx].used ? &a->pool[idx] : NULL;
+}
 
-            if (expr_type(a,left) == EXPR_NUMBER &&
-                mpq_cmp_ui(*expr_value(a, left), 0, 1) == 0) {
-                //expr_release(e);
-                return expr_simplify(a,right);
-            }
+// Fills in the metadata of a node whose type and data are set, from the
+// metadata of its children.
+static void expr_meta_init(const ExprArena* a, Expr* e) {
+    const Expr* l = NULL;
+    const Expr* r = NULL;
+    e->depth = 1;
+    e->degree = 0;
+    if (e->type == EXPR_NUMBER) {
+        // meta holds the cached double
+        e->flags = EXPR_META_CONST | EXPR_META_POLY;
+        return;
+    }
+    e->meta.shape.size = 1;
+    e->meta.shape.terms = 1;
+    switch (e->type) {
+        case EXPR_SYMBOL:
+            e->flags = EXPR_META_POLY;
+            e->degree = 1;
+            return;
+        case EXPR_ADD:
+        case EXPR_MUL:
+        case EXPR_POW:
+            l = expr_meta_child(a, e->data.binop.left);
+            r = expr_meta_child(a, e->data.binop.right);
+            break;
+        case EXPR_FUNC:
+            l = expr_meta_child(a, e->data.func.arg);
+            break;
+        default:
+            l = expr_meta_child(a, e->data.diff.inner);
+            break;
+    }
 
-            if (expr_type(a,right) == EXPR_NUMBER &&
-                mpq_cmp_ui(*expr_value(a,right), 0, 1) == 0) {
-                //expr_release(eright);
-                return expr_simplify(a,left);
-            }
+    uint64_t size = 1;
+    unsigned depth = 0;
+    if (l) {
+        size += expr_meta_size(l);
+        depth = l->depth;
+    }
+    if (r) {
+        size += expr_meta_size(r);
+        if (r->depth > depth) depth = r->depth;
+    }
+    e->meta.shape.size = expr_meta_sat32(size);
+    e->depth = expr_meta_sat16((uint64_t)depth + 1);
+    e->flags = 0;
+    if (!l) return;
 
-            // reorder if left is symbol/function and right is number
-            if ((expr_type(a,left) == EXPR_SYMBOL || expr_type(a,left) == EXPR_FUNC ||
-                 expr_type(a,left) == EXPR_MUL    || expr_type(a,left) == EXPR_ADD) &&
-                expr_type(a,right) == EXPR_NUMBER) {
-                
-                ExprIndex swapped = expr_add(a,right, left);
-                //expr_release(left);
-                //expr_release(right);
-                return expr_simplify(a,swapped);
+    switch (e->type) {
+        case EXPR_ADD:
+        case EXPR_MUL:
+            if (!r) return;
+            e->flags = l->flags & r->flags;
+            if (!(e->flags & EXPR_META_POLY)) return;
+            if (e->type == EXPR_ADD) {
+                e->degree = l->degree > r->degree ? l->degree : r->degree;
+                e->meta.shape.terms = expr_meta_sat32((uint64_t)expr_meta_terms(l) + expr_meta_terms(r));
+            } else {
+                e->degree = expr_meta_sat16((uint64_t)l->degree + r->degree);
+                e->meta.shape.terms = expr_meta_sat32((uint64_t)expr_meta_terms(l) * expr_meta_terms(r));
             }
+            return;
+        case EXPR_POW: {
+            if (!r) return;
+            e->flags = l->flags & r->flags & EXPR_META_CONST;
+            if (!(l->flags & EXPR_META_POLY) || r->type != EXPR_NUMBER) return;
+            if (mpz_cmp_ui(mpq_denref(r->data.value), 1) != 0 || mpq_sgn(r->data.value) < 0) return;
+            e->flags |= EXPR_META_POLY;
+            mpz_srcptr n = mpq_numref(r->data.value);
+            if (l->degree && mpz_cmp_ui(n, UINT16_MAX) > 0) e->degree = UINT16_MAX;
+            else e->degree = expr_meta_sat16((uint64_t)l->degree * mpz_get_ui(n));
+            e->meta.shape.terms = expr_meta_pow_terms(expr_meta_terms(l), n);
+            return;
+        }
+        case EXPR_FUNC:
+            e->flags = l->flags & EXPR_META_CONST;
+            return;
+        default:
+            // derivatives and integrals stay opaque
+            return;
+    }
+}
 
-            // a*x + b*x → (a+b)*x
-            if (expr_type(a, left) == EXPR_MUL &&
-                expr_type(a, right) == EXPR_MUL) {
-                
-                Expr* lmul = expr_at(a, left);
-                Expr* rmul = expr_at(a, right);
-                
-                ExprIndex c = lmul->data.binop.left;
-                ExprIndex x1 = lmul->data.binop.right;
-                
-                ExprIndex b = rmul->data.binop.left;
-                ExprIndex x2 = rmul->data.binop.right;
-                
-                if (expr_equal(a, x1, x2)) {
-                    ExprIndex sum = expr_simplify(a, expr_add(a, c, b));
-                    ExprIndex result = expr_mul(a, sum, x1);
-                    return result;
-                }
-            }
+ExprIndex expr_number(ExprArena* arena, char* num_str) {
+    mpq_ptr num = expr_scratch_q(arena);
 
-            // keep as ADD
-            ExprIndex result = expr_add(a, left, right);
-            return result;
-        }
+    if (mpq_set_str(num, num_str, 10) != 0) {
+        fprintf(stderr, "Invalid rational string: %s\n", num_str);
+        exit(1);
+    }
+    mpq_canonicalize(num);
+    ExprIndex idx = expr_number_mpq(arena, num);
+    expr_scratch_q_release(arena, num);
 
-        case EXPR_MUL: {
-            ExprIndex left = expr_simplify(a, e->data.binop.left);
-            ExprIndex right = expr_simplify(a, e->data.binop.right);
-            
-            // number * number → number
-            if (expr_type(a,left) == EXPR_NUMBER && expr_type(a,right) == EXPR_NUMBER) {
-                ExprIndex result = expr_mul_numbers(a, left, right);
-                //expr_release(left);
-                //expr_release(right);
-                return result;
-            }
- 
-            if (expr_type(a,left) == EXPR_NUMBER) {
-                if (mpq_cmp_ui(*expr_value(a,left), 1, 1) == 0) {
-                // 1 * right → right
-                //expr_release(left);
-                return expr_simplify(a, right);
-            }
-            if (mpq_cmp_ui(*expr_value(a,left), 0, 1) == 0) {
-                // 0 * anything → 0
-                //expr_release(right);
-                return expr_number(a,"0");
-            }
-            }
+    return idx;
+}
 
-            // reorder if left is symbol/function and right is number
-            if ((expr_type(a,left) == EXPR_SYMBOL || expr_type(a,left) == EXPR_FUNC ||
-                 expr_type(a,left) == EXPR_MUL    || expr_type(a,left) == EXPR_ADD) &&
-                expr_type(a,right) == EXPR_NUMBER) {
-                
-                ExprIndex swapped = expr_mul(a,right, left);
-                //expr_release(left);
-                //expr_release(right);
-                return expr_simplify(a,swapped);
-            }
-
-
-            // number * (number * expr) → (number * number) * expr
-            if (expr_type(a,left) == EXPR_NUMBER &&
-                (expr_type(a,right) == EXPR_MUL )) {
-                // multiply constants
-                ExprIndex rightleft = expr_left(a, right);
-                ExprIndex merged;
-                if( expr_type(a,rightleft) == EXPR_NUMBER)                
-                    merged = expr_mul_numbers(a,left, rightleft);
-                else 
-                    merged = expr_mul(a,left,rightleft);
-                
-                ExprIndex rightright = expr_right(a, right);
-                ExprIndex newmul = expr_mul(a, merged, rightright);
-                //expr_release(left);
-                //expr_release(right);
-                return expr_simplify(a,newmul);
-            }
-            // number * (number + expr) → (number * number) + (number * expr)
-            if (expr_type(a,left) == EXPR_NUMBER &&
-                (expr_type(a,right) == EXPR_ADD )) {
-                // multiply constants
-                ExprIndex rightleft = expr_left(a, right);
-                ExprIndex merged;
-                if( expr_type(a,rightleft) == EXPR_NUMBER)                
-                    merged = expr_mul_numbers(a,left, rightleft);
-                else 
-                    merged = expr_mul(a,left,rightleft);
-                
-                ExprIndex rightright = expr_mul(a,left,expr_right(a, right));
-                ExprIndex newmul = expr_add(a, merged, rightright);
-                //expr_release(left);
-                //expr_release(right);
-                return expr_simplify(a,newmul);
-            }
-            
-            // x * x -> x^2
-            if (expr_equal(a, left, right)) {
-                ExprIndex exponent = expr_number(a,"2");
-                ExprIndex result = expr_pow(a, left, exponent);
-                //expr_release(right);
-                return expr_simplify(a,result);
-            }
-            
-            // x^a * x^b → x^(a+b)
-            if (expr_type(a,left) == EXPR_POW &&
-                expr_type(a,right) == EXPR_POW) {
+ExprIndex expr_symbol(ExprArena* arena, char* name) {
+    ExprKey key = expr_key_symbol(name);
+    ExprIndex idx = expr_hashcons_lookup(arena, &key);
+    if (idx != INVALID_INDEX) return idx;
 
-                ExprIndex base1 = expr_left(a,left);
-                ExprIndex base2 = expr_left(a,right);
+    idx = expr_arena_alloc(arena);
+    Expr* sym_expr = expr_at(arena,idx);
+    sym_expr->type = EXPR_SYMBOL;
+    sym_expr->data.name = expr_mem_strdup(&arena->allocator, name);
+    expr_meta_init(arena, sym_expr);
+    return expr_hashcons_insert(arena, &key, idx);
+}
 
-                if (expr_equal(a, base1, base2)) {
-                    ExprIndex exp1 = expr_right(a,left);
-                    ExprIndex exp2 = expr_right(a,right);
+ExprIndex expr_add(ExprArena* arena, ExprIndex left, ExprIndex right) {
+    ExprKey key = expr_key_binop(EXPR_ADD, left, right);
+    ExprIndex idx = expr_hashcons_lookup(arena, &key);
+    if (idx != INVALID_INDEX) return idx;
 
-                    ExprIndex exp_sum = expr_simplify(a,expr_add(a,exp1, exp2));
-                    ExprIndex result = expr_pow(a, base1, exp_sum); //expr_copy(base1)
+    idx = expr_arena_alloc(arena);
+    Expr* add_expr = expr_at(arena,idx);
+    add_expr->type = EXPR_ADD;
 
-                    //expr_release(left);
-                    //expr_release(right);
-                    return result;
-                }
-            }
+    add_expr->data.binop.left  = left;
+    add_expr->data.binop.right = right;
+    expr_meta_init(arena, add_expr);
 
-            // keep as MUL
-            ExprIndex result = expr_mul(a, left, right);
-            return result;
-        }
+    return expr_hashcons_insert(arena, &key, idx);
+}
 
-        case EXPR_POW: {
-            ExprIndex base = expr_simplify(a,e->data.binop.left);
-            ExprIndex exponent = expr_simplify(a,e->data.binop.right);
-            
-            if (expr_type(a, exponent) == EXPR_NUMBER) {
-                if (mpq_cmp_ui(*expr_value(a, exponent), 0, 1) == 0) {
-                    // x^0 = 1
-                    //expr_release(base);
-                    //expr_release(exponent);
-                    return expr_number(a, "1");
-                }
-                if (mpq_cmp_ui(*expr_value(a, exponent), 1, 1) == 0) {
-                    // x^1 = x
-                    //expr_release(exponent);
-                    return expr_simplify(a, base);
-                }
-            }
-            
-            if (expr_type(a,base) == EXPR_NUMBER) {
-                if (mpq_cmp_ui(*expr_value(a,base), 0, 1) == 0) {
-                    // 0^x = 0
-                    //expr_release(exponent);
-                    return expr_number(a,"0");
-                }
-                if (mpq_cmp_ui(*expr_value(a,base), 1, 1) == 0) {
-                    // 1^x = 1
-                    //expr_release(exponent);
-                    return expr_number(a,"1");
-                }
-            }
+ExprIndex expr_mul(ExprArena* arena, ExprIndex left, ExprIndex right) {
+    ExprKey key = expr_key_binop(EXPR_MUL, left, right);
+    ExprIndex idx = expr_hashcons_lookup(arena, &key);
+    if (idx != INVALID_INDEX) return idx;
 
-            //if(base->type==EXPR_NUMBER && exponent->type==EXPR_NUMBER) {
-            //    Expr* result = expr_mul_numbers(base, exponent);
-            //    expr_release(base);
-            //    expr_release(exponent);
-            //    return result;
-            //}
-            
-            return expr_pow(a, base, exponent);
-        }
-        
-        case EXPR_FUNC: {
-            ExprIndex arg = expr_simplify(a, e->data.func.arg);
-            return expr_func(a, e->data.func.func, arg);
-        }
+    idx = expr_arena_alloc(arena);
+    Expr* mul_expr= expr_at(arena,idx);
 
-        case EXPR_DIFF: {
-            ExprIndex inner = e->data.diff.inner;
+    mul_expr->type = EXPR_MUL;
+
+    mul_expr->data.binop.left  = left;
+    mul_expr->data.binop.right = right;
+    expr_meta_init(arena, mul_expr);
+
+    return expr_hashcons_insert(arena, &key, idx);
+}
+
+ExprIndex expr_pow(ExprArena* arena, ExprIndex base, ExprIndex exponent) {
+    ExprKey key = expr_key_binop(EXPR_POW, base, exponent);
+    ExprIndex idx = expr_hashcons_lookup(arena, &key);
+    if (idx != INVALID_INDEX) return idx;
+
+    idx = expr_arena_alloc(arena);
+    Expr* pow_expr= expr_at(arena,idx);
+
+    pow_expr->type = EXPR_POW;
+
+    pow_expr->data.binop.left  = base;
+    pow_expr->data.binop.right = exponent;
+    expr_meta_init(arena, pow_expr);
+
+    return expr_hashcons_insert(arena, &key, idx);
+}
+
+ExprIndex expr_func(ExprArena* arena,FuncType f, ExprIndex arg) {
+    switch (f) {
+        case FUNC_SIN: break;
+        case FUNC_COS: break;
+        case FUNC_EXP: break;
+        case FUNC_LOG: break;
+        default:
+            fprintf(stderr, "Unknown function type: %d\n", f);
+            exit(1);
+    }
+
+    ExprKey key = expr_key_func(f, arg);
+    ExprIndex idx = expr_hashcons_lookup(arena, &key);
+    if (idx != INVALID_INDEX) return idx;
+
+    idx = expr_arena_alloc(arena);
+    Expr* fun_expr = expr_at(arena,idx);
+
+    fun_expr->type = EXPR_FUNC;
+    fun_expr->data.func.func = f;
+    fun_expr->data.func.arg  = arg;
+    expr_meta_init(arena, fun_expr);
+
+    return expr_hashcons_insert(arena, &key, idx);
+}
+
+ExprIndex expr_diff(ExprArena* arena, ExprIndex f, const char* var) {
+    //if (!(false) || !var) return NULL;
+    ExprIndex idx = expr_arena_alloc(arena);
+    Expr* e = expr_at(arena,idx);
+    e->type = EXPR_DIFF;
+    e->data.diff.inner = f;
+    e->data.diff.var = expr_mem_strdup(&arena->allocator, var);
+    expr_meta_init(arena, e);
+    return idx;
+}
+
+ExprIndex expr_int(ExprArena* arena, ExprIndex f, const char* var) {
+    //if (!(false) || !var) return NULL;
+    ExprIndex idx = expr_arena_alloc(arena);
+    Expr* e = expr_at(arena,idx);
+    e->type = EXPR_INT;
+    e->data.diff.inner = f;
+    e->data.diff.var = expr_mem_strdup(&arena->allocator, var);
+    expr_meta_init(arena, e);
+    return idx;
+}
+
+void expr_print(ExprArena* arena, ExprIndex idx) {
+    Expr* e = expr_at(arena, idx);
+    if (!e) {
+        printf("<null>");
+        return;
+    }
+    switch (e->type) {
+        case EXPR_NUMBER:
+            gmp_printf("%Qd", e->data.value);
+            break;
+        case EXPR_SYMBOL:
+            printf("%s", e->data.name);
+            break;
+        case EXPR_ADD:
+            printf("(");
+            expr_print(arena, e->data.binop.left);
+            printf(" + ");
+            expr_print(arena, e->data.binop.right);
+            printf(")");
+            break;
+        case EXPR_MUL:
+            printf("(");
+            expr_print(arena, e->data.binop.left);
+            printf(" * ");
+            expr_print(arena, e->data.binop.right);
+            printf(")");
+            break;
+        case EXPR_POW:
+            printf("(");
+            expr_print(arena, e->data.binop.left);
+            printf(" ^ ");
+            expr_print(arena, e->data.binop.right);
+            printf(")");
+            break;
+        case EXPR_FUNC:
+            switch (e->data.func.func) {
+                case FUNC_SIN: printf("sin"); break;
+                case FUNC_COS: printf("cos"); break;
+                case FUNC_EXP: printf("exp"); break;
+                case FUNC_LOG: printf("log"); break;
+                default:
+                    fprintf(stderr, "Unknown function type: %d\n", e->data.func.func);
+                    exit(1);
+            }
+            printf("(");
+            expr_print(arena, e->data.func.arg);
+            printf(")");
+            break;
+        case EXPR_DIFF:
+        {
             const char* var = e->data.diff.var;
-            
-            ExprIndex simplified_inner = expr_simplify(a, inner);
 
-            // Try to fully evaluate the derivative using existing engine
-            ExprIndex attempted = expr_differentiate(a, simplified_inner, var);
-            if (attempted != INVALID_INDEX) return expr_simplify(a,attempted);
-               
-            // Return symbolic diff since it couldn’t be evaluated
-            return expr_diff(a, simplified_inner, var);
+            printf("d/d%s", var);
+            printf("(");
+            expr_print(arena, e->data.diff.inner);
+            printf(")");
+            break;
+        }
+        case EXPR_INT:
+        {
+            const char* var = e->data.integral.var;
+            printf( "∫");
+            printf("(");
+            expr_print(arena, e->data.integral.inner);
+            printf(")");
+            printf( "d%s",var);
+            break;
+        }
+        default:
+            printf("<expr_type_%d>", e->type);
+    }
+}
+
+static inline char* concat(char* s1, const char* s2) {
+    size_t len1 = strlen(s1);
+    size_t len2 = strlen(s2);
+    char* result = malloc(len1 + len2 + 1);
+    memcpy(result, s1, len1);
+    memcpy(result + len1, s2, len2 + 1);
+    free(s1);
+    return result;
+}
+typedef struct {
+    char* items;
+    size_t count;
+    size_t capacity;
+} ExprStringBuilder;
+
+static void expr_sb_append(ExprStringBuilder* sb, const char* str) {
+    size_t len = strlen(str);
+    if (sb->count + len + 1 > sb->capacity) {
+        size_t capacity = sb->capacity ? sb->capacity : 64;
+        while (sb->count + len + 1 > capacity) capacity *= 2;
+        char* items = (char*)realloc(sb->items, capacity);
+        if (!items) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        sb->items = items;
+        sb->capacity = capacity;
+    }
+    memcpy(sb->items + sb->count, str, len + 1);
+    sb->count += len;
+}
+
+static void expr_to_string_impl(ExprArena* arena, ExprIndex idx, ExprStringBuilder* sb) {
+    Expr* e = expr_at(arena, idx);
+    switch (e->type) {
+        case EXPR_NUMBER: {
+            mpq_srcptr q = e->data.value;
+            size_t size = mpz_sizeinbase(mpq_numref(q), 10) + mpz_sizeinbase(mpq_denref(q), 10) + 3;
+            char small[64];
+            char* buf = size <= sizeof(small) ? small : (char*)malloc(size);
+            if (!buf) {
+                fprintf(stderr, "Out of memory\n");
+                exit(1);
+            }
+            mpq_get_str(buf, 10, q);
+            expr_sb_append(sb, buf);
+            if (buf != small) free(buf);
+            break;
+        }
+        case EXPR_SYMBOL:
+            expr_sb_append(sb, e->data.name);
+            break;
+        case EXPR_ADD:
+        case EXPR_MUL:
+        case EXPR_POW:
+            expr_sb_append(sb, "(");
+            expr_to_string_impl(arena, e->data.binop.left, sb);
+            expr_sb_append(sb, e->type == EXPR_ADD ? " + " : e->type == EXPR_MUL ? " * " : " ^ ");
+            expr_to_string_impl(arena, e->data.binop.right, sb);
+            expr_sb_append(sb, ")");
+            break;
+        case EXPR_FUNC:
+            switch (e->data.func.func) {
+                case FUNC_SIN: expr_sb_append(sb, "sin"); break;
+                case FUNC_COS: expr_sb_append(sb, "cos"); break;
+                case FUNC_EXP: expr_sb_append(sb, "exp"); break;
+                case FUNC_LOG: expr_sb_append(sb, "log"); break;
+                default:
+                    fprintf(stderr, "Unknown function type: %d\n", e->data.func.func);
+                    exit(1);
+            }
+            expr_sb_append(sb, "(");
+            expr_to_string_impl(arena, e->data.func.arg, sb);
+            expr_sb_append(sb, ")");
+            break;
+        case EXPR_DIFF:
+            expr_sb_append(sb, "d/d");
+            expr_sb_append(sb, e->data.diff.var);
+            expr_sb_append(sb, "(");
+            expr_to_string_impl(arena, e->data.diff.inner, sb);
+            expr_sb_append(sb, ")");
+            break;
+        case EXPR_INT:
+            expr_sb_append(sb, "∫(");
+            expr_to_string_impl(arena, e->data.integral.inner, sb);
+            expr_sb_append(sb, ")d");
+            expr_sb_append(sb, e->data.integral.var);
+            break;
+        default:
+            fprintf(stderr, "Unknown expression type in conversion to string: %d.\n", e->type);
+            exit(1);
+    }
+}
+
+char* expr_to_string(ExprArena* arena, ExprIndex idx) {
+    ExprStringBuilder sb = {0};
+    expr_sb_append(&sb, "");
+    expr_to_string_impl(arena, idx, &sb);
+    return sb.items;
+}
+
+ExprType expr_type(ExprArena* arena, ExprIndex idx) {
+    return (expr_at(arena,idx))->type;
+}
+
+size_t expr_size(ExprArena* arena, ExprIndex idx) {
+    return expr_meta_size(expr_at(arena, idx));
+}
+
+unsigned expr_depth(ExprArena* arena, ExprIndex idx) {
+    return expr_at(arena, idx)->depth;
+}
+
+bool expr_is_const(ExprArena* arena, ExprIndex idx) {
+    return (expr_at(arena, idx)->flags & EXPR_META_CONST) != 0;
+}
+
+bool expr_is_poly(ExprArena* arena, ExprIndex idx) {
+    return (expr_at(arena, idx)->flags & EXPR_META_POLY) != 0;
+}
+
+long expr_degree(ExprArena* arena, ExprIndex idx) {
+    Expr* e = expr_at(arena, idx);
+    return (e->flags & EXPR_META_POLY) ? (long)e->degree : -1;
+}
+
+FuncType expr_ftype(ExprArena* arena, ExprIndex idx) {
+    Expr* e = expr_at(arena, idx);
+    if (!e || e->type != EXPR_FUNC) {
+        fprintf(stderr, "expr_value: not a function\n");
+        exit(1);
+    }
+    return e->data.func.func;
+}
+
+ExprIndex expr_arg(ExprArena* arena, ExprIndex idx) {
+    Expr* e = expr_at(arena, idx);
+    if (!e || e->type != EXPR_FUNC) {
+        fprintf(stderr, "expr_value: not a function\n");
+        exit(1);
+    }
+    return e->data.func.arg;
+}
+
+mpq_t* expr_value(ExprArena* arena, ExprIndex idx) {
+    Expr* e = expr_at(arena, idx);
+    if (!e || e->type != EXPR_NUMBER) {
+        fprintf(stderr, "expr_value: not a number\n");
+        exit(1);
+    }
+    return &e->data.value;
+}
+
+// The cache may be filled by several threads at once; they all store the
+// same value.
+double expr_value_d(ExprArena* arena, ExprIndex idx) {
+    Expr* e = expr_at(arena, idx);
+    if (!e || e->type != EXPR_NUMBER) {
+        fprintf(stderr, "expr_value_d: not a number\n");
+        exit(1);
+    }
+    double d;
+    __atomic_load(&e->meta.approx, &d, __ATOMIC_RELAXED);
+    if (isnan(d)) {
+        EXPR_STAT_ADD(arena, approx_misses, 1);
+        d = mpq_get_d(e->data.value);
+        __atomic_store(&e->meta.approx, &d, __ATOMIC_RELAXED);
+    } else {
+        EXPR_STAT_ADD(arena, approx_hits, 1);
+    }
+    return d;
+}
+
+char* expr_name(ExprArena* arena, ExprIndex idx) {
+    Expr* e = expr_at(arena, idx);
+    if (!e || e->type != EXPR_SYMBOL) {
+        fprintf(stderr, "expr_value: not a number\n");
+        exit(1);
+    }
+    return e->data.name;
+}
+
+ExprIndex expr_left(ExprArena* arena, ExprIndex idx) {
+    Expr* e = expr_at(arena, idx);
+    if (!e || (e->type != EXPR_MUL && e->type != EXPR_ADD && e->type != EXPR_POW)) {
+        fprintf(stderr, "expr_value: not a binop %d \n", e->type);
+        exit(1);
+    }
+    return e->data.binop.left;
+}
+
+ExprIndex expr_right(ExprArena* arena, ExprIndex idx) {
+    Expr* e = expr_at(arena, idx);
+    if (!e || e->type != EXPR_MUL && e->type != EXPR_ADD && e->type != EXPR_POW) {
+        fprintf(stderr, "expr_value: not a binop %d \n", e->type);
+        exit(1);
+    }
+    return e->data.binop.right;
+}
+
+ExprIndex expr_add_numbers(ExprArena* arena, ExprIndex a_idx, ExprIndex b_idx) {
+    Expr* a = expr_at(arena, a_idx);
+    Expr* b = expr_at(arena, b_idx);
+    if (!a || !b || a->type != EXPR_NUMBER || b->type != EXPR_NUMBER) {
+        fprintf(stderr, "expr_add_numbers: operands must be EXPR_NUMBER\n");
+        exit(1);
+    }
+
+    mpq_ptr sum = expr_scratch_q(arena);
+    mpq_add(sum, a->data.value, b->data.value);
+    ExprIndex result_idx = expr_number_mpq(arena, sum);
+    expr_scratch_q_release(arena, sum);
+    return result_idx;
+}
+
+ExprIndex expr_mul_numbers(ExprArena* arena, ExprIndex a_idx, ExprIndex b_idx) {
+    Expr* a = expr_at(arena, a_idx);
+    Expr* b = expr_at(arena, b_idx);
+    if (!a || !b || a->type != EXPR_NUMBER || b->type != EXPR_NUMBER) {
+        fprintf(stderr, "expr_mul_numbers: operands must be EXPR_NUMBER\n");
+        exit(1);
+    }
+
+    mpq_ptr product = expr_scratch_q(arena);
+    mpq_mul(product, a->data.value, b->data.value);
+    ExprIndex result_idx = expr_number_mpq(arena, product);
+    expr_scratch_q_release(arena, product);
+    return result_idx;
+}
+
+/*Expr* expr_pow_numbers(const Expr* a, const Expr* b) {
+    Expr* result = malloc(sizeof(Expr));
+    result->type = EXPR_NUMBER;
+    result->refcount = 1;
+    mpq_init(result->data.value);
+    mpq_pow(result->data.value, a->data.value, b->data.value);
+    return result;
+}*/
+
+const char* func_type_name(FuncType f) {
+    switch (f) {
+        case FUNC_SIN: return "sin";
+        case FUNC_COS: return "cos";
+        case FUNC_EXP: return "exp";
+        case FUNC_LOG: return "log";
+        default:       return "unknown_func";
+    }
+}
+
+void expr_print_tree_impl(ExprArena* a, ExprIndex idx, int indent, const char* prefix) {
+    Expr *e = expr_at(a, idx);
+    if (!e) {
+        printf("%*s%s(NULL)\n", indent, "", prefix);
+        return;
+    }
+
+    char buf[256];
+    const char* label = "???";
+
+    switch (e->type) {
+        case EXPR_NUMBER:
+            gmp_snprintf(buf, sizeof(buf), "NUMBER: %Qd", e->data.value);
+            label = buf;
+            break;
+
+        case EXPR_SYMBOL:
+            snprintf(buf, sizeof(buf), "SYMBOL: %s", e->data.name);
+            label = buf;
+            break;
+
+        case EXPR_ADD:
+            label = "ADD";
+            break;
+
+        case EXPR_MUL:
+            label = "MUL";
+            break;
+
+        case EXPR_POW:
+            label = "POW";
+            break;
+
+        case EXPR_FUNC:
+            snprintf(buf, sizeof(buf), "FUNC: %s", func_type_name(e->data.func.func));
+            label = buf;
+            break;
+
+        case EXPR_DIFF:
+            snprintf(buf, sizeof(buf), "DIFF w.r.t. %s", e->data.diff.var);
+            label = buf;
+            break;
+
+        case EXPR_INT:
+            snprintf(buf, sizeof(buf), "INTEGRAL w.r.t. %s", e->data.integral.var);
+            label = buf;
+            break;
+    }
+
+    printf("%*s%s%s\n", indent, "", prefix, label);
+
+    // Recurse on children
+    switch (e->type) {
+        case EXPR_ADD:
+        case EXPR_MUL:
+        case EXPR_POW:
+            expr_print_tree_impl(a, e->data.binop.left, indent + 4, "├── ");
+            expr_print_tree_impl(a, e->data.binop.right, indent + 4, "└── ");
+            break;
+
+        case EXPR_FUNC:
+            expr_print_tree_impl(a, e->data.func.arg, indent + 4, "└── ");
+            break;
+
+        case EXPR_DIFF:
+            expr_print_tree_impl(a, e->data.diff.inner, indent + 4, "└── ");
+            break;
+
+        case EXPR_INT:
+            expr_print_tree_impl(a, e->data.integral.inner, indent + 4, "└── ");
+            break;
+
+        default:
+            break;  // Nothing to recurse on
+    }
+}
+
+void expr_print_tree(ExprArena* a, ExprIndex e) {
+    expr_print_tree_impl(a, e, 0, "");
+}
+
+
+// Rule application for a binary node whose operands are already simplified.
+static ExprIndex expr_simplify_add(ExprArena* a, ExprIndex left, ExprIndex right) {
+    // number + number → number
+    if (expr_type(a,left) == EXPR_NUMBER && expr_type(a,right) == EXPR_NUMBER) {
+        EXPR_RULE_SCOPE(a, EXPR_RULE_ADD_NUMBERS);
+        ExprIndex result = expr_add_numbers(a, left, right);
+        //expr_release(left);
+        //expr_release(right);
+        return result;
+    }
+
+    if (expr_type(a,left) == EXPR_NUMBER &&
+        mpq_cmp_ui(*expr_value(a, left), 0, 1) == 0) {
+        EXPR_RULE_SCOPE(a, EXPR_RULE_ADD_ZERO);
+        //expr_release(e);
+        return expr_simplify(a,right);
+    }
+
+    if (expr_type(a,right) == EXPR_NUMBER &&
+        mpq_cmp_ui(*expr_value(a,right), 0, 1) == 0) {
+        EXPR_RULE_SCOPE(a, EXPR_RULE_ADD_ZERO);
+        //expr_release(eright);
+        return expr_simplify(a,left);
+    }
+
+    // reorder if left is symbol/function and right is number
+    if ((expr_type(a,left) == EXPR_SYMBOL || expr_type(a,left) == EXPR_FUNC ||
+         expr_type(a,left) == EXPR_MUL    || expr_type(a,left) == EXPR_ADD) &&
+        expr_type(a,right) == EXPR_NUMBER) {
+        EXPR_RULE_SCOPE(a, EXPR_RULE_ADD_SWAP);
+        ExprIndex swapped = expr_add(a,right, left);
+        //expr_release(left);
+        //expr_release(right);
+        return expr_simplify(a,swapped);
+    }
+
+    // a*x + b*x → (a+b)*x
+    if (expr_type(a, left) == EXPR_MUL &&
+        expr_type(a, right) == EXPR_MUL) {
+        
+        Expr* lmul = expr_at(a, left);
+        Expr* rmul = expr_at(a, right);
+        
+        ExprIndex c = lmul->data.binop.left;
+        ExprIndex x1 = lmul->data.binop.right;
+        
+        ExprIndex b = rmul->data.binop.left;
+        ExprIndex x2 = rmul->data.binop.right;
+        
+        if (expr_equal(a, x1, x2)) {
+            EXPR_RULE_SCOPE(a, EXPR_RULE_ADD_COLLECT);
+            ExprIndex sum = expr_simplify(a, expr_add(a, c, b));
+            ExprIndex result = expr_mul(a, sum, x1);
+            return result;
+        }
+    }
+
+    // keep as ADD
+    ExprIndex result = expr_add(a, left, right);
+    return result;
+}
+
+static ExprIndex expr_simplify_mul(ExprArena* a, ExprIndex left, ExprIndex right) {
+    // number * number → number
+    if (expr_type(a,left) == EXPR_NUMBER && expr_type(a,right) == EXPR_NUMBER) {
+        EXPR_RULE_SCOPE(a, EXPR_RULE_MUL_NUMBERS);
+        ExprIndex result = expr_mul_numbers(a, left, right);
+        //expr_release(left);
+        //expr_release(right);
+        return result;
+    }
+ 
+    if (expr_type(a,left) == EXPR_NUMBER) {
+        if (mpq_cmp_ui(*expr_value(a,left), 1, 1) == 0) {
+        // 1 * right → right
+        EXPR_RULE_SCOPE(a, EXPR_RULE_MUL_ONE);
+        //expr_release(left);
+        return expr_simplify(a, right);
+    }
+    if (mpq_cmp_ui(*expr_value(a,left), 0, 1) == 0) {
+        // 0 * anything → 0
+        EXPR_RULE_SCOPE(a, EXPR_RULE_MUL_ZERO);
+        //expr_release(right);
+        return expr_number(a,"0");
+    }
+    }
+
+    // reorder if left is symbol/function and right is number
+    if ((expr_type(a,left) == EXPR_SYMBOL || expr_type(a,left) == EXPR_FUNC ||
+         expr_type(a,left) == EXPR_MUL    || expr_type(a,left) == EXPR_ADD) &&
+        expr_type(a,right) == EXPR_NUMBER) {
+        EXPR_RULE_SCOPE(a, EXPR_RULE_MUL_SWAP);
+        ExprIndex swapped = expr_mul(a,right, left);
+        //expr_release(left);
+        //expr_release(right);
+        return expr_simplify(a,swapped);
+    }
+
+
+    // number * (number * expr) → (number * number) * expr
+    if (expr_type(a,left) == EXPR_NUMBER &&
+        (expr_type(a,right) == EXPR_MUL )) {
+        EXPR_RULE_SCOPE(a, EXPR_RULE_MUL_COEFF);
+        // multiply constants
+        ExprIndex rightleft = expr_left(a, right);
+        ExprIndex merged;
+        if( expr_type(a,rightleft) == EXPR_NUMBER)                
+            merged = expr_mul_numbers(a,left, rightleft);
+        else 
+            merged = expr_mul(a,left,rightleft);
+        
+        ExprIndex rightright = expr_right(a, right);
+        ExprIndex newmul = expr_mul(a, merged, rightright);
+        //expr_release(left);
+        //expr_release(right);
+        return expr_simplify(a,newmul);
+    }
+    // number * (number + expr) → (number * number) + (number * expr)
+    if (expr_type(a,left) == EXPR_NUMBER &&
+        (expr_type(a,right) == EXPR_ADD )) {
+        EXPR_RULE_SCOPE(a, EXPR_RULE_MUL_DISTRIBUTE);
+        // multiply constants
+        ExprIndex rightleft = expr_left(a, right);
+        ExprIndex merged;
+        if( expr_type(a,rightleft) == EXPR_NUMBER)                
+            merged = expr_mul_numbers(a,left, rightleft);
+        else 
+            merged = expr_mul(a,left,rightleft);
+        
+        ExprIndex rightright = expr_mul(a,left,expr_right(a, right));
+        ExprIndex newmul = expr_add(a, merged, rightright);
+        //expr_release(left);
+        //expr_release(right);
+        return expr_simplify(a,newmul);
+    }
+    
+    // x * x -> x^2
+    if (expr_equal(a, left, right)) {
+        EXPR_RULE_SCOPE(a, EXPR_RULE_MUL_SQUARE);
+        ExprIndex exponent = expr_number(a,"2");
+        ExprIndex result = expr_pow(a, left, exponent);
+        //expr_release(right);
+        return expr_simplify(a,result);
+    }
+    
+    // x^a * x^b → x^(a+b)
+    if (expr_type(a,left) == EXPR_POW &&
+        expr_type(a,right) == EXPR_POW) {
+
+        ExprIndex base1 = expr_left(a,left);
+        ExprIndex base2 = expr_left(a,right);
+
+        if (expr_equal(a, base1, base2)) {
+            EXPR_RULE_SCOPE(a, EXPR_RULE_MUL_POW_MERGE);
+            ExprIndex exp1 = expr_right(a,left);
+            ExprIndex exp2 = expr_right(a,right);
+
+            ExprIndex exp_sum = expr_simplify(a,expr_add(a,exp1, exp2));
+            ExprIndex result = expr_pow(a, base1, exp_sum); //expr_copy(base1)
+
+            //expr_release(left);
+            //expr_release(right);
+            return result;
+        }
+    }
+
+    // keep as MUL
+    ExprIndex result = expr_mul(a, left, right);
+    return result;
+}
+
+static ExprIndex expr_simplify_pow(ExprArena* a, ExprIndex base, ExprIndex exponent) {
+    if (expr_type(a, exponent) == EXPR_NUMBER) {
+        if (mpq_cmp_ui(*expr_value(a, exponent), 0, 1) == 0) {
+            // x^0 = 1
+            EXPR_RULE_SCOPE(a, EXPR_RULE_POW_ZERO);
+            //expr_release(base);
+            //expr_release(exponent);
+            return expr_number(a, "1");
+        }
+        if (mpq_cmp_ui(*expr_value(a, exponent), 1, 1) == 0) {
+            // x^1 = x
+            EXPR_RULE_SCOPE(a, EXPR_RULE_POW_ONE);
+            //expr_release(exponent);
+            return expr_simplify(a, base);
+        }
+    }
+    
+    if (expr_type(a,base) == EXPR_NUMBER) {
+        if (mpq_cmp_ui(*expr_value(a,base), 0, 1) == 0) {
+            // 0^x = 0
+            EXPR_RULE_SCOPE(a, EXPR_RULE_POW_ZERO_BASE);
+            //expr_release(exponent);
+            return expr_number(a,"0");
+        }
+        if (mpq_cmp_ui(*expr_value(a,base), 1, 1) == 0) {
+            // 1^x = 1
+            EXPR_RULE_SCOPE(a, EXPR_RULE_POW_ONE_BASE);
+            //expr_release(exponent);
+            return expr_number(a,"1");
+        }
+    }
+
+    //if(base->type==EXPR_NUMBER && exponent->type==EXPR_NUMBER) {
+    //    Expr* result = expr_mul_numbers(base, exponent);
+    //    expr_release(base);
+    //    expr_release(exponent);
+    //    return result;
+    //}
+    
+    return expr_pow(a, base, exponent);
+}
+
+static ExprIndex expr_simplify_node(ExprArena* a, ExprIndex idx) {
+    //if (!e) return NULL;
+    Expr* e = expr_at(a,idx);
+    switch (e->type) {
+
+        case EXPR_NUMBER:
+        case EXPR_SYMBOL:
+            return idx;
+
+        case EXPR_ADD: {
+            ExprIndex left = expr_simplify(a, e->data.binop.left);
+            ExprIndex right = expr_simplify(a, e->data.binop.right);
+            return expr_simplify_add(a, left, right);
+        }
+
+        case EXPR_MUL: {
+            ExprIndex left = expr_simplify(a, e->data.binop.left);
+            ExprIndex right = expr_simplify(a, e->data.binop.right);
+            return expr_simplify_mul(a, left, right);
+        }
+
+        case EXPR_POW: {
+            ExprIndex base = expr_simplify(a,e->data.binop.left);
+            ExprIndex exponent = expr_simplify(a,e->data.binop.right);
+            return expr_simplify_pow(a, base, exponent);
+        }
+        
+        case EXPR_FUNC: {
+            ExprIndex arg = expr_simplify(a, e->data.func.arg);
+            return expr_func(a, e->data.func.func, arg);
+        }
+
+        case EXPR_DIFF: {
+            ExprIndex inner = e->data.diff.inner;
+            const char* var = e->data.diff.var;
+            
+            ExprIndex simplified_inner = expr_simplify(a, inner);
+            EXPR_RULE_SCOPE(a, EXPR_RULE_DIFF);
+            EXPR_TRACE_SCOPE(a, EXPR_TRACE_DIFF);
+
+            // Try to fully evaluate the derivative using existing engine
+            ExprIndex attempted = expr_differentiate(a, simplified_inner, var);
+            if (attempted != INVALID_INDEX) return expr_simplify(a,attempted);
+               
+            // Return symbolic diff since it couldn’t be evaluated
+            return expr_diff(a, simplified_inner, var);
+        }
+
+        case EXPR_INT: {
+            ExprIndex inner = e->data.integral.inner;
+            const char* var = e->data.integral.var;
+
+            ExprIndex simp_inner = expr_simplify(a, inner);
+            EXPR_RULE_SCOPE(a, EXPR_RULE_INT);
+            EXPR_TRACE_SCOPE(a, EXPR_TRACE_INT);
+
+            // Try to evaluate with existing integration engine
+            ExprIndex attempted = expr_integrate(a, simp_inner, var);
+            if (attempted != INVALID_INDEX) return expr_simplify(a, attempted);
+            return expr_int(a, simp_inner, var);
+            
+        }
+
+        default:
+            fprintf(stderr, "Unknown expression type in expr_simplify.\n");
+            exit(1);
+    }
+}
+
+// Whether expr_simplify may hand a polynomial to expr_expand. A term of the
+// result takes a coefficient and a sum node plus up to four nodes per
+// variable, and a term has at most min(degree, symbol leaves) variables.
+static bool expr_expand_fits(ExprArena* a, ExprIndex idx) {
+    const Expr* e = expr_at(a, idx);
+    uint32_t terms = expr_meta_terms(e);
+    if (!(e->flags & EXPR_META_POLY) || terms > EXPR_MPOLY_SIMPLIFY_MAX_TERMS) return false;
+    uint64_t leaves = ((uint64_t)expr_meta_size(e) + 1) / 2;
+    uint64_t vars = e->degree < leaves ? e->degree : leaves;
+    uint64_t nodes = (uint64_t)terms * (2 + 4 * vars);
+    int free_count = __atomic_load_n(&a->free_count, __ATOMIC_RELAXED);
+    return free_count > 0 && nodes <= (uint64_t)free_count;
+}
+
+// Walks the ADD/MUL/POW spine and hands each maximal polynomial subtree
+// that is large enough, and whose expansion stays small enough, to
+// expr_expand.
+static ExprIndex expr_simplify_routed(ExprArena* a, ExprIndex idx) {
+    ExprType type = expr_type(a, idx);
+    if (type != EXPR_ADD && type != EXPR_MUL && type != EXPR_POW) return expr_simplify_node(a, idx);
+    if (expr_size(a, idx) < EXPR_MPOLY_SIMPLIFY_THRESHOLD) return expr_simplify_node(a, idx);
+    if (expr_expand_fits(a, idx)) {
+        EXPR_RULE_SCOPE(a, EXPR_RULE_EXPAND);
+        ExprIndex expanded = expr_expand(a, idx);
+        if (expanded != INVALID_INDEX) return expanded;
+    }
+
+    ExprIndex left = expr_simplify_routed(a, expr_left(a, idx));
+    ExprIndex right = expr_simplify_routed(a, expr_right(a, idx));
+    switch (type) {
+        case EXPR_ADD: return expr_simplify_add(a, left, right);
+        case EXPR_MUL: return expr_simplify_mul(a, left, right);
+        default:       return expr_simplify_pow(a, left, right);
+    }
+}
+
+ExprIndex expr_simplify(ExprArena* a, ExprIndex idx) {
+    EXPR_STATS_SCOPE(a, EXPR_ALGO_SIMPLIFY);
+    EXPR_TRACE_SCOPE(a, EXPR_TRACE_SIMPLIFY);
+    ExprType type = expr_type(a, idx);
+    if ((type != EXPR_ADD && type != EXPR_MUL && type != EXPR_POW) ||
+        expr_size(a, idx) < EXPR_MPOLY_SIMPLIFY_THRESHOLD) {
+        return expr_simplify_node(a, idx);
+    }
+    return expr_simplify_routed(a, idx);
+}
+static ExprIndex expr_copy_impl(ExprArena* dst, ExprArena* src, ExprIndex idx, ExprIndex* memo) {
+    if (memo[idx] != INVALID_INDEX) return memo[idx];
+    Expr* e = expr_at(src, idx);
+    ExprIndex result;
+    switch (e->type) {
+        case EXPR_NUMBER:
+            result = expr_number_mpq(dst, e->data.value);
+            break;
+        case EXPR_SYMBOL:
+            result = expr_symbol(dst, e->data.name);
+            break;
+        case EXPR_ADD:
+        case EXPR_MUL:
+        case EXPR_POW: {
+            ExprIndex left = expr_copy_impl(dst, src, e->data.binop.left, memo);
+            ExprIndex right = expr_copy_impl(dst, src, e->data.binop.right, memo);
+            result = e->type == EXPR_ADD ? expr_add(dst, left, right)
+                   : e->type == EXPR_MUL ? expr_mul(dst, left, right)
+                   : expr_pow(dst, left, right);
+            break;
+        }
+        case EXPR_FUNC:
+            result = expr_func(dst, e->data.func.func, expr_copy_impl(dst, src, e->data.func.arg, memo));
+            break;
+        case EXPR_DIFF:
+            result = expr_diff(dst, expr_copy_impl(dst, src, e->data.diff.inner, memo), e->data.diff.var);
+            break;
+        case EXPR_INT:
+            result = expr_int(dst, expr_copy_impl(dst, src, e->data.integral.inner, memo), e->data.integral.var);
+            break;
+        default:
+            fprintf(stderr, "Unknown expression type in copy: %d\n", e->type);
+            exit(1);
+    }
+    memo[idx] = result;
+    return result;
+}
+
+ExprIndex expr_copy(ExprArena* dst, ExprArena* src, ExprIndex e) {
+    ExprIndex* memo = (ExprIndex*)malloc(MAX_EXPR_COUNT * sizeof(ExprIndex));
+    if (!memo) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    memset(memo, 0xff, MAX_EXPR_COUNT * sizeof(ExprIndex));
+    ExprIndex result = expr_copy_impl(dst, src, e, memo);
+    free(memo);
+    return result;
+}
+int expr_equal(const ExprArena* arena, ExprIndex a_idx, ExprIndex b_idx) {
+    EXPR_STAT_ADD(arena, equal_calls, 1);
+    if (a_idx == b_idx) return 1;
+    if (a_idx < 0 || b_idx < 0) return 0;
+    EXPR_STAT_ADD(arena, equal_deep, 1);
+
+    const Expr* a = expr_at(arena, a_idx);
+    const Expr* b = expr_at(arena, b_idx);
+    if (!a || !b) return 0;
+
+    if (a->type != b->type) return 0;
+    // equal trees have equal metadata, so most mismatches stop here
+    if (expr_meta_size(a) != expr_meta_size(b) || a->depth != b->depth || a->flags != b->flags || a->degree != b->degree) return 0;
+
+    switch (a->type) {
+        case EXPR_NUMBER:
+            return mpq_cmp(a->data.value, b->data.value) == 0;
+
+        case EXPR_SYMBOL:
+            return strcmp(a->data.name, b->data.name) == 0;
+
+        case EXPR_ADD:
+        case EXPR_MUL:
+        case EXPR_POW:
+            return expr_equal(arena, a->data.binop.left, b->data.binop.left) &&
+                   expr_equal(arena, a->data.binop.right, b->data.binop.right);
+
+        case EXPR_FUNC:
+            return a->data.func.func == b->data.func.func &&
+                   expr_equal(arena, a->data.func.arg, b->data.func.arg);
+
+        case EXPR_DIFF:
+            return strcmp(a->data.diff.var, b->data.diff.var) == 0 &&
+                   expr_equal(arena, a->data.diff.inner, b->data.diff.inner);
+
+        case EXPR_INT:
+            return strcmp(a->data.integral.var, b->data.integral.var) == 0 &&
+                   expr_equal(arena, a->data.integral.inner, b->data.integral.inner);
+
+        default:
+            fprintf(stderr, "Unknown expression type in expr_equal: %d\n", a->type);
+            exit(1);
+    }
+}
+
+
+ExprIndex expr_substitute(ExprArena* a, ExprIndex idx, const char* symbol_name, const char* value_str){
+    EXPR_STATS_SCOPE(a, EXPR_ALGO_SUBSTITUTE);
+    EXPR_TRACE_SCOPE(a, EXPR_TRACE_SUBSTITUTE);
+    Expr* e = expr_at(a,idx);
+    if (!e) return INVALID_INDEX;
+
+    switch (e->type) {
+      
+        case EXPR_NUMBER:
+            return idx;
+  
+        case EXPR_SYMBOL:
+            if (strcmp(e->data.name, symbol_name) == 0) {
+                return expr_number(a,value_str);
+            } else {
+                return idx;
+            }
+
+        case EXPR_ADD: {
+            ExprIndex left  = expr_substitute(a, expr_left(a,idx) , symbol_name, value_str);
+            ExprIndex right = expr_substitute(a, expr_right(a,idx), symbol_name, value_str);
+            return expr_add(a, left, right);
+        }
+
+        case EXPR_MUL: {
+            ExprIndex left  = expr_substitute(a, expr_left(a,idx) , symbol_name, value_str);
+            ExprIndex right = expr_substitute(a, expr_right(a,idx), symbol_name, value_str);
+            return expr_mul(a, left, right);
+        }
+
+        case EXPR_POW: {
+            ExprIndex base = expr_substitute(a,expr_left(a,idx), symbol_name, value_str);
+            ExprIndex exponent = expr_substitute(a,expr_right(a,idx), symbol_name, value_str);
+            return expr_pow(a, base, exponent);
+        }
+
+        case EXPR_FUNC: {
+            ExprIndex arg = expr_substitute(a, expr_arg(a,idx), symbol_name, value_str);
+            return expr_func(a, expr_ftype(a,idx), arg);
+        }
+ 
+        default:
+            fprintf(stderr, "Unknown expression type in expr_substitute.\n");
+            exit(1);
+    }
+           
+}
+/*
+Expr* expr_eval(const Expr* e, 
+                const char* symbol_name, 
+                const char* value_str) {
+    if (!e) return NULL;
+
+    switch (e->type) {
+        case EXPR_NUMBER:
+            return expr_copy(e);
+
+        case EXPR_SYMBOL:
+            if (strcmp(e->data.name, symbol_name) == 0) {
+                // Replace symbol with number
+                return expr_number(value_str);
+            } else {
+                return expr_copy(e);
+            }
+
+        case EXPR_ADD: {
+            Expr* left = expr_eval(e->data.binop.left, symbol_name, value_str);
+            Expr* right = expr_eval(e->data.binop.right, symbol_name, value_str);
+
+            if (left->type == EXPR_NUMBER && right->type == EXPR_NUMBER) {
+                Expr* result = expr_add_numbers(left, right);
+                expr_release(left);
+                expr_release(right);
+                return result;
+            } else {
+                Expr* result = expr_add(left, right);
+                return result;
+            }
+        }
+
+        case EXPR_MUL: {
+            Expr* left = expr_eval(e->data.binop.left, symbol_name, value_str);
+            Expr* right = expr_eval(e->data.binop.right, symbol_name, value_str);
+
+            if (left->type == EXPR_NUMBER && right->type == EXPR_NUMBER) {
+                Expr* result = malloc(sizeof(Expr));
+                result->type = EXPR_NUMBER;
+                result->refcount = 1;
+                mpq_init(result->data.value);
+                mpq_mul(result->data.value, left->data.value, right->data.value);
+
+                expr_release(left);
+                expr_release(right);
+                return result;
+            } else {
+                Expr* result = expr_mul(left, right);
+                return result;
+            }
+        }
+
+        case EXPR_POW: {
+            Expr* base = expr_eval(e->data.binop.left, symbol_name, value_str);
+            Expr* exponent = expr_eval(e->data.binop.right, symbol_name, value_str);
+
+            // For now, we keep powers symbolic
+            Expr* result = expr_pow(base, exponent);
+            return result;
+        }
+
+        case EXPR_FUNC: {
+            Expr* arg = expr_eval(e->data.func.arg, symbol_name, value_str);
+
+        if (arg->type == EXPR_NUMBER) {
+            double x = mpq_get_d(arg->data.value);
+            double result_val;
+
+            switch (e->data.func.func) {
+                case FUNC_SIN: result_val = sin(x); break;
+                case FUNC_COS: result_val = cos(x); break;
+                case FUNC_EXP: result_val = exp(x); break;
+                case FUNC_LOG: result_val = log(x); break;
+                default:
+                    fprintf(stderr, "Unsupported function type: %d\n", e->data.func.func);
+                    exit(1);
+            }
+
+            Expr* result = malloc(sizeof(Expr));
+            result->type = EXPR_NUMBER;
+            result->refcount = 1;
+            mpq_init(result->data.value);
+            mpq_set_d(result->data.value, result_val); // approximate
+            expr_release(arg);
+            return result;
+        }
+
+            Expr* result = expr_func(e->data.func.func, arg);
+            return result;
+        }
+
+        default:
+            fprintf(stderr, "Unknown expression type in expr_eval.\n");
+            exit(1);
+    }
+}
+*/
+double expr_eval_numeric(ExprArena* a, ExprIndex idx) {
+    EXPR_STATS_SCOPE(a, EXPR_ALGO_EVAL);
+    EXPR_TRACE_SCOPE(a, EXPR_TRACE_EVAL);
+    Expr* e = expr_at(a,idx);
+    if (!e) {
+        fprintf(stderr, "expr_eval_numeric called with NULL expression.\n");
+        exit(1);
+    }
+    
+
+    switch (e->type) {
+        
+        case EXPR_NUMBER:
+            return expr_value_d(a, idx);
+
+        case EXPR_SYMBOL:
+            fprintf(stderr, "Cannot evaluate expression with free symbol: %s\n", e->data.name);
+            exit(1);
+
+        case EXPR_ADD: {
+            double left  = expr_eval_numeric(a, expr_left(a,idx) );
+            double right = expr_eval_numeric(a, expr_right(a,idx));
+            return left + right;
+        }
+
+        case EXPR_MUL: {
+            double left  = expr_eval_numeric(a, expr_left(a,idx) );
+            double right = expr_eval_numeric(a, expr_right(a,idx));
+            return left * right;
+        }
+
+        case EXPR_POW: {
+            double base     = expr_eval_numeric(a, expr_left(a,idx) );
+            double exponent = expr_eval_numeric(a, expr_right(a,idx));
+            return pow(base, exponent);
+        }
+
+        case EXPR_FUNC: {
+            double arg_val = expr_eval_numeric(a, expr_arg(a,idx));
+            switch (e->data.func.func) {
+                case FUNC_SIN: return sin(arg_val);
+                case FUNC_COS: return cos(arg_val);
+                case FUNC_EXP: return exp(arg_val);
+                case FUNC_LOG: return log(arg_val);
+                default:
+                    fprintf(stderr, "Unknown function in expr_eval_numeric.\n");
+                    exit(1);
+            }
+        }
+
+        default:
+            fprintf(stderr, "Unknown expression type in expr_eval_numeric.\n");
+            exit(1);
+    }
+            
+}
+
+ExprIndex expr_differentiate(ExprArena* a, ExprIndex idx, const char* var_name) {
+    EXPR_STATS_SCOPE(a, EXPR_ALGO_DIFFERENTIATE);
+    EXPR_TRACE_SCOPE(a, EXPR_TRACE_DIFFERENTIATE);
+    Expr* e = expr_at(a, idx);
+    if (!e) return INVALID_INDEX;
+
+    switch (e->type) {
+        case EXPR_NUMBER:
+            return expr_number(a, "0");
+
+        case EXPR_SYMBOL:
+            if (strcmp(e->data.name, var_name) == 0) {
+                return expr_number(a,"1");
+            } else {
+                return expr_number(a,"0");
+            }
+
+        case EXPR_ADD: {
+            ExprIndex left = expr_differentiate(a,e->data.binop.left, var_name);
+            ExprIndex right = expr_differentiate(a,e->data.binop.right, var_name);
+            if (left == INVALID_INDEX || right == INVALID_INDEX) return INVALID_INDEX;
+            return expr_add(a,left, right);
+        }
+
+        case EXPR_MUL: {
+            ExprIndex f = e->data.binop.left;
+            ExprIndex g = e->data.binop.right;
+
+            ExprIndex df = expr_differentiate(a,f, var_name);
+            ExprIndex dg = expr_differentiate(a,g, var_name);
+            if (df == INVALID_INDEX || dg == INVALID_INDEX) return INVALID_INDEX;
+
+            ExprIndex left_term = expr_mul(a,df, g);
+            ExprIndex right_term = expr_mul(a,f, dg);
+
+            return expr_add(a, left_term, right_term);
+        }
+
+
+        case EXPR_POW: {
+            ExprIndex base = e->data.binop.left;
+            ExprIndex exponent = e->data.binop.right;
+
+            if (expr_type(a,exponent) == EXPR_NUMBER &&
+                expr_type(a,base) == EXPR_SYMBOL &&
+                strcmp(expr_name(a,base), var_name) == 0) {
+                // d/dx x^n = n * x^(n-1)
+                mpq_ptr new_exp = expr_scratch_q(a);
+                mpq_set(new_exp, *expr_value(a,exponent));
+                mpz_sub(mpq_numref(new_exp), mpq_numref(new_exp), mpq_denref(new_exp));
+
+                ExprIndex new_exp_idx = expr_number_mpq(a, new_exp);
+                expr_scratch_q_release(a, new_exp);
+
+                ExprIndex x_pow_n_minus_1 = expr_pow(a, base, new_exp_idx);
+                ExprIndex coeff_n = expr_number_mpq(a, *expr_value(a,exponent));
+
+                return expr_mul(a, coeff_n, x_pow_n_minus_1);
+
+
+            } else if (expr_type(a,exponent) == EXPR_NUMBER) {
+                // d/dx u^n = n * u^(n-1) * u'
+                ExprIndex du = expr_differentiate(a, base, var_name);
+                if (du == INVALID_INDEX) return INVALID_INDEX;
+                mpq_ptr new_exp = expr_scratch_q(a);
+                mpq_set(new_exp, *expr_value(a,exponent));
+                mpz_sub(mpq_numref(new_exp), mpq_numref(new_exp), mpq_denref(new_exp));
+                ExprIndex new_exp_idx = expr_number_mpq(a, new_exp);
+                expr_scratch_q_release(a, new_exp);
+                ExprIndex u_pow_n_minus_1 = expr_pow(a, base, new_exp_idx);
+                return expr_mul(a, expr_mul(a, exponent, u_pow_n_minus_1), du);
+            } else {
+                // d/dx u^v = u^v * (v' log u + v u'/u)
+                ExprIndex du = expr_differentiate(a, base, var_name);
+                ExprIndex dv = expr_differentiate(a, exponent, var_name);
+                if (du == INVALID_INDEX || dv == INVALID_INDEX) return INVALID_INDEX;
+                ExprIndex log_term = expr_mul(a, dv, expr_func(a, FUNC_LOG, base));
+                ExprIndex base_term = expr_mul(a, expr_mul(a, exponent, du), expr_pow(a, base, expr_number(a, "-1")));
+                return expr_mul(a, idx, expr_add(a, log_term, base_term));
+            }
+        }
+
+        case EXPR_FUNC: {
+            ExprIndex u = e->data.func.arg;
+            ExprIndex du = expr_differentiate(a,u, var_name);
+            if (du == INVALID_INDEX) return INVALID_INDEX;
+
+            switch (e->data.func.func) {
+                case FUNC_SIN: {
+                    ExprIndex cos_u = expr_func(a, FUNC_COS, u);
+                    return expr_mul(a, cos_u, du);
+                }
+                case FUNC_COS: {
+                    ExprIndex sin_u = expr_func(a, FUNC_SIN, u);
+                    ExprIndex neg_sin_u = expr_mul(a,expr_number(a,"-1"), sin_u);
+                    return expr_mul(a,neg_sin_u, du);
+                }
+                case FUNC_EXP: {
+                    ExprIndex exp_u = expr_func(a,FUNC_EXP, u);
+                    return expr_mul(a,exp_u, du);
+                }
+                case FUNC_LOG: {
+                    ExprIndex reiprocal = expr_pow(a,u, expr_number(a,"-1"));
+                    return expr_mul(a,reiprocal, du);
+                }
+                default:
+                    return INVALID_INDEX;
+            }
+        }
+        default:
+            // unevaluated derivatives and integrals, silent as in expr_integrate
+            return INVALID_INDEX;
+    }
+}
+
+ExprIndex expr_number_mpq(ExprArena* a, mpq_srcptr value) {
+    ExprKey key = expr_key_number(value);
+    ExprIndex idx = expr_hashcons_lookup(a, &key);
+    if (idx != INVALID_INDEX) return idx;
+
+    idx = expr_arena_alloc(a);
+    Expr* e = expr_at(a,idx);
+    e->type = EXPR_NUMBER;
+#ifdef CYMCALC_GMP_POOL
+    ExprGmpPool* saved = expr_gmp_current;
+    expr_gmp_current = a->gmp;
+#endif
+    mpq_init(e->data.value);
+    mpq_set(e->data.value, value);
+#ifdef CYMCALC_GMP_POOL
+    expr_gmp_current = saved;
+#endif
+    e->meta.approx = NAN;
+    expr_meta_init(a, e);
+#ifdef CYMCALC_STATS
+    EXPR_STAT_MAX(a, gmp_bytes_peak, EXPR_STAT_ADD(a, gmp_bytes, expr_stats_number_bytes(e)));
+#endif
+    return expr_hashcons_insert(a, &key, idx);
+}
+/*
+void mpq_add_ui(mpq_t rop, const mpq_t op1, unsigned long int op2) {
+    mpq_t temp;
+    mpq_init(temp);
+    mpq_set_ui(temp, op2, 1);
+    mpq_add(rop, op1, temp);
+    mpq_clear(temp);
+}
+*/
+ExprIndex expr_integrate(ExprArena* a, const ExprIndex idx, const char* var_name){
+    EXPR_STATS_SCOPE(a, EXPR_ALGO_INTEGRATE);
+    EXPR_TRACE_SCOPE(a, EXPR_TRACE_INTEGRATE);
+    Expr* e = expr_at(a,idx);
+    if (!e) return INVALID_INDEX;
+
+    switch (e->type) {
+        
+        case EXPR_NUMBER:
+            return expr_mul(a,idx,expr_symbol(a, var_name));
+
+        case EXPR_SYMBOL:
+            if (strcmp(e->data.name, var_name) == 0) {
+                return expr_mul(a,expr_number(a,"1/2"),expr_pow(a,expr_symbol(a,var_name), expr_number(a,"2")));
+            } else {
+                return expr_mul(a,idx,expr_symbol(a,var_name));
+            }
+
+        case EXPR_ADD: {
+            ExprIndex left = expr_integrate(a,e->data.binop.left, var_name);
+            if (left == INVALID_INDEX) return INVALID_INDEX;
+            ExprIndex right = expr_integrate(a,e->data.binop.right, var_name);
+            if (right == INVALID_INDEX) return INVALID_INDEX;
+            return expr_add(a,left, right);
+        }
+
+        case EXPR_MUL: {
+            ExprIndex f = e->data.binop.left;
+            ExprIndex g = e->data.binop.right;
+
+           /* if (expr_type(a,g) == EXPR_NUMBER) {
+                ExprIndex inner = expr_integrate(a, f, var_name);
+                return expr_mul(a,g, inner);
+            }*/
+
+            if (expr_type(a,f) == EXPR_NUMBER) {
+                ExprIndex inner = expr_integrate(a, g, var_name);
+                if (inner == INVALID_INDEX) return INVALID_INDEX;
+                return expr_mul(a,f, inner);
+            }
+
+            break; // product rule not implemented
+
+        }
+
+        case EXPR_POW: {
+            ExprIndex base = e->data.binop.left;
+            ExprIndex exponent = e->data.binop.right;
+        
+            if (expr_type(a, exponent) == EXPR_NUMBER &&
+                expr_type(a, base) == EXPR_SYMBOL &&
+                strcmp(expr_name(a, base), var_name) == 0) {
+                
+                // Create one: 1/1
+                ExprIndex one = expr_number(a, "1");
+                
+                // new_exp = exponent + 1
+                ExprIndex new_exp = expr_add(a, exponent, one);
+                new_exp = expr_simplify(a, new_exp);
+                
+                // x^(n+1)
+                ExprIndex pow_expr = expr_pow(a, base, new_exp);
+                
+                // 1 / (n+1)
+                ExprIndex coeff = expr_div(a, one, new_exp);
+                
+                //expr_release(a, one);
+                //expr_release(a, new_exp);
+                
+                return expr_mul(a, coeff, pow_expr);
+            }
+            return INVALID_INDEX; // power rule for general expressions not implemented yet
+        }
+
+
+        case EXPR_FUNC: {
+            ExprIndex u = e->data.func.arg;
+            //Expr* du = expr_diff(u, var_name);
+            if (expr_type(a,u) == EXPR_SYMBOL && strcmp(expr_name(a,u), var_name) == 0) {
+                switch (e->data.func.func) {
+                    case FUNC_SIN: {
+                        ExprIndex cos_u = expr_func(a,FUNC_COS, u);
+                        ExprIndex neg_cos_u = expr_mul(a,expr_number(a,"-1"), cos_u);
+                        return neg_cos_u;
+                    }
+                    case FUNC_COS: {
+                        ExprIndex sin_u = expr_func(a,FUNC_SIN, u);
+                        return sin_u;
+                    }
+                    case FUNC_EXP: {
+                        ExprIndex exp_u = expr_func(a,FUNC_EXP, u);
+                        return exp_u;
+                    }
+                    case FUNC_LOG: {
+                        ExprIndex reiprocal = expr_pow(a,u, expr_number(a,"-1"));
+                        return reiprocal;
+                    }
+                    default:
+                        break;
+                }
+            }
+
+            break; // only f(var) is handled, no substitution rule yet
+        }
+
+        default:
+            break; // unevaluated derivatives and integrals
+    }
+
+    // Unresolved. Batch jobs integrate on worker threads, so nothing is printed.
+    return INVALID_INDEX;
+}
+/*
+Expr* expr_neg(const Expr* a) {
+    if (!a) return NULL;
+
+    if (a->type == EXPR_NUMBER) {
+        mpq_t neg_value;
+        mpq_init(neg_value);
+        mpq_neg(neg_value, a->data.value);
+        Expr* neg = expr_number_mpq(neg_value);
+        mpq_clear(neg_value);
+        return neg;
+    }
+
+    Expr* minus1 = expr_number("-1");
+    Expr* result = expr_mul(minus1, expr_retain(a));
+    expr_release(minus1);
+    return expr_simplify(result);
+}
+
+Expr* expr_sub(const Expr* a, const Expr* b) {
+    if (!a || !b) return NULL;
+
+    Expr* neg_b = expr_neg(b);
+    Expr* result = expr_add(expr_retain(a), neg_b);
+    expr_release(neg_b);
+    return expr_simplify(result);
+}
+*/
+static ExprIndex expr_div_cancel(ExprArena* a, ExprIndex num, ExprIndex den);
+
+ExprIndex expr_div(ExprArena* a, ExprIndex num, ExprIndex den) {
+    if (num == INVALID_INDEX || den == INVALID_INDEX)
+        return INVALID_INDEX;
+
+    Expr* en = expr_at(a, num);
+    Expr* ed = expr_at(a, den);
+
+    // a / 1 = a
+    if (expr_type(a, den) == EXPR_NUMBER &&
+        mpq_cmp_ui(*expr_value(a, den), 1, 1) == 0) {
+        return num;
+    }
+
+    // 0 / b = 0 (as long as b ≠ 0)
+    if (expr_type(a, num) == EXPR_NUMBER &&
+        mpq_sgn(*expr_value(a, num)) == 0) {
+        return expr_number(a, "0");
+    }
+
+    // a / a = 1
+    if (expr_equal(a, num, den)) {
+        return expr_number(a, "1");
+    }
+
+    // both numeric → directly divide
+    if (expr_type(a, num) == EXPR_NUMBER &&
+        expr_type(a, den) == EXPR_NUMBER) {
+        mpq_ptr q = expr_scratch_q(a);
+        mpq_div(q, *expr_value(a, num), *expr_value(a, den));
+        ExprIndex result = expr_number_mpq(a, q);
+        expr_scratch_q_release(a, q);
+        return result;
+    }
+
+    // cancel the gcd of polynomial numerator and denominator
+    if (expr_type(a, den) != EXPR_NUMBER &&
+        expr_is_poly(a, num) && expr_is_poly(a, den)) {
+        ExprIndex reduced = expr_div_cancel(a, num, den);
+        if (reduced != INVALID_INDEX) return reduced;
+    }
+
+    // a / b → a * b^(-1)
+    ExprIndex minus_one = expr_number(a, "-1");
+    ExprIndex reciprocal = expr_pow(a, den, minus_one);
+    ExprIndex result = expr_mul(a, num, reciprocal);
+    //expr_release(a, reciprocal);
+    return expr_simplify(a, result);
+}
+
+//-----------------------------------------------
+// Dense univariate polynomials
+//-----------------------------------------------
+
+// Packing into one integer wins from ~16 terms for 8..1000 bit coefficients.
+#ifndef EXPR_POLY_KRONECKER_THRESHOLD
+#define EXPR_POLY_KRONECKER_THRESHOLD 16
+#endif
+#ifndef EXPR_POLY_DIVISION_THRESHOLD
+#define EXPR_POLY_DIVISION_THRESHOLD 16
+#endif
+
+void expr_poly_init(ExprPoly* p) {
+    p->coeffs = NULL;
+    p->len = 0;
+    p->capacity = 0;
+    mpz_init_set_ui(p->den, 1);
+}
+
+void expr_poly_clear(ExprPoly* p) {
+    for (size_t i = 0; i < p->capacity; i++) mpz_clear(p->coeffs[i]);
+    free(p->coeffs);
+    mpz_clear(p->den);
+    p->coeffs = NULL;
+    p->len = 0;
+    p->capacity = 0;
+}
+
+static void expr_poly_swap(ExprPoly* a, ExprPoly* b) {
+    ExprPoly t = *a;
+    *a = *b;
+    *b = t;
+}
+
+static void expr_poly_reserve(ExprPoly* p, size_t n) {
+    if (n <= p->capacity) return;
+    size_t capacity = p->capacity ? p->capacity : 4;
+    while (capacity < n) capacity *= 2;
+    mpz_t* coeffs = (mpz_t*)realloc(p->coeffs, capacity * sizeof(mpz_t));
+    if (!coeffs) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    for (size_t i = p->capacity; i < capacity; i++) mpz_init(coeffs[i]);
+    p->coeffs = coeffs;
+    p->capacity = capacity;
+}
+
+// Sets len, zeroing coefficients that become visible.
+static void expr_poly_resize(ExprPoly* p, size_t len) {
+    expr_poly_reserve(p, len);
+    for (size_t i = p->len; i < len; i++) mpz_set_ui(p->coeffs[i], 0);
+    p->len = len;
+}
+
+// Strips leading zeros and cancels the content against the denominator.
+static void expr_poly_normalize(ExprPoly* p) {
+    while (p->len && mpz_sgn(p->coeffs[p->len - 1]) == 0) p->len--;
+    if (p->len == 0) {
+        mpz_set_ui(p->den, 1);
+        return;
+    }
+    if (mpz_cmp_ui(p->den, 1) == 0) return;
+    mpz_t g;
+    mpz_init_set(g, p->den);
+    for (size_t i = 0; i < p->len && mpz_cmp_ui(g, 1) != 0; i++) {
+        mpz_gcd(g, g, p->coeffs[i]);
+    }
+    if (mpz_cmp_ui(g, 1) != 0) {
+        for (size_t i = 0; i < p->len; i++) mpz_divexact(p->coeffs[i], p->coeffs[i], g);
+        mpz_divexact(p->den, p->den, g);
+    }
+    mpz_clear(g);
+}
+
+void expr_poly_set(ExprPoly* dst, const ExprPoly* src) {
+    if (dst == src) return;
+    expr_poly_reserve(dst, src->len);
+    for (size_t i = 0; i < src->len; i++) mpz_set(dst->coeffs[i], src->coeffs[i]);
+    dst->len = src->len;
+    mpz_set(dst->den, src->den);
+}
+
+long expr_poly_degree(const ExprPoly* p) {
+    return (long)p->len - 1;
+}
+
+void expr_poly_get_coeff(mpq_t c, const ExprPoly* p, size_t i) {
+    if (i >= p->len) {
+        mpq_set_ui(c, 0, 1);
+        return;
+    }
+    mpz_set(mpq_numref(c), p->coeffs[i]);
+    mpz_set(mpq_denref(c), p->den);
+    mpq_canonicalize(c);
+}
+
+void expr_poly_set_coeff(ExprPoly* p, size_t i, const mpq_t c) {
+    if (i >= p->len) expr_poly_resize(p, i + 1);
+    // bring everything over lcm(den, den(c))
+    mpz_t l, f;
+    mpz_init(l);
+    mpz_init(f);
+    mpz_lcm(l, p->den, mpq_denref(c));
+    mpz_divexact(f, l, p->den);
+    if (mpz_cmp_ui(f, 1) != 0) {
+        for (size_t k = 0; k < p->len; k++) mpz_mul(p->coeffs[k], p->coeffs[k], f);
+    }
+    mpz_divexact(f, l, mpq_denref(c));
+    mpz_mul(p->coeffs[i], mpq_numref(c), f);
+    mpz_set(p->den, l);
+    mpz_clear(l);
+    mpz_clear(f);
+    expr_poly_normalize(p);
+}
+
+static void expr_poly_addsub(ExprPoly* r, const ExprPoly* a, const ExprPoly* b, bool subtract) {
+    ExprPoly t;
+    expr_poly_init(&t);
+    size_t len = a->len > b->len ? a->len : b->len;
+    expr_poly_resize(&t, len);
+
+    mpz_t fa, fb;
+    mpz_init(fa);
+    mpz_init(fb);
+    mpz_lcm(t.den, a->den, b->den);
+    mpz_divexact(fa, t.den, a->den);
+    mpz_divexact(fb, t.den, b->den);
+    for (size_t i = 0; i < a->len; i++) mpz_mul(t.coeffs[i], a->coeffs[i], fa);
+    for (size_t i = 0; i < b->len; i++) {
+        if (subtract) mpz_submul(t.coeffs[i], b->coeffs[i], fb);
+        else          mpz_addmul(t.coeffs[i], b->coeffs[i], fb);
+    }
+    mpz_clear(fa);
+    mpz_clear(fb);
+
+    expr_poly_normalize(&t);
+    expr_poly_swap(r, &t);
+    expr_poly_clear(&t);
+}
+
+void expr_poly_add(ExprPoly* r, const ExprPoly* a, const ExprPoly* b) {
+    expr_poly_addsub(r, a, b, false);
+}
+
+void expr_poly_sub(ExprPoly* r, const ExprPoly* a, const ExprPoly* b) {
+    expr_poly_addsub(r, a, b, true);
+}
+
+// r[0 .. n+m-2] += a*b
+static void expr_zpoly_mul_classical(mpz_t* r, const mpz_t* a, size_t n, const mpz_t* b, size_t m) {
+    for (size_t i = 0; i < n; i++) {
+        if (mpz_sgn(a[i]) == 0) continue;
+        for (size_t j = 0; j < m; j++) mpz_addmul(r[i + j], a[i], b[j]);
+    }
+}
+
+static mpz_t* expr_zpoly_alloc(size_t n) {
+    mpz_t* v = (mpz_t*)malloc((n ? n : 1) * sizeof(mpz_t));
+    if (!v) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < n; i++) mpz_init(v[i]);
+    return v;
+}
+
+static void expr_zpoly_free(mpz_t* v, size_t n) {
+    for (size_t i = 0; i < n; i++) mpz_clear(v[i]);
+    free(v);
+}
+
+static mp_bitcnt_t expr_zpoly_max_bits(const mpz_t* a, size_t n) {
+    mp_bitcnt_t bits = 0;
+    for (size_t i = 0; i < n; i++) {
+        mp_bitcnt_t b = mpz_sgn(a[i]) ? mpz_sizeinbase(a[i], 2) : 0;
+        if (b > bits) bits = b;
+    }
+    return bits;
+}
+
+// z = sum a[i] * 2^(bits*i), with every |a[i]| < 2^bits
+static void expr_zpoly_pack(mpz_t z, const mpz_t* a, size_t n, mp_bitcnt_t bits) {
+    size_t limbs = (size_t)((n * bits) / GMP_NUMB_BITS) + 2;
+    mpz_t pos, neg;
+    mpz_init(pos);
+    mpz_init(neg);
+    mp_limb_t* p = mpz_limbs_write(pos, (mp_size_t)limbs);
+    mp_limb_t* q = mpz_limbs_write(neg, (mp_size_t)limbs);
+    memset(p, 0, limbs * sizeof(mp_limb_t));
+    memset(q, 0, limbs * sizeof(mp_limb_t));
+
+    for (size_t i = 0; i < n; i++) {
+        int sgn = mpz_sgn(a[i]);
+        if (sgn == 0) continue;
+        mp_limb_t* dst = sgn > 0 ? p : q;
+        const mp_limb_t* src = mpz_limbs_read(a[i]);
+        size_t size = mpz_size(a[i]);
+        mp_bitcnt_t offset = bits * i;
+        size_t w = (size_t)(offset / GMP_NUMB_BITS);
+        unsigned shift = (unsigned)(offset % GMP_NUMB_BITS);
+        for (size_t j = 0; j < size; j++) {
+            dst[w + j] |= src[j] << shift;
+            if (shift) dst[w + j + 1] |= src[j] >> (GMP_NUMB_BITS - shift);
+        }
+    }
+    mpz_limbs_finish(pos, (mp_size_t)limbs);
+    mpz_limbs_finish(neg, (mp_size_t)limbs);
+    mpz_sub(z, pos, neg);
+    mpz_clear(pos);
+    mpz_clear(neg);
+}
+
+// Inverse of pack for signed digits with |r[i]| < 2^(bits-1).
+static void expr_zpoly_unpack(mpz_t* r, size_t len, const mpz_t z, mp_bitcnt_t bits) {
+    int sign = mpz_sgn(z);
+    const mp_limb_t* src = mpz_limbs_read(z);
+    size_t size = mpz_size(z);
+    size_t field_limbs = (size_t)((bits + GMP_NUMB_BITS - 1) / GMP_NUMB_BITS);
+    unsigned top_bits = (unsigned)(bits % GMP_NUMB_BITS);
+
+    mpz_t base;
+    mpz_init(base);
+    mpz_setbit(base, bits);
+
+    int carry = 0;
+    for (size_t i = 0; i < len; i++) {
+        mp_bitcnt_t offset = bits * i;
+        size_t w = (size_t)(offset / GMP_NUMB_BITS);
+        unsigned shift = (unsigned)(offset % GMP_NUMB_BITS);
+
+        mp_limb_t* dst = mpz_limbs_write(r[i], (mp_size_t)field_limbs);
+        for (size_t j = 0; j < field_limbs; j++) {
+            mp_limb_t lo = w + j < size ? src[w + j] : 0;
+            mp_limb_t hi = w + j + 1 < size ? src[w + j + 1] : 0;
+            dst[j] = shift ? (lo >> shift) | (hi << (GMP_NUMB_BITS - shift)) : lo;
+        }
+        if (top_bits) dst[field_limbs - 1] &= ((mp_limb_t)1 << top_bits) - 1;
+        mpz_limbs_finish(r[i], (mp_size_t)field_limbs);
+
+        if (carry) mpz_add_ui(r[i], r[i], 1);
+        if (mpz_sgn(r[i]) && mpz_sizeinbase(r[i], 2) >= bits) {
+            mpz_sub(r[i], r[i], base);
+            carry = 1;
+        } else {
+            carry = 0;
+        }
+        if (sign < 0) mpz_neg(r[i], r[i]);
+    }
+    mpz_clear(base);
+}
+
+// r[0 .. n+m-2] = a*b by evaluating both at 2^bits and multiplying once.
+static void expr_zpoly_mul_kronecker(mpz_t* r, const mpz_t* a, size_t n, const mpz_t* b, size_t m) {
+    size_t shorter = n < m ? n : m;
+    mp_bitcnt_t log_len = 0;
+    while (((size_t)1 << log_len) < shorter) log_len++;
+    mp_bitcnt_t bits = expr_zpoly_max_bits(a, n) + expr_zpoly_max_bits(b, m) + log_len + 2;
+
+    mpz_t za, zb;
+    mpz_init(za);
+    mpz_init(zb);
+    expr_zpoly_pack(za, a, n, bits);
+    expr_zpoly_pack(zb, b, m, bits);
+    mpz_mul(za, za, zb);
+    expr_zpoly_unpack(r, n + m - 1, za, bits);
+    mpz_clear(za);
+    mpz_clear(zb);
+}
+
+// r = a*b over Z, r must have n+m-1 initialized entries and not alias a or b.
+static void expr_zpoly_mul(mpz_t* r, const mpz_t* a, size_t n, const mpz_t* b, size_t m) {
+    size_t shorter = n < m ? n : m;
+    if (shorter >= EXPR_POLY_KRONECKER_THRESHOLD) {
+        expr_zpoly_mul_kronecker(r, a, n, b, m);
+        return;
+    }
+    for (size_t i = 0; i < n + m - 1; i++) mpz_set_ui(r[i], 0);
+    expr_zpoly_mul_classical(r, a, n, b, m);
+}
+
+void expr_poly_mul(ExprPoly* r, const ExprPoly* a, const ExprPoly* b) {
+    ExprPoly t;
+    expr_poly_init(&t);
+    if (a->len && b->len) {
+        expr_poly_resize(&t, a->len + b->len - 1);
+        expr_zpoly_mul(t.coeffs, a->coeffs, a->len, b->coeffs, b->len);
+        mpz_mul(t.den, a->den, b->den);
+    }
+    expr_poly_normalize(&t);
+    expr_poly_swap(r, &t);
+    expr_poly_clear(&t);
+}
+
+void expr_poly_pow_ui(ExprPoly* r, const ExprPoly* a, unsigned long n) {
+    ExprPoly base, acc;
+    expr_poly_init(&base);
+    expr_poly_init(&acc);
+    expr_poly_set(&base, a);
+    mpq_t one;
+    mpq_init(one);
+    mpq_set_ui(one, 1, 1);
+    expr_poly_set_coeff(&acc, 0, one);
+    mpq_clear(one);
+    while (n) {
+        if (n & 1) expr_poly_mul(&acc, &acc, &base);
+        n >>= 1;
+        if (n) expr_poly_mul(&base, &base, &base);
+    }
+    expr_poly_swap(r, &acc);
+    expr_poly_clear(&acc);
+    expr_poly_clear(&base);
+}
+
+// Keeps the terms of degree < n.
+static void expr_poly_truncate(ExprPoly* p, size_t n) {
+    if (p->len > n) {
+        p->len = n;
+        expr_poly_normalize(p);
+    }
+}
+
+// Exact division over Z by Kronecker substitution: a and b are evaluated at
+// 2^bits, divided as integers and the quotient unpacked. Fails if the
+// integer division leaves a remainder or the unpacked quotient does not
+// multiply back to a (quotient digits wider than the chosen field).
+static bool expr_zpoly_divexact_kronecker(mpz_t* q, const mpz_t* a, size_t n, const mpz_t* b, size_t m) {
+    mp_bitcnt_t log_len = 0;
+    while (((size_t)1 << log_len) < n) log_len++;
+    mp_bitcnt_t bits = expr_zpoly_max_bits(a, n) + expr_zpoly_max_bits(b, m) + log_len + 2;
+    size_t qlen = n - m + 1;
+
+    mpz_t za, zb, zr;
+    mpz_init(za);
+    mpz_init(zb);
+    mpz_init(zr);
+    expr_zpoly_pack(za, a, n, bits);
+    expr_zpoly_pack(zb, b, m, bits);
+    mpz_tdiv_qr(za, zr, za, zb);
+    bool ok = mpz_sgn(zr) == 0;
+    if (ok) {
+        expr_zpoly_unpack(q, qlen, za, bits);
+        mpz_t* check = expr_zpoly_alloc(n);
+        expr_zpoly_mul(check, q, qlen, b, m);
+        for (size_t i = 0; ok && i < n; i++) ok = mpz_cmp(check[i], a[i]) == 0;
+        expr_zpoly_free(check, n);
+    }
+    mpz_clear(za);
+    mpz_clear(zb);
+    mpz_clear(zr);
+    return ok;
+}
+
+// p = sum c[i] x^i, put over the lcm of the denominators in one pass.
+static void expr_poly_set_mpq(ExprPoly* p, mpq_t* c, size_t n) {
+    mpz_t den, scale;
+    mpz_init_set_ui(den, 1);
+    mpz_init(scale);
+    for (size_t i = 0; i < n; i++) {
+        if (mpq_sgn(c[i])) mpz_lcm(den, den, mpq_denref(c[i]));
+    }
+    expr_poly_resize(p, n);
+    for (size_t i = 0; i < n; i++) {
+        mpz_divexact(scale, den, mpq_denref(c[i]));
+        mpz_mul(p->coeffs[i], mpq_numref(c[i]), scale);
+    }
+    mpz_set(p->den, den);
+    expr_poly_normalize(p);
+    mpz_clear(den);
+    mpz_clear(scale);
+}
+
+static void expr_poly_divrem_classical(ExprPoly* q, ExprPoly* r, const ExprPoly* a, const ExprPoly* b) {
+    size_t n = a->len, m = b->len;
+    mpq_t* rem = (mpq_t*)malloc(n * sizeof(mpq_t));
+    if (!rem) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < n; i++) {
+        mpq_init(rem[i]);
+        expr_poly_get_coeff(rem[i], a, i);
+    }
+    mpq_t lc, c, t;
+    mpq_init(lc);
+    mpq_init(c);
+    mpq_init(t);
+    expr_poly_get_coeff(lc, b, m - 1);
+
+    mpq_t* bq = (mpq_t*)malloc(m * sizeof(mpq_t));
+    if (!bq) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    for (size_t j = 0; j < m; j++) {
+        mpq_init(bq[j]);
+        expr_poly_get_coeff(bq[j], b, j);
+    }
+
+    // quotient digits land in rem[m-1 .. n-1] as the top terms are consumed
+    for (size_t k = n - m + 1; k-- > 0;) {
+        mpq_div(c, rem[k + m - 1], lc);
+        if (mpq_sgn(c) != 0) {
+            for (size_t j = 0; j + 1 < m; j++) {
+                mpq_mul(t, bq[j], c);
+                mpq_sub(rem[k + j], rem[k + j], t);
+            }
+        }
+        mpq_swap(rem[k + m - 1], c);
+    }
+
+    if (r) expr_poly_set_mpq(r, rem, m - 1);
+    if (q) expr_poly_set_mpq(q, rem + m - 1, n - m + 1);
+
+    for (size_t j = 0; j < m; j++) mpq_clear(bq[j]);
+    free(bq);
+    for (size_t i = 0; i < n; i++) mpq_clear(rem[i]);
+    free(rem);
+    mpq_clear(lc);
+    mpq_clear(c);
+    mpq_clear(t);
+}
+
+bool expr_poly_divexact(ExprPoly* q, const ExprPoly* a, const ExprPoly* b) {
+    if (b->len == 0) return false;
+    if (a->len == 0) {
+        expr_poly_truncate(q, 0);
+        return true;
+    }
+    if (a->len < b->len) return false;
+
+    // With b = cb * B/db primitive B, Gauss' lemma makes A/B integral whenever
+    // it is a polynomial at all, and q = (A/B) * db / (da * cb).
+    ExprPoly t;
+    expr_poly_init(&t);
+    expr_poly_resize(&t, a->len - b->len + 1);
+    mpz_t content;
+    mpz_init(content);
+    for (size_t i = 0; i < b->len; i++) mpz_gcd(content, content, b->coeffs[i]);
+    if (mpz_sgn(b->coeffs[b->len - 1]) < 0) mpz_neg(content, content);
+
+    mpz_t* prim = expr_zpoly_alloc(b->len);
+    for (size_t i = 0; i < b->len; i++) mpz_divexact(prim[i], b->coeffs[i], content);
+
+    bool ok;
+    bool kronecker = b->len >= EXPR_POLY_DIVISION_THRESHOLD && t.len >= EXPR_POLY_DIVISION_THRESHOLD;
+    if (kronecker) {
+        ok = expr_zpoly_divexact_kronecker(t.coeffs, a->coeffs, a->len, prim, b->len);
+    } else {
+        // schoolbook over Z, every quotient digit must divide exactly
+        mpz_t* rem = expr_zpoly_alloc(a->len);
+        for (size_t i = 0; i < a->len; i++) mpz_set(rem[i], a->coeffs[i]);
+        ok = true;
+        for (size_t k = t.len; ok && k-- > 0;) {
+            mpz_srcptr top = rem[k + b->len - 1];
+            if (!mpz_divisible_p(top, prim[b->len - 1])) {
+                ok = false;
+                break;
+            }
+            mpz_divexact(t.coeffs[k], top, prim[b->len - 1]);
+            for (size_t j = 0; j < b->len; j++) mpz_submul(rem[k + j], t.coeffs[k], prim[j]);
+        }
+        for (size_t i = 0; ok && i < b->len - 1; i++) ok = mpz_sgn(rem[i]) == 0;
+        expr_zpoly_free(rem, a->len);
+    }
+    if (!ok && kronecker) {
+        // Kronecker can miss when quotient digits outgrow the field
+        ExprPoly r;
+        expr_poly_init(&r);
+        expr_poly_divrem_classical(&t, &r, a, b);
+        ok = r.len == 0;
+        expr_poly_clear(&r);
+    } else if (ok) {
+        for (size_t i = 0; i < t.len; i++) mpz_mul(t.coeffs[i], t.coeffs[i], b->den);
+        mpz_mul(t.den, a->den, content);
+        if (mpz_sgn(t.den) < 0) {
+            mpz_neg(t.den, t.den);
+            for (size_t i = 0; i < t.len; i++) mpz_neg(t.coeffs[i], t.coeffs[i]);
+        }
+        expr_poly_normalize(&t);
+    }
+    if (ok) expr_poly_swap(q, &t);
+
+    expr_zpoly_free(prim, b->len);
+    mpz_clear(content);
+    expr_poly_clear(&t);
+    return ok;
+}
+
+bool expr_poly_divrem(ExprPoly* q, ExprPoly* r, const ExprPoly* a, const ExprPoly* b) {
+    if (b->len == 0) return false;
+    if (a->len < b->len) {
+        if (r) expr_poly_set(r, a);
+        if (q) expr_poly_truncate(q, 0);
+        return true;
+    }
+    // exact quotients are common and much cheaper through Kronecker
+    if (b->len >= EXPR_POLY_DIVISION_THRESHOLD && a->len - b->len + 1 >= EXPR_POLY_DIVISION_THRESHOLD) {
+        ExprPoly t;
+        expr_poly_init(&t);
+        bool exact = expr_poly_divexact(&t, a, b);
+        if (exact) {
+            if (q) expr_poly_swap(q, &t);
+            if (r) expr_poly_truncate(r, 0);
+        }
+        expr_poly_clear(&t);
+        if (exact) return true;
+    }
+    expr_poly_divrem_classical(q, r, a, b);
+    return true;
+}
+
+bool expr_to_poly(ExprPoly* p, ExprArena* arena, ExprIndex idx, const char* var) {
+    switch (expr_type(arena, idx)) {
+        case EXPR_NUMBER:
+            expr_poly_truncate(p, 0);
+            if (mpq_sgn(*expr_value(arena, idx))) expr_poly_set_coeff(p, 0, *expr_value(arena, idx));
+            return true;
+
+        case EXPR_SYMBOL: {
+            if (strcmp(expr_name(arena, idx), var) != 0) return false;
+            mpq_t one;
+            mpq_init(one);
+            mpq_set_ui(one, 1, 1);
+            expr_poly_truncate(p, 0);
+            expr_poly_set_coeff(p, 1, one);
+            mpq_clear(one);
+            return true;
+        }
+
+        case EXPR_ADD:
+        case EXPR_MUL: {
+            ExprPoly rhs;
+            expr_poly_init(&rhs);
+            bool ok = expr_to_poly(p, arena, expr_left(arena, idx), var) &&
+                      expr_to_poly(&rhs, arena, expr_right(arena, idx), var);
+            if (ok) {
+                if (expr_type(arena, idx) == EXPR_ADD) expr_poly_add(p, p, &rhs);
+                else                                   expr_poly_mul(p, p, &rhs);
+            }
+            expr_poly_clear(&rhs);
+            return ok;
+        }
+
+        case EXPR_POW: {
+            ExprIndex exponent = expr_right(arena, idx);
+            if (expr_type(arena, exponent) != EXPR_NUMBER) return false;
+            mpq_srcptr n = *expr_value(arena, exponent);
+            if (mpz_cmp_ui(mpq_denref(n), 1) != 0 || mpq_sgn(n) < 0 ||
+                !mpz_fits_ulong_p(mpq_numref(n))) {
+                return false;
+            }
+            if (!expr_to_poly(p, arena, expr_left(arena, idx), var)) return false;
+            expr_poly_pow_ui(p, p, mpz_get_ui(mpq_numref(n)));
+            return true;
+        }
+
+        default:
+            return false;
+    }
+}
+
+ExprIndex expr_from_poly(ExprArena* arena, const ExprPoly* p, const char* var) {
+    if (p->len == 0) return expr_number(arena, "0");
+
+    // ((c0 + c1*x) + c2*x^2) + ... with unit coefficients left out
+    mpq_ptr c = expr_scratch_q(arena);
+    ExprIndex x = expr_symbol(arena, (char*)var);
+    ExprIndex result = INVALID_INDEX;
+    for (size_t i = 0; i < p->len; i++) {
+        if (mpz_sgn(p->coeffs[i]) == 0) continue;
+        expr_poly_get_coeff(c, p, i);
+
+        ExprIndex term;
+        if (i == 0) {
+            term = expr_number_mpq(arena, c);
+        } else {
+            ExprIndex power = x;
+            if (i > 1) {
+                mpq_ptr k = expr_scratch_q(arena);
+                mpq_set_ui(k, (unsigned long)i, 1);
+                power = expr_pow(arena, x, expr_number_mpq(arena, k));
+                expr_scratch_q_release(arena, k);
+            }
+            term = mpq_cmp_ui(c, 1, 1) == 0 ? power : expr_mul(arena, expr_number_mpq(arena, c), power);
+        }
+        result = result == INVALID_INDEX ? term : expr_add(arena, result, term);
+    }
+    expr_scratch_q_release(arena, c);
+    return result;
+}
+
+//-----------------------------------------------
+// Sparse multivariate polynomials
+//-----------------------------------------------
+
+#define EXPR_MPOLY_GUARD 0x8000800080008000ull
+
+static void expr_mpoly_ring_set_words(ExprMPolyRing* ring) {
+    ring->words = (ring->nvars + EXPR_MPOLY_FIELDS - 1) / EXPR_MPOLY_FIELDS;
+    if (ring->words == 0) ring->words = 1;
+}
+
+void expr_mpoly_ring_init(ExprMPolyRing* ring, const char* const* vars, size_t nvars) {
+    ring->vars = (char**)malloc((nvars ? nvars : 1) * sizeof(char*));
+    if (!ring->vars) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < nvars; i++) ring->vars[i] = strdup(vars[i]);
+    ring->nvars = nvars;
+    expr_mpoly_ring_set_words(ring);
+}
+
+static void expr_mpoly_collect_symbols(ExprArena* arena, ExprIndex idx, ExprMPolyRing* ring, size_t* capacity) {
+    Expr* e = expr_at(arena, idx);
+    switch (e->type) {
+        case EXPR_SYMBOL: {
+            for (size_t i = 0; i < ring->nvars; i++) {
+                if (strcmp(ring->vars[i], e->data.name) == 0) return;
+            }
+            if (ring->nvars == *capacity) {
+                *capacity *= 2;
+                ring->vars = (char**)realloc(ring->vars, *capacity * sizeof(char*));
+                if (!ring->vars) {
+                    fprintf(stderr, "Out of memory\n");
+                    exit(1);
+                }
+            }
+            ring->vars[ring->nvars++] = strdup(e->data.name);
+            return;
+        }
+        case EXPR_ADD:
+        case EXPR_MUL:
+        case EXPR_POW:
+            expr_mpoly_collect_symbols(arena, e->data.binop.left, ring, capacity);
+            expr_mpoly_collect_symbols(arena, e->data.binop.right, ring, capacity);
+            return;
+        case EXPR_FUNC:
+            expr_mpoly_collect_symbols(arena, e->data.func.arg, ring, capacity);
+            return;
+        default:
+            return;
+    }
+}
+
+static int expr_mpoly_compare_names(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+static void expr_mpoly_ring_from_exprs(ExprMPolyRing* ring, ExprArena* arena, const ExprIndex* es, size_t n) {
+    size_t capacity = 8;
+    ring->vars = (char**)malloc(capacity * sizeof(char*));
+    if (!ring->vars) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    ring->nvars = 0;
+    for (size_t i = 0; i < n; i++) expr_mpoly_collect_symbols(arena, es[i], ring, &capacity);
+    qsort(ring->vars, ring->nvars, sizeof(char*), expr_mpoly_compare_names);
+    expr_mpoly_ring_set_words(ring);
+}
+
+void expr_mpoly_ring_from_expr(ExprMPolyRing* ring, ExprArena* arena, ExprIndex e) {
+    expr_mpoly_ring_from_exprs(ring, arena, &e, 1);
+}
+
+void expr_mpoly_ring_clear(ExprMPolyRing* ring) {
+    for (size_t i = 0; i < ring->nvars; i++) free(ring->vars[i]);
+    free(ring->vars);
+    ring->vars = NULL;
+    ring->nvars = 0;
+}
+
+static inline unsigned expr_mpoly_shift(size_t var) {
+    return 64 - EXPR_MPOLY_FIELD_BITS * (unsigned)(var % EXPR_MPOLY_FIELDS + 1);
+}
+
+static inline unsigned long expr_mpoly_exp(const uint64_t* m, size_t var) {
+    return (unsigned long)((m[var / EXPR_MPOLY_FIELDS] >> expr_mpoly_shift(var)) & ((1u << EXPR_MPOLY_FIELD_BITS) - 1));
+}
+
+static inline int expr_mpoly_cmp(const uint64_t* a, const uint64_t* b, size_t words) {
+    for (size_t w = 0; w < words; w++) {
+        if (a[w] != b[w]) return a[w] < b[w] ? -1 : 1;
+    }
+    return 0;
+}
+
+// r = a*b on monomials, false on exponent overflow.
+static inline bool expr_mpoly_mono_mul(uint64_t* r, const uint64_t* a, const uint64_t* b, size_t words) {
+    uint64_t overflow = 0;
+    for (size_t w = 0; w < words; w++) {
+        r[w] = a[w] + b[w];
+        overflow |= r[w];
+    }
+    return (overflow & EXPR_MPOLY_GUARD) == 0;
+}
+
+// r = a/b on monomials, false if b does not divide a.
+static inline bool expr_mpoly_mono_div(uint64_t* r, const uint64_t* a, const uint64_t* b, size_t words) {
+    for (size_t w = 0; w < words; w++) {
+        uint64_t d = (a[w] | EXPR_MPOLY_GUARD) - b[w];
+        if ((d & EXPR_MPOLY_GUARD) != EXPR_MPOLY_GUARD) return false;
+        r[w] = d & ~EXPR_MPOLY_GUARD;
+    }
+    return true;
+}
+
+void expr_mpoly_init(ExprMPoly* p, const ExprMPolyRing* ring) {
+    p->ring = ring;
+    p->exps = NULL;
+    p->coeffs = NULL;
+    p->len = 0;
+    p->capacity = 0;
+    mpz_init_set_ui(p->den, 1);
+}
+
+void expr_mpoly_clear(ExprMPoly* p) {
+    for (size_t i = 0; i < p->capacity; i++) mpz_clear(p->coeffs[i]);
+    free(p->coeffs);
+    free(p->exps);
+    mpz_clear(p->den);
+    p->exps = NULL;
+    p->coeffs = NULL;
+    p->len = 0;
+    p->capacity = 0;
+}
+
+static void expr_mpoly_swap(ExprMPoly* a, ExprMPoly* b) {
+    ExprMPoly t = *a;
+    *a = *b;
+    *b = t;
+}
+
+static void expr_mpoly_reserve(ExprMPoly* p, size_t n) {
+    if (n <= p->capacity) return;
+    size_t capacity = p->capacity ? p->capacity : 4;
+    while (capacity < n) capacity *= 2;
+    mpz_t* coeffs = (mpz_t*)realloc(p->coeffs, capacity * sizeof(mpz_t));
+    uint64_t* exps = (uint64_t*)realloc(p->exps, capacity * p->ring->words * sizeof(uint64_t));
+    if (!coeffs || !exps) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    for (size_t i = p->capacity; i < capacity; i++) mpz_init(coeffs[i]);
+    p->coeffs = coeffs;
+    p->exps = exps;
+    p->capacity = capacity;
+}
+
+// Appends a term with coefficient 0 and returns its index.
+static size_t expr_mpoly_push(ExprMPoly* p, const uint64_t* m) {
+    expr_mpoly_reserve(p, p->len + 1);
+    size_t words = p->ring->words;
+    memcpy(p->exps + p->len * words, m, words * sizeof(uint64_t));
+    mpz_set_ui(p->coeffs[p->len], 0);
+    return p->len++;
+}
+
+// Cancels the content against the denominator.
+static void expr_mpoly_normalize(ExprMPoly* p) {
+    if (p->len == 0) {
+        mpz_set_ui(p->den, 1);
+        return;
+    }
+    if (mpz_cmp_ui(p->den, 1) == 0) return;
+    mpz_t g;
+    mpz_init_set(g, p->den);
+    for (size_t i = 0; i < p->len && mpz_cmp_ui(g, 1) != 0; i++) {
+        mpz_gcd(g, g, p->coeffs[i]);
+    }
+    if (mpz_cmp_ui(g, 1) != 0) {
+        for (size_t i = 0; i < p->len; i++) mpz_divexact(p->coeffs[i], p->coeffs[i], g);
+        mpz_divexact(p->den, p->den, g);
+    }
+    mpz_clear(g);
+}
+
+void expr_mpoly_set(ExprMPoly* dst, const ExprMPoly* src) {
+    if (dst == src) return;
+    size_t words = src->ring->words;
+    dst->ring = src->ring;
+    dst->len = 0;
+    expr_mpoly_reserve(dst, src->len);
+    memcpy(dst->exps, src->exps, src->len * words * sizeof(uint64_t));
+    for (size_t i = 0; i < src->len; i++) mpz_set(dst->coeffs[i], src->coeffs[i]);
+    dst->len = src->len;
+    mpz_set(dst->den, src->den);
+}
+
+static void expr_mpoly_set_constant(ExprMPoly* p, const mpq_t c) {
+    p->len = 0;
+    mpz_set(p->den, mpq_denref(c));
+    if (mpq_sgn(c) == 0) return;
+    uint64_t* zero = (uint64_t*)calloc(p->ring->words, sizeof(uint64_t));
+    size_t i = expr_mpoly_push(p, zero);
+    mpz_set(p->coeffs[i], mpq_numref(c));
+    free(zero);
+}
+
+// Sorted merge of a*(L/da) and +-b*(L/db) over L = lcm(da, db).
+static void expr_mpoly_addsub(ExprMPoly* r, const ExprMPoly* a, const ExprMPoly* b, bool subtract) {
+    size_t words = a->ring->words;
+    mpz_t den, sa, sb;
+    mpz_init(den);
+    mpz_init(sa);
+    mpz_init(sb);
+    mpz_lcm(den, a->den, b->den);
+    mpz_divexact(sa, den, a->den);
+    mpz_divexact(sb, den, b->den);
+
+    ExprMPoly t;
+    expr_mpoly_init(&t, a->ring);
+    expr_mpoly_reserve(&t, a->len + b->len);
+    size_t i = 0, j = 0;
+    while (i < a->len || j < b->len) {
+        int c;
+        if (i == a->len)      c = -1;
+        else if (j == b->len) c = 1;
+        else                  c = expr_mpoly_cmp(a->exps + i * words, b->exps + j * words, words);
+
+        size_t k;
+        if (c > 0) {
+            k = expr_mpoly_push(&t, a->exps + i * words);
+            mpz_mul(t.coeffs[k], a->coeffs[i++], sa);
+        } else if (c < 0) {
+            k = expr_mpoly_push(&t, b->exps + j * words);
+            mpz_mul(t.coeffs[k], b->coeffs[j++], sb);
+            if (subtract) mpz_neg(t.coeffs[k], t.coeffs[k]);
+        } else {
+            k = expr_mpoly_push(&t, a->exps + i * words);
+            mpz_mul(t.coeffs[k], a->coeffs[i++], sa);
+            if (subtract) mpz_submul(t.coeffs[k], b->coeffs[j++], sb);
+            else          mpz_addmul(t.coeffs[k], b->coeffs[j++], sb);
+            if (mpz_sgn(t.coeffs[k]) == 0) t.len--;
+        }
+    }
+    mpz_swap(t.den, den);
+    expr_mpoly_normalize(&t);
+    expr_mpoly_swap(r, &t);
+
+    expr_mpoly_clear(&t);
+    mpz_clear(den);
+    mpz_clear(sa);
+    mpz_clear(sb);
+}
+
+void expr_mpoly_add(ExprMPoly* r, const ExprMPoly* a, const ExprMPoly* b) {
+    expr_mpoly_addsub(r, a, b, false);
+}
+
+void expr_mpoly_sub(ExprMPoly* r, const ExprMPoly* a, const ExprMPoly* b) {
+    expr_mpoly_addsub(r, a, b, true);
+}
+
+// Max-heap of pending products x_i * y_j, one row per term i of the
+// multiplier with at most one product in flight, so the product's column
+// and monomial live in the row. Products with equal monomials are chained
+// into one node on insertion (Monagan-Pearce), which keeps the heap small
+// and pops every contribution to a term at once. The node caches the first
+// monomial word, settling most comparisons without touching mono.
+typedef struct {
+    uint64_t lead;
+    size_t row;        // head of the chain
+} ExprMPolyHeapNode;
+
+typedef struct {
+    ExprMPolyHeapNode* nodes;
+    size_t len;
+    size_t rows;
+    size_t words;
+    uint64_t* mono;    // rows * words
+    size_t* col;
+    size_t* next;      // chain links, SIZE_MAX terminates
+    size_t* pending;   // rows popped for the current term
+} ExprMPolyHeap;
+
+static void expr_mpoly_heap_resize(ExprMPolyHeap* h, size_t rows) {
+    h->nodes = (ExprMPolyHeapNode*)realloc(h->nodes, rows * sizeof(ExprMPolyHeapNode));
+    h->mono = (uint64_t*)realloc(h->mono, rows * h->words * sizeof(uint64_t));
+    h->col = (size_t*)realloc(h->col, rows * sizeof(size_t));
+    h->next = (size_t*)realloc(h->next, rows * sizeof(size_t));
+    h->pending = (size_t*)realloc(h->pending, rows * sizeof(size_t));
+    if (!h->nodes || !h->mono || !h->col || !h->next || !h->pending) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    h->rows = rows;
+}
+
+static void expr_mpoly_heap_init(ExprMPolyHeap* h, size_t rows, size_t words) {
+    h->nodes = NULL;
+    h->mono = NULL;
+    h->col = NULL;
+    h->next = NULL;
+    h->pending = NULL;
+    h->len = 0;
+    h->words = words;
+    expr_mpoly_heap_resize(h, rows ? rows : 1);
+}
+
+static void expr_mpoly_heap_free(ExprMPolyHeap* h) {
+    free(h->nodes);
+    free(h->mono);
+    free(h->col);
+    free(h->next);
+    free(h->pending);
+}
+
+static inline int expr_mpoly_heap_cmp(const ExprMPolyHeap* h, uint64_t lead, size_t row, const ExprMPolyHeapNode* n) {
+    if (lead != n->lead) return lead < n->lead ? -1 : 1;
+    if (h->words == 1) return 0;
+    return expr_mpoly_cmp(h->mono + row * h->words + 1, h->mono + n->row * h->words + 1, h->words - 1);
+}
+
+static inline uint64_t* expr_mpoly_heap_top(const ExprMPolyHeap* h) {
+    return h->mono + h->nodes[0].row * h->words;
+}
+
+// Inserts row's current product (col and mono already set).
+static void expr_mpoly_heap_insert(ExprMPolyHeap* h, size_t row) {
+    uint64_t lead = h->mono[row * h->words];
+    size_t k = h->len;
+    int c = -1;
+    while (k > 0) {
+        size_t parent = (k - 1) / 2;
+        c = expr_mpoly_heap_cmp(h, lead, row, &h->nodes[parent]);
+        if (c <= 0) break;
+        k = parent;
+    }
+    if (k > 0 && c == 0) {
+        ExprMPolyHeapNode* n = &h->nodes[(k - 1) / 2];
+        h->next[row] = n->row;
+        n->row = row;
+        return;
+    }
+    if (k == 0 && h->len > 0 && expr_mpoly_heap_cmp(h, lead, row, &h->nodes[0]) == 0) {
+        h->next[row] = h->nodes[0].row;
+        h->nodes[0].row = row;
+        return;
+    }
+    for (size_t hole = h->len++; hole > k; hole = (hole - 1) / 2) {
+        h->nodes[hole] = h->nodes[(hole - 1) / 2];
+    }
+    h->nodes[k].lead = lead;
+    h->nodes[k].row = row;
+    h->next[row] = SIZE_MAX;
+}
+
+// Removes the top node and returns the head of its chain.
+static size_t expr_mpoly_heap_pop(ExprMPolyHeap* h) {
+    size_t row = h->nodes[0].row;
+    ExprMPolyHeapNode last = h->nodes[--h->len];
+    size_t k = 0;
+    for (;;) {
+        size_t c = 2 * k + 1;
+        if (c >= h->len) break;
+        if (c + 1 < h->len &&
+            expr_mpoly_heap_cmp(h, h->nodes[c + 1].lead, h->nodes[c + 1].row, &h->nodes[c]) > 0) {
+            c++;
+        }
+        if (expr_mpoly_heap_cmp(h, h->nodes[c].lead, h->nodes[c].row, &last) <= 0) break;
+        h->nodes[k] = h->nodes[c];
+        k = c;
+    }
+    if (h->len) h->nodes[k] = last;
+    return row;
+}
+
+#ifdef __SIZEOF_INT128__
+// Coefficients that fit a long are multiplied into a 128-bit accumulator
+// and only folded into the mpz result when it would overflow.
+#define EXPR_MPOLY_SMALL_COEFFS 1
+
+static void expr_mpz_add_i128(mpz_t z, __int128 v) {
+    unsigned __int128 u = v < 0 ? -(unsigned __int128)v : (unsigned __int128)v;
+    if ((u >> 64) == 0 && sizeof(unsigned long) == 8) {
+        if (v < 0) mpz_sub_ui(z, z, (unsigned long)u);
+        else       mpz_add_ui(z, z, (unsigned long)u);
+        return;
+    }
+    uint64_t limbs[2];
+    limbs[0] = (uint64_t)u;
+    limbs[1] = (uint64_t)(u >> 64);
+    mpz_t t;
+    mpz_init(t);
+    mpz_import(t, 2, -1, sizeof(uint64_t), 0, 0, limbs);
+    if (v < 0) mpz_sub(z, z, t);
+    else       mpz_add(z, z, t);
+    mpz_clear(t);
+}
+
+// Copies the coefficients to longs, false if any does not fit.
+static bool expr_mpoly_small_coeffs(long** out, const ExprMPoly* p) {
+    *out = NULL;
+    for (size_t i = 0; i < p->len; i++) {
+        if (!mpz_fits_slong_p(p->coeffs[i])) return false;
+    }
+    *out = (long*)malloc((p->len ? p->len : 1) * sizeof(long));
+    if (!*out) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < p->len; i++) (*out)[i] = mpz_get_si(p->coeffs[i]);
+    return true;
+}
+#endif
+
+bool expr_mpoly_mul(ExprMPoly* r, const ExprMPoly* a, const ExprMPoly* b) {
+    if (a->len > b->len) {
+        const ExprMPoly* t = a;
+        a = b;
+        b = t;
+    }
+    size_t words = a->ring->words;
+    ExprMPoly t;
+    expr_mpoly_init(&t, a->ring);
+    mpz_mul(t.den, a->den, b->den);
+    if (a->len == 0) {
+        expr_mpoly_normalize(&t);
+        expr_mpoly_swap(r, &t);
+        expr_mpoly_clear(&t);
+        return true;
+    }
+
+    // One row per term of the shorter operand, walking along b. Row i + 1
+    // enters only once row i leaves column 0, since a_{i+1} b_0 < a_i b_0.
+    ExprMPolyHeap h;
+    expr_mpoly_heap_init(&h, a->len, words);
+    uint64_t* m = (uint64_t*)malloc(words * sizeof(uint64_t));
+    if (!m) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+
+#ifdef EXPR_MPOLY_SMALL_COEFFS
+    long* sa = NULL;
+    long* sb = NULL;
+    bool small = expr_mpoly_small_coeffs(&sa, a) && expr_mpoly_small_coeffs(&sb, b);
+#endif
+
+    h.col[0] = 0;
+    bool ok = expr_mpoly_mono_mul(h.mono, a->exps, b->exps, words);
+    expr_mpoly_heap_insert(&h, 0);
+    while (ok && h.len) {
+        memcpy(m, expr_mpoly_heap_top(&h), words * sizeof(uint64_t));
+        size_t k = expr_mpoly_push(&t, m);
+        size_t npending = 0;
+#ifdef EXPR_MPOLY_SMALL_COEFFS
+        if (small) {
+            __int128 acc = 0;
+            while (h.len && expr_mpoly_cmp(expr_mpoly_heap_top(&h), m, words) == 0) {
+                for (size_t i = expr_mpoly_heap_pop(&h); i != SIZE_MAX; i = h.next[i]) {
+                    __int128 prod = (__int128)sa[i] * sb[h.col[i]], sum;
+                    if (__builtin_add_overflow(acc, prod, &sum)) {
+                        expr_mpz_add_i128(t.coeffs[k], acc);
+                        sum = prod;
+                    }
+                    acc = sum;
+                    h.pending[npending++] = i;
+                }
+            }
+            expr_mpz_add_i128(t.coeffs[k], acc);
+        }
+#endif
+        while (h.len && expr_mpoly_cmp(expr_mpoly_heap_top(&h), m, words) == 0) {
+            for (size_t i = expr_mpoly_heap_pop(&h); i != SIZE_MAX; i = h.next[i]) {
+                mpz_addmul(t.coeffs[k], a->coeffs[i], b->coeffs[h.col[i]]);
+                h.pending[npending++] = i;
+            }
+        }
+        for (size_t p = 0; p < npending && ok; p++) {
+            size_t i = h.pending[p], j = h.col[i];
+            if (j == 0 && i + 1 < a->len) {
+                h.col[i + 1] = 0;
+                ok = expr_mpoly_mono_mul(h.mono + (i + 1) * words, a->exps + (i + 1) * words, b->exps, words);
+                expr_mpoly_heap_insert(&h, i + 1);
+            }
+            if (j + 1 < b->len && ok) {
+                h.col[i] = j + 1;
+                ok = expr_mpoly_mono_mul(h.mono + i * words, a->exps + i * words, b->exps + (j + 1) * words, words);
+                expr_mpoly_heap_insert(&h, i);
+            }
+        }
+        if (mpz_sgn(t.coeffs[k]) == 0) t.len--;
+    }
+
+    if (ok) {
+        expr_mpoly_normalize(&t);
+        expr_mpoly_swap(r, &t);
+    }
+    expr_mpoly_heap_free(&h);
+    free(m);
+#ifdef EXPR_MPOLY_SMALL_COEFFS
+    free(sa);
+    free(sb);
+#endif
+    expr_mpoly_clear(&t);
+    return ok;
+}
+
+bool expr_mpoly_pow_ui(ExprMPoly* r, const ExprMPoly* a, unsigned long n) {
+    ExprMPoly result, base;
+    expr_mpoly_init(&result, a->ring);
+    expr_mpoly_init(&base, a->ring);
+    mpq_t one;
+    mpq_init(one);
+    mpq_set_ui(one, 1, 1);
+    expr_mpoly_set_constant(&result, one);
+    mpq_clear(one);
+    expr_mpoly_set(&base, a);
+
+    bool ok = true;
+    while (n && ok) {
+        if (n & 1) ok = expr_mpoly_mul(&result, &result, &base);
+        n >>= 1;
+        if (n && ok) ok = expr_mpoly_mul(&base, &base, &base);
+    }
+    if (ok) expr_mpoly_swap(r, &result);
+    expr_mpoly_clear(&result);
+    expr_mpoly_clear(&base);
+    return ok;
+}
+
+bool expr_mpoly_divexact(ExprMPoly* q, const ExprMPoly* a, const ExprMPoly* b) {
+    if (b->len == 0) return false;
+    size_t words = a->ring->words;
+    ExprMPoly t;
+    expr_mpoly_init(&t, a->ring);
+    if (a->len == 0) {
+        expr_mpoly_swap(q, &t);
+        expr_mpoly_clear(&t);
+        return true;
+    }
+
+    // Divide by the primitive part B of b's numerator: by Gauss' lemma the
+    // quotient is then integral, so any non-integral digit means b does not
+    // divide a. q = (A/B) * db / (da * content).
+    mpz_t content;
+    mpz_init(content);
+    for (size_t i = 0; i < b->len; i++) mpz_gcd(content, content, b->coeffs[i]);
+    if (mpz_sgn(b->coeffs[0]) < 0) mpz_neg(content, content);
+    mpz_t* prim = (mpz_t*)malloc(b->len * sizeof(mpz_t));
+    for (size_t i = 0; i < b->len; i++) {
+        mpz_init(prim[i]);
+        mpz_divexact(prim[i], b->coeffs[i], content);
+    }
+
+    // The heap holds q_k * B_j for j >= 1, one row per quotient term.
+    ExprMPolyHeap h;
+    expr_mpoly_heap_init(&h, 16, words);
+    uint64_t* m = (uint64_t*)malloc(words * sizeof(uint64_t));
+    if (!m) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    mpz_t c;
+    mpz_init(c);
+
+    bool ok = true;
+    size_t i = 0;
+    while (ok && (i < a->len || h.len)) {
+        if (i < a->len && (h.len == 0 || expr_mpoly_cmp(a->exps + i * words, expr_mpoly_heap_top(&h), words) >= 0)) {
+            memcpy(m, a->exps + i * words, words * sizeof(uint64_t));
+        } else {
+            memcpy(m, expr_mpoly_heap_top(&h), words * sizeof(uint64_t));
+        }
+        if (i < a->len && expr_mpoly_cmp(a->exps + i * words, m, words) == 0) mpz_set(c, a->coeffs[i++]);
+        else mpz_set_ui(c, 0);
+
+        size_t npending = 0;
+        while (h.len && expr_mpoly_cmp(expr_mpoly_heap_top(&h), m, words) == 0) {
+            for (size_t k = expr_mpoly_heap_pop(&h); k != SIZE_MAX; k = h.next[k]) {
+                mpz_submul(c, t.coeffs[k], prim[h.col[k]]);
+                h.pending[npending++] = k;
+            }
+        }
+        for (size_t p = 0; p < npending && ok; p++) {
+            size_t k = h.pending[p], j = h.col[k];
+            if (j + 1 < b->len) {
+                // an overflowing product cannot be matched by a term of a
+                h.col[k] = j + 1;
+                ok = expr_mpoly_mono_mul(h.mono + k * words, t.exps + k * words, b->exps + (j + 1) * words, words);
+                expr_mpoly_heap_insert(&h, k);
+            }
+        }
+        if (!ok) break;
+        if (mpz_sgn(c) == 0) continue;
+
+        // the leading term of what is left must be a multiple of lt(B)
+        if (!mpz_divisible_p(c, prim[0])) {
+            ok = false;
+            break;
+        }
+        expr_mpoly_reserve(&t, t.len + 1);
+        if (!expr_mpoly_mono_div(t.exps + t.len * words, m, b->exps, words)) {
+            ok = false;
+            break;
+        }
+        size_t k = t.len++;
+        mpz_divexact(t.coeffs[k], c, prim[0]);
+        if (b->len > 1) {
+            if (k == h.rows) expr_mpoly_heap_resize(&h, 2 * h.rows);
+            h.col[k] = 1;
+            ok = expr_mpoly_mono_mul(h.mono + k * words, t.exps + k * words, b->exps + words, words);
+            expr_mpoly_heap_insert(&h, k);
+        }
+    }
+
+    if (ok) {
+        for (size_t k = 0; k < t.len; k++) mpz_mul(t.coeffs[k], t.coeffs[k], b->den);
+        mpz_mul(t.den, a->den, content);
+        if (mpz_sgn(t.den) < 0) {
+            mpz_neg(t.den, t.den);
+            for (size_t k = 0; k < t.len; k++) mpz_neg(t.coeffs[k], t.coeffs[k]);
+        }
+        expr_mpoly_normalize(&t);
+        expr_mpoly_swap(q, &t);
+    }
+
+    mpz_clear(c);
+    free(m);
+    expr_mpoly_heap_free(&h);
+    for (size_t k = 0; k < b->len; k++) mpz_clear(prim[k]);
+    free(prim);
+    mpz_clear(content);
+    expr_mpoly_clear(&t);
+    return ok;
+}
+
+bool expr_to_mpoly(ExprMPoly* p, ExprArena* arena, ExprIndex idx) {
+    const ExprMPolyRing* ring = p->ring;
+    switch (expr_type(arena, idx)) {
+        case EXPR_NUMBER:
+            expr_mpoly_set_constant(p, *expr_value(arena, idx));
+            return true;
+
+        case EXPR_SYMBOL: {
+            const char* name = expr_name(arena, idx);
+            size_t var = 0;
+            while (var < ring->nvars && strcmp(ring->vars[var], name) != 0) var++;
+            if (var == ring->nvars) return false;
+            p->len = 0;
+            mpz_set_ui(p->den, 1);
+            uint64_t* m = (uint64_t*)calloc(ring->words, sizeof(uint64_t));
+            m[var / EXPR_MPOLY_FIELDS] = (uint64_t)1 << expr_mpoly_shift(var);
+            size_t k = expr_mpoly_push(p, m);
+            mpz_set_ui(p->coeffs[k], 1);
+            free(m);
+            return true;
+        }
+
+        case EXPR_ADD:
+        case EXPR_MUL: {
+            ExprMPoly rhs;
+            expr_mpoly_init(&rhs, ring);
+            bool ok = expr_to_mpoly(p, arena, expr_left(arena, idx)) &&
+                      expr_to_mpoly(&rhs, arena, expr_right(arena, idx));
+            if (ok) {
+                if (expr_type(arena, idx) == EXPR_ADD) expr_mpoly_add(p, p, &rhs);
+                else                                   ok = expr_mpoly_mul(p, p, &rhs);
+            }
+            expr_mpoly_clear(&rhs);
+            return ok;
+        }
+
+        case EXPR_POW: {
+            ExprIndex exponent = expr_right(arena, idx);
+            if (expr_type(arena, exponent) != EXPR_NUMBER) return false;
+            mpq_srcptr n = *expr_value(arena, exponent);
+            if (mpz_cmp_ui(mpq_denref(n), 1) != 0 || mpq_sgn(n) < 0 ||
+                mpz_cmp_ui(mpq_numref(n), EXPR_MPOLY_MAX_EXP) > 0) {
+                return false;
+            }
+            if (!expr_to_mpoly(p, arena, expr_left(arena, idx))) return false;
+            return expr_mpoly_pow_ui(p, p, mpz_get_ui(mpq_numref(n)));
+        }
+
+        default:
+            return false;
+    }
+}
+
+ExprIndex expr_from_mpoly(ExprArena* arena, const ExprMPoly* p) {
+    if (p->len == 0) return expr_number(arena, "0");
+
+    const ExprMPolyRing* ring = p->ring;
+    mpq_ptr c = expr_scratch_q(arena);
+    mpq_ptr k = expr_scratch_q(arena);
+    ExprIndex* symbols = (ExprIndex*)malloc((ring->nvars ? ring->nvars : 1) * sizeof(ExprIndex));
+    for (size_t v = 0; v < ring->nvars; v++) symbols[v] = INVALID_INDEX;
+
+    // terms in stored order, c * x1^e1 * x2^e2 * ... with a unit c left out
+    ExprIndex result = INVALID_INDEX;
+    for (size_t i = 0; i < p->len; i++) {
+        const uint64_t* m = p->exps + i * ring->words;
+        ExprIndex monomial = INVALID_INDEX;
+        for (size_t v = 0; v < ring->nvars; v++) {
+            unsigned long e = expr_mpoly_exp(m, v);
+            if (e == 0) continue;
+            if (symbols[v] == INVALID_INDEX) symbols[v] = expr_symbol(arena, ring->vars[v]);
+            ExprIndex factor = symbols[v];
+            if (e > 1) {
+                mpq_set_ui(k, e, 1);
+                factor = expr_pow(arena, factor, expr_number_mpq(arena, k));
+            }
+            monomial = monomial == INVALID_INDEX ? factor : expr_mul(arena, monomial, factor);
+        }
+
+        mpz_set(mpq_numref(c), p->coeffs[i]);
+        mpz_set(mpq_denref(c), p->den);
+        mpq_canonicalize(c);
+        ExprIndex term;
+        if (monomial == INVALID_INDEX)         term = expr_number_mpq(arena, c);
+        else if (mpq_cmp_ui(c, 1, 1) == 0)     term = monomial;
+        else                                   term = expr_mul(arena, expr_number_mpq(arena, c), monomial);
+        result = result == INVALID_INDEX ? term : expr_add(arena, result, term);
+    }
+
+    free(symbols);
+    expr_scratch_q_release(arena, k);
+    expr_scratch_q_release(arena, c);
+    return result;
+}
+
+ExprIndex expr_expand(ExprArena* arena, ExprIndex e) {
+    EXPR_STATS_SCOPE(arena, EXPR_ALGO_EXPAND);
+    EXPR_TRACE_SCOPE(arena, EXPR_TRACE_EXPAND);
+    ExprMPolyRing ring;
+    expr_mpoly_ring_from_expr(&ring, arena, e);
+    ExprMPoly p;
+    expr_mpoly_init(&p, &ring);
+    ExprIndex result = expr_to_mpoly(&p, arena, e) ? expr_from_mpoly(arena, &p) : INVALID_INDEX;
+    expr_mpoly_clear(&p);
+    expr_mpoly_ring_clear(&ring);
+    return result;
+}
+
+//-----------------------------------------------
+// Polynomial GCD and rational functions
+//-----------------------------------------------
+
+// Heuristic GCD gives up once an evaluation point times the degree would
+// need more bits than this.
+#ifndef EXPR_GCDHEU_MAX_BITS
+#define EXPR_GCDHEU_MAX_BITS 100000
+#endif
+
+// Nonnegative gcd of the numerators.
+static void expr_mpoly_content(mpz_t c, const ExprMPoly* p) {
+    mpz_set_ui(c, 0);
+    for (size_t i = 0; i < p->len && mpz_cmp_ui(c, 1) != 0; i++) mpz_gcd(c, c, p->coeffs[i]);
+}
+
+// Drops the denominator and the content and makes the leading coefficient
+// positive.
+static void expr_mpoly_make_primitive(ExprMPoly* p) {
+    mpz_set_ui(p->den, 1);
+    if (p->len == 0) return;
+    mpz_t c;
+    mpz_init(c);
+    expr_mpoly_content(c, p);
+    if (mpz_sgn(p->coeffs[0]) < 0) mpz_neg(c, c);
+    for (size_t i = 0; i < p->len; i++) mpz_divexact(p->coeffs[i], p->coeffs[i], c);
+    mpz_clear(c);
+}
+
+static void expr_mpoly_mul_mpz(ExprMPoly* p, const mpz_t c) {
+    for (size_t i = 0; i < p->len; i++) mpz_mul(p->coeffs[i], p->coeffs[i], c);
+    if (mpz_sgn(c) == 0) p->len = 0;
+    expr_mpoly_normalize(p);
+}
+
+static bool expr_mpoly_is_constant(const ExprMPoly* p) {
+    if (p->len > 1) return false;
+    for (size_t w = 0; p->len && w < p->ring->words; w++) {
+        if (p->exps[w]) return false;
+    }
+    return true;
+}
+
+static bool expr_mpoly_is_one(const ExprMPoly* p) {
+    return p->len == 1 && expr_mpoly_is_constant(p) && mpz_cmp(p->coeffs[0], p->den) == 0;
+}
+
+// Highest variable index with a nonzero exponent, -1 for constants.
+static long expr_mpoly_last_var(const ExprMPoly* p) {
+    size_t words = p->ring->words;
+    for (size_t w = words; w-- > 0;) {
+        uint64_t used = 0;
+        for (size_t i = 0; i < p->len; i++) used |= p->exps[i * words + w];
+        if (!used) continue;
+        for (size_t f = EXPR_MPOLY_FIELDS; f-- > 0;) {
+            size_t var = w * EXPR_MPOLY_FIELDS + f;
+            if ((used >> expr_mpoly_shift(var)) & ((1u << EXPR_MPOLY_FIELD_BITS) - 1)) return (long)var;
+        }
+    }
+    return -1;
+}
+
+static unsigned long expr_mpoly_degree_in(const ExprMPoly* p, size_t var) {
+    unsigned long d = 0;
+    for (size_t i = 0; i < p->len; i++) {
+        unsigned long e = expr_mpoly_exp(p->exps + i * p->ring->words, var);
+        if (e > d) d = e;
+    }
+    return d;
+}
+
+static void expr_mpoly_max_norm(mpz_t n, const ExprMPoly* p) {
+    mpz_set_ui(n, 0);
+    for (size_t i = 0; i < p->len; i++) {
+        if (mpz_cmpabs(p->coeffs[i], n) > 0) mpz_abs(n, p->coeffs[i]);
+    }
+}
+
+// r = p with var = xi, for an integer p in which no variable after var
+// occurs. Clearing the last field keeps the terms sorted with equal
+// monomials adjacent, so one pass combines them.
+static void expr_mpoly_eval_last(ExprMPoly* r, const ExprMPoly* p, size_t var, const mpz_t xi) {
+    size_t words = p->ring->words;
+    unsigned long deg = expr_mpoly_degree_in(p, var);
+    mpz_t* powers = expr_zpoly_alloc(deg + 1);
+    mpz_set_ui(powers[0], 1);
+    for (unsigned long k = 1; k <= deg; k++) mpz_mul(powers[k], powers[k - 1], xi);
+
+    uint64_t mask = ~((uint64_t)((1u << EXPR_MPOLY_FIELD_BITS) - 1) << expr_mpoly_shift(var));
+    uint64_t* m = (uint64_t*)malloc(words * sizeof(uint64_t));
+    ExprMPoly t;
+    expr_mpoly_init(&t, p->ring);
+    for (size_t i = 0; i < p->len; i++) {
+        const uint64_t* src = p->exps + i * words;
+        memcpy(m, src, words * sizeof(uint64_t));
+        m[var / EXPR_MPOLY_FIELDS] &= mask;
+        if (t.len == 0 || expr_mpoly_cmp(t.exps + (t.len - 1) * words, m, words) != 0) {
+            if (t.len && mpz_sgn(t.coeffs[t.len - 1]) == 0) t.len--;
+            expr_mpoly_push(&t, m);
+        }
+        mpz_addmul(t.coeffs[t.len - 1], p->coeffs[i], powers[expr_mpoly_exp(src, var)]);
+    }
+    if (t.len && mpz_sgn(t.coeffs[t.len - 1]) == 0) t.len--;
+    expr_mpoly_swap(r, &t);
+
+    expr_mpoly_clear(&t);
+    free(m);
+    expr_zpoly_free(powers, deg + 1);
+}
+
+// Inverse of eval_last: reads every coefficient of g as symmetric base-xi
+// digits, digit k becoming the coefficient of var^k.
+static bool expr_mpoly_interpolate(ExprMPoly* r, const ExprMPoly* g, size_t var, const mpz_t xi) {
+    size_t words = g->ring->words;
+    ExprMPoly t;
+    expr_mpoly_init(&t, g->ring);
+    mpz_t c, d, half;
+    mpz_init(c);
+    mpz_init(d);
+    mpz_init(half);
+    mpz_fdiv_q_2exp(half, xi, 1);
+    uint64_t* m = (uint64_t*)malloc(words * sizeof(uint64_t));
+    size_t ndigits = 0, capacity = 8;
+    mpz_t* digits = expr_zpoly_alloc(capacity);
+
+    bool ok = true;
+    for (size_t i = 0; i < g->len && ok; i++) {
+        ndigits = 0;
+        mpz_set(c, g->coeffs[i]);
+        while (mpz_sgn(c)) {
+            mpz_fdiv_qr(c, d, c, xi);
+            if (mpz_cmp(d, half) > 0) {
+                mpz_sub(d, d, xi);
+                mpz_add_ui(c, c, 1);
+            }
+            if (ndigits == capacity) {
+                mpz_t* grown = expr_zpoly_alloc(2 * capacity);
+                for (size_t k = 0; k < ndigits; k++) mpz_swap(grown[k], digits[k]);
+                expr_zpoly_free(digits, capacity);
+                digits = grown;
+                capacity *= 2;
+            }
+            mpz_swap(digits[ndigits++], d);
+        }
+        if (ndigits > EXPR_MPOLY_MAX_EXP + 1) {
+            ok = false;
+            break;
+        }
+        // highest power first keeps the terms sorted
+        for (size_t k = ndigits; k-- > 0;) {
+            if (mpz_sgn(digits[k]) == 0) continue;
+            memcpy(m, g->exps + i * words, words * sizeof(uint64_t));
+            m[var / EXPR_MPOLY_FIELDS] |= (uint64_t)k << expr_mpoly_shift(var);
+            size_t j = expr_mpoly_push(&t, m);
+            mpz_swap(t.coeffs[j], digits[k]);
+        }
+    }
+    if (ok) expr_mpoly_swap(r, &t);
+
+    expr_zpoly_free(digits, capacity);
+    free(m);
+    mpz_clear(c);
+    mpz_clear(d);
+    mpz_clear(half);
+    expr_mpoly_clear(&t);
+    return ok;
+}
+
+static bool expr_mpoly_gcd_integer(ExprMPoly* g, const ExprMPoly* a, const ExprMPoly* b);
+
+// Heuristic GCD of primitive integer polynomials (Char, Geddes, Gonnet).
+static bool expr_mpoly_gcdheu(ExprMPoly* g, const ExprMPoly* a, const ExprMPoly* b, size_t var) {
+    unsigned long deg = expr_mpoly_degree_in(a, var);
+    if (expr_mpoly_degree_in(b, var) > deg) deg = expr_mpoly_degree_in(b, var);
+
+    mpz_t xi, nb;
+    mpz_init(xi);
+    mpz_init(nb);
+    expr_mpoly_max_norm(xi, a);
+    expr_mpoly_max_norm(nb, b);
+    if (mpz_cmp(nb, xi) < 0) mpz_swap(xi, nb);
+    mpz_mul_2exp(xi, xi, 1);
+    mpz_add_ui(xi, xi, 29);
+
+    ExprMPoly ea, eb, gamma, cand, q;
+    expr_mpoly_init(&ea, a->ring);
+    expr_mpoly_init(&eb, a->ring);
+    expr_mpoly_init(&gamma, a->ring);
+    expr_mpoly_init(&cand, a->ring);
+    expr_mpoly_init(&q, a->ring);
+
+    bool found = false;
+    for (int attempt = 0; attempt < 6 && !found; attempt++) {
+        if (mpz_sizeinbase(xi, 2) * (deg + 1) > EXPR_GCDHEU_MAX_BITS) break;
+        expr_mpoly_eval_last(&ea, a, var, xi);
+        expr_mpoly_eval_last(&eb, b, var, xi);
+        if (ea.len && eb.len && expr_mpoly_gcd_integer(&gamma, &ea, &eb) &&
+            expr_mpoly_interpolate(&cand, &gamma, var, xi)) {
+            expr_mpoly_make_primitive(&cand);
+            found = cand.len && expr_mpoly_divexact(&q, a, &cand) && expr_mpoly_divexact(&q, b, &cand);
+        }
+        // next point as in the original paper, avoiding simple ratios
+        mpz_mul_ui(xi, xi, 73794);
+        mpz_fdiv_q_ui(xi, xi, 27011);
+    }
+    if (found) expr_mpoly_swap(g, &cand);
+
+    expr_mpoly_clear(&ea);
+    expr_mpoly_clear(&eb);
+    expr_mpoly_clear(&gamma);
+    expr_mpoly_clear(&cand);
+    expr_mpoly_clear(&q);
+    mpz_clear(xi);
+    mpz_clear(nb);
+    return found;
+}
+
+// gcd over Q[x] by Euclid with primitive remainders, for a and b in var only.
+static void expr_mpoly_gcd_euclid(ExprMPoly* g, const ExprMPoly* a, const ExprMPoly* b, size_t var) {
+    size_t words = a->ring->words;
+    ExprPoly u, v, r;
+    expr_poly_init(&u);
+    expr_poly_init(&v);
+    expr_poly_init(&r);
+    const ExprMPoly* src[2] = { a, b };
+    ExprPoly* dst[2] = { &u, &v };
+    for (int s = 0; s < 2; s++) {
+        expr_poly_resize(dst[s], src[s]->len ? expr_mpoly_exp(src[s]->exps, var) + 1 : 0);
+        for (size_t i = 0; i < src[s]->len; i++) {
+            mpz_set(dst[s]->coeffs[expr_mpoly_exp(src[s]->exps + i * words, var)], src[s]->coeffs[i]);
+        }
+        expr_poly_normalize(dst[s]);
+    }
+    while (v.len) {
+        expr_poly_divrem(NULL, &r, &u, &v);
+        // keep the remainder primitive, only its associate class matters
+        mpz_set_ui(r.den, 1);
+        mpz_t c;
+        mpz_init(c);
+        for (size_t i = 0; i < r.len; i++) mpz_gcd(c, c, r.coeffs[i]);
+        for (size_t i = 0; r.len && i < r.len; i++) mpz_divexact(r.coeffs[i], r.coeffs[i], c);
+        mpz_clear(c);
+        expr_poly_swap(&u, &v);
+        expr_poly_swap(&v, &r);
+    }
+
+    ExprMPoly t;
+    expr_mpoly_init(&t, a->ring);
+    uint64_t* m = (uint64_t*)calloc(words, sizeof(uint64_t));
+    for (size_t k = u.len; k-- > 0;) {
+        if (mpz_sgn(u.coeffs[k]) == 0) continue;
+        m[var / EXPR_MPOLY_FIELDS] = (uint64_t)k << expr_mpoly_shift(var);
+        size_t j = expr_mpoly_push(&t, m);
+        mpz_set(t.coeffs[j], u.coeffs[k]);
+    }
+    expr_mpoly_make_primitive(&t);
+    expr_mpoly_swap(g, &t);
+
+    free(m);
+    expr_mpoly_clear(&t);
+    expr_poly_clear(&u);
+    expr_poly_clear(&v);
+    expr_poly_clear(&r);
+}
+
+// Full gcd of integer polynomials, content included.
+static bool expr_mpoly_gcd_integer(ExprMPoly* g, const ExprMPoly* a, const ExprMPoly* b) {
+    if (a->len == 0 || b->len == 0) {
+        expr_mpoly_set(g, a->len ? a : b);
+        if (g->len && mpz_sgn(g->coeffs[0]) < 0) {
+            for (size_t i = 0; i < g->len; i++) mpz_neg(g->coeffs[i], g->coeffs[i]);
+        }
+        return true;
+    }
+
+    mpz_t ca, cb;
+    mpz_init(ca);
+    mpz_init(cb);
+    expr_mpoly_content(ca, a);
+    expr_mpoly_content(cb, b);
+    mpz_gcd(ca, ca, cb);
+
+    ExprMPoly pa, pb, t;
+    expr_mpoly_init(&pa, a->ring);
+    expr_mpoly_init(&pb, a->ring);
+    expr_mpoly_init(&t, a->ring);
+    expr_mpoly_set(&pa, a);
+    expr_mpoly_set(&pb, b);
+    expr_mpoly_make_primitive(&pa);
+    expr_mpoly_make_primitive(&pb);
+
+    long va = expr_mpoly_last_var(&pa), vb = expr_mpoly_last_var(&pb);
+    long var = va > vb ? va : vb;
+    bool ok = true;
+    if (va < 0 || vb < 0) {
+        // a constant is coprime to any primitive polynomial
+        mpq_t one;
+        mpq_init(one);
+        mpq_set_ui(one, 1, 1);
+        expr_mpoly_set_constant(&t, one);
+        mpq_clear(one);
+    } else if (!expr_mpoly_gcdheu(&t, &pa, &pb, (size_t)var)) {
+        ok = false;
+        // univariate problems always have Euclid to fall back on
+        bool univariate = true;
+        for (long v = 0; v < var && univariate; v++) {
+            univariate = expr_mpoly_degree_in(&pa, (size_t)v) == 0 && expr_mpoly_degree_in(&pb, (size_t)v) == 0;
+        }
+        if (univariate) {
+            expr_mpoly_gcd_euclid(&t, &pa, &pb, (size_t)var);
+            ok = true;
+        }
+    }
+    if (ok) {
+        expr_mpoly_mul_mpz(&t, ca);
+        expr_mpoly_swap(g, &t);
+    }
+
+    expr_mpoly_clear(&pa);
+    expr_mpoly_clear(&pb);
+    expr_mpoly_clear(&t);
+    mpz_clear(ca);
+    mpz_clear(cb);
+    return ok;
+}
+
+bool expr_mpoly_gcd(ExprMPoly* g, const ExprMPoly* a, const ExprMPoly* b) {
+    ExprMPoly ia, ib;
+    expr_mpoly_init(&ia, a->ring);
+    expr_mpoly_init(&ib, a->ring);
+    expr_mpoly_set(&ia, a);
+    expr_mpoly_set(&ib, b);
+    expr_mpoly_make_primitive(&ia);
+    expr_mpoly_make_primitive(&ib);
+    bool ok = expr_mpoly_gcd_integer(g, &ia, &ib);
+    if (ok) expr_mpoly_make_primitive(g);
+    expr_mpoly_clear(&ia);
+    expr_mpoly_clear(&ib);
+    return ok;
+}
+
+void expr_ratfunc_init(ExprRatFunc* r, const ExprMPolyRing* ring) {
+    expr_mpoly_init(&r->num, ring);
+    expr_mpoly_init(&r->den, ring);
+    mpq_t one;
+    mpq_init(one);
+    mpq_set_ui(one, 1, 1);
+    expr_mpoly_set_constant(&r->den, one);
+    mpq_clear(one);
+}
+
+void expr_ratfunc_clear(ExprRatFunc* r) {
+    expr_mpoly_clear(&r->num);
+    expr_mpoly_clear(&r->den);
+}
+
+static void expr_ratfunc_swap(ExprRatFunc* a, ExprRatFunc* b) {
+    ExprRatFunc t = *a;
+    *a = *b;
+    *b = t;
+}
+
+// Moves the rational content and sign of den into num.
+static void expr_ratfunc_fix_den(ExprRatFunc* r) {
+    ExprMPoly* den = &r->den;
+    mpz_t k;
+    mpz_init(k);
+    expr_mpoly_content(k, den);
+    if (mpz_sgn(den->coeffs[0]) < 0) mpz_neg(k, k);
+    for (size_t i = 0; i < r->num.len; i++) mpz_mul(r->num.coeffs[i], r->num.coeffs[i], den->den);
+    mpz_mul(r->num.den, r->num.den, k);
+    if (mpz_sgn(r->num.den) < 0) {
+        mpz_neg(r->num.den, r->num.den);
+        for (size_t i = 0; i < r->num.len; i++) mpz_neg(r->num.coeffs[i], r->num.coeffs[i]);
+    }
+    expr_mpoly_normalize(&r->num);
+    expr_mpoly_make_primitive(den);
+    mpz_clear(k);
+}
+
+// Divides num and den by their gcd. If the heuristic gives up the fraction
+// is left as is: still correct, just not reduced.
+static void expr_ratfunc_cancel(ExprRatFunc* r) {
+    if (r->num.len == 0) {
+        expr_ratfunc_clear(r);
+        expr_ratfunc_init(r, r->num.ring);
+        return;
+    }
+    ExprMPoly g;
+    expr_mpoly_init(&g, r->num.ring);
+    if (expr_mpoly_gcd(&g, &r->num, &r->den) && !expr_mpoly_is_constant(&g)) {
+        expr_mpoly_divexact(&r->num, &r->num, &g);
+        expr_mpoly_divexact(&r->den, &r->den, &g);
+    }
+    expr_mpoly_clear(&g);
+    expr_ratfunc_fix_den(r);
+}
+
+void expr_ratfunc_add(ExprRatFunc* r, const ExprRatFunc* a, const ExprRatFunc* b) {
+    // Henrici: with g = gcd(da, db) only factors of g can cancel
+    const ExprMPolyRing* ring = a->num.ring;
+    ExprRatFunc t;
+    expr_ratfunc_init(&t, ring);
+    ExprMPoly g, da, db, x;
+    expr_mpoly_init(&g, ring);
+    expr_mpoly_init(&da, ring);
+    expr_mpoly_init(&db, ring);
+    expr_mpoly_init(&x, ring);
+    if (!expr_mpoly_gcd(&g, &a->den, &b->den)) g.len = 0;
+
+    if (g.len == 0 || expr_mpoly_is_constant(&g)) {
+        expr_mpoly_mul(&t.num, &a->num, &b->den);
+        expr_mpoly_mul(&x, &b->num, &a->den);
+        expr_mpoly_add(&t.num, &t.num, &x);
+        expr_mpoly_mul(&t.den, &a->den, &b->den);
+        if (g.len == 0) expr_ratfunc_cancel(&t);
+        else if (t.num.len == 0) expr_ratfunc_cancel(&t);
+        else expr_ratfunc_fix_den(&t);
+    } else {
+        expr_mpoly_divexact(&da, &a->den, &g);
+        expr_mpoly_divexact(&db, &b->den, &g);
+        expr_mpoly_mul(&t.num, &a->num, &db);
+        expr_mpoly_mul(&x, &b->num, &da);
+        expr_mpoly_add(&t.num, &t.num, &x);
+        if (t.num.len == 0) {
+            expr_ratfunc_cancel(&t);
+        } else {
+            ExprMPoly h;
+            expr_mpoly_init(&h, ring);
+            if (expr_mpoly_gcd(&h, &t.num, &g) && !expr_mpoly_is_constant(&h)) {
+                expr_mpoly_divexact(&t.num, &t.num, &h);
+                expr_mpoly_divexact(&x, &b->den, &h);
+            } else {
+                expr_mpoly_set(&x, &b->den);
+            }
+            expr_mpoly_mul(&t.den, &da, &x);
+            expr_mpoly_clear(&h);
+            expr_ratfunc_fix_den(&t);
+        }
+    }
+    expr_ratfunc_swap(r, &t);
+
+    expr_ratfunc_clear(&t);
+    expr_mpoly_clear(&g);
+    expr_mpoly_clear(&da);
+    expr_mpoly_clear(&db);
+    expr_mpoly_clear(&x);
+}
+
+void expr_ratfunc_sub(ExprRatFunc* r, const ExprRatFunc* a, const ExprRatFunc* b) {
+    ExprRatFunc nb;
+    expr_ratfunc_init(&nb, b->num.ring);
+    expr_mpoly_set(&nb.num, &b->num);
+    expr_mpoly_set(&nb.den, &b->den);
+    for (size_t i = 0; i < nb.num.len; i++) mpz_neg(nb.num.coeffs[i], nb.num.coeffs[i]);
+    expr_ratfunc_add(r, a, &nb);
+    expr_ratfunc_clear(&nb);
+}
+
+void expr_ratfunc_mul(ExprRatFunc* r, const ExprRatFunc* a, const ExprRatFunc* b) {
+    // cross cancellation, a.num/a.den and b.num/b.den are already reduced
+    const ExprMPolyRing* ring = a->num.ring;
+    ExprRatFunc t;
+    expr_ratfunc_init(&t, ring);
+    ExprMPoly g1, g2, an, ad, bn, bd;
+    expr_mpoly_init(&g1, ring);
+    expr_mpoly_init(&g2, ring);
+    expr_mpoly_init(&an, ring);
+    expr_mpoly_init(&ad, ring);
+    expr_mpoly_init(&bn, ring);
+    expr_mpoly_init(&bd, ring);
+    expr_mpoly_set(&an, &a->num);
+    expr_mpoly_set(&ad, &a->den);
+    expr_mpoly_set(&bn, &b->num);
+    expr_mpoly_set(&bd, &b->den);
+    if (expr_mpoly_gcd(&g1, &an, &bd) && !expr_mpoly_is_constant(&g1)) {
+        expr_mpoly_divexact(&an, &an, &g1);
+        expr_mpoly_divexact(&bd, &bd, &g1);
+    }
+    if (expr_mpoly_gcd(&g2, &bn, &ad) && !expr_mpoly_is_constant(&g2)) {
+        expr_mpoly_divexact(&bn, &bn, &g2);
+        expr_mpoly_divexact(&ad, &ad, &g2);
+    }
+    expr_mpoly_mul(&t.num, &an, &bn);
+    expr_mpoly_mul(&t.den, &ad, &bd);
+    if (t.num.len == 0) expr_ratfunc_cancel(&t);
+    else expr_ratfunc_fix_den(&t);
+    expr_ratfunc_swap(r, &t);
+
+    expr_ratfunc_clear(&t);
+    expr_mpoly_clear(&g1);
+    expr_mpoly_clear(&g2);
+    expr_mpoly_clear(&an);
+    expr_mpoly_clear(&ad);
+    expr_mpoly_clear(&bn);
+    expr_mpoly_clear(&bd);
+}
+
+// r = 1/a, a nonzero
+static void expr_ratfunc_invert(ExprRatFunc* r, const ExprRatFunc* a) {
+    ExprRatFunc t;
+    expr_ratfunc_init(&t, a->num.ring);
+    expr_mpoly_set(&t.num, &a->den);
+    expr_mpoly_set(&t.den, &a->num);
+    expr_ratfunc_fix_den(&t);
+    expr_ratfunc_swap(r, &t);
+    expr_ratfunc_clear(&t);
+}
+
+bool expr_ratfunc_div(ExprRatFunc* r, const ExprRatFunc* a, const ExprRatFunc* b) {
+    if (b->num.len == 0) return false;
+    ExprRatFunc inv;
+    expr_ratfunc_init(&inv, b->num.ring);
+    expr_ratfunc_invert(&inv, b);
+    expr_ratfunc_mul(r, a, &inv);
+    expr_ratfunc_clear(&inv);
+    return true;
+}
+
+bool expr_ratfunc_pow_si(ExprRatFunc* r, const ExprRatFunc* a, long n) {
+    ExprRatFunc t;
+    expr_ratfunc_init(&t, a->num.ring);
+    if (n < 0) {
+        if (a->num.len == 0) {
+            expr_ratfunc_clear(&t);
+            return false;
+        }
+        expr_ratfunc_invert(&t, a);
+    } else {
+        expr_mpoly_set(&t.num, &a->num);
+        expr_mpoly_set(&t.den, &a->den);
+    }
+    unsigned long k = n < 0 ? 0ul - (unsigned long)n : (unsigned long)n;
+    // powers of coprime polynomials stay coprime
+    bool ok = expr_mpoly_pow_ui(&t.num, &t.num, k) && expr_mpoly_pow_ui(&t.den, &t.den, k);
+    if (ok) expr_ratfunc_swap(r, &t);
+    expr_ratfunc_clear(&t);
+    return ok;
+}
+
+bool expr_to_ratfunc(ExprRatFunc* r, ExprArena* arena, ExprIndex idx) {
+    const ExprMPolyRing* ring = r->num.ring;
+    switch (expr_type(arena, idx)) {
+        case EXPR_NUMBER:
+        case EXPR_SYMBOL: {
+            ExprRatFunc t;
+            expr_ratfunc_init(&t, ring);
+            bool ok = expr_to_mpoly(&t.num, arena, idx);
+            if (ok) expr_ratfunc_swap(r, &t);
+            expr_ratfunc_clear(&t);
+            return ok;
+        }
+
+        case EXPR_ADD:
+        case EXPR_MUL: {
+            ExprRatFunc rhs;
+            expr_ratfunc_init(&rhs, ring);
+            bool ok = expr_to_ratfunc(r, arena, expr_left(arena, idx)) &&
+                      expr_to_ratfunc(&rhs, arena, expr_right(arena, idx));
+            if (ok) {
+                if (expr_type(arena, idx) == EXPR_ADD) expr_ratfunc_add(r, r, &rhs);
+                else                                   expr_ratfunc_mul(r, r, &rhs);
+            }
+            expr_ratfunc_clear(&rhs);
+            return ok;
+        }
+
+        case EXPR_POW: {
+            ExprIndex exponent = expr_right(arena, idx);
+            if (expr_type(arena, exponent) != EXPR_NUMBER) return false;
+            mpq_srcptr n = *expr_value(arena, exponent);
+            if (mpz_cmp_ui(mpq_denref(n), 1) != 0 || mpz_cmpabs_ui(mpq_numref(n), EXPR_MPOLY_MAX_EXP) > 0) {
+                return false;
+            }
+            if (!expr_to_ratfunc(r, arena, expr_left(arena, idx))) return false;
+            return expr_ratfunc_pow_si(r, r, mpz_get_si(mpq_numref(n)));
+        }
+
+        default:
+            return false;
+    }
+}
+
+ExprIndex expr_from_ratfunc(ExprArena* arena, const ExprRatFunc* r) {
+    if (expr_mpoly_is_constant(&r->den)) return expr_from_mpoly(arena, &r->num);
+    ExprIndex den = expr_from_mpoly(arena, &r->den);
+    ExprIndex inv = expr_pow(arena, den, expr_number(arena, "-1"));
+    if (expr_mpoly_is_one(&r->num)) return inv;
+    return expr_mul(arena, expr_from_mpoly(arena, &r->num), inv);
+}
+
+ExprIndex expr_normal(ExprArena* arena, ExprIndex e) {
+    EXPR_STATS_SCOPE(arena, EXPR_ALGO_NORMAL);
+    EXPR_TRACE_SCOPE(arena, EXPR_TRACE_NORMAL);
+    ExprMPolyRing ring;
+    expr_mpoly_ring_from_expr(&ring, arena, e);
+    ExprRatFunc r;
+    expr_ratfunc_init(&r, &ring);
+    ExprIndex result = expr_to_ratfunc(&r, arena, e) ? expr_from_ratfunc(arena, &r) : INVALID_INDEX;
+    expr_ratfunc_clear(&r);
+    expr_mpoly_ring_clear(&ring);
+    return result;
+}
+
+// num/den with their gcd divided out, INVALID_INDEX if the gcd is trivial.
+static ExprIndex expr_div_cancel(ExprArena* a, ExprIndex num, ExprIndex den) {
+    ExprIndex operands[2] = { num, den };
+    ExprMPolyRing ring;
+    expr_mpoly_ring_from_exprs(&ring, a, operands, 2);
+    ExprMPoly pn, pd, g;
+    expr_mpoly_init(&pn, &ring);
+    expr_mpoly_init(&pd, &ring);
+    expr_mpoly_init(&g, &ring);
+
+    ExprIndex result = INVALID_INDEX;
+    if (expr_to_mpoly(&pn, a, num) && expr_to_mpoly(&pd, a, den) && pd.len &&
+        expr_mpoly_gcd(&g, &pn, &pd) && !expr_mpoly_is_constant(&g)) {
+        expr_mpoly_divexact(&pn, &pn, &g);
+        expr_mpoly_divexact(&pd, &pd, &g);
+        result = expr_div(a, expr_from_mpoly(a, &pn), expr_from_mpoly(a, &pd));
+    }
+
+    expr_mpoly_clear(&pn);
+    expr_mpoly_clear(&pd);
+    expr_mpoly_clear(&g);
+    expr_mpoly_ring_clear(&ring);
+    return result;
+}
+
+//-----------------------------------------------
+// Truncated power series
+//-----------------------------------------------
+
+// Coefficients stay GMP rationals while they are numbers, so expansions of
+// purely numeric models build no nodes until the result. Only symbolic
+// coefficients live in the arena.
+static bool expr_is_number(ExprArena* a, ExprIndex idx, long value) {
+    return expr_type(a, idx) == EXPR_NUMBER && mpz_cmp_ui(mpq_denref(*expr_value(a, idx)), 1) == 0 &&
+           mpz_cmp_si(mpq_numref(*expr_value(a, idx)), value) == 0;
+}
+
+typedef struct {
+    mpq_t q;        // the value while sym is INVALID_INDEX
+    ExprIndex sym;  // symbolic coefficient
+} ExprSeriesCoeff;
+
+typedef struct {
+    ExprIndex idx;
+    ExprSeriesCoeff* s;
+} ExprSeriesMemo;
+
+typedef struct {
+    ExprArena* arena;
+    const char* var;
+    ExprIndex point;
+    size_t n;              // coefficients kept, order + 1
+    ExprIndex zero, one;   // shared by every coefficient that becomes a node
+    ExprSeriesMemo* memo;  // series of already expanded nodes, open addressing by index
+    size_t mask;           // memo capacity - 1
+} ExprSeriesCtx;
+
+static void expr_series_coeff_init(ExprSeriesCoeff* c) {
+    mpq_init(c->q);
+    c->sym = INVALID_INDEX;
+}
+
+static bool expr_series_coeff_is(const ExprSeriesCoeff* c, long value) {
+    return c->sym == INVALID_INDEX && mpz_cmp_ui(mpq_denref(c->q), 1) == 0 && mpz_cmp_si(mpq_numref(c->q), value) == 0;
+}
+
+static void expr_series_coeff_set(ExprSeriesCoeff* r, const ExprSeriesCoeff* x) {
+    if (r == x) return;
+    if (x->sym == INVALID_INDEX) mpq_set(r->q, x->q);
+    r->sym = x->sym;
+}
+
+static void expr_series_coeff_set_si(ExprSeriesCoeff* r, long value) {
+    mpq_set_si(r->q, value, 1);
+    r->sym = INVALID_INDEX;
+}
+
+// Number nodes are read back into q, anything else is kept as a node.
+static void expr_series_coeff_set_node(ExprSeriesCtx* ctx, ExprSeriesCoeff* r, ExprIndex idx) {
+    if (expr_type(ctx->arena, idx) == EXPR_NUMBER) {
+        mpq_set(r->q, *expr_value(ctx->arena, idx));
+        r->sym = INVALID_INDEX;
+    } else {
+        r->sym = idx;
+    }
+}
+
+static ExprIndex expr_series_coeff_node(ExprSeriesCtx* ctx, const ExprSeriesCoeff* c) {
+    if (c->sym != INVALID_INDEX) return c->sym;
+    if (expr_series_coeff_is(c, 0)) return ctx->zero;
+    if (expr_series_coeff_is(c, 1)) return ctx->one;
+    return expr_number_mpq(ctx->arena, c->q);
+}
+
+static void expr_series_coeff_add(ExprSeriesCtx* ctx, ExprSeriesCoeff* r, const ExprSeriesCoeff* x, const ExprSeriesCoeff* y) {
+    if (x->sym == INVALID_INDEX && y->sym == INVALID_INDEX) {
+        mpq_add(r->q, x->q, y->q);
+        r->sym = INVALID_INDEX;
+    } else if (expr_series_coeff_is(x, 0)) {
+        expr_series_coeff_set(r, y);
+    } else if (expr_series_coeff_is(y, 0)) {
+        expr_series_coeff_set(r, x);
+    } else {
+        ExprIndex sum = expr_add(ctx->arena, expr_series_coeff_node(ctx, x), expr_series_coeff_node(ctx, y));
+        expr_series_coeff_set_node(ctx, r, sum);
+    }
+}
+
+static void expr_series_coeff_mul(ExprSeriesCtx* ctx, ExprSeriesCoeff* r, const ExprSeriesCoeff* x, const ExprSeriesCoeff* y) {
+    if (x->sym == INVALID_INDEX && y->sym == INVALID_INDEX) {
+        mpq_mul(r->q, x->q, y->q);
+        r->sym = INVALID_INDEX;
+    } else if (expr_series_coeff_is(x, 0) || expr_series_coeff_is(y, 0)) {
+        expr_series_coeff_set_si(r, 0);
+    } else if (expr_series_coeff_is(x, 1)) {
+        expr_series_coeff_set(r, y);
+    } else if (expr_series_coeff_is(y, 1)) {
+        expr_series_coeff_set(r, x);
+    } else {
+        ExprIndex product = expr_mul(ctx->arena, expr_series_coeff_node(ctx, x), expr_series_coeff_node(ctx, y));
+        expr_series_coeff_set_node(ctx, r, product);
+    }
+}
+
+// r = x * num/den
+static void expr_series_coeff_scale(ExprSeriesCtx* ctx, ExprSeriesCoeff* r, const ExprSeriesCoeff* x, long num, unsigned long den) {
+    if (x->sym == INVALID_INDEX) {
+        mpz_mul_si(mpq_numref(r->q), mpq_numref(x->q), num);
+        mpz_mul_ui(mpq_denref(r->q), mpq_denref(x->q), den);
+        mpq_canonicalize(r->q);
+        r->sym = INVALID_INDEX;
+        return;
+    }
+    mpq_ptr k = expr_scratch_q(ctx->arena);
+    mpq_set_si(k, num, den);
+    mpq_canonicalize(k);
+    if (mpq_sgn(k) == 0) {
+        expr_series_coeff_set_si(r, 0);
+    } else if (mpq_cmp_ui(k, 1, 1) == 0) {
+        r->sym = x->sym;
+    } else {
+        expr_series_coeff_set_node(ctx, r, expr_mul(ctx->arena, expr_number_mpq(ctx->arena, k), x->sym));
+    }
+    expr_scratch_q_release(ctx->arena, k);
+}
+
+static void expr_series_coeff_inv(ExprSeriesCtx* ctx, ExprSeriesCoeff* r, const ExprSeriesCoeff* x) {
+    if (x->sym == INVALID_INDEX) {
+        mpq_inv(r->q, x->q);
+        r->sym = INVALID_INDEX;
+        return;
+    }
+    expr_series_coeff_set_node(ctx, r, expr_pow(ctx->arena, x->sym, expr_number(ctx->arena, "-1")));
+}
+
+// r = x^alpha, folded for a number raised to an integer
+static void expr_series_coeff_pow(ExprSeriesCtx* ctx, ExprSeriesCoeff* r, const ExprSeriesCoeff* x, ExprIndex alpha) {
+    mpq_srcptr q = *expr_value(ctx->arena, alpha);
+    if (x->sym != INVALID_INDEX || mpz_cmp_ui(mpq_denref(q), 1) != 0 || !mpz_fits_slong_p(mpq_numref(q))) {
+        expr_series_coeff_set_node(ctx, r, expr_pow(ctx->arena, expr_series_coeff_node(ctx, x), alpha));
+        return;
+    }
+    long n = mpz_get_si(mpq_numref(q));
+    unsigned long k = n < 0 ? 0ul - (unsigned long)n : (unsigned long)n;
+    mpz_pow_ui(mpq_numref(r->q), mpq_numref(x->q), k);
+    mpz_pow_ui(mpq_denref(r->q), mpq_denref(x->q), k);
+    if (n < 0) mpq_inv(r->q, r->q);
+    r->sym = INVALID_INDEX;
+}
+
+// f(x0), with the values at 0 (and log 1) known exactly.
+static void expr_series_coeff_func(ExprSeriesCtx* ctx, ExprSeriesCoeff* r, FuncType f, const ExprSeriesCoeff* x) {
+    if (expr_series_coeff_is(x, 0) && (f == FUNC_SIN || f == FUNC_COS || f == FUNC_EXP)) {
+        expr_series_coeff_set_si(r, f == FUNC_SIN ? 0 : 1);
+    } else if (f == FUNC_LOG && expr_series_coeff_is(x, 1)) {
+        expr_series_coeff_set_si(r, 0);
+    } else {
+        expr_series_coeff_set_node(ctx, r, expr_func(ctx->arena, f, expr_series_coeff_node(ctx, x)));
+    }
+}
+
+static ExprSeriesCoeff* expr_series_alloc(ExprSeriesCtx* ctx) {
+    ExprSeriesCoeff* s = (ExprSeriesCoeff*)malloc(ctx->n * sizeof(ExprSeriesCoeff));
+    if (!s) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    for (size_t k = 0; k < ctx->n; k++) expr_series_coeff_init(&s[k]);
+    return s;
+}
+
+static void expr_series_free(ExprSeriesCtx* ctx, ExprSeriesCoeff* s) {
+    for (size_t k = 0; k < ctx->n; k++) mpq_clear(s[k].q);
+    free(s);
+}
+
+// c = a*b truncated, O(n^2). c must not alias a or b.
+static void expr_series_mul(ExprSeriesCtx* ctx, ExprSeriesCoeff* c, const ExprSeriesCoeff* a, const ExprSeriesCoeff* b) {
+    ExprSeriesCoeff term;
+    expr_series_coeff_init(&term);
+    for (size_t k = 0; k < ctx->n; k++) {
+        expr_series_coeff_set_si(&c[k], 0);
+        for (size_t j = 0; j <= k; j++) {
+            expr_series_coeff_mul(ctx, &term, &a[j], &b[k - j]);
+            expr_series_coeff_add(ctx, &c[k], &c[k], &term);
+        }
+    }
+    mpq_clear(term.q);
+}
+
+// b = a^alpha for a0 != 0 by Miller's recurrence:
+// b_k = 1/(k a0) * sum_{j=1..k} ((alpha+1) j - k) a_j b_{k-j}
+static void expr_series_pow(ExprSeriesCtx* ctx, ExprSeriesCoeff* b, const ExprSeriesCoeff* a, ExprIndex alpha) {
+    ExprSeriesCoeff inv_a0, w, sum, term;
+    expr_series_coeff_init(&inv_a0);
+    expr_series_coeff_init(&w);
+    expr_series_coeff_init(&sum);
+    expr_series_coeff_init(&term);
+    expr_series_coeff_inv(ctx, &inv_a0, &a[0]);
+    expr_series_coeff_pow(ctx, &b[0], &a[0], alpha);
+    mpq_srcptr q = *expr_value(ctx->arena, alpha);
+    for (size_t k = 1; k < ctx->n; k++) {
+        expr_series_coeff_set_si(&sum, 0);
+        for (size_t j = 1; j <= k; j++) {
+            // ((alpha+1) j - k)
+            mpz_add(mpq_numref(w.q), mpq_numref(q), mpq_denref(q));
+            mpz_mul_ui(mpq_numref(w.q), mpq_numref(w.q), (unsigned long)j);
+            mpz_submul_ui(mpq_numref(w.q), mpq_denref(q), (unsigned long)k);
+            mpz_set(mpq_denref(w.q), mpq_denref(q));
+            mpq_canonicalize(w.q);
+            expr_series_coeff_mul(ctx, &term, &a[j], &b[k - j]);
+            expr_series_coeff_mul(ctx, &term, &w, &term);
+            expr_series_coeff_add(ctx, &sum, &sum, &term);
+        }
+        expr_series_coeff_mul(ctx, &term, &sum, &inv_a0);
+        expr_series_coeff_scale(ctx, &b[k], &term, 1, k);
+    }
+    mpq_clear(inv_a0.q);
+    mpq_clear(w.q);
+    mpq_clear(sum.q);
+    mpq_clear(term.q);
+}
+
+static ExprSeriesCoeff* expr_series_node(ExprSeriesCtx* ctx, ExprIndex idx);
+
+static bool expr_series_exp(ExprSeriesCtx* ctx, ExprSeriesCoeff* b, const ExprSeriesCoeff* a) {
+    // b' = a' b: b_k = 1/k sum_{j=1..k} j a_j b_{k-j}
+    ExprSeriesCoeff sum, term;
+    expr_series_coeff_init(&sum);
+    expr_series_coeff_init(&term);
+    expr_series_coeff_func(ctx, &b[0], FUNC_EXP, &a[0]);
+    for (size_t k = 1; k < ctx->n; k++) {
+        expr_series_coeff_set_si(&sum, 0);
+        for (size_t j = 1; j <= k; j++) {
+            expr_series_coeff_mul(ctx, &term, &a[j], &b[k - j]);
+            expr_series_coeff_scale(ctx, &term, &term, (long)j, 1);
+            expr_series_coeff_add(ctx, &sum, &sum, &term);
+        }
+        expr_series_coeff_scale(ctx, &b[k], &sum, 1, k);
+    }
+    mpq_clear(sum.q);
+    mpq_clear(term.q);
+    return true;
+}
+
+static void expr_series_sincos(ExprSeriesCtx* ctx, ExprSeriesCoeff* s, ExprSeriesCoeff* c, const ExprSeriesCoeff* a) {
+    // s' = a' c, c' = -a' s
+    ExprSeriesCoeff ss, cs, term;
+    expr_series_coeff_init(&ss);
+    expr_series_coeff_init(&cs);
+    expr_series_coeff_init(&term);
+    expr_series_coeff_func(ctx, &s[0], FUNC_SIN, &a[0]);
+    expr_series_coeff_func(ctx, &c[0], FUNC_COS, &a[0]);
+    for (size_t k = 1; k < ctx->n; k++) {
+        expr_series_coeff_set_si(&ss, 0);
+        expr_series_coeff_set_si(&cs, 0);
+        for (size_t j = 1; j <= k; j++) {
+            expr_series_coeff_mul(ctx, &term, &a[j], &c[k - j]);
+            expr_series_coeff_scale(ctx, &term, &term, (long)j, 1);
+            expr_series_coeff_add(ctx, &ss, &ss, &term);
+            expr_series_coeff_mul(ctx, &term, &a[j], &s[k - j]);
+            expr_series_coeff_scale(ctx, &term, &term, (long)j, 1);
+            expr_series_coeff_add(ctx, &cs, &cs, &term);
+        }
+        expr_series_coeff_scale(ctx, &s[k], &ss, 1, k);
+        expr_series_coeff_scale(ctx, &c[k], &cs, -1, k);
+    }
+    mpq_clear(ss.q);
+    mpq_clear(cs.q);
+    mpq_clear(term.q);
+}
+
+static bool expr_series_log(ExprSeriesCtx* ctx, ExprSeriesCoeff* b, const ExprSeriesCoeff* a) {
+    // a b' = a': b_k = (a_k - 1/k sum_{j=1..k-1} j b_j a_{k-j}) / a0
+    if (expr_series_coeff_is(&a[0], 0)) return false;
+    ExprSeriesCoeff inv_a0, sum, term;
+    expr_series_coeff_init(&inv_a0);
+    expr_series_coeff_init(&sum);
+    expr_series_coeff_init(&term);
+    expr_series_coeff_inv(ctx, &inv_a0, &a[0]);
+    expr_series_coeff_func(ctx, &b[0], FUNC_LOG, &a[0]);
+    for (size_t k = 1; k < ctx->n; k++) {
+        expr_series_coeff_set_si(&sum, 0);
+        for (size_t j = 1; j < k; j++) {
+            expr_series_coeff_mul(ctx, &term, &b[j], &a[k - j]);
+            expr_series_coeff_scale(ctx, &term, &term, (long)j, 1);
+            expr_series_coeff_add(ctx, &sum, &sum, &term);
+        }
+        expr_series_coeff_scale(ctx, &term, &sum, -1, k);
+        expr_series_coeff_add(ctx, &term, &a[k], &term);
+        expr_series_coeff_mul(ctx, &b[k], &term, &inv_a0);
+    }
+    mpq_clear(inv_a0.q);
+    mpq_clear(sum.q);
+    mpq_clear(term.q);
+    return true;
+}
+
+static ExprSeriesMemo* expr_series_memo_slot(ExprSeriesCtx* ctx, ExprIndex idx) {
+    size_t pos = (size_t)expr_hash_mix(0, (uint64_t)idx) & ctx->mask;
+    while (ctx->memo[pos].idx != INVALID_INDEX && ctx->memo[pos].idx != idx) pos = (pos + 1) & ctx->mask;
+    return &ctx->memo[pos];
+}
+
+// Series of a node, NULL if the expansion does not exist (a pole or log of
+// something vanishing at the point) or the node is unsupported.
+static ExprSeriesCoeff* expr_series_node(ExprSeriesCtx* ctx, ExprIndex idx) {
+    ExprSeriesMemo* slot = expr_series_memo_slot(ctx, idx);
+    if (slot->s) return slot->s;
+    ExprArena* ar = ctx->arena;
+    ExprSeriesCoeff* s = expr_series_alloc(ctx);
+    bool ok = true;
+
+    switch (expr_type(ar, idx)) {
+        case EXPR_NUMBER:
+            expr_series_coeff_set_node(ctx, &s[0], idx);
+            break;
+
+        case EXPR_SYMBOL:
+            if (strcmp(expr_name(ar, idx), ctx->var) == 0) {
+                expr_series_coeff_set_node(ctx, &s[0], ctx->point);
+                if (ctx->n > 1) expr_series_coeff_set_si(&s[1], 1);
+            } else {
+                s[0].sym = idx;
+            }
+            break;
+
+        case EXPR_ADD: {
+            ExprSeriesCoeff* l = expr_series_node(ctx, expr_left(ar, idx));
+            ExprSeriesCoeff* r = l ? expr_series_node(ctx, expr_right(ar, idx)) : NULL;
+            ok = l && r;
+            for (size_t k = 0; ok && k < ctx->n; k++) expr_series_coeff_add(ctx, &s[k], &l[k], &r[k]);
+            break;
         }
 
-        case EXPR_INT: {
-            ExprIndex inner = e->data.integral.inner;
-            const char* var = e->data.integral.var;
+        case EXPR_MUL: {
+            ExprSeriesCoeff* l = expr_series_node(ctx, expr_left(ar, idx));
+            ExprSeriesCoeff* r = l ? expr_series_node(ctx, expr_right(ar, idx)) : NULL;
+            ok = l && r;
+            if (ok) expr_series_mul(ctx, s, l, r);
+            break;
+        }
 
-            ExprIndex simp_inner = expr_simplify(a, inner);
+        case EXPR_POW: {
+            ExprSeriesCoeff* base = expr_series_node(ctx, expr_left(ar, idx));
+            ExprIndex exponent = expr_right(ar, idx);
+            ok = base != NULL;
+            if (!ok) break;
+            if (expr_type(ar, exponent) == EXPR_NUMBER && !expr_series_coeff_is(&base[0], 0)) {
+                expr_series_pow(ctx, s, base, exponent);
+            } else if (expr_type(ar, exponent) == EXPR_NUMBER) {
+                // a0 = 0: only non-negative integer powers have a Taylor series
+                mpq_srcptr q = *expr_value(ar, exponent);
+                ok = mpz_cmp_ui(mpq_denref(q), 1) == 0 && mpq_sgn(q) >= 0 && mpz_fits_ulong_p(mpq_numref(q));
+                if (!ok) break;
+                unsigned long e = mpz_get_ui(mpq_numref(q));
+                expr_series_coeff_set_si(&s[0], 1);
+                ExprSeriesCoeff* t = expr_series_alloc(ctx);
+                for (unsigned long i = 0; i < e && i < ctx->n + 1; i++) {
+                    expr_series_mul(ctx, t, s, base);
+                    ExprSeriesCoeff* swap = s;
+                    s = t;
+                    t = swap;
+                }
+                if (e > ctx->n) {
+                    for (size_t k = 0; k < ctx->n; k++) expr_series_coeff_set_si(&s[k], 0);
+                }
+                expr_series_free(ctx, t);
+            } else {
+                // a^b = exp(b log a)
+                ExprSeriesCoeff* b = expr_series_node(ctx, exponent);
+                ExprSeriesCoeff* l = expr_series_alloc(ctx);
+                ExprSeriesCoeff* p = expr_series_alloc(ctx);
+                ok = b && expr_series_log(ctx, l, base);
+                if (ok) {
+                    expr_series_mul(ctx, p, b, l);
+                    expr_series_exp(ctx, s, p);
+                }
+                expr_series_free(ctx, l);
+                expr_series_free(ctx, p);
+            }
+            break;
+        }
 
-            // Try to evaluate with existing integration engine
-            ExprIndex attempted = expr_integrate(a, simp_inner, var);
-            if (attempted != INVALID_INDEX) return expr_simplify(a, attempted);
-            return expr_int(a, simp_inner, var);
-            
+        case EXPR_FUNC: {
+            ExprSeriesCoeff* arg = expr_series_node(ctx, expr_arg(ar, idx));
+            ok = arg != NULL;
+            if (!ok) break;
+            switch (expr_ftype(ar, idx)) {
+                case FUNC_EXP:
+                    expr_series_exp(ctx, s, arg);
+                    break;
+                case FUNC_LOG:
+                    ok = expr_series_log(ctx, s, arg);
+                    break;
+                case FUNC_SIN:
+                case FUNC_COS: {
+                    ExprSeriesCoeff* other = expr_series_alloc(ctx);
+                    if (expr_ftype(ar, idx) == FUNC_SIN) expr_series_sincos(ctx, s, other, arg);
+                    else                                     expr_series_sincos(ctx, other, s, arg);
+                    expr_series_free(ctx, other);
+                    break;
+                }
+            }
+            break;
         }
 
         default:
-            fprintf(stderr, "Unknown expression type in expr_simplify.\n");
-            exit(1);
+            ok = false;
+            break;
+    }
+
+    if (!ok) {
+        expr_series_free(ctx, s);
+        return NULL;
     }
+    // the children may have taken the slot found above
+    slot = expr_series_memo_slot(ctx, idx);
+    slot->idx = idx;
+    slot->s = s;
+    return s;
 }
-/*
-Expr* expr_copy(const Expr* e) {
-    if (!e) return NULL;
 
-    switch (e->type) {
+ExprIndex expr_series(ExprArena* arena, ExprIndex e, const char* var, ExprIndex point, size_t order) {
+    EXPR_STATS_SCOPE(arena, EXPR_ALGO_SERIES);
+    EXPR_TRACE_SCOPE(arena, EXPR_TRACE_SERIES);
+    ExprSeriesCtx ctx;
+    ctx.arena = arena;
+    ctx.var = var;
+    ctx.point = point;
+    ctx.n = order + 1;
+    ctx.zero = expr_number(arena, "0");
+    ctx.one = expr_number(arena, "1");
+    // e has at most expr_size distinct nodes, so the memo stays at most half full
+    size_t nodes = expr_size(arena, e);
+    if (nodes > MAX_EXPR_COUNT) nodes = MAX_EXPR_COUNT;
+    size_t capacity = 1;
+    while (capacity < 2 * nodes) capacity <<= 1;
+    ctx.mask = capacity - 1;
+    ctx.memo = (ExprSeriesMemo*)malloc(capacity * sizeof(ExprSeriesMemo));
+    if (!ctx.memo) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < capacity; i++) {
+        ctx.memo[i].idx = INVALID_INDEX;
+        ctx.memo[i].s = NULL;
+    }
 
-        case EXPR_NUMBER: {
-            // allocate new node
-            Expr* copy = malloc(sizeof(Expr));
-            if (!copy) {
-                fprintf(stderr, "Out of memory\n");
-                exit(1);
+    ExprIndex result = INVALID_INDEX;
+    ExprSeriesCoeff* s = expr_series_node(&ctx, e);
+    if (s) {
+        // c0 + c1*(var - point) + c2*(var - point)^2 + ...
+        ExprIndex t = expr_symbol(arena, (char*)var);
+        if (!expr_is_number(arena, point, 0)) {
+            ExprSeriesCoeff shift;
+            expr_series_coeff_init(&shift);
+            expr_series_coeff_set_node(&ctx, &shift, point);
+            expr_series_coeff_scale(&ctx, &shift, &shift, -1, 1);
+            t = expr_add(arena, t, expr_series_coeff_node(&ctx, &shift));
+            mpq_clear(shift.q);
+        }
+        mpq_t k;
+        mpq_init(k);
+        for (size_t i = 0; i < ctx.n; i++) {
+            if (expr_series_coeff_is(&s[i], 0)) continue;
+            ExprIndex c = expr_series_coeff_node(&ctx, &s[i]);
+            if (s[i].sym != INVALID_INDEX) {
+                // polynomial coefficients (in other symbols) collapse fully
+                c = expr_is_poly(arena, c) ? expr_expand(arena, c) : expr_simplify(arena, c);
+                if (expr_is_number(arena, c, 0)) continue;
+            }
+            ExprIndex term;
+            if (i == 0) {
+                term = c;
+            } else {
+                ExprIndex power = t;
+                if (i > 1) {
+                    mpq_set_ui(k, (unsigned long)i, 1);
+                    power = expr_pow(arena, t, expr_number_mpq(arena, k));
+                }
+                term = expr_is_number(arena, c, 1) ? power : expr_mul(arena, c, power);
             }
-            copy->type = EXPR_NUMBER;
-            copy->refcount = 1;
-            mpq_init(copy->data.value);
-            mpq_set(copy->data.value, e->data.value);
-            return copy;
+            result = result == INVALID_INDEX ? term : expr_add(arena, result, term);
         }
+        mpq_clear(k);
+        if (result == INVALID_INDEX) result = ctx.zero;
+    }
 
-        case EXPR_SYMBOL: {
-            Expr* copy = malloc(sizeof(Expr));
-            if (!copy) {
-                fprintf(stderr, "Out of memory\n");
-                exit(1);
-            }
-            copy->type = EXPR_SYMBOL;
-            copy->refcount = 1;
-            copy->data.name = strdup(e->data.name);
-            if (!copy->data.name) {
-                fprintf(stderr, "Out of memory\n");
-                exit(1);
+    for (size_t i = 0; i < capacity; i++) {
+        if (ctx.memo[i].s) expr_series_free(&ctx, ctx.memo[i].s);
+    }
+    free(ctx.memo);
+    return result;
+}
+
+//-----------------------------------------------
+// Matrices
+//-----------------------------------------------
+
+void expr_matrix_init(ExprMatrix* m, ExprArena* arena, size_t rows, size_t cols) {
+    m->rows = rows;
+    m->cols = cols;
+    m->data = (ExprIndex*)malloc((rows * cols + 1) * sizeof(ExprIndex));
+    if (!m->data) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    ExprIndex zero = expr_number(arena, "0");
+    for (size_t k = 0; k < rows * cols; k++) m->data[k] = zero;
+}
+
+void expr_matrix_clear(ExprMatrix* m) {
+    free(m->data);
+    m->data = NULL;
+    m->rows = m->cols = 0;
+}
+
+ExprIndex expr_matrix_get(const ExprMatrix* m, size_t i, size_t j) {
+    return m->data[i * m->cols + j];
+}
+
+void expr_matrix_set(ExprMatrix* m, size_t i, size_t j, ExprIndex e) {
+    m->data[i * m->cols + j] = e;
+}
+
+// l = lcm(l, d) up to a constant. If the gcd heuristic gives up the plain
+// product is used, a multiple of the lcm, which is still a valid row scale.
+static bool expr_matrix_lcm(ExprMPoly* l, const ExprMPoly* d) {
+    ExprMPoly g, t;
+    expr_mpoly_init(&g, l->ring);
+    expr_mpoly_init(&t, l->ring);
+    expr_mpoly_set(&t, d);
+    if (expr_mpoly_gcd(&g, l, d) && !expr_mpoly_is_constant(&g)) expr_mpoly_divexact(&t, &t, &g);
+    bool ok = expr_mpoly_mul(l, l, &t);
+    expr_mpoly_clear(&g);
+    expr_mpoly_clear(&t);
+    return ok;
+}
+
+// num/den as an expression in normal form.
+static ExprIndex expr_matrix_quotient(ExprArena* arena, const ExprMPoly* num, const ExprMPoly* den) {
+    ExprRatFunc r;
+    expr_ratfunc_init(&r, num->ring);
+    expr_mpoly_set(&r.num, num);
+    expr_mpoly_set(&r.den, den);
+    expr_ratfunc_cancel(&r);
+    ExprIndex result = expr_from_ratfunc(arena, &r);
+    expr_ratfunc_clear(&r);
+    return result;
+}
+
+// Bareiss elimination on [a | b] over the polynomials of every symbol in
+// the entries. Each row is first multiplied by the lcm of its denominators,
+// which leaves solutions alone and scales the determinant by the product of
+// the lcms. After step k every entry is a (k+1)x(k+1) minor of the scaled
+// matrix, so the division by the previous pivot is exact and coefficients
+// grow linearly instead of doubling per step. Computes *det if det is not
+// NULL and x = a^-1 b if x is not NULL.
+static bool expr_matrix_bareiss(ExprArena* arena, const ExprMatrix* a, const ExprMatrix* b, ExprIndex* det, ExprMatrix* x) {
+    size_t n = a->rows, m = b ? b->cols : 0, w = n + m;
+    if (a->cols != n || (b && b->rows != n)) return false;
+    if (n == 0) {
+        // the empty product, and a 0 x m solution
+        if (det) *det = expr_number(arena, "1");
+        if (x) expr_matrix_init(x, arena, 0, m);
+        return true;
+    }
+
+    ExprIndex* es = (ExprIndex*)malloc((n * w + 1) * sizeof(ExprIndex));
+    if (!es) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < n; i++) {
+        for (size_t j = 0; j < w; j++) es[i * w + j] = j < n ? expr_matrix_get(a, i, j) : expr_matrix_get(b, i, j - n);
+    }
+    ExprMPolyRing ring;
+    expr_mpoly_ring_from_exprs(&ring, arena, es, n * w);
+
+    ExprMPoly* mat = (ExprMPoly*)malloc((n * w + 1) * sizeof(ExprMPoly));
+    if (!mat) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    for (size_t k = 0; k < n * w; k++) expr_mpoly_init(&mat[k], &ring);
+    ExprMPoly scale, l, prev, t, u;
+    expr_mpoly_init(&scale, &ring);
+    expr_mpoly_init(&l, &ring);
+    expr_mpoly_init(&prev, &ring);
+    expr_mpoly_init(&t, &ring);
+    expr_mpoly_init(&u, &ring);
+    mpq_t one;
+    mpq_init(one);
+    mpq_set_ui(one, 1, 1);
+    expr_mpoly_set_constant(&scale, one);
+    expr_mpoly_set_constant(&prev, one);
+
+    bool ok = true;
+    ExprRatFunc* row = (ExprRatFunc*)malloc((w + 1) * sizeof(ExprRatFunc));
+    if (!row) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    for (size_t j = 0; j < w; j++) expr_ratfunc_init(&row[j], &ring);
+    for (size_t i = 0; i < n && ok; i++) {
+        expr_mpoly_set_constant(&l, one);
+        for (size_t j = 0; j < w && ok; j++) {
+            ok = expr_to_ratfunc(&row[j], arena, es[i * w + j]) && expr_matrix_lcm(&l, &row[j].den);
+        }
+        for (size_t j = 0; j < w && ok; j++) {
+            expr_mpoly_divexact(&t, &l, &row[j].den);
+            ok = expr_mpoly_mul(&mat[i * w + j], &row[j].num, &t);
+        }
+        ok = ok && expr_mpoly_mul(&scale, &scale, &l);
+    }
+    for (size_t j = 0; j < w; j++) expr_ratfunc_clear(&row[j]);
+    free(row);
+
+    // Fraction-free forward elimination, pivoting on the sparsest entry.
+    int sign = 1;
+    bool singular = false;
+    for (size_t k = 0; k < n && ok && !singular; k++) {
+        size_t p = SIZE_MAX;
+        for (size_t i = k; i < n; i++) {
+            size_t len = mat[i * w + k].len;
+            if (len && (p == SIZE_MAX || len < mat[p * w + k].len)) p = i;
+        }
+        if (p == SIZE_MAX) {
+            singular = true;
+            break;
+        }
+        if (p != k) {
+            for (size_t j = 0; j < w; j++) expr_mpoly_swap(&mat[k * w + j], &mat[p * w + j]);
+            sign = -sign;
+        }
+        const ExprMPoly* pivot = &mat[k * w + k];
+        for (size_t i = k + 1; i < n && ok; i++) {
+            const ExprMPoly* lead = &mat[i * w + k];
+            for (size_t j = k + 1; j < w && ok; j++) {
+                // m_ij = (m_kk m_ij - m_ik m_kj) / prev
+                ok = expr_mpoly_mul(&t, pivot, &mat[i * w + j]) && expr_mpoly_mul(&u, lead, &mat[k * w + j]);
+                if (!ok) break;
+                expr_mpoly_sub(&t, &t, &u);
+                ok = expr_mpoly_divexact(&mat[i * w + j], &t, &prev);
             }
-            return copy;
+            mat[i * w + k].len = 0;
         }
+        expr_mpoly_set(&prev, pivot);
+    }
 
-        case EXPR_ADD:
-        case EXPR_MUL:
-        case EXPR_POW: {
-            Expr* left_copy = expr_copy(e->data.binop.left);
-            Expr* right_copy = expr_copy(e->data.binop.right);
-            Expr* copy = malloc(sizeof(Expr));
-            if (!copy) {
-                fprintf(stderr, "Out of memory\n");
-                exit(1);
+    if (ok && det) {
+        if (singular) {
+            *det = expr_number(arena, "0");
+        } else {
+            // prev is now the determinant of the scaled matrix
+            if (sign < 0) {
+                for (size_t k = 0; k < prev.len; k++) mpz_neg(prev.coeffs[k], prev.coeffs[k]);
             }
-            copy->type = e->type;
-            copy->refcount = 1;
-            copy->data.binop.left = left_copy;
-            copy->data.binop.right = right_copy;
-            return copy;
+            *det = expr_matrix_quotient(arena, &prev, &scale);
         }
+    }
 
-        case EXPR_FUNC: {
-            Expr* arg_copy = expr_copy(e->data.func.arg);
-            Expr* copy = malloc(sizeof(Expr));
-            if (!copy) {
+    if (ok && x) {
+        ok = !singular;
+        if (ok) {
+            // Back substitution on y = d x, which is polynomial by Cramer's
+            // rule: m_ii y_i = d c_i - sum_{j>i} m_ij y_j.
+            ExprMPoly* y = (ExprMPoly*)malloc((n + 1) * sizeof(ExprMPoly));
+            if (!y) {
                 fprintf(stderr, "Out of memory\n");
                 exit(1);
             }
-            copy->type = EXPR_FUNC;
-            copy->refcount = 1;
-            copy->data.func.func = e->data.func.func;
-            copy->data.func.arg = arg_copy;
-            return copy;
+            for (size_t i = 0; i < n; i++) expr_mpoly_init(&y[i], &ring);
+            expr_matrix_init(x, arena, n, m);
+            for (size_t c = 0; c < m && ok; c++) {
+                for (size_t i = n; i-- > 0 && ok;) {
+                    ok = expr_mpoly_mul(&t, &prev, &mat[i * w + n + c]);
+                    for (size_t j = i + 1; j < n && ok; j++) {
+                        ok = expr_mpoly_mul(&u, &mat[i * w + j], &y[j]);
+                        expr_mpoly_sub(&t, &t, &u);
+                    }
+                    ok = ok && expr_mpoly_divexact(&y[i], &t, &mat[i * w + i]);
+                }
+                for (size_t i = 0; i < n && ok; i++) expr_matrix_set(x, i, c, expr_matrix_quotient(arena, &y[i], &prev));
+            }
+            for (size_t i = 0; i < n; i++) expr_mpoly_clear(&y[i]);
+            free(y);
+            if (!ok) expr_matrix_clear(x);
         }
+    }
 
-        default:
-            fprintf(stderr, "Unknown expression type in copy: %d\n", e->type);
+    mpq_clear(one);
+    expr_mpoly_clear(&scale);
+    expr_mpoly_clear(&l);
+    expr_mpoly_clear(&prev);
+    expr_mpoly_clear(&t);
+    expr_mpoly_clear(&u);
+    for (size_t k = 0; k < n * w; k++) expr_mpoly_clear(&mat[k]);
+    free(mat);
+    free(es);
+    expr_mpoly_ring_clear(&ring);
+    return ok;
+}
+
+ExprIndex expr_matrix_det(ExprArena* arena, const ExprMatrix* a) {
+    ExprIndex det = INVALID_INDEX;
+    return expr_matrix_bareiss(arena, a, NULL, &det, NULL) ? det : INVALID_INDEX;
+}
+
+bool expr_matrix_solve(ExprArena* arena, ExprMatrix* x, const ExprMatrix* a, const ExprMatrix* b) {
+    return expr_matrix_bareiss(arena, a, b, NULL, x);
+}
+
+bool expr_matrix_inverse(ExprArena* arena, ExprMatrix* inv, const ExprMatrix* a) {
+    ExprMatrix id;
+    expr_matrix_init(&id, arena, a->rows, a->rows);
+    ExprIndex one = expr_number(arena, "1");
+    for (size_t i = 0; i < a->rows; i++) expr_matrix_set(&id, i, i, one);
+    bool ok = expr_matrix_bareiss(arena, a, &id, NULL, inv);
+    expr_matrix_clear(&id);
+    return ok;
+}
+
+//-----------------------------------------------
+// Compiled evaluation
+//-----------------------------------------------
+
+static size_t expr_tape_emit(ExprTape* t, ExprOp op, size_t a, size_t b, double value) {
+    if (t->len == t->capacity) {
+        t->capacity = t->capacity ? 2 * t->capacity : 64;
+        t->code = (ExprInstr*)realloc(t->code, t->capacity * sizeof(ExprInstr));
+        if (!t->code) {
+            fprintf(stderr, "Out of memory\n");
             exit(1);
+        }
     }
+    ExprInstr* in = &t->code[t->len];
+    in->op = op;
+    in->a = a;
+    in->b = b;
+    in->value = value;
+    return t->len++;
 }
-*/
-int expr_equal(const ExprArena* arena, ExprIndex a_idx, ExprIndex b_idx) {
-    if (a_idx == b_idx) return 1;
-    if (a_idx < 0 || b_idx < 0) return 0;
-
-    const Expr* a = expr_at(arena, a_idx);
-    const Expr* b = expr_at(arena, b_idx);
-    if (!a || !b) return 0;
 
-    if (a->type != b->type) return 0;
+// Slot holding the value of idx, emitting its instructions on first visit.
+// memo maps arena indices to slot + 1 so shared subtrees are computed once.
+static size_t expr_tape_node(ExprTape* t, ExprArena* a, ExprIndex idx, const char* const* vars, size_t* memo) {
+    if (memo[idx]) return memo[idx] - 1;
 
-    switch (a->type) {
+    size_t slot = SIZE_MAX;
+    switch (expr_type(a, idx)) {
         case EXPR_NUMBER:
-            return mpq_cmp(a->data.value, b->data.value) == 0;
+            slot = expr_tape_emit(t, EXPR_OP_CONST, 0, 0, expr_value_d(a, idx));
+            break;
 
         case EXPR_SYMBOL:
-            return strcmp(a->data.name, b->data.name) == 0;
+            for (size_t i = 0; i < t->nvars; i++) {
+                if (vars[i] && strcmp(vars[i], expr_name(a, idx)) == 0) {
+                    slot = expr_tape_emit(t, EXPR_OP_VAR, i, 0, 0.0);
+                    break;
+                }
+            }
+            break;
 
         case EXPR_ADD:
-        case EXPR_MUL:
-        case EXPR_POW:
-            return expr_equal(arena, a->data.binop.left, b->data.binop.left) &&
-                   expr_equal(arena, a->data.binop.right, b->data.binop.right);
-
-        case EXPR_FUNC:
-            return a->data.func.func == b->data.func.func &&
-                   expr_equal(arena, a->data.func.arg, b->data.func.arg);
+        case EXPR_MUL: {
+            size_t l = expr_tape_node(t, a, expr_left(a, idx), vars, memo);
+            size_t r = l == SIZE_MAX ? SIZE_MAX : expr_tape_node(t, a, expr_right(a, idx), vars, memo);
+            if (r != SIZE_MAX) slot = expr_tape_emit(t, expr_type(a, idx) == EXPR_ADD ? EXPR_OP_ADD : EXPR_OP_MUL, l, r, 0.0);
+            break;
+        }
 
-        case EXPR_DIFF:
-            return strcmp(a->data.diff.var, b->data.diff.var) == 0 &&
-                   expr_equal(arena, a->data.diff.inner, b->data.diff.inner);
+        case EXPR_POW: {
+            size_t base = expr_tape_node(t, a, expr_left(a, idx), vars, memo);
+            if (base == SIZE_MAX) break;
+            ExprIndex exponent = expr_right(a, idx);
+            // small integer powers by repeated squaring: exact and no libm call
+            if (expr_type(a, exponent) == EXPR_NUMBER && mpz_cmp_ui(mpq_denref(*expr_value(a, exponent)), 1) == 0 &&
+                mpz_cmpabs_ui(mpq_numref(*expr_value(a, exponent)), 64) <= 0) {
+                slot = expr_tape_emit(t, EXPR_OP_POWI, base, 0, (double)mpz_get_si(mpq_numref(*expr_value(a, exponent))));
+                break;
+            }
+            size_t e = expr_tape_node(t, a, exponent, vars, memo);
+            if (e != SIZE_MAX) slot = expr_tape_emit(t, EXPR_OP_POW, base, e, 0.0);
+            break;
+        }
 
-        case EXPR_INT:
-            return strcmp(a->data.integral.var, b->data.integral.var) == 0 &&
-                   expr_equal(arena, a->data.integral.inner, b->data.integral.inner);
+        case EXPR_FUNC: {
+            size_t arg = expr_tape_node(t, a, expr_arg(a, idx), vars, memo);
+            if (arg == SIZE_MAX) break;
+            switch (expr_ftype(a, idx)) {
+                case FUNC_SIN: slot = expr_tape_emit(t, EXPR_OP_SIN, arg, 0, 0.0); break;
+                case FUNC_COS: slot = expr_tape_emit(t, EXPR_OP_COS, arg, 0, 0.0); break;
+                case FUNC_EXP: slot = expr_tape_emit(t, EXPR_OP_EXP, arg, 0, 0.0); break;
+                case FUNC_LOG: slot = expr_tape_emit(t, EXPR_OP_LOG, arg, 0, 0.0); break;
+            }
+            break;
+        }
 
         default:
-            fprintf(stderr, "Unknown expression type in expr_equal: %d\n", a->type);
-            exit(1);
+            break;
     }
+    if (slot != SIZE_MAX) memo[idx] = slot + 1;
+    return slot;
 }
 
+bool expr_tape_compile(ExprTape* t, ExprArena* arena, const ExprIndex* outputs, size_t noutputs,
+                       const char* const* vars, size_t nvars) {
+    t->code = NULL;
+    t->lanes = NULL;
+    t->len = t->capacity = 0;
+    t->nvars = nvars;
+    t->noutputs = noutputs;
+    t->outputs = (size_t*)malloc((noutputs + 1) * sizeof(size_t));
+    size_t* memo = (size_t*)calloc(MAX_EXPR_COUNT, sizeof(size_t));
+    if (!t->outputs || !memo) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    bool ok = true;
+    for (size_t i = 0; i < noutputs && ok; i++) {
+        t->outputs[i] = expr_tape_node(t, arena, outputs[i], vars, memo);
+        ok = t->outputs[i] != SIZE_MAX;
+    }
+    free(memo);
+    t->regs = (double*)malloc((t->len + 1) * sizeof(double));
+    if (!t->regs) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    if (!ok) expr_tape_clear(t);
+    return ok;
+}
 
-ExprIndex expr_substitute(ExprArena* a, ExprIndex idx, const char* symbol_name, const char* value_str){
-    Expr* e = expr_at(a,idx);
-    if (!e) return INVALID_INDEX;
+void expr_tape_clear(ExprTape* t) {
+    free(t->code);
+    free(t->outputs);
+    free(t->regs);
+    free(t->lanes);
+    t->code = NULL;
+    t->outputs = NULL;
+    t->regs = NULL;
+    t->lanes = NULL;
+    t->len = t->capacity = t->noutputs = 0;
+}
 
-    switch (e->type) {
-      
-        case EXPR_NUMBER:
-            return idx;
-  
-        case EXPR_SYMBOL:
-            if (strcmp(e->data.name, symbol_name) == 0) {
-                return expr_number(a,value_str);
-            } else {
-                return idx;
-            }
+static inline double expr_powi(double x, long n) {
+    unsigned long k = n < 0 ? 0ul - (unsigned long)n : (unsigned long)n;
+    double r = 1.0;
+    while (k) {
+        if (k & 1) r *= x;
+        x *= x;
+        k >>= 1;
+    }
+    return n < 0 ? 1.0 / r : r;
+}
 
-        case EXPR_ADD: {
-            ExprIndex left  = expr_substitute(a, expr_left(a,idx) , symbol_name, value_str);
-            ExprIndex right = expr_substitute(a, expr_right(a,idx), symbol_name, value_str);
-            return expr_add(a, left, right);
+void expr_tape_eval(ExprTape* t, const double* x, double* out) {
+    double* r = t->regs;
+    const ExprInstr* code = t->code;
+    for (size_t i = 0; i < t->len; i++) {
+        const ExprInstr* in = &code[i];
+        switch (in->op) {
+            case EXPR_OP_CONST: r[i] = in->value; break;
+            case EXPR_OP_VAR:   r[i] = x[in->a]; break;
+            case EXPR_OP_ADD:   r[i] = r[in->a] + r[in->b]; break;
+            case EXPR_OP_MUL:   r[i] = r[in->a] * r[in->b]; break;
+            case EXPR_OP_POW:   r[i] = pow(r[in->a], r[in->b]); break;
+            case EXPR_OP_POWI:  r[i] = expr_powi(r[in->a], (long)in->value); break;
+            case EXPR_OP_SIN:   r[i] = sin(r[in->a]); break;
+            case EXPR_OP_COS:   r[i] = cos(r[in->a]); break;
+            case EXPR_OP_EXP:   r[i] = exp(r[in->a]); break;
+            case EXPR_OP_LOG:   r[i] = log(r[in->a]); break;
         }
+    }
+    for (size_t k = 0; k < t->noutputs; k++) out[k] = r[t->outputs[k]];
+}
 
-        case EXPR_MUL: {
-            ExprIndex left  = expr_substitute(a, expr_left(a,idx) , symbol_name, value_str);
-            ExprIndex right = expr_substitute(a, expr_right(a,idx), symbol_name, value_str);
-            return expr_mul(a, left, right);
-        }
+// Lane kernels. With GCC or Clang they are written on vector types, so
+// they compile to packed SIMD at any optimization level (AVX when enabled,
+// pairs of SSE2 operations otherwise). aligned(8) allows loads from any
+// double. Elsewhere they are plain loops.
+#if defined(__GNUC__)
+typedef double ExprVec __attribute__((vector_size(32), aligned(8)));
+#define EXPR_VEC_WIDTH 4
+#if EXPR_TAPE_LANES % EXPR_VEC_WIDTH
+#error "EXPR_TAPE_LANES must be a multiple of 4"
+#endif
+#define EXPR_LANES_MAP(r, expr)                                                    \
+    for (size_t j = 0; j < EXPR_TAPE_LANES; j += EXPR_VEC_WIDTH) {                 \
+        const ExprVec a_ = *(const ExprVec*)(ra + j), b_ = *(const ExprVec*)(rb + j); \
+        (void)a_;                                                                  \
+        (void)b_;                                                                  \
+        *(ExprVec*)((r) + j) = (expr);                                             \
+    }
+#else
+#define EXPR_LANES_MAP(r, expr)                         \
+    for (size_t j = 0; j < EXPR_TAPE_LANES; j++) {      \
+        const double a_ = ra[j], b_ = rb[j];            \
+        (void)a_;                                       \
+        (void)b_;                                       \
+        (r)[j] = (expr);                                \
+    }
+#endif
 
-        case EXPR_POW: {
-            ExprIndex base = expr_substitute(a,expr_left(a,idx), symbol_name, value_str);
-            ExprIndex exponent = expr_substitute(a,expr_right(a,idx), symbol_name, value_str);
-            return expr_pow(a, base, exponent);
+// Runs the tape over one block of EXPR_TAPE_LANES points. vars[v] points at
+// the values of variable v for this block. Only the first w lanes are
+// loaded; the rest compute on stale values and are ignored.
+static void expr_tape_run_block(const ExprTape* t, double* lanes, const double* const* vars, size_t w) {
+    for (size_t i = 0; i < t->len; i++) {
+        const ExprInstr* in = &t->code[i];
+        double* r = lanes + i * EXPR_TAPE_LANES;
+        const double* ra = lanes + in->a * EXPR_TAPE_LANES;
+        const double* rb = lanes + in->b * EXPR_TAPE_LANES;
+        switch (in->op) {
+            case EXPR_OP_CONST: for (size_t j = 0; j < EXPR_TAPE_LANES; j++) r[j] = in->value; break;
+            case EXPR_OP_VAR:   memcpy(r, vars[in->a], w * sizeof(double)); break;
+            case EXPR_OP_ADD:   EXPR_LANES_MAP(r, a_ + b_); break;
+            case EXPR_OP_MUL:   EXPR_LANES_MAP(r, a_ * b_); break;
+            case EXPR_OP_POW:   for (size_t j = 0; j < w; j++) r[j] = pow(ra[j], rb[j]); break;
+            case EXPR_OP_POWI: {
+                long n = (long)in->value;
+                if (n == 2) {
+                    EXPR_LANES_MAP(r, a_ * a_);
+                } else if (n == -1) {
+                    EXPR_LANES_MAP(r, 1.0 / a_);
+                } else {
+                    for (size_t j = 0; j < w; j++) r[j] = expr_powi(ra[j], n);
+                }
+                break;
+            }
+            case EXPR_OP_SIN:   for (size_t j = 0; j < w; j++) r[j] = sin(ra[j]); break;
+            case EXPR_OP_COS:   for (size_t j = 0; j < w; j++) r[j] = cos(ra[j]); break;
+            case EXPR_OP_EXP:   for (size_t j = 0; j < w; j++) r[j] = exp(ra[j]); break;
+            case EXPR_OP_LOG:   for (size_t j = 0; j < w; j++) r[j] = log(ra[j]); break;
         }
+    }
+}
 
-        case EXPR_FUNC: {
-            ExprIndex arg = expr_substitute(a, expr_arg(a,idx), symbol_name, value_str);
-            return expr_func(a, expr_ftype(a,idx), arg);
+static double* expr_tape_alloc_lanes(const ExprTape* t) {
+    // zeroed so lanes past the end of a short block never hold garbage
+    double* lanes = (double*)calloc((t->len + 1) * EXPR_TAPE_LANES, sizeof(double));
+    if (!lanes) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    return lanes;
+}
+
+void expr_tape_eval_batch(ExprTape* t, const double* x, size_t count, double* out) {
+    if (!t->lanes) t->lanes = expr_tape_alloc_lanes(t);
+    const double** vars = (const double**)malloc((t->nvars + 1) * sizeof(double*));
+    if (!vars) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    for (size_t base = 0; base < count; base += EXPR_TAPE_LANES) {
+        size_t w = count - base < EXPR_TAPE_LANES ? count - base : EXPR_TAPE_LANES;
+        for (size_t v = 0; v < t->nvars; v++) vars[v] = x + v * count + base;
+        expr_tape_run_block(t, t->lanes, vars, w);
+        for (size_t k = 0; k < t->noutputs; k++) {
+            memcpy(out + k * count + base, t->lanes + t->outputs[k] * EXPR_TAPE_LANES, w * sizeof(double));
         }
- 
-        default:
-            fprintf(stderr, "Unknown expression type in expr_substitute.\n");
-            exit(1);
     }
-           
+    free(vars);
+}
+
+//-----------------------------------------------
+// Root finding
+//-----------------------------------------------
+
+// f and f' of var (and param, if given) on one tape.
+static bool expr_root_compile(ExprTape* t, ExprArena* arena, ExprIndex e, const char* var, const char* param) {
+    ExprIndex de = expr_differentiate(arena, e, var);
+    if (de == INVALID_INDEX) return false;
+    ExprIndex outputs[2] = { e, expr_simplify(arena, de) };
+    const char* vars[2] = { var, param };
+    return expr_tape_compile(t, arena, outputs, 2, vars, param ? 2 : 1);
+}
+
+// Newton from x0, halving the step while it does not decrease |f|.
+static bool expr_root_newton(ExprTape* t, double* x, double x0, double tol) {
+    double fd[2];
+    x[0] = x0;
+    expr_tape_eval(t, x, fd);
+    for (int iter = 0; iter < EXPR_ROOT_MAX_ITER; iter++) {
+        if (fd[0] == 0.0) return true;
+        if (!isfinite(fd[0]) || !isfinite(fd[1]) || fd[1] == 0.0) return false;
+        double xold = x[0], fold = fd[0], dx = fd[0] / fd[1];
+        for (int halvings = 0; halvings < 30; halvings++) {
+            x[0] = xold - dx;
+            expr_tape_eval(t, x, fd);
+            if (isfinite(fd[0]) && fabs(fd[0]) < fabs(fold)) break;
+            dx *= 0.5;
+        }
+        if (fabs(dx) <= tol * (1.0 + fabs(x[0]))) return isfinite(fd[0]);
+    }
+    return false;
 }
-/*
-Expr* expr_eval(const Expr* e, 
-                const char* symbol_name, 
-                const char* value_str) {
-    if (!e) return NULL;
 
-    switch (e->type) {
-        case EXPR_NUMBER:
-            return expr_copy(e);
+// Newton kept inside a sign-changing bracket: any step that would leave the
+// bracket or that does not at least halve it is replaced by bisection, so
+// convergence is guaranteed and quadratic once Newton takes over.
+static bool expr_root_bracketed(ExprTape* t, double* x, double x0, double lo, double hi, double tol) {
+    double fd[2];
+    x[0] = lo;
+    expr_tape_eval(t, x, fd);
+    double flo = fd[0];
+    x[0] = hi;
+    expr_tape_eval(t, x, fd);
+    double fhi = fd[0];
+    if (flo == 0.0) {
+        x[0] = lo;
+        return true;
+    }
+    if (fhi == 0.0) return true;
+    if (!(flo * fhi < 0.0)) return false;
+    if (flo > 0.0) {
+        // orient so that f(lo) < 0 < f(hi)
+        double s = lo;
+        lo = hi;
+        hi = s;
+    }
 
-        case EXPR_SYMBOL:
-            if (strcmp(e->data.name, symbol_name) == 0) {
-                // Replace symbol with number
-                return expr_number(value_str);
-            } else {
-                return expr_copy(e);
-            }
+    x[0] = (x0 > fmin(lo, hi) && x0 < fmax(lo, hi)) ? x0 : 0.5 * (lo + hi);
+    double dxold = fabs(hi - lo), dx = dxold;
+    expr_tape_eval(t, x, fd);
+    for (int iter = 0; iter < EXPR_ROOT_MAX_ITER; iter++) {
+        double f = fd[0], df = fd[1];
+        if (!isfinite(f)) return false;
+        if (f == 0.0) return true;
+        if (!isfinite(df) || ((x[0] - hi) * df - f) * ((x[0] - lo) * df - f) > 0.0 ||
+            fabs(2.0 * f) > fabs(dxold * df)) {
+            dxold = dx;
+            dx = 0.5 * (hi - lo);
+            x[0] = lo + dx;
+        } else {
+            dxold = dx;
+            dx = f / df;
+            x[0] -= dx;
+        }
+        if (fabs(dx) <= tol * (1.0 + fabs(x[0]))) return true;
+        expr_tape_eval(t, x, fd);
+        if (fd[0] < 0.0) lo = x[0];
+        else hi = x[0];
+    }
+    return false;
+}
 
-        case EXPR_ADD: {
-            Expr* left = expr_eval(e->data.binop.left, symbol_name, value_str);
-            Expr* right = expr_eval(e->data.binop.right, symbol_name, value_str);
+bool expr_find_root(ExprArena* arena, ExprIndex e, const char* var, double x0, const double* bracket,
+                    double tol, double* root) {
+    ExprTape t;
+    if (!expr_root_compile(&t, arena, e, var, NULL)) return false;
+    double x[1];
+    bool ok = bracket ? expr_root_bracketed(&t, x, x0, bracket[0], bracket[1], tol)
+                      : expr_root_newton(&t, x, x0, tol);
+    if (ok) *root = x[0];
+    expr_tape_clear(&t);
+    return ok;
+}
 
-            if (left->type == EXPR_NUMBER && right->type == EXPR_NUMBER) {
-                Expr* result = expr_add_numbers(left, right);
-                expr_release(left);
-                expr_release(right);
-                return result;
-            } else {
-                Expr* result = expr_add(left, right);
-                return result;
-            }
-        }
+size_t expr_find_roots(ExprArena* arena, ExprIndex e, const char* var, const char* param,
+                       const double* params, size_t count, double x0, const double* bracket,
+                       double tol, double* roots) {
+    ExprTape t;
+    if (!expr_root_compile(&t, arena, e, var, param)) {
+        for (size_t i = 0; i < count; i++) roots[i] = NAN;
+        return 0;
+    }
+    size_t found = 0;
+    double x[2];
+    for (size_t i = 0; i < count; i++) {
+        x[1] = params[i];
+        bool ok = bracket ? expr_root_bracketed(&t, x, x0, bracket[0], bracket[1], tol)
+                          : expr_root_newton(&t, x, x0, tol);
+        roots[i] = ok ? x[0] : NAN;
+        found += ok;
+    }
+    expr_tape_clear(&t);
+    return found;
+}
 
-        case EXPR_MUL: {
-            Expr* left = expr_eval(e->data.binop.left, symbol_name, value_str);
-            Expr* right = expr_eval(e->data.binop.right, symbol_name, value_str);
+//-----------------------------------------------
+// Ordinary differential equations
+//-----------------------------------------------
 
-            if (left->type == EXPR_NUMBER && right->type == EXPR_NUMBER) {
-                Expr* result = malloc(sizeof(Expr));
-                result->type = EXPR_NUMBER;
-                result->refcount = 1;
-                mpq_init(result->data.value);
-                mpq_mul(result->data.value, left->data.value, right->data.value);
+static double* expr_ode_alloc(size_t n) {
+    double* p = (double*)malloc((n + 1) * sizeof(double));
+    if (!p) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    return p;
+}
 
-                expr_release(left);
-                expr_release(right);
-                return result;
-            } else {
-                Expr* result = expr_mul(left, right);
-                return result;
+bool expr_ode_init(ExprODE* ode, ExprArena* arena, const ExprIndex* rhs, const char* const* states, size_t n,
+                   const char* time) {
+    // variables are (t, y_0 .. y_{n-1}) on both tapes
+    const char** vars = (const char**)malloc((n + 1) * sizeof(char*));
+    ExprIndex* outputs = (ExprIndex*)malloc((n + 1) * (n + 1) * sizeof(ExprIndex));
+    if (!vars || !outputs) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    vars[0] = time;
+    for (size_t i = 0; i < n; i++) vars[i + 1] = states[i];
+
+    ode->n = n;
+    ode->steps = ode->rejected = 0;
+    bool ok = expr_tape_compile(&ode->rhs, arena, rhs, n, vars, n + 1);
+    if (ok) {
+        // f, df/dt, then the Jacobian row by row
+        ExprIndex zero = expr_number(arena, "0");
+        for (size_t i = 0; i < n; i++) {
+            outputs[i] = rhs[i];
+            outputs[n + i] = time ? expr_simplify(arena, expr_differentiate(arena, rhs[i], time)) : zero;
+            for (size_t j = 0; j < n; j++) {
+                outputs[2 * n + i * n + j] = expr_simplify(arena, expr_differentiate(arena, rhs[i], states[j]));
             }
         }
+        ok = expr_tape_compile(&ode->jac, arena, outputs, n * (n + 2), vars, n + 1);
+        if (!ok) expr_tape_clear(&ode->rhs);
+    }
+    free(vars);
+    free(outputs);
+    if (!ok) return false;
+
+    ode->x = expr_ode_alloc(n + 1);
+    ode->work = expr_ode_alloc(n * (2 * n + 9));
+    ode->pivots = (size_t*)malloc((n + 1) * sizeof(size_t));
+    if (!ode->pivots) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    return true;
+}
 
-        case EXPR_POW: {
-            Expr* base = expr_eval(e->data.binop.left, symbol_name, value_str);
-            Expr* exponent = expr_eval(e->data.binop.right, symbol_name, value_str);
+void expr_ode_clear(ExprODE* ode) {
+    expr_tape_clear(&ode->rhs);
+    expr_tape_clear(&ode->jac);
+    free(ode->x);
+    free(ode->work);
+    free(ode->pivots);
+    ode->x = ode->work = NULL;
+    ode->pivots = NULL;
+    ode->n = 0;
+}
 
-            // For now, we keep powers symbolic
-            Expr* result = expr_pow(base, exponent);
-            return result;
-        }
+static void expr_ode_f(ExprODE* ode, double t, const double* y, double* f) {
+    ode->x[0] = t;
+    memcpy(ode->x + 1, y, ode->n * sizeof(double));
+    expr_tape_eval(&ode->rhs, ode->x, f);
+}
 
-        case EXPR_FUNC: {
-            Expr* arg = expr_eval(e->data.func.arg, symbol_name, value_str);
+// Weighted RMS norm of the local error estimate.
+static double expr_ode_error(size_t n, const double* err, const double* y0, const double* y1, double rtol, double atol) {
+    double sum = 0.0;
+    for (size_t i = 0; i < n; i++) {
+        double scale = atol + rtol * fmax(fabs(y0[i]), fabs(y1[i]));
+        double e = err[i] / scale;
+        sum += e * e;
+    }
+    return n ? sqrt(sum / (double)n) : 0.0;
+}
 
-        if (arg->type == EXPR_NUMBER) {
-            double x = mpq_get_d(arg->data.value);
-            double result_val;
+// Initial step from the scale of y and f (Hairer, Norsett, Wanner).
+static double expr_ode_first_step(size_t n, const double* y, const double* f, double span, double rtol, double atol) {
+    double d0 = 0.0, d1 = 0.0;
+    for (size_t i = 0; i < n; i++) {
+        double scale = atol + rtol * fabs(y[i]);
+        d0 += (y[i] / scale) * (y[i] / scale);
+        d1 += (f[i] / scale) * (f[i] / scale);
+    }
+    double h = (d0 < 1e-10 || d1 < 1e-10) ? 1e-6 : 0.01 * sqrt(d0 / d1);
+    return fmin(h, fabs(span));
+}
 
-            switch (e->data.func.func) {
-                case FUNC_SIN: result_val = sin(x); break;
-                case FUNC_COS: result_val = cos(x); break;
-                case FUNC_EXP: result_val = exp(x); break;
-                case FUNC_LOG: result_val = log(x); break;
-                default:
-                    fprintf(stderr, "Unsupported function type: %d\n", e->data.func.func);
-                    exit(1);
+// Dormand-Prince 5(4) tableau.
+static const double expr_dp_c[7] = { 0.0, 1.0 / 5, 3.0 / 10, 4.0 / 5, 8.0 / 9, 1.0, 1.0 };
+static const double expr_dp_a[7][6] = {
+    { 0 },
+    { 1.0 / 5 },
+    { 3.0 / 40, 9.0 / 40 },
+    { 44.0 / 45, -56.0 / 15, 32.0 / 9 },
+    { 19372.0 / 6561, -25360.0 / 2187, 64448.0 / 6561, -212.0 / 729 },
+    { 9017.0 / 3168, -355.0 / 33, 46732.0 / 5247, 49.0 / 176, -5103.0 / 18656 },
+    { 35.0 / 384, 0.0, 500.0 / 1113, 125.0 / 192, -2187.0 / 6784, 11.0 / 84 },
+};
+// fifth minus fourth order weights
+static const double expr_dp_e[7] = {
+    71.0 / 57600, 0.0, -71.0 / 16695, 71.0 / 1920, -17253.0 / 339200, 22.0 / 525, -1.0 / 40
+};
+
+bool expr_ode_rk45(ExprODE* ode, double t0, double t1, double* y, double rtol, double atol) {
+    size_t n = ode->n;
+    double* k[7];
+    for (int s = 0; s < 7; s++) k[s] = ode->work + (size_t)s * n;
+    double* ynew = ode->work + 7 * n;
+    double* err = ode->work + 8 * n;
+
+    ode->steps = ode->rejected = 0;
+    double dir = t1 >= t0 ? 1.0 : -1.0, t = t0;
+    expr_ode_f(ode, t, y, k[0]);
+    double h = expr_ode_first_step(n, y, k[0], t1 - t0, rtol, atol);
+
+    while (dir * (t1 - t) > 0.0) {
+        if (ode->steps + ode->rejected >= EXPR_ODE_MAX_STEPS) return false;
+        if (h > fabs(t1 - t)) h = fabs(t1 - t);
+        if (h < 1e-14 * fmax(fabs(t), 1.0)) return false;
+        double hs = dir * h;
+
+        for (int s = 1; s < 7; s++) {
+            for (size_t i = 0; i < n; i++) {
+                double acc = y[i];
+                for (int j = 0; j < s; j++) acc += hs * expr_dp_a[s][j] * k[j][i];
+                ynew[i] = acc;
             }
-
-            Expr* result = malloc(sizeof(Expr));
-            result->type = EXPR_NUMBER;
-            result->refcount = 1;
-            mpq_init(result->data.value);
-            mpq_set_d(result->data.value, result_val); // approximate
-            expr_release(arg);
-            return result;
+            expr_ode_f(ode, t + expr_dp_c[s] * hs, ynew, k[s]);
         }
-
-            Expr* result = expr_func(e->data.func.func, arg);
-            return result;
+        // ynew holds the fifth order solution after the last stage
+        for (size_t i = 0; i < n; i++) {
+            double e = 0.0;
+            for (int s = 0; s < 7; s++) e += expr_dp_e[s] * k[s][i];
+            err[i] = hs * e;
         }
-
-        default:
-            fprintf(stderr, "Unknown expression type in expr_eval.\n");
-            exit(1);
+        double norm = expr_ode_error(n, err, y, ynew, rtol, atol);
+        if (!isfinite(norm)) {
+            h *= 0.2;
+            ode->rejected++;
+            continue;
+        }
+        if (norm <= 1.0) {
+            t = (fabs(t1 - t) <= h) ? t1 : t + hs;
+            memcpy(y, ynew, n * sizeof(double));
+            memcpy(k[0], k[6], n * sizeof(double)); // first same as last
+            ode->steps++;
+        } else {
+            ode->rejected++;
+        }
+        h *= fmin(5.0, fmax(0.2, 0.9 * pow(fmax(norm, 1e-10), -0.2)));
     }
+    return true;
 }
-*/
-double expr_eval_numeric(ExprArena* a, ExprIndex idx) {
-    Expr* e = expr_at(a,idx);
-    if (!e) {
-        fprintf(stderr, "expr_eval_numeric called with NULL expression.\n");
-        exit(1);
-    }
-    
 
-    switch (e->type) {
-        
-        case EXPR_NUMBER:
-            return mpq_get_d(e->data.value);
+// LU with partial pivoting in place, false if singular.
+static bool expr_ode_lu(double* m, size_t* piv, size_t n) {
+    for (size_t c = 0; c < n; c++) {
+        size_t p = c;
+        for (size_t r = c + 1; r < n; r++) {
+            if (fabs(m[r * n + c]) > fabs(m[p * n + c])) p = r;
+        }
+        if (m[p * n + c] == 0.0) return false;
+        piv[c] = p;
+        if (p != c) {
+            for (size_t j = 0; j < n; j++) {
+                double s = m[c * n + j];
+                m[c * n + j] = m[p * n + j];
+                m[p * n + j] = s;
+            }
+        }
+        for (size_t r = c + 1; r < n; r++) {
+            double l = m[r * n + c] /= m[c * n + c];
+            for (size_t j = c + 1; j < n; j++) m[r * n + j] -= l * m[c * n + j];
+        }
+    }
+    return true;
+}
 
-        case EXPR_SYMBOL:
-            fprintf(stderr, "Cannot evaluate expression with free symbol: %s\n", e->data.name);
-            exit(1);
+static void expr_ode_lu_solve(const double* m, const size_t* piv, size_t n, double* b) {
+    for (size_t c = 0; c < n; c++) {
+        double s = b[c];
+        b[c] = b[piv[c]];
+        b[piv[c]] = s;
+        for (size_t r = c + 1; r < n; r++) b[r] -= m[r * n + c] * b[c];
+    }
+    for (size_t c = n; c-- > 0;) {
+        for (size_t j = c + 1; j < n; j++) b[c] -= m[c * n + j] * b[j];
+        b[c] /= m[c * n + c];
+    }
+}
 
-        case EXPR_ADD: {
-            double left  = expr_eval_numeric(a, expr_left(a,idx) );
-            double right = expr_eval_numeric(a, expr_right(a,idx));
-            return left + right;
+bool expr_ode_rosenbrock(ExprODE* ode, double t0, double t1, double* y, double rtol, double atol) {
+    // Shampine and Reichelt's ode23s: one LU of W = I - h d J per step and
+    // three linear solves, with no Newton iteration.
+    size_t n = ode->n;
+    const double d = 1.0 / (2.0 + sqrt(2.0)), e32 = 6.0 + sqrt(2.0);
+    double* fj = ode->work;                 // f, df/dt, J
+    double* w = ode->work + n * (n + 2);    // n * n
+    double* k1 = w + n * n;
+    double* k2 = k1 + n;
+    double* k3 = k2 + n;
+    double* f1 = k3 + n;
+    double* f2 = f1 + n;
+    double* ynew = f2 + n;
+    double* err = ynew + n;
+    const double* f0 = fj;
+    const double* dfdt = fj + n;
+    const double* jac = fj + 2 * n;
+
+    ode->steps = ode->rejected = 0;
+    double dir = t1 >= t0 ? 1.0 : -1.0, t = t0;
+    ode->x[0] = t;
+    memcpy(ode->x + 1, y, n * sizeof(double));
+    expr_tape_eval(&ode->jac, ode->x, fj);
+    double h = expr_ode_first_step(n, y, f0, t1 - t0, rtol, atol);
+
+    while (dir * (t1 - t) > 0.0) {
+        if (ode->steps + ode->rejected >= EXPR_ODE_MAX_STEPS) return false;
+        if (h > fabs(t1 - t)) h = fabs(t1 - t);
+        if (h < 1e-14 * fmax(fabs(t), 1.0)) return false;
+        double hs = dir * h;
+
+        for (size_t i = 0; i < n * n; i++) w[i] = -hs * d * jac[i];
+        for (size_t i = 0; i < n; i++) w[i * n + i] += 1.0;
+        if (!expr_ode_lu(w, ode->pivots, n)) {
+            h *= 0.5;
+            ode->rejected++;
+            continue;
         }
 
-        case EXPR_MUL: {
-            double left  = expr_eval_numeric(a, expr_left(a,idx) );
-            double right = expr_eval_numeric(a, expr_right(a,idx));
-            return left * right;
+        for (size_t i = 0; i < n; i++) k1[i] = f0[i] + hs * d * dfdt[i];
+        expr_ode_lu_solve(w, ode->pivots, n, k1);
+        for (size_t i = 0; i < n; i++) ynew[i] = y[i] + 0.5 * hs * k1[i];
+        expr_ode_f(ode, t + 0.5 * hs, ynew, f1);
+        for (size_t i = 0; i < n; i++) k2[i] = f1[i] - k1[i];
+        expr_ode_lu_solve(w, ode->pivots, n, k2);
+        for (size_t i = 0; i < n; i++) {
+            k2[i] += k1[i];
+            ynew[i] = y[i] + hs * k2[i];
+        }
+        expr_ode_f(ode, t + hs, ynew, f2);
+        for (size_t i = 0; i < n; i++) {
+            k3[i] = f2[i] - e32 * (k2[i] - f1[i]) - 2.0 * (k1[i] - f0[i]) + hs * d * dfdt[i];
         }
+        expr_ode_lu_solve(w, ode->pivots, n, k3);
+        for (size_t i = 0; i < n; i++) err[i] = hs / 6.0 * (k1[i] - 2.0 * k2[i] + k3[i]);
+
+        double norm = expr_ode_error(n, err, y, ynew, rtol, atol);
+        if (isfinite(norm) && norm <= 1.0) {
+            t = (fabs(t1 - t) <= h) ? t1 : t + hs;
+            memcpy(y, ynew, n * sizeof(double));
+            ode->x[0] = t;
+            memcpy(ode->x + 1, y, n * sizeof(double));
+            expr_tape_eval(&ode->jac, ode->x, fj);
+            ode->steps++;
+        } else {
+            ode->rejected++;
+        }
+        if (!isfinite(norm)) norm = 1e10;
+        h *= fmin(5.0, fmax(0.2, 0.8 * pow(fmax(norm, 1e-10), -1.0 / 3.0)));
+    }
+    return true;
+}
 
-        case EXPR_POW: {
-            double base     = expr_eval_numeric(a, expr_left(a,idx) );
-            double exponent = expr_eval_numeric(a, expr_right(a,idx));
-            return pow(base, exponent);
+bool expr_ode_rk45_batch(ExprODE* ode, double t0, double t1, double* y, size_t count, double rtol, double atol) {
+    // All trajectories share t and h, so every stage is one batched tape
+    // evaluation; the step is set by the worst trajectory.
+    size_t n = ode->n, nc = n * count;
+    double* x = expr_ode_alloc(nc + count);  // t row, then the states
+    double* buf = expr_ode_alloc(9 * nc);
+    double* k[7];
+    for (int s = 0; s < 7; s++) k[s] = buf + (size_t)s * nc;
+    double* ynew = buf + 7 * nc;
+    double* err = buf + 8 * nc;
+    double* col = expr_ode_alloc(4 * n);     // one trajectory, unstrided
+    bool ok = true;
+
+    ode->steps = ode->rejected = 0;
+    double dir = t1 >= t0 ? 1.0 : -1.0, t = t0;
+    for (size_t j = 0; j < count; j++) x[j] = t;
+    memcpy(x + count, y, nc * sizeof(double));
+    expr_tape_eval_batch(&ode->rhs, x, count, k[0]);
+    double h = fabs(t1 - t0);
+    for (size_t j = 0; j < count; j++) {
+        for (size_t i = 0; i < n; i++) {
+            col[i] = y[i * count + j];
+            col[n + i] = k[0][i * count + j];
         }
+        h = fmin(h, expr_ode_first_step(n, col, col + n, t1 - t0, rtol, atol));
+    }
 
-        case EXPR_FUNC: {
-            double arg_val = expr_eval_numeric(a, expr_arg(a,idx));
-            switch (e->data.func.func) {
-                case FUNC_SIN: return sin(arg_val);
-                case FUNC_COS: return cos(arg_val);
-                case FUNC_EXP: return exp(arg_val);
-                case FUNC_LOG: return log(arg_val);
-                default:
-                    fprintf(stderr, "Unknown function in expr_eval_numeric.\n");
-                    exit(1);
+    while (ok && dir * (t1 - t) > 0.0) {
+        if (ode->steps + ode->rejected >= EXPR_ODE_MAX_STEPS || h < 1e-14 * fmax(fabs(t), 1.0)) {
+            ok = false;
+            break;
+        }
+        if (h > fabs(t1 - t)) h = fabs(t1 - t);
+        double hs = dir * h;
+
+        for (int s = 1; s < 7; s++) {
+            for (size_t j = 0; j < count; j++) x[j] = t + expr_dp_c[s] * hs;
+            for (size_t i = 0; i < nc; i++) {
+                double acc = y[i];
+                for (int r = 0; r < s; r++) acc += hs * expr_dp_a[s][r] * k[r][i];
+                x[count + i] = acc;
             }
+            expr_tape_eval_batch(&ode->rhs, x, count, k[s]);
         }
-
-        default:
-            fprintf(stderr, "Unknown expression type in expr_eval_numeric.\n");
-            exit(1);
+        memcpy(ynew, x + count, nc * sizeof(double));
+        for (size_t i = 0; i < nc; i++) {
+            double e = 0.0;
+            for (int s = 0; s < 7; s++) e += expr_dp_e[s] * k[s][i];
+            err[i] = hs * e;
+        }
+        double norm = 0.0;
+        for (size_t j = 0; j < count; j++) {
+            for (size_t i = 0; i < n; i++) {
+                col[i] = err[i * count + j];
+                col[n + i] = y[i * count + j];
+                col[2 * n + i] = ynew[i * count + j];
+            }
+            // fmax drops a NaN, so a diverging trajectory must reject the step itself
+            double e = expr_ode_error(n, col, col + n, col + 2 * n, rtol, atol);
+            if (!isfinite(e)) {
+                norm = INFINITY;
+                break;
+            }
+            norm = fmax(norm, e);
+        }
+        if (isfinite(norm) && norm <= 1.0) {
+            t = (fabs(t1 - t) <= h) ? t1 : t + hs;
+            memcpy(y, ynew, nc * sizeof(double));
+            memcpy(k[0], k[6], nc * sizeof(double));
+            ode->steps++;
+        } else {
+            ode->rejected++;
+        }
+        if (!isfinite(norm)) norm = 1e10;
+        h *= fmin(5.0, fmax(0.2, 0.9 * pow(fmax(norm, 1e-10), -0.2)));
     }
-            
+
+    free(x);
+    free(buf);
+    free(col);
+    return ok;
 }
 
-ExprIndex expr_differentiate(ExprArena* a, ExprIndex idx, const char* var_name) {
-    Expr* e = expr_at(a, idx);
-    if (!e) return INVALID_INDEX;
+//-----------------------------------------------
+// Least-squares fitting
+//-----------------------------------------------
 
-    switch (e->type) {
-        case EXPR_NUMBER:
-            return expr_number(a, "0");
+// Everything one pass over the data needs. The tape computes the model and
+// its gradient in the parameters.
+typedef struct {
+    ExprTape* tape;
+    const ExprDataset* data;
+    size_t np;
+    const double* p;   // parameters to evaluate at
+    double* jtj;       // np * np, upper triangle filled
+    double* jtr;       // np
+    double cost;       // sum of squared residuals
+} ExprFitPass;
+
+// Neumaier summation. Over millions of rows a plain running sum loses more
+// than the relative cost decrease the convergence test looks for.
+static inline void expr_sum_add(double* sum, double* comp, double x) {
+    double t = *sum + x;
+    *comp += fabs(*sum) >= fabs(x) ? (*sum - t) + x : (x - t) + *sum;
+    *sum = t;
+}
 
-        case EXPR_SYMBOL:
-            if (strcmp(e->data.name, var_name) == 0) {
-                return expr_number(a,"1");
-            } else {
-                return expr_number(a,"0");
+// Accumulates J^T J, J^T r and r^T r over rows [begin, end) into the given
+// sums, using lanes (from expr_tape_alloc_lanes) as scratch. Each block is
+// summed directly and the block sums are added with compensation.
+static void expr_fit_chunk(const ExprFitPass* s, size_t begin, size_t end, double* lanes,
+                           double* jtj, double* jtr, double* cost) {
+    const ExprTape* t = s->tape;
+    const ExprDataset* d = s->data;
+    size_t np = s->np;
+    // parameters are broadcast once, data columns are read in place
+    double* bcast = (double*)malloc((np + 1) * EXPR_TAPE_LANES * sizeof(double));
+    const double** vars = (const double**)malloc((t->nvars + 1) * sizeof(double*));
+    const double** grad = (const double**)malloc((np + 1) * sizeof(double*));
+    double* r = (double*)malloc(EXPR_TAPE_LANES * sizeof(double));
+    // running sums and their compensations: J^T J, J^T r, cost
+    size_t nsums = np * np + np + 1;
+    double* sums = (double*)calloc(2 * nsums, sizeof(double));
+    if (!bcast || !vars || !grad || !r || !sums) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    for (size_t k = 0; k < np; k++) {
+        for (size_t j = 0; j < EXPR_TAPE_LANES; j++) bcast[k * EXPR_TAPE_LANES + j] = s->p[k];
+        vars[k] = bcast + k * EXPR_TAPE_LANES;
+        grad[k] = lanes + t->outputs[k + 1] * EXPR_TAPE_LANES;
+    }
+    const double* model = lanes + t->outputs[0] * EXPR_TAPE_LANES;
+
+    double* comp = sums + nsums;
+    for (size_t base = begin; base < end; base += EXPR_TAPE_LANES) {
+        size_t w = end - base < EXPR_TAPE_LANES ? end - base : EXPR_TAPE_LANES;
+        for (size_t k = 0; k < d->ncolumns; k++) vars[np + k] = d->data[k] + base;
+        expr_tape_run_block(t, lanes, vars, w);
+        double c = 0.0;
+        for (size_t j = 0; j < w; j++) {
+            r[j] = model[j] - d->y[base + j];
+            c += r[j] * r[j];
+        }
+        expr_sum_add(&sums[nsums - 1], &comp[nsums - 1], c);
+        for (size_t a = 0; a < np; a++) {
+            double g = 0.0;
+            for (size_t j = 0; j < w; j++) g += grad[a][j] * r[j];
+            expr_sum_add(&sums[np * np + a], &comp[np * np + a], g);
+            for (size_t b = a; b < np; b++) {
+                double h = 0.0;
+                for (size_t j = 0; j < w; j++) h += grad[a][j] * grad[b][j];
+                expr_sum_add(&sums[a * np + b], &comp[a * np + b], h);
             }
+        }
+    }
+    for (size_t k = 0; k < np * np; k++) jtj[k] += sums[k] + comp[k];
+    for (size_t k = 0; k < np; k++) jtr[k] += sums[np * np + k] + comp[np * np + k];
+    *cost += sums[nsums - 1] + comp[nsums - 1];
+    free(sums);
+    free(bcast);
+    free(vars);
+    free(grad);
+    free(r);
+}
 
-        case EXPR_ADD: {
-            ExprIndex left = expr_differentiate(a,e->data.binop.left, var_name);
-            ExprIndex right = expr_differentiate(a,e->data.binop.right, var_name);
-            return expr_add(a,left, right);
+static void expr_fit_pass_serial(ExprFitPass* s, void* ctx) {
+    (void)ctx;
+    memset(s->jtj, 0, s->np * s->np * sizeof(double));
+    memset(s->jtr, 0, s->np * sizeof(double));
+    s->cost = 0.0;
+    if (!s->tape->lanes) s->tape->lanes = expr_tape_alloc_lanes(s->tape);
+    expr_fit_chunk(s, 0, s->data->rows, s->tape->lanes, s->jtj, s->jtr, &s->cost);
+}
+
+// In place Cholesky solve of a x = b for symmetric a (upper triangle used),
+// false if a is not positive definite.
+static bool expr_fit_cholesky(double* a, double* b, size_t n) {
+    for (size_t j = 0; j < n; j++) {
+        double d = a[j * n + j];
+        for (size_t k = 0; k < j; k++) d -= a[k * n + j] * a[k * n + j];
+        if (!(d > 0.0)) return false;
+        d = sqrt(d);
+        a[j * n + j] = d;
+        for (size_t i = j + 1; i < n; i++) {
+            double v = a[j * n + i];
+            for (size_t k = 0; k < j; k++) v -= a[k * n + j] * a[k * n + i];
+            a[j * n + i] = v / d;
         }
+    }
+    // a = U^T U: forward then back substitution
+    for (size_t i = 0; i < n; i++) {
+        for (size_t k = 0; k < i; k++) b[i] -= a[k * n + i] * b[k];
+        b[i] /= a[i * n + i];
+    }
+    for (size_t i = n; i-- > 0;) {
+        for (size_t k = i + 1; k < n; k++) b[i] -= a[i * n + k] * b[k];
+        b[i] /= a[i * n + i];
+    }
+    return true;
+}
 
-        case EXPR_MUL: {
-            ExprIndex f = e->data.binop.left;
-            ExprIndex g = e->data.binop.right;
+static bool expr_fit_run(ExprArena* arena, ExprIndex model, const char* const* params, size_t np,
+                         const ExprDataset* data, double* p, double tol,
+                         void (*pass)(ExprFitPass* s, void* ctx), void* ctx) {
+    // tape variables: parameters, then data columns; outputs: model, gradient
+    const char** vars = (const char**)malloc((np + data->ncolumns + 1) * sizeof(char*));
+    ExprIndex* outputs = (ExprIndex*)malloc((np + 1) * sizeof(ExprIndex));
+    if (!vars || !outputs) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    for (size_t k = 0; k < np; k++) vars[k] = params[k];
+    for (size_t k = 0; k < data->ncolumns; k++) vars[np + k] = data->columns[k];
+    outputs[0] = model;
+    bool ok = true;
+    for (size_t k = 0; k < np && ok; k++) {
+        ExprIndex d = expr_differentiate(arena, model, params[k]);
+        ok = d != INVALID_INDEX;
+        if (ok) outputs[k + 1] = expr_simplify(arena, d);
+    }
 
-            ExprIndex df = expr_differentiate(a,f, var_name);
-            ExprIndex dg = expr_differentiate(a,g, var_name);
+    ExprTape tape;
+    if (ok) ok = expr_tape_compile(&tape, arena, outputs, np + 1, vars, np + data->ncolumns);
+    free(vars);
+    free(outputs);
+    if (!ok) return false;
 
-            ExprIndex left_term = expr_mul(a,df, g);
-            ExprIndex right_term = expr_mul(a,f, dg);
+    // cur holds the sums at p, trial those at the candidate p + step
+    double* buf = (double*)malloc((3 * np * np + 5 * np + 1) * sizeof(double));
+    if (!buf) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    ExprFitPass cur, trial;
+    cur.tape = trial.tape = &tape;
+    cur.data = trial.data = data;
+    cur.np = trial.np = np;
+    cur.jtj = buf;
+    trial.jtj = buf + np * np;
+    double* m = buf + 2 * np * np;
+    cur.jtr = m + np * np;
+    trial.jtr = cur.jtr + np;
+    double* step = trial.jtr + np;
+    double* pnew = step + np;
+    double* scale = pnew + np;
+
+    cur.p = p;
+    trial.p = pnew;
+    pass(&cur, ctx);
+    double lambda = 1e-3;
+    bool converged = false;
+    // a model that is not finite at the starting point has nothing to descend
+    for (int iter = 0; iter < EXPR_FIT_MAX_ITER && !converged && isfinite(cur.cost); iter++) {
+        if (cur.cost == 0.0) {
+            converged = true;
+            break;
+        }
+        // The undamped Gauss-Newton step bounds what any step can gain,
+        // jtr . (J^T J)^-1 jtr. Near the minimum actual decreases are at
+        // rounding level, so this, not the observed decrease, decides.
+        memcpy(m, cur.jtj, np * np * sizeof(double));
+        memcpy(step, cur.jtr, np * sizeof(double));
+        if (expr_fit_cholesky(m, step, np)) {
+            double gain = 0.0;
+            for (size_t k = 0; k < np; k++) gain += step[k] * cur.jtr[k];
+            if (gain <= tol * cur.cost) {
+                converged = true;
+                break;
+            }
+        }
 
-            return expr_add(a, left_term, right_term);
+        // Marquardt: damp with the diagonal of J^T J
+        for (size_t k = 0; k < np; k++) scale[k] = fmax(cur.jtj[k * np + k], 1e-300);
+        bool accepted = false;
+        while (!accepted && lambda < 1e16) {
+            memcpy(m, cur.jtj, np * np * sizeof(double));
+            for (size_t k = 0; k < np; k++) {
+                m[k * np + k] += lambda * scale[k];
+                step[k] = -cur.jtr[k];
+            }
+            if (!expr_fit_cholesky(m, step, np)) {
+                lambda *= 10.0;
+                continue;
+            }
+            for (size_t k = 0; k < np; k++) pnew[k] = p[k] + step[k];
+            pass(&trial, ctx);
+            if (!(isfinite(trial.cost) && trial.cost < cur.cost)) {
+                lambda *= 10.0;
+                continue;
+            }
+            accepted = true;
+            double pnorm = 0.0, snorm = 0.0;
+            for (size_t k = 0; k < np; k++) {
+                pnorm += p[k] * p[k];
+                snorm += step[k] * step[k];
+            }
+            converged = sqrt(snorm) <= tol * (sqrt(pnorm) + tol);
+            memcpy(p, pnew, np * sizeof(double));
+            double* swap = cur.jtj;
+            cur.jtj = trial.jtj;
+            trial.jtj = swap;
+            swap = cur.jtr;
+            cur.jtr = trial.jtr;
+            trial.jtr = swap;
+            cur.cost = trial.cost;
+            lambda = fmax(lambda / 10.0, 1e-12);
+        }
+        // no amount of damping reduces the cost: stationary to working precision
+        if (!accepted) {
+            converged = isfinite(cur.cost);
+            break;
         }
+    }
 
+    free(buf);
+    expr_tape_clear(&tape);
+    return converged;
+}
 
-        case EXPR_POW: {
-            ExprIndex base = e->data.binop.left;
-            ExprIndex exponent = e->data.binop.right;
+bool expr_fit(ExprArena* arena, ExprIndex model, const char* const* params, size_t nparams,
+              const ExprDataset* data, double* p, double tol) {
+    return expr_fit_run(arena, model, params, nparams, data, p, tol, expr_fit_pass_serial, NULL);
+}
 
-            if (expr_type(a,exponent) == EXPR_NUMBER &&
-                expr_type(a,base) == EXPR_SYMBOL &&
-                strcmp(expr_name(a,base), var_name) == 0) {
-                // d/dx x^n = n * x^(n-1)
-                mpq_t new_exp;
-                mpq_init(new_exp);
+#ifdef CYMCALC_THREADS
+//-----------------------------------------------
+// Parallelism
+//-----------------------------------------------
 
-                mpq_t one;
-                mpq_init(one);
-                mpq_set_ui(one, 1, 1);
+#include <sched.h>
+#include <unistd.h>
 
-                mpq_sub(new_exp, *expr_value(a,exponent), one);
+static __thread int expr_pool_worker = -1;
 
-                ExprIndex new_exp_idx = expr_number_mpq(a, new_exp);
-                mpq_clear(new_exp);
+int expr_pool_worker_index(void) {
+    return expr_pool_worker;
+}
 
-                ExprIndex x_pow_n_minus_1 = expr_pow(a, base, new_exp_idx);
-                ExprIndex coeff_n = expr_number_mpq(a, *expr_value(a,exponent));
+static bool expr_deque_push(ExprDeque* d, ExprTask* task) {
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+    long t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    if (b - t >= EXPR_DEQUE_SIZE) return false;
+    __atomic_store_n(&d->tasks[b % EXPR_DEQUE_SIZE], task, __ATOMIC_RELAXED);
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+static ExprTask* expr_deque_pop(ExprDeque* d) {
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+    if (t > b) {
+        // empty
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    ExprTask* task = __atomic_load_n(&d->tasks[b % EXPR_DEQUE_SIZE], __ATOMIC_RELAXED);
+    if (t == b) {
+        // last task, race against thieves for it
+        if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, false,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            task = NULL;
+        }
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+    return task;
+}
+
+static ExprTask* expr_deque_steal(ExprDeque* d) {
+    long t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+    if (t >= b) return NULL;
+    ExprTask* task = __atomic_load_n(&d->tasks[t % EXPR_DEQUE_SIZE], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, false,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        return NULL;
+    }
+    return task;
+}
 
-                return expr_mul(a, coeff_n, x_pow_n_minus_1);
+static void expr_task_execute(ExprTask* task) {
+    task->run(task);
+    __atomic_store_n(&task->done, 1, __ATOMIC_RELEASE);
+}
 
+// Pops local work first, then tries every other worker once.
+static bool expr_pool_work_once(ExprPool* pool, int self) {
+    ExprTask* task = expr_deque_pop(&pool->deques[self]);
+    for (int i = 1; !task && i < pool->worker_count; i++) {
+        task = expr_deque_steal(&pool->deques[(self + i) % pool->worker_count]);
+    }
+    if (!task) return false;
+    expr_task_execute(task);
+    return true;
+}
 
-            } else {
-                fprintf(stderr, "Power rule for general expressions not implemented yet.\n");
-                return INVALID_INDEX;
-            }
+typedef struct {
+    ExprPool* pool;
+    int self;
+} ExprPoolStart;
+
+static void* expr_pool_thread(void* arg) {
+    ExprPoolStart start = *(ExprPoolStart*)arg;
+    free(arg);
+    ExprPool* pool = start.pool;
+    expr_pool_worker = start.self;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->stop && !__atomic_load_n(&pool->active, __ATOMIC_ACQUIRE)) {
+            pthread_cond_wait(&pool->wake, &pool->lock);
         }
+        bool stop = pool->stop;
+        pthread_mutex_unlock(&pool->lock);
+        if (stop) break;
 
-        case EXPR_FUNC: {
-            ExprIndex u = e->data.func.arg;
-            ExprIndex du = expr_differentiate(a,u, var_name);
+        while (__atomic_load_n(&pool->active, __ATOMIC_ACQUIRE)) {
+            if (!expr_pool_work_once(pool, start.self)) sched_yield();
+        }
+    }
+    return NULL;
+}
 
-            switch (e->data.func.func) {
-                case FUNC_SIN: {
-                    ExprIndex cos_u = expr_func(a, FUNC_COS, u);
-                    return expr_mul(a, cos_u, du);
-                }
-                case FUNC_COS: {
-                    ExprIndex sin_u = expr_func(a, FUNC_SIN, u);
-                    ExprIndex neg_sin_u = expr_mul(a,expr_number(a,"-1"), sin_u);
-                    return expr_mul(a,neg_sin_u, du);
-                }
-                case FUNC_EXP: {
-                    ExprIndex exp_u = expr_func(a,FUNC_EXP, u);
-                    return expr_mul(a,exp_u, du);
-                }
-                case FUNC_LOG: {
-                    ExprIndex reiprocal = expr_pow(a,u, expr_number(a,"-1"));
-                    return expr_mul(a,reiprocal, du);
-                }
-                default:
-                    fprintf(stderr, "Unknown function in differentiation.\n");
-                    exit(1);
-            }
+void expr_pool_init(ExprPool* pool, int workers) {
+    if (workers <= 0) {
+#ifdef _SC_NPROCESSORS_ONLN
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = cpus > 0 ? (int)cpus : 1;
+#else
+        workers = 4;
+#endif
+    }
+    pool->worker_count = workers;
+    pool->active = 0;
+    pool->stop = 0;
+    pool->deques = (ExprDeque*)calloc((size_t)workers, sizeof(ExprDeque));
+    pool->threads = (pthread_t*)calloc((size_t)workers, sizeof(pthread_t));
+    if (!pool->deques || !pool->threads) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    pool->arenas = NULL;
+    pool->copy_memo = NULL;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+
+    // Worker 0 is whichever thread calls expr_pool_run.
+    for (int i = 1; i < workers; i++) {
+        ExprPoolStart* start = (ExprPoolStart*)malloc(sizeof(ExprPoolStart));
+        if (!start) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
         }
-        default:
-            fprintf(stderr, "Unknown expression type in differentiation.\n");
-            expr_print_tree(a,idx);
+        start->pool = pool;
+        start->self = i;
+        if (pthread_create(&pool->threads[i], NULL, expr_pool_thread, start) != 0) {
+            fprintf(stderr, "expr_pool_init: failed to start worker %d\n", i);
             exit(1);
+        }
     }
 }
 
-ExprIndex expr_number_mpq(ExprArena* a, const mpq_t value) {
-    ExprIndex idx = expr_arena_alloc(a);
-    Expr* e = expr_at(a,idx);
-    e->type = EXPR_NUMBER;
-    mpq_init(e->data.value);
-    mpq_set(e->data.value, value);
-    return idx;
-}
-/*
-void mpq_add_ui(mpq_t rop, const mpq_t op1, unsigned long int op2) {
-    mpq_t temp;
-    mpq_init(temp);
-    mpq_set_ui(temp, op2, 1);
-    mpq_add(rop, op1, temp);
-    mpq_clear(temp);
+void expr_pool_destroy(ExprPool* pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 1; i < pool->worker_count; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->wake);
+    if (pool->arenas) {
+        for (int i = 0; i < pool->worker_count; i++) {
+            expr_arena_destroy(&pool->arenas[i]);
+        }
+    }
+    free(pool->arenas);
+    free(pool->copy_memo);
+    free(pool->threads);
+    free(pool->deques);
+    pool->arenas = NULL;
+    pool->copy_memo = NULL;
+    pool->threads = NULL;
+    pool->deques = NULL;
+    pool->worker_count = 0;
 }
-*/
-ExprIndex expr_integrate(ExprArena* a, const ExprIndex idx, const char* var_name){
-    Expr* e = expr_at(a,idx);
-    if (!e) return INVALID_INDEX;
 
-    switch (e->type) {
-        
-        case EXPR_NUMBER:
-            return expr_mul(a,idx,expr_symbol(a, var_name));
+void expr_pool_run(ExprPool* pool, ExprTask* root) {
+    int prev_worker = expr_pool_worker;
+    expr_pool_worker = 0;
 
-        case EXPR_SYMBOL:
-            if (strcmp(e->data.name, var_name) == 0) {
-                ExprIndex res = expr_mul(a,expr_number(a,"1/2"),expr_pow(a,expr_symbol(a,var_name), expr_number(a,"2")));
-                expr_print_tree(a,res);
-                return res;
-            } else {
-                return expr_mul(a,idx,expr_symbol(a,var_name));
-            }
+    pthread_mutex_lock(&pool->lock);
+    __atomic_store_n(&pool->active, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
 
-        case EXPR_ADD: {
-            ExprIndex left = expr_integrate(a,e->data.binop.left, var_name);
-            ExprIndex right = expr_integrate(a,e->data.binop.right, var_name);
-            return expr_add(a,left, right);
-        }
+    root->done = 0;
+    expr_task_execute(root);
 
-        case EXPR_MUL: {
-            ExprIndex f = e->data.binop.left;
-            ExprIndex g = e->data.binop.right;
+    __atomic_store_n(&pool->active, 0, __ATOMIC_RELEASE);
+    expr_pool_worker = prev_worker;
+}
 
-           /* if (expr_type(a,g) == EXPR_NUMBER) {
-                ExprIndex inner = expr_integrate(a, f, var_name);
-                return expr_mul(a,g, inner);
-            }*/
+void expr_pool_spawn(ExprPool* pool, ExprTask* task) {
+    task->done = 0;
+    if (expr_pool_worker < 0 || !expr_deque_push(&pool->deques[expr_pool_worker], task)) {
+        expr_task_execute(task);
+    }
+}
 
-            if (expr_type(a,f) == EXPR_NUMBER) {
-                ExprIndex inner = expr_integrate(a, g, var_name);
-                return expr_mul(a,f, inner);
-            }
+void expr_pool_join(ExprPool* pool, ExprTask* task) {
+    while (!__atomic_load_n(&task->done, __ATOMIC_ACQUIRE)) {
+        if (!expr_pool_work_once(pool, expr_pool_worker)) sched_yield();
+    }
+}
 
-            break; // product rule not implemented
+typedef struct {
+    ExprTask task;
+    ExprPool* pool;
+    ExprArena* arena;
+    ExprIndex input;
+    ExprIndex result;
+} ExprSimplifyTask;
+
+static ExprIndex expr_simplify_fork(ExprPool* pool, ExprArena* a, ExprIndex idx);
+
+static void expr_simplify_task_run(ExprTask* task) {
+    ExprSimplifyTask* t = (ExprSimplifyTask*)task;
+    t->result = expr_simplify_fork(t->pool, t->arena, t->input);
+}
 
-        }
+static ExprIndex expr_simplify_fork(ExprPool* pool, ExprArena* a, ExprIndex idx) {
+    ExprType type = expr_type(a, idx);
+    if ((type != EXPR_ADD && type != EXPR_MUL && type != EXPR_POW) ||
+        expr_size(a, idx) < EXPR_PARALLEL_THRESHOLD) {
+        return expr_simplify(a, idx);
+    }
+    // routed like expr_simplify, so whole polynomials are expanded before splitting
+    if (expr_expand_fits(a, idx)) {
+        EXPR_RULE_SCOPE(a, EXPR_RULE_EXPAND);
+        ExprIndex expanded = expr_expand(a, idx);
+        if (expanded != INVALID_INDEX) return expanded;
+    }
 
-        case EXPR_POW: {
-            ExprIndex base = e->data.binop.left;
-            ExprIndex exponent = e->data.binop.right;
-        
-            if (expr_type(a, exponent) == EXPR_NUMBER &&
-                expr_type(a, base) == EXPR_SYMBOL &&
-                strcmp(expr_name(a, base), var_name) == 0) {
-                
-                // Create one: 1/1
-                ExprIndex one = expr_number(a, "1");
-                
-                // new_exp = exponent + 1
-                ExprIndex new_exp = expr_add(a, exponent, one);
-                new_exp = expr_simplify(a, new_exp);
-                
-                // x^(n+1)
-                ExprIndex pow_expr = expr_pow(a, base, new_exp);
-                
-                // 1 / (n+1)
-                ExprIndex coeff = expr_div(a, one, new_exp);
-                
-                //expr_release(a, one);
-                //expr_release(a, new_exp);
-                
-                return expr_mul(a, coeff, pow_expr);
-            } else {
-                fprintf(stderr, "Power rule for general expressions not implemented yet.\n");
-                return INVALID_INDEX;
-            }
-        }
+    ExprSimplifyTask left;
+    left.task.run = expr_simplify_task_run;
+    left.pool = pool;
+    left.arena = a;
+    left.input = expr_left(a, idx);
+    left.result = INVALID_INDEX;
+    expr_pool_spawn(pool, &left.task);
+
+    ExprIndex right = expr_simplify_fork(pool, a, expr_right(a, idx));
+    expr_pool_join(pool, &left.task);
+
+    switch (type) {
+        case EXPR_ADD: return expr_simplify_add(a, left.result, right);
+        case EXPR_MUL: return expr_simplify_mul(a, left.result, right);
+        default:       return expr_simplify_pow(a, left.result, right);
+    }
+}
 
+ExprIndex expr_simplify_parallel(ExprPool* pool, ExprArena* arena, ExprIndex e) {
+    bool was_concurrent = arena->concurrent;
+    arena->concurrent = true;
 
-        case EXPR_FUNC: {
-            ExprIndex u = e->data.func.arg;
-            //Expr* du = expr_diff(u, var_name);
-            if (expr_type(a,u) == EXPR_SYMBOL && strcmp(expr_name(a,u), var_name) == 0) {
-                switch (e->data.func.func) {
-                    case FUNC_SIN: {
-                        ExprIndex cos_u = expr_func(a,FUNC_COS, u);
-                        ExprIndex neg_cos_u = expr_mul(a,expr_number(a,"-1"), cos_u);
-                        return neg_cos_u;
-                    }
-                    case FUNC_COS: {
-                        ExprIndex sin_u = expr_func(a,FUNC_SIN, u);
-                        return sin_u;
-                    }
-                    case FUNC_EXP: {
-                        ExprIndex exp_u = expr_func(a,FUNC_EXP, u);
-                        return exp_u;
-                    }
-                    case FUNC_LOG: {
-                        ExprIndex reiprocal = expr_pow(a,u, expr_number(a,"-1"));
-                        return reiprocal;
-                    }
-                    default:
-                        fprintf(stderr, "Unknown function in Integration.\n");
-                        exit(1);
-                }
-            }
+    ExprSimplifyTask root;
+    root.task.run = expr_simplify_task_run;
+    root.pool = pool;
+    root.arena = arena;
+    root.input = e;
+    root.result = INVALID_INDEX;
+    expr_pool_run(pool, &root.task);
 
-        }
+    arena->concurrent = was_concurrent;
+    return root.result;
+}
+typedef struct {
+    ExprPool* pool;
+    ExprArena* source;
+    const ExprJob* jobs;
+    size_t count;
+    size_t next;            // next unclaimed job
+    ExprJobCallback done;
+    void* ctx;
+} ExprBatch;
+
+typedef struct {
+    ExprTask task;
+    ExprBatch* batch;
+} ExprBatchTask;
+
+// Undoes the memo entries a copy of idx set, leaving the memo all
+// INVALID_INDEX again without touching the rest of it.
+static void expr_copy_forget(ExprArena* src, ExprIndex idx, ExprIndex* memo) {
+    if (memo[idx] == INVALID_INDEX) return;
+    memo[idx] = INVALID_INDEX;
+    Expr* e = expr_at(src, idx);
+    switch (e->type) {
+        case EXPR_ADD:
+        case EXPR_MUL:
+        case EXPR_POW:
+            expr_copy_forget(src, e->data.binop.left, memo);
+            expr_copy_forget(src, e->data.binop.right, memo);
+            break;
+        case EXPR_FUNC:
+            expr_copy_forget(src, e->data.func.arg, memo);
+            break;
+        case EXPR_DIFF:
+            expr_copy_forget(src, e->data.diff.inner, memo);
+            break;
+        case EXPR_INT:
+            expr_copy_forget(src, e->data.integral.inner, memo);
+            break;
+        default:
+            break;
+    }
+}
+
+// Worker arenas and memos are empty between jobs and are reset in time
+// proportional to the job, not to MAX_EXPR_COUNT.
+static void expr_batch_process(ExprBatch* batch, const ExprJob* job, int worker) {
+    ExprArena* arena = &batch->pool->arenas[worker];
+    ExprIndex* memo = batch->pool->copy_memo + (size_t)worker * MAX_EXPR_COUNT;
+    int mark = arena->free_count;
+    if (!expr_meta_child(batch->source, job->expr)) {
+        // not a node of the source arena
+        batch->done(job, arena, INVALID_INDEX, NULL, batch->ctx);
+        return;
+    }
 
+    arena->error = false;
+    ExprIndex e = expr_copy_impl(arena, batch->source, job->expr, memo);
+    ExprIndex result;
+    switch (job->op) {
+        case EXPR_JOB_SIMPLIFY:
+            result = expr_simplify(arena, e);
+            break;
+        case EXPR_JOB_DIFFERENTIATE:
+            result = expr_differentiate(arena, e, job->var);
+            break;
+        case EXPR_JOB_INTEGRATE:
+            result = expr_integrate(arena, e, job->var);
+            break;
         default:
-            fprintf(stderr, "Unknown expression type in Integration.\n");
-            expr_print_tree(a,idx);
+            fprintf(stderr, "Unknown job type in expr_batch_run: %d\n", job->op);
             exit(1);
     }
+    if (result != INVALID_INDEX && job->op != EXPR_JOB_SIMPLIFY &&
+        (job->options & EXPR_JOB_SIMPLIFY_RESULT)) {
+        result = expr_simplify(arena, result);
+    }
+    // a bug that reached expr_at fails this job only
+    if (arena->error) result = INVALID_INDEX;
 
-    fprintf(stderr, "Couldn't resolve integration for expression: ");
-    expr_print(a,idx);
-    fprintf(stderr, "\n");
-    return INVALID_INDEX;
+    char* text = NULL;
+    if (result != INVALID_INDEX && (job->options & EXPR_JOB_SERIALIZE)) {
+        text = expr_to_string(arena, result);
+    }
+    batch->done(job, arena, result, text, batch->ctx);
+    free(text);
+    expr_copy_forget(batch->source, job->expr, memo);
+    expr_arena_rewind(arena, mark);
 }
-/*
-Expr* expr_neg(const Expr* a) {
-    if (!a) return NULL;
 
-    if (a->type == EXPR_NUMBER) {
-        mpq_t neg_value;
-        mpq_init(neg_value);
-        mpq_neg(neg_value, a->data.value);
-        Expr* neg = expr_number_mpq(neg_value);
-        mpq_clear(neg_value);
-        return neg;
+static void expr_batch_drain(ExprTask* task) {
+    ExprBatch* batch = ((ExprBatchTask*)task)->batch;
+    int worker = expr_pool_worker_index();
+    for (;;) {
+        size_t i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED);
+        if (i >= batch->count) break;
+        expr_batch_process(batch, &batch->jobs[i], worker);
     }
+}
 
-    Expr* minus1 = expr_number("-1");
-    Expr* result = expr_mul(minus1, expr_retain(a));
-    expr_release(minus1);
-    return expr_simplify(result);
+typedef struct {
+    ExprTask task;
+    ExprBatch* batch;
+    ExprBatchTask* drains;
+} ExprBatchRoot;
+
+static void expr_batch_root(ExprTask* task) {
+    ExprBatchRoot* root = (ExprBatchRoot*)task;
+    ExprPool* pool = root->batch->pool;
+    for (int i = 1; i < pool->worker_count; i++) {
+        expr_pool_spawn(pool, &root->drains[i].task);
+    }
+    expr_batch_drain(&root->drains[0].task);
+    for (int i = 1; i < pool->worker_count; i++) {
+        expr_pool_join(pool, &root->drains[i].task);
+    }
 }
 
-Expr* expr_sub(const Expr* a, const Expr* b) {
-    if (!a || !b) return NULL;
+void expr_batch_run(ExprPool* pool, ExprArena* source, const ExprJob* jobs, size_t count,
+                    ExprJobCallback done, void* ctx) {
+    if (!pool->arenas) {
+        pool->arenas = (ExprArena*)malloc((size_t)pool->worker_count * sizeof(ExprArena));
+        pool->copy_memo = (ExprIndex*)malloc((size_t)pool->worker_count * MAX_EXPR_COUNT * sizeof(ExprIndex));
+        if (!pool->arenas || !pool->copy_memo) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        for (int i = 0; i < pool->worker_count; i++) {
+            expr_arena_init(&pool->arenas[i]);
+        }
+        memset(pool->copy_memo, 0xff, (size_t)pool->worker_count * MAX_EXPR_COUNT * sizeof(ExprIndex));
+    }
 
-    Expr* neg_b = expr_neg(b);
-    Expr* result = expr_add(expr_retain(a), neg_b);
-    expr_release(neg_b);
-    return expr_simplify(result);
+    ExprBatch batch;
+    batch.pool = pool;
+    batch.source = source;
+    batch.jobs = jobs;
+    batch.count = count;
+    batch.next = 0;
+    batch.done = done;
+    batch.ctx = ctx;
+
+    ExprBatchTask* drains = (ExprBatchTask*)malloc((size_t)pool->worker_count * sizeof(ExprBatchTask));
+    if (!drains) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    for (int i = 0; i < pool->worker_count; i++) {
+        drains[i].task.run = expr_batch_drain;
+        drains[i].batch = &batch;
+    }
+
+    ExprBatchRoot root;
+    root.task.run = expr_batch_root;
+    root.batch = &batch;
+    root.drains = drains;
+    expr_pool_run(pool, &root.task);
+    free(drains);
 }
-*/
-ExprIndex expr_div(ExprArena* a, ExprIndex num, ExprIndex den) {
-    if (num == INVALID_INDEX || den == INVALID_INDEX)
-        return INVALID_INDEX;
 
-    Expr* en = expr_at(a, num);
-    Expr* ed = expr_at(a, den);
+// Parallel least-squares passes: the rows are cut into contiguous chunks,
+// each task sums its chunk with its own lanes, and the partial sums are
+// added in chunk order so results do not depend on scheduling.
+typedef struct {
+    ExprTask task;
+    const ExprFitPass* pass;
+    size_t begin;
+    size_t end;
+    double* lanes;
+    double* jtj;
+    double* jtr;
+    double cost;
+} ExprFitTask;
+
+static void expr_fit_task_run(ExprTask* task) {
+    ExprFitTask* t = (ExprFitTask*)task;
+    size_t np = t->pass->np;
+    memset(t->jtj, 0, np * np * sizeof(double));
+    memset(t->jtr, 0, np * sizeof(double));
+    t->cost = 0.0;
+    expr_fit_chunk(t->pass, t->begin, t->end, t->lanes, t->jtj, t->jtr, &t->cost);
+}
 
-    // a / 1 = a
-    if (expr_type(a, den) == EXPR_NUMBER &&
-        mpq_cmp_ui(*expr_value(a, den), 1, 1) == 0) {
-        return num;
-    }
+typedef struct {
+    ExprTask task;
+    ExprPool* pool;
+    ExprFitTask* chunks;
+    size_t count;
+} ExprFitRoot;
+
+static void expr_fit_root(ExprTask* task) {
+    ExprFitRoot* root = (ExprFitRoot*)task;
+    for (size_t i = 1; i < root->count; i++) expr_pool_spawn(root->pool, &root->chunks[i].task);
+    expr_fit_task_run(&root->chunks[0].task);
+    for (size_t i = 1; i < root->count; i++) expr_pool_join(root->pool, &root->chunks[i].task);
+}
 
-    // 0 / b = 0 (as long as b ≠ 0)
-    if (expr_type(a, num) == EXPR_NUMBER &&
-        mpq_sgn(*expr_value(a, num)) == 0) {
-        return expr_number(a, "0");
+static void expr_fit_pass_parallel(ExprFitPass* s, void* ctx) {
+    ExprPool* pool = (ExprPool*)ctx;
+    size_t rows = s->data->rows, np = s->np;
+    size_t count = (size_t)pool->worker_count * 4;
+    size_t most = (rows + EXPR_FIT_CHUNK - 1) / EXPR_FIT_CHUNK;
+    if (count > most) count = most;
+    if (count == 0) count = 1;
+
+    ExprFitTask* chunks = (ExprFitTask*)malloc(count * sizeof(ExprFitTask));
+    double* sums = (double*)malloc(count * (np * np + np + 1) * sizeof(double));
+    if (!chunks || !sums) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
     }
-
-    // a / a = 1
-    if (expr_equal(a, num, den)) {
-        return expr_number(a, "1");
+    for (size_t i = 0; i < count; i++) {
+        chunks[i].task.run = expr_fit_task_run;
+        chunks[i].pass = s;
+        chunks[i].begin = rows * i / count;
+        chunks[i].end = rows * (i + 1) / count;
+        chunks[i].lanes = expr_tape_alloc_lanes(s->tape);
+        chunks[i].jtj = sums + i * (np * np + np);
+        chunks[i].jtr = chunks[i].jtj + np * np;
     }
-
-    // both numeric → directly divide
-    if (expr_type(a, num) == EXPR_NUMBER &&
-        expr_type(a, den) == EXPR_NUMBER) {
-        mpq_t q;
-        mpq_init(q);
-        mpq_div(q, *expr_value(a, num), *expr_value(a, den));
-        ExprIndex result = expr_number_mpq(a, q);
-        mpq_clear(q);
-        return result;
+    ExprFitRoot root;
+    root.task.run = expr_fit_root;
+    root.pool = pool;
+    root.chunks = chunks;
+    root.count = count;
+    expr_pool_run(pool, &root.task);
+
+    memset(s->jtj, 0, np * np * sizeof(double));
+    memset(s->jtr, 0, np * sizeof(double));
+    s->cost = 0.0;
+    for (size_t i = 0; i < count; i++) {
+        for (size_t k = 0; k < np * np; k++) s->jtj[k] += chunks[i].jtj[k];
+        for (size_t k = 0; k < np; k++) s->jtr[k] += chunks[i].jtr[k];
+        s->cost += chunks[i].cost;
+        free(chunks[i].lanes);
     }
+    free(sums);
+    free(chunks);
+}
 
-    // a / b → a * b^(-1)
-    ExprIndex minus_one = expr_number(a, "-1");
-    ExprIndex reciprocal = expr_pow(a, den, minus_one);
-    ExprIndex result = expr_mul(a, num, reciprocal);
-    //expr_release(a, reciprocal);
-    return expr_simplify(a, result);
+bool expr_fit_parallel(ExprPool* pool, ExprArena* arena, ExprIndex model, const char* const* params,
+                       size_t nparams, const ExprDataset* data, double* p, double tol) {
+    return expr_fit_run(arena, model, params, nparams, data, p, tol, expr_fit_pass_parallel, pool);
 }
+#endif // CYMCALC_THREADS
 
 #endif // CYMCALC_IMPLEMENTATION
\ No newline at end of file
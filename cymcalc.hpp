@@ -0,0 +1,539 @@
+#ifndef CYMCALC_HPP
+#define CYMCALC_HPP
+
+// C++ layer over cymcalc.h. The implementation is still compiled from C: in
+// exactly one .c file, define CYMCALC_IMPLEMENTATION before including
+// cymcalc.h, and link it in.
+//
+//   cymcalc::Arena arena;
+//   cymcalc::Expression x = arena.symbol("x");
+//   cymcalc::Expression f = (x^2) + 3*sin(x);
+//   double y = f.diff("x").simplify().substitute("x", "1/2").eval();
+//
+// Note that ^ binds weaker than + in C++, so powers need parentheses. The
+// handle is named Expression so that `using namespace cymcalc;` does not
+// clash with the C struct Expr.
+
+#include "cymcalc.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <new>
+#include <ostream>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#if __cplusplus >= 201703L && defined(__has_include)
+#if __has_include(<memory_resource>)
+#include <memory_resource>
+#define CYMCALC_HAS_PMR 1
+#endif
+#endif
+
+namespace cymcalc {
+
+namespace detail {
+
+inline ExprIndex number(ExprArena* arena, long num, unsigned long den) {
+    mpq_ptr q = expr_scratch_q(arena);
+    mpq_set_si(q, num, den);
+    mpq_canonicalize(q);
+    ExprIndex idx = expr_number_mpq(arena, q);
+    expr_scratch_q_release(arena, q);
+    return idx;
+}
+
+} // namespace detail
+
+// Handle to a node of an arena: an arena pointer and an index, trivially
+// copyable, no ownership. Operations that cannot be carried out (an integral
+// the engine does not know, a derivative of an unevaluated node) give an
+// invalid handle, and operations on invalid handles stay invalid.
+class Expression {
+public:
+    Expression() noexcept = default;
+    Expression(ExprArena* arena, ExprIndex index) noexcept : arena_(arena), index_(index) {}
+
+    ExprArena* arena() const noexcept { return arena_; }
+    ExprIndex index() const noexcept { return index_; }
+    bool valid() const noexcept { return arena_ && index_ != INVALID_INDEX; }
+    explicit operator bool() const noexcept { return valid(); }
+
+    ExprType type() const { return expr_type(arena_, index_); }
+    Expression left() const { return {arena_, expr_left(arena_, index_)}; }
+    Expression right() const { return {arena_, expr_right(arena_, index_)}; }
+    Expression arg() const { return {arena_, expr_arg(arena_, index_)}; }
+    FuncType func() const { return expr_ftype(arena_, index_); }
+    const char* name() const { return expr_name(arena_, index_); }
+    mpq_srcptr value() const { return *expr_value(arena_, index_); }
+
+    Expression simplify() const { return apply([&] { return expr_simplify(arena_, index_); }); }
+    Expression diff(const char* var) const { return apply([&] { return expr_differentiate(arena_, index_, var); }); }
+    Expression integrate(const char* var) const { return apply([&] { return expr_integrate(arena_, index_, var); }); }
+    Expression expand() const { return apply([&] { return expr_expand(arena_, index_); }); }
+    Expression normal() const { return apply([&] { return expr_normal(arena_, index_); }); }
+    Expression substitute(const char* var, const char* value) const {
+        return apply([&] { return expr_substitute(arena_, index_, var, value); });
+    }
+    Expression series(const char* var, Expression point, size_t order) const {
+        if (!point.valid()) return {};
+        return apply([&] { return expr_series(arena_, index_, var, point.index_, order); });
+    }
+
+    // Exits with a message on free symbols, like expr_eval_numeric
+    double eval() const { return expr_eval_numeric(arena_, index_); }
+
+    std::string str() const {
+        if (!valid()) return "<invalid>";
+        char* text = expr_to_string(arena_, index_);
+        std::string result(text ? text : "");
+        std::free(text);
+        return result;
+    }
+
+    // Structural equality; operator== is left to mean identity of handles
+    bool equals(Expression other) const { return expr_equal(arena_, index_, other.index_) != 0; }
+    bool operator==(Expression other) const noexcept { return arena_ == other.arena_ && index_ == other.index_; }
+    bool operator!=(Expression other) const noexcept { return !(*this == other); }
+
+private:
+    template <typename F>
+    Expression apply(F&& f) const {
+        if (!valid()) return {};
+        return {arena_, f()};
+    }
+
+    ExprArena* arena_ = nullptr;
+    ExprIndex index_ = INVALID_INDEX;
+};
+
+// Owns an ExprArena on the heap, too big for the stack. Move-only; handles
+// stay valid across moves since the arena itself does not move.
+class Arena {
+public:
+    Arena() : arena_(static_cast<ExprArena*>(std::malloc(sizeof(ExprArena)))) {
+        if (!arena_) throw std::bad_alloc();
+        expr_arena_init(arena_);
+    }
+#ifdef CYMCALC_HAS_PMR
+    // Node array, names and, when the C side is built with CYMCALC_GMP_POOL
+    // and has called expr_gmp_pool_install, number limbs all come from
+    // resource, which must outlive the arena. Running out of it exits like
+    // any other allocation failure in the engine.
+    explicit Arena(std::pmr::memory_resource* resource)
+        : arena_(static_cast<ExprArena*>(resource->allocate(sizeof(ExprArena), alignof(ExprArena)))),
+          resource_(resource) {
+        expr_arena_init(arena_);
+        ExprAllocator allocator = {pmr_alloc, pmr_free, resource};
+        expr_arena_set_allocator(arena_, &allocator);
+    }
+#endif
+    ~Arena() { reset(); }
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+    Arena(Arena&& other) noexcept : arena_(other.arena_) {
+        other.arena_ = nullptr;
+#ifdef CYMCALC_HAS_PMR
+        resource_ = other.resource_;
+#endif
+    }
+    Arena& operator=(Arena&& other) noexcept {
+        std::swap(arena_, other.arena_);
+#ifdef CYMCALC_HAS_PMR
+        std::swap(resource_, other.resource_);
+#endif
+        return *this;
+    }
+
+    ExprArena* get() const noexcept { return arena_; }
+
+    Expression symbol(const char* name) { return {arena_, expr_symbol(arena_, const_cast<char*>(name))}; }
+    // Rational literal such as "3/4"; exits with a message when malformed
+    Expression number(const char* text) { return {arena_, expr_number(arena_, const_cast<char*>(text))}; }
+    Expression number(long num, unsigned long den = 1) { return {arena_, detail::number(arena_, num, den)}; }
+    // The exact binary value of x
+    Expression number(double x) {
+        mpq_ptr q = expr_scratch_q(arena_);
+        mpq_set_d(q, x);
+        ExprIndex idx = expr_number_mpq(arena_, q);
+        expr_scratch_q_release(arena_, q);
+        return {arena_, idx};
+    }
+    Expression wrap(ExprIndex idx) const noexcept { return {arena_, idx}; }
+
+    // Frees every node; all handles into the arena become dangling
+    void clear() { expr_arena_clear(arena_); }
+
+private:
+    void reset() noexcept {
+        if (!arena_) return;
+        expr_arena_destroy(arena_);
+#ifdef CYMCALC_HAS_PMR
+        if (resource_) resource_->deallocate(arena_, sizeof(ExprArena), alignof(ExprArena));
+        else std::free(arena_);
+#else
+        std::free(arena_);
+#endif
+        arena_ = nullptr;
+    }
+
+#ifdef CYMCALC_HAS_PMR
+    // Exceptions must not cross the C frames; NULL makes the engine report it
+    static void* pmr_alloc(void* ctx, size_t size) {
+        try {
+            return static_cast<std::pmr::memory_resource*>(ctx)->allocate(size, alignof(std::max_align_t));
+        } catch (...) {
+            return nullptr;
+        }
+    }
+    static void pmr_free(void* ctx, void* p, size_t size) {
+        static_cast<std::pmr::memory_resource*>(ctx)->deallocate(p, size, alignof(std::max_align_t));
+    }
+
+#endif
+
+    ExprArena* arena_;
+#ifdef CYMCALC_HAS_PMR
+    std::pmr::memory_resource* resource_ = nullptr;
+#endif
+};
+
+namespace detail {
+
+template <typename F>
+inline Expression binary(Expression a, Expression b, F&& f) {
+    if (!a.valid() || !b.valid()) return {};
+    return {a.arena(), f(a.arena(), a.index(), b.index())};
+}
+
+inline Expression constant(Expression like, long n) {
+    if (!like.valid()) return {};
+    return {like.arena(), number(like.arena(), n, 1)};
+}
+
+inline Expression func(FuncType f, Expression a) {
+    if (!a.valid()) return {};
+    return {a.arena(), expr_func(a.arena(), f, a.index())};
+}
+
+} // namespace detail
+
+inline Expression operator+(Expression a, Expression b) { return detail::binary(a, b, expr_add); }
+inline Expression operator*(Expression a, Expression b) { return detail::binary(a, b, expr_mul); }
+inline Expression operator^(Expression a, Expression b) { return detail::binary(a, b, expr_pow); }
+inline Expression operator/(Expression a, Expression b) { return detail::binary(a, b, expr_div); }
+inline Expression operator-(Expression a) { return detail::constant(a, -1) * a; }
+inline Expression operator-(Expression a, Expression b) { return a + -b; }
+
+// Integer operands become numbers in the other operand's arena
+inline Expression operator+(Expression a, long n) { return a + detail::constant(a, n); }
+inline Expression operator+(long n, Expression a) { return detail::constant(a, n) + a; }
+inline Expression operator-(Expression a, long n) { return a + detail::constant(a, -n); }
+inline Expression operator-(long n, Expression a) { return detail::constant(a, n) - a; }
+inline Expression operator*(Expression a, long n) { return a * detail::constant(a, n); }
+inline Expression operator*(long n, Expression a) { return detail::constant(a, n) * a; }
+inline Expression operator/(Expression a, long n) { return a / detail::constant(a, n); }
+inline Expression operator/(long n, Expression a) { return detail::constant(a, n) / a; }
+inline Expression operator^(Expression a, long n) { return a ^ detail::constant(a, n); }
+
+inline Expression& operator+=(Expression& a, Expression b) { return a = a + b; }
+inline Expression& operator-=(Expression& a, Expression b) { return a = a - b; }
+inline Expression& operator*=(Expression& a, Expression b) { return a = a * b; }
+inline Expression& operator/=(Expression& a, Expression b) { return a = a / b; }
+
+inline Expression sin(Expression a) { return detail::func(FUNC_SIN, a); }
+inline Expression cos(Expression a) { return detail::func(FUNC_COS, a); }
+inline Expression exp(Expression a) { return detail::func(FUNC_EXP, a); }
+inline Expression log(Expression a) { return detail::func(FUNC_LOG, a); }
+
+inline std::ostream& operator<<(std::ostream& out, Expression e) { return out << e.str(); }
+
+#if __cplusplus >= 201703L
+
+//-----------------------------------------------
+// Compile-time expressions
+//-----------------------------------------------
+
+// Formulas known at build time can be written as types mirroring the EXPR_*
+// kinds. diff and the folding rules below run during compilation, eval is a
+// plain inlined arithmetic expression, and to_expr builds the same tree in an
+// arena when the runtime engine is needed.
+//
+//   using namespace cymcalc::ct;
+//   constexpr Sym<'x'> x{};
+//   constexpr auto f = (x^num<3>) + num<2>*sin(x);
+//   constexpr auto df = diff(f, x);               // 3*x^2 + 2*cos(x)
+//   double y = eval(df, bind(x, 0.5));
+//   auto k = kernel(df, x);                       // double(double)
+//   cymcalc::Expression g = to_expr(arena, df);
+
+namespace ct {
+
+struct Node {};
+
+template <typename T>
+constexpr bool is_node = std::is_base_of<Node, T>::value;
+
+template <typename S>
+struct Bound { double value; };
+
+// EXPR_NUMBER, reduced with a positive denominator; spell it num<N, D>
+template <long N, long D>
+struct Num : Node {
+    static constexpr long n = N, d = D;
+    template <typename Env>
+    static constexpr double eval(const Env&) { return double(N) / double(D); }
+    static ExprIndex build(ExprArena* arena) { return cymcalc::detail::number(arena, N, D); }
+};
+
+template <char... Name>
+struct Sym : Node {
+    static constexpr char name[] = {Name..., '\0'};
+    template <typename Env>
+    static constexpr double eval(const Env& env) { return std::get<Bound<Sym>>(env).value; }
+    static ExprIndex build(ExprArena* arena) { return expr_symbol(arena, const_cast<char*>(name)); }
+};
+
+template <typename L, typename R>
+struct Add : Node {
+    template <typename Env>
+    static constexpr double eval(const Env& env) { return L::eval(env) + R::eval(env); }
+    static ExprIndex build(ExprArena* arena) { return expr_add(arena, L::build(arena), R::build(arena)); }
+};
+
+template <typename L, typename R>
+struct Mul : Node {
+    using left = L;
+    using right = R;
+    template <typename Env>
+    static constexpr double eval(const Env& env) { return L::eval(env) * R::eval(env); }
+    static ExprIndex build(ExprArena* arena) { return expr_mul(arena, L::build(arena), R::build(arena)); }
+};
+
+namespace detail {
+
+constexpr long gcd(long a, long b) {
+    if (a < 0) a = -a;
+    if (b < 0) b = -b;
+    while (b) {
+        long t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+template <long N, long D>
+struct reduce {
+    static_assert(D != 0, "division by zero in a compile-time expression");
+    static constexpr long g = gcd(N, D) * (D < 0 ? -1 : 1);
+    using type = Num<N / g, D / g>;
+};
+
+// Square and multiply; with n known the loop unrolls to a few multiplies
+constexpr double ipow(double b, long n) {
+    if (n < 0) return 1.0 / ipow(b, -n);
+    double r = 1.0;
+    while (n) {
+        if (n & 1) r *= b;
+        b *= b;
+        n >>= 1;
+    }
+    return r;
+}
+
+constexpr long lpow(long b, long n) {
+    long r = 1;
+    while (n--) r *= b;
+    return r;
+}
+
+} // namespace detail
+
+template <long N, long D = 1>
+constexpr typename detail::reduce<N, D>::type num{};
+
+template <typename T> struct is_num_t : std::false_type {};
+template <long N, long D> struct is_num_t<Num<N, D>> : std::true_type {};
+template <typename T> constexpr bool is_num = is_num_t<T>::value;
+
+template <typename T, long V>
+constexpr bool is_value() {
+    if constexpr (is_num<T>) return T::n == V && T::d == 1;
+    else return false;
+}
+
+template <typename T>
+constexpr bool is_integer() {
+    if constexpr (is_num<T>) return T::d == 1;
+    else return false;
+}
+
+template <typename B, typename E>
+struct Pow : Node {
+    template <typename Env>
+    static constexpr double eval(const Env& env) {
+        if constexpr (is_integer<E>()) return detail::ipow(B::eval(env), E::n);
+        else if constexpr (std::is_same<E, Num<1, 2>>::value) return std::sqrt(B::eval(env));
+        else return std::pow(B::eval(env), E::eval(env));
+    }
+    static ExprIndex build(ExprArena* arena) { return expr_pow(arena, B::build(arena), E::build(arena)); }
+};
+
+template <FuncType F, typename A>
+struct Func : Node {
+    template <typename Env>
+    static double eval(const Env& env) {
+        double x = A::eval(env);
+        if constexpr (F == FUNC_SIN) return std::sin(x);
+        else if constexpr (F == FUNC_COS) return std::cos(x);
+        else if constexpr (F == FUNC_EXP) return std::exp(x);
+        else return std::log(x);
+    }
+    static ExprIndex build(ExprArena* arena) { return expr_func(arena, F, A::build(arena)); }
+};
+
+template <typename T> struct is_scaled_t : std::false_type {};
+template <long N, long D, typename X> struct is_scaled_t<Mul<Num<N, D>, X>> : std::true_type {};
+
+// Builders fold what is decidable from the types alone: rational arithmetic,
+// the 0 and 1 identities, x+x, x*x, and numbers pulled to the left of a
+// product so that coefficients meet.
+template <typename L, typename R>
+constexpr auto add(L, R) {
+    if constexpr (is_num<L> && is_num<R>) return num<L::n * R::d + R::n * L::d, L::d * R::d>;
+    else if constexpr (is_value<L, 0>()) return R{};
+    else if constexpr (is_value<R, 0>()) return L{};
+    else if constexpr (std::is_same<L, R>::value) return Mul<Num<2, 1>, L>{};
+    else return Add<L, R>{};
+}
+
+template <typename L, typename R>
+constexpr auto mul(L, R) {
+    if constexpr (is_num<L> && is_num<R>) return num<L::n * R::n, L::d * R::d>;
+    else if constexpr (is_value<L, 0>() || is_value<R, 0>()) return num<0>;
+    else if constexpr (is_value<L, 1>()) return R{};
+    else if constexpr (is_value<R, 1>()) return L{};
+    else if constexpr (is_num<R>) return mul(R{}, L{});
+    else if constexpr (is_num<L> && is_scaled_t<R>::value) return mul(mul(L{}, typename R::left{}), typename R::right{});
+    else if constexpr (std::is_same<L, R>::value) return Pow<L, Num<2, 1>>{};
+    else return Mul<L, R>{};
+}
+
+template <typename B, typename E>
+constexpr auto pow(B, E) {
+    if constexpr (is_value<E, 0>()) return num<1>;
+    else if constexpr (is_value<E, 1>()) return B{};
+    else if constexpr (is_num<B> && is_integer<E>()) {
+        if constexpr (E::n > 0) return num<detail::lpow(B::n, E::n), detail::lpow(B::d, E::n)>;
+        else return num<detail::lpow(B::d, -E::n), detail::lpow(B::n, -E::n)>;
+    }
+    else return Pow<B, E>{};
+}
+
+template <FuncType F, typename A>
+constexpr auto func(A) {
+    if constexpr (F == FUNC_SIN && is_value<A, 0>()) return num<0>;
+    else if constexpr ((F == FUNC_COS || F == FUNC_EXP) && is_value<A, 0>()) return num<1>;
+    else if constexpr (F == FUNC_LOG && is_value<A, 1>()) return num<0>;
+    else return Func<F, A>{};
+}
+
+template <typename V, long N, long D> constexpr auto derive(Num<N, D>);
+template <typename V, char... Name> constexpr auto derive(Sym<Name...>);
+template <typename V, typename L, typename R> constexpr auto derive(Add<L, R>);
+template <typename V, typename L, typename R> constexpr auto derive(Mul<L, R>);
+template <typename V, typename B, typename E> constexpr auto derive(Pow<B, E>);
+template <typename V, FuncType F, typename A> constexpr auto derive(Func<F, A>);
+
+template <typename V, long N, long D>
+constexpr auto derive(Num<N, D>) { return num<0>; }
+
+template <typename V, char... Name>
+constexpr auto derive(Sym<Name...>) { return num<std::is_same<V, Sym<Name...>>::value>; }
+
+template <typename V, typename L, typename R>
+constexpr auto derive(Add<L, R>) { return add(derive<V>(L{}), derive<V>(R{})); }
+
+template <typename V, typename L, typename R>
+constexpr auto derive(Mul<L, R>) {
+    return add(mul(derive<V>(L{}), R{}), mul(L{}, derive<V>(R{})));
+}
+
+template <typename V, typename B, typename E>
+constexpr auto derive(Pow<B, E>) {
+    if constexpr (is_num<E>) {
+        return mul(mul(E{}, pow(B{}, num<E::n - E::d, E::d>)), derive<V>(B{}));
+    } else {
+        // d(b^e) = b^e (e' log b + e b'/b)
+        return mul(Pow<B, E>{}, add(mul(derive<V>(E{}), func<FUNC_LOG>(B{})),
+                                    mul(E{}, mul(derive<V>(B{}), pow(B{}, num<-1>)))));
+    }
+}
+
+template <typename V, FuncType F, typename A>
+constexpr auto derive(Func<F, A>) {
+    if constexpr (F == FUNC_SIN) return mul(func<FUNC_COS>(A{}), derive<V>(A{}));
+    else if constexpr (F == FUNC_COS) return mul(mul(num<-1>, func<FUNC_SIN>(A{})), derive<V>(A{}));
+    else if constexpr (F == FUNC_EXP) return mul(Func<F, A>{}, derive<V>(A{}));
+    else return mul(pow(A{}, num<-1>), derive<V>(A{}));
+}
+
+template <typename T>
+using enable_node = std::enable_if_t<is_node<T>>;
+
+template <typename E, char... Name, typename = enable_node<E>>
+constexpr auto diff(E, Sym<Name...>) { return derive<Sym<Name...>>(E{}); }
+
+template <char... Name>
+constexpr Bound<Sym<Name...>> bind(Sym<Name...>, double value) { return {value}; }
+
+// Every symbol of e needs a binding; a missing one fails to compile
+template <typename E, typename... S, typename = enable_node<E>>
+constexpr double eval(E, Bound<S>... values) {
+    return E::eval(std::tuple<Bound<S>...>(values...));
+}
+
+template <typename>
+using as_double = double;
+
+// Callable taking one double per listed symbol, in order
+template <typename E, typename... S, typename = enable_node<E>>
+constexpr auto kernel(E, S...) {
+    return [](as_double<S>... values) { return E::eval(std::tuple<Bound<S>...>(Bound<S>{values}...)); };
+}
+
+template <typename E, typename = enable_node<E>>
+ExprIndex to_expr(ExprArena* arena, E) { return E::build(arena); }
+
+template <typename E, typename = enable_node<E>>
+cymcalc::Expression to_expr(Arena& arena, E) { return arena.wrap(E::build(arena.get())); }
+
+template <typename L, typename R, typename = enable_node<L>, typename = enable_node<R>>
+constexpr auto operator+(L, R) { return add(L{}, R{}); }
+template <typename L, typename R, typename = enable_node<L>, typename = enable_node<R>>
+constexpr auto operator*(L, R) { return mul(L{}, R{}); }
+template <typename B, typename E, typename = enable_node<B>, typename = enable_node<E>>
+constexpr auto operator^(B, E) { return pow(B{}, E{}); }
+template <typename A, typename = enable_node<A>>
+constexpr auto operator-(A) { return mul(num<-1>, A{}); }
+template <typename L, typename R, typename = enable_node<L>, typename = enable_node<R>>
+constexpr auto operator-(L, R) { return add(L{}, mul(num<-1>, R{})); }
+template <typename L, typename R, typename = enable_node<L>, typename = enable_node<R>>
+constexpr auto operator/(L, R) { return mul(L{}, pow(R{}, num<-1>)); }
+
+template <typename A, typename = enable_node<A>> constexpr auto sin(A) { return func<FUNC_SIN>(A{}); }
+template <typename A, typename = enable_node<A>> constexpr auto cos(A) { return func<FUNC_COS>(A{}); }
+template <typename A, typename = enable_node<A>> constexpr auto exp(A) { return func<FUNC_EXP>(A{}); }
+template <typename A, typename = enable_node<A>> constexpr auto log(A) { return func<FUNC_LOG>(A{}); }
+
+} // namespace ct
+
+#endif // __cplusplus >= 201703L
+
+} // namespace cymcalc
+
+#endif // CYMCALC_HPP
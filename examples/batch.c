@@ -0,0 +1,78 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#define CYMCALC_THREADS
+#define CYMCALC_IMPLEMENTATION
+#include "..\cymcalc.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+void setup_utf8_console() {
+#ifdef _WIN32
+    SetConsoleOutputCP(CP_UTF8);
+#endif
+}
+
+static ExprArena a;
+static ExprPool pool;
+
+// Callbacks run on the workers in any order, so results are kept per job
+// and printed once the batch is done.
+static void keep_result(const ExprJob* job, ExprArena* arena, ExprIndex result, const char* text, void* ctx) {
+    (void)arena;
+    (void)ctx;
+    char** slot = (char**)job->user;
+    *slot = strdup(result == INVALID_INDEX ? "unresolved" : text);
+}
+
+int main() {
+
+    setup_utf8_console();
+
+    expr_arena_init(&a);
+    expr_pool_init(&pool, 4);
+    printf("----------------------------------------------------\n");
+    printf(" Example: Batch jobs\n");
+    printf("----------------------------------------------------\n");
+    {
+        ExprIndex x = expr_symbol(&a, "x");
+        ExprIndex sinx = expr_func(&a, FUNC_SIN, x);
+        ExprIndex expx = expr_func(&a, FUNC_EXP, x);
+        ExprIndex x3 = expr_pow(&a, x, expr_number(&a, "3"));
+
+        ExprIndex inputs[6] = {
+            expr_add(&a, expr_mul(&a, expr_number(&a, "2"), x), expr_mul(&a, expr_number(&a, "3"), x)),
+            expr_mul(&a, x3, sinx),
+            expr_add(&a, x3, expr_mul(&a, expr_number(&a, "4"), expx)),
+            expr_add(&a, x, expr_mul(&a, sinx, expx)),  // no antiderivative rule for sin(x)*exp(x)
+            expr_mul(&a, expr_number(&a, "5"), expr_func(&a, FUNC_COS, x)),
+            INVALID_INDEX,                              // not a node of the source arena
+        };
+        ExprJobOp ops[6] = {EXPR_JOB_SIMPLIFY, EXPR_JOB_DIFFERENTIATE, EXPR_JOB_INTEGRATE,
+                            EXPR_JOB_INTEGRATE, EXPR_JOB_INTEGRATE, EXPR_JOB_SIMPLIFY};
+        const char* names[3] = {"simplify", "d/dx", "∫dx"};
+        char* results[6] = {0};
+
+        ExprJob jobs[6];
+        for (int i = 0; i < 6; i++) {
+            jobs[i].expr = inputs[i];
+            jobs[i].op = ops[i];
+            jobs[i].var = "x";
+            jobs[i].options = EXPR_JOB_SIMPLIFY_RESULT | EXPR_JOB_SERIALIZE;
+            jobs[i].user = &results[i];
+        }
+        expr_batch_run(&pool, &a, jobs, 6, keep_result, NULL);
+
+        for (int i = 0; i < 6; i++) {
+            printf("%s ", names[ops[i]]);
+            expr_print(&a, inputs[i]);
+            printf(" = %s\n", results[i]);
+            free(results[i]);
+        }
+    }
+
+    expr_pool_destroy(&pool);
+    return 0;
+}
@@ -0,0 +1,297 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Room for the largest workload plus what one operation allocates on top
+#define MAX_EXPR_COUNT (1 << 18)
+#define CYMCALC_IMPLEMENTATION
+#include "../cymcalc.h"
+
+// Synthetic workloads timed per core operation. Results are one JSON record
+// per (workload, operation) line so scripts can read them without a parser.
+//
+//   bench [output.json [seconds]]   (stdout when no file is given)
+
+// Time spent in each operation, overridable per run
+#define BENCH_MIN_SECONDS 0.25
+#define BENCH_MAX_REPS 1000000
+// Clear the scratch arena once fewer nodes than this are free
+#define BENCH_HEADROOM (MAX_EXPR_COUNT / 2)
+
+static double bench_min_seconds = BENCH_MIN_SECONDS;
+
+static const char* bench_vars[] = {"x", "y", "z"};
+static const char* bench_values[] = {"3/7", "-5/11", "2/9"};
+
+//-----------------------------------------------
+// Generators
+//-----------------------------------------------
+
+typedef struct {
+    uint64_t state;
+} BenchRng;
+
+static uint64_t bench_rand(BenchRng* r) {
+    r->state ^= r->state >> 12;
+    r->state ^= r->state << 25;
+    r->state ^= r->state >> 27;
+    return r->state * 0x2545f4914f6cdd1dull;
+}
+
+static ExprIndex bench_rational(ExprArena* a, long num, long den) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%ld/%ld", num, den);
+    return expr_number(a, buf);
+}
+
+static ExprIndex bench_var(ExprArena* a, int v) {
+    return expr_symbol(a, (char*)bench_vars[v]);
+}
+
+static ExprIndex bench_power(ExprArena* a, ExprIndex base, long n) {
+    return expr_pow(a, base, bench_rational(a, n, 1));
+}
+
+// Random tree of sums, products, small powers and sin/cos/exp over nvars
+// symbols. Leaves appear early with probability 1/4.
+static ExprIndex gen_random_tree(ExprArena* a, BenchRng* r, int depth, int nvars) {
+    if (depth == 0 || bench_rand(r) % 4 == 0) {
+        if (bench_rand(r) % 2) return bench_var(a, (int)(bench_rand(r) % nvars));
+        return bench_rational(a, (long)(bench_rand(r) % 9) + 1, (long)(bench_rand(r) % 4) + 1);
+    }
+    unsigned pick = (unsigned)(bench_rand(r) % 20);
+    if (pick < 7) return expr_add(a, gen_random_tree(a, r, depth - 1, nvars), gen_random_tree(a, r, depth - 1, nvars));
+    if (pick < 14) return expr_mul(a, gen_random_tree(a, r, depth - 1, nvars), gen_random_tree(a, r, depth - 1, nvars));
+    if (pick < 17) return bench_power(a, gen_random_tree(a, r, depth - 1, nvars), 2 + (long)(bench_rand(r) % 2));
+    static const FuncType funcs[] = {FUNC_SIN, FUNC_COS, FUNC_EXP};
+    return expr_func(a, funcs[bench_rand(r) % 3], gen_random_tree(a, r, depth - 1, nvars));
+}
+
+// ((c1*x^k1 + c2*x^k2) + c3*sin(x)) + ... as a left-deep chain of terms
+static ExprIndex gen_deep_sum(ExprArena* a, int terms) {
+    ExprIndex x = bench_var(a, 0);
+    ExprIndex sum = INVALID_INDEX;
+    for (int i = 1; i <= terms; i++) {
+        ExprIndex term = i % 3 == 0 ? expr_func(a, FUNC_SIN, x) : bench_power(a, x, 2 + i % 4);
+        term = expr_mul(a, bench_rational(a, i, 1 + i % 5), term);
+        sum = sum == INVALID_INDEX ? term : expr_add(a, sum, term);
+    }
+    return sum;
+}
+
+// Every monomial of total degree <= degree in nvars symbols
+static ExprIndex gen_dense_poly(ExprArena* a, int degree, int nvars) {
+    ExprIndex sum = INVALID_INDEX;
+    int exps[3] = {0, 0, 0};
+    for (;;) {
+        int total = 0;
+        for (int v = 0; v < nvars; v++) total += exps[v];
+        if (total <= degree) {
+            ExprIndex term = bench_rational(a, 1 + (total * 7 + exps[0]) % 13, 1 + exps[nvars - 1] % 3);
+            for (int v = 0; v < nvars; v++) {
+                if (exps[v] == 0) continue;
+                ExprIndex factor = exps[v] == 1 ? bench_var(a, v) : bench_power(a, bench_var(a, v), exps[v]);
+                term = expr_mul(a, term, factor);
+            }
+            sum = sum == INVALID_INDEX ? term : expr_add(a, sum, term);
+        }
+        int v = 0;
+        while (v < nvars && ++exps[v] > degree) exps[v++] = 0;
+        if (v == nvars) break;
+    }
+    return sum;
+}
+
+// sin(1/2*exp(1/3*cos(... (x + 1) ...))) with depth applications
+static ExprIndex gen_nested_funcs(ExprArena* a, int depth) {
+    static const FuncType funcs[] = {FUNC_SIN, FUNC_EXP, FUNC_COS};
+    ExprIndex e = expr_add(a, bench_var(a, 0), bench_rational(a, 1, 1));
+    for (int i = 0; i < depth; i++) {
+        e = expr_func(a, funcs[i % 3], expr_mul(a, bench_rational(a, 1, 2 + i % 3), e));
+    }
+    return e;
+}
+
+// order-th derivative of x^3 * sin(x) * exp(x), left unsimplified
+static ExprIndex gen_derivative_chain(ExprArena* a, int order) {
+    ExprIndex x = bench_var(a, 0);
+    ExprIndex e = expr_mul(a, expr_mul(a, bench_power(a, x, 3), expr_func(a, FUNC_SIN, x)), expr_func(a, FUNC_EXP, x));
+    for (int i = 0; i < order; i++) e = expr_differentiate(a, e, "x");
+    return e;
+}
+
+typedef enum {
+    GEN_RANDOM_TREE,
+    GEN_DEEP_SUM,
+    GEN_DENSE_POLY,
+    GEN_NESTED_FUNCS,
+    GEN_DERIVATIVE_CHAIN
+} BenchGenerator;
+
+typedef struct {
+    const char* name;
+    BenchGenerator gen;
+    int size;         // depth, terms, degree or order
+    int nvars;
+    uint64_t seed;
+    bool integrable;  // within what expr_integrate handles
+} BenchWorkload;
+
+static const BenchWorkload bench_workloads[] = {
+    {"random_tree_d8",       GEN_RANDOM_TREE,      8,   3, 1, false},
+    {"random_tree_d12",      GEN_RANDOM_TREE,      12,  3, 7, false},
+    {"deep_sum_200",         GEN_DEEP_SUM,         200, 1, 0, true},
+    {"deep_sum_1000",        GEN_DEEP_SUM,         1000, 1, 0, true},
+    {"dense_poly_d40",       GEN_DENSE_POLY,       40,  1, 0, true},
+    {"dense_poly_d10_xyz",   GEN_DENSE_POLY,       10,  3, 0, false},
+    {"nested_funcs_50",      GEN_NESTED_FUNCS,     50,  1, 0, false},
+    {"derivative_chain_4",   GEN_DERIVATIVE_CHAIN, 4,   1, 0, false},
+};
+
+static ExprIndex bench_generate(ExprArena* a, const BenchWorkload* w) {
+    BenchRng rng = {w->seed * 0x9e3779b97f4a7c15ull + 1};
+    switch (w->gen) {
+        case GEN_RANDOM_TREE:      return gen_random_tree(a, &rng, w->size, w->nvars);
+        case GEN_DEEP_SUM:         return gen_deep_sum(a, w->size);
+        case GEN_DENSE_POLY:       return gen_dense_poly(a, w->size, w->nvars);
+        case GEN_NESTED_FUNCS:     return gen_nested_funcs(a, w->size);
+        case GEN_DERIVATIVE_CHAIN: return gen_derivative_chain(a, w->size);
+    }
+    return INVALID_INDEX;
+}
+
+//-----------------------------------------------
+// Operations
+//-----------------------------------------------
+
+typedef struct {
+    const BenchWorkload* workload;
+    ExprIndex input;    // generated expression
+    ExprIndex numeric;  // input with every symbol substituted
+    double sink;        // keeps numeric results alive
+} BenchCase;
+
+typedef enum {
+    OP_SIMPLIFY,
+    OP_DIFFERENTIATE,
+    OP_INTEGRATE,
+    OP_SUBSTITUTE,
+    OP_EVAL_NUMERIC,
+    OP_COUNT
+} BenchOp;
+
+static const char* bench_op_names[OP_COUNT] = {
+    "simplify", "differentiate", "integrate", "substitute", "eval_numeric"
+};
+
+static ExprIndex bench_substitute_all(ExprArena* a, ExprIndex e, int nvars) {
+    for (int v = 0; v < nvars; v++) e = expr_substitute(a, e, bench_vars[v], bench_values[v]);
+    return e;
+}
+
+static void bench_apply(ExprArena* a, BenchCase* c, BenchOp op) {
+    switch (op) {
+        case OP_SIMPLIFY:      expr_simplify(a, c->input); break;
+        case OP_DIFFERENTIATE: expr_differentiate(a, c->input, "x"); break;
+        case OP_INTEGRATE:     expr_integrate(a, c->input, "x"); break;
+        case OP_SUBSTITUTE:    bench_substitute_all(a, c->input, c->workload->nvars); break;
+        case OP_EVAL_NUMERIC:  c->sink += expr_eval_numeric(a, c->numeric); break;
+        default: break;
+    }
+}
+
+//-----------------------------------------------
+// Measurement
+//-----------------------------------------------
+
+static double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + 1e-9 * (double)ts.tv_nsec;
+}
+
+static size_t bench_live_nodes(const ExprArena* a) {
+    return MAX_EXPR_COUNT - (size_t)a->free_count;
+}
+
+typedef struct {
+    size_t reps;
+    double seconds;
+    size_t nodes_allocated;  // by one application
+    size_t peak_arena;       // live nodes at the end of one application
+} BenchResult;
+
+// Repeats op on the frozen input until bench_min_seconds have been spent
+// inside it. Nodes an application allocates go to an overlay that is
+// cleared between applications, outside the timed region.
+static BenchResult bench_measure(ExprArena* overlay, BenchCase* c, BenchOp op) {
+    BenchResult r = {0};
+    expr_arena_clear(overlay);
+    size_t before = bench_live_nodes(overlay);
+    bench_apply(overlay, c, op);
+    r.nodes_allocated = bench_live_nodes(overlay) - before;
+    r.peak_arena = bench_live_nodes(overlay);
+
+    while (r.seconds < bench_min_seconds && r.reps < BENCH_MAX_REPS) {
+        if ((size_t)overlay->free_count < BENCH_HEADROOM) expr_arena_clear(overlay);
+        double start = bench_now();
+        bench_apply(overlay, c, op);
+        r.seconds += bench_now() - start;
+        r.reps++;
+    }
+    return r;
+}
+
+int main(int argc, char** argv) {
+    FILE* out = stdout;
+    if (argc > 1) {
+        out = fopen(argv[1], "w");
+        if (!out) {
+            fprintf(stderr, "Could not open %s\n", argv[1]);
+            return 1;
+        }
+    }
+    if (argc > 2) bench_min_seconds = atof(argv[2]);
+
+    ExprArena* arena = (ExprArena*)malloc(sizeof(ExprArena));
+    ExprArena* overlay = (ExprArena*)malloc(sizeof(ExprArena));
+    if (!arena || !overlay) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    fprintf(out, "{\"arena_capacity\": %d, \"results\": [\n", MAX_EXPR_COUNT);
+    size_t count = sizeof(bench_workloads) / sizeof(bench_workloads[0]);
+    bool first = true;
+    for (size_t i = 0; i < count; i++) {
+        const BenchWorkload* w = &bench_workloads[i];
+        expr_arena_init(arena);
+        BenchCase c = {w, INVALID_INDEX, INVALID_INDEX, 0.0};
+        c.input = bench_generate(arena, w);
+        c.numeric = bench_substitute_all(arena, c.input, w->nvars);
+        size_t input_nodes = bench_live_nodes(arena);
+
+        ExprSnapshot* snapshot = expr_snapshot_freeze(arena);
+        expr_arena_init_overlay(overlay, snapshot);
+        for (int op = 0; op < OP_COUNT; op++) {
+            if (op == OP_INTEGRATE && !w->integrable) continue;
+            fprintf(stderr, "%s/%s\n", w->name, bench_op_names[op]);
+            BenchResult r = bench_measure(overlay, &c, (BenchOp)op);
+            fprintf(out, "%s  {\"workload\": \"%s\", \"op\": \"%s\", \"ops_per_sec\": %.6g, \"reps\": %zu, "
+                    "\"input_nodes\": %zu, \"nodes_allocated\": %zu, \"peak_arena\": %zu}",
+                    first ? "" : ",\n", w->name, bench_op_names[op], (double)r.reps / r.seconds, r.reps,
+                    input_nodes, r.nodes_allocated, r.peak_arena);
+            first = false;
+        }
+        expr_arena_destroy(overlay);
+        expr_snapshot_free(snapshot);
+        expr_arena_destroy(arena);
+    }
+    fprintf(out, "\n]}\n");
+
+    if (out != stdout) fclose(out);
+    free(overlay);
+    free(arena);
+    return 0;
+}
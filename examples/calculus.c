@@ -89,5 +89,40 @@ int main() {
 
     }
 
+    printf("--------------------------------------------\n");
+    printf(" Derivatives\n");
+    printf("--------------------------------------------\n");
+    {
+        ExprIndex x = expr_symbol(&a,"x");
+        ExprIndex fs[4] = {
+            expr_pow(&a, x, x),
+            expr_pow(&a, expr_add(&a, x, expr_number(&a,"1")), expr_number(&a,"3")),
+            expr_func(&a, FUNC_LOG, expr_add(&a, expr_pow(&a, x, expr_number(&a,"2")), expr_number(&a,"1"))),
+            expr_mul(&a, expr_func(&a, FUNC_EXP, x), expr_func(&a, FUNC_COS, x)),
+        };
+        for (int i = 0; i < 4; i++) {
+            printf("d/dx ");
+            expr_print(&a, fs[i]);
+            printf(" = ");
+            expr_print(&a, expr_simplify(&a, expr_diff(&a, fs[i], "x")));
+            printf("\n");
+        }
+    }
+
+    printf("--------------------------------------------\n");
+    printf(" Taylor series\n");
+    printf("--------------------------------------------\n");
+    {
+        ExprIndex x = expr_symbol(&a,"x");
+        ExprIndex g = expr_func(&a, FUNC_EXP, expr_func(&a, FUNC_SIN, x));
+        int free_before = a.free_count;
+        ExprIndex Tg = expr_series(&a, g, "x", expr_number(&a,"0"), 40);
+
+        printf("exp(sin(x)) = ");
+        expr_print(&a, Tg);
+        printf(" + O(x^41)\n");
+        printf("nodes used: %d\n", free_before - a.free_count);
+    }
+
     return 0;
 }
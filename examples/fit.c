@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#define CYMCALC_IMPLEMENTATION
+#include "..\cymcalc.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+void setup_utf8_console() {
+#ifdef _WIN32
+    SetConsoleOutputCP(CP_UTF8);
+#endif
+}
+
+#define ROWS 200
+
+static ExprArena a;
+
+int main() {
+
+    setup_utf8_console();
+
+    expr_arena_init(&a);
+    ExprIndex t = expr_symbol(&a, "t");
+    ExprIndex amp = expr_symbol(&a, "a");
+    ExprIndex k = expr_symbol(&a, "k");
+    ExprIndex c = expr_symbol(&a, "c");
+
+    static double ts[ROWS], ys[ROWS];
+    const char* columns[1] = {"t"};
+    const double* data[1] = {ts};
+    ExprDataset set = {columns, data, 1, ys, ROWS};
+
+    printf("----------------------------------------------------\n");
+    printf(" Example: Least-squares fitting\n");
+    printf("----------------------------------------------------\n");
+    {
+        // a exp(-k t) + c through 2.5 exp(-1.3 t) + 0.5 with a small
+        // deterministic wiggle
+        for (int i = 0; i < ROWS; i++) {
+            ts[i] = 4.0 * i / ROWS;
+            ys[i] = 2.5 * exp(-1.3 * ts[i]) + 0.5 + 1e-3 * sin(37.0 * i);
+        }
+        ExprIndex model = expr_add(&a, expr_mul(&a, amp, expr_func(&a, FUNC_EXP, expr_mul(&a, expr_number(&a, "-1"), expr_mul(&a, k, t)))), c);
+        const char* params[3] = {"a", "k", "c"};
+        double p[3] = {1, 1, 0};
+        bool ok = expr_fit(&a, model, params, 3, &set, p, 1e-10);
+        printf("a exp(-k t) + c: ok %d, a = %.3f, k = %.3f, c = %.3f\n", ok, p[0], p[1], p[2]);
+    }
+    {
+        // A model linear in its parameters, a t^2 + k t + c, fits exactly
+        for (int i = 0; i < ROWS; i++) ys[i] = 0.75 * ts[i] * ts[i] - 2 * ts[i] + 1;
+        ExprIndex model = expr_add(&a, expr_add(&a, expr_mul(&a, amp, expr_pow(&a, t, expr_number(&a, "2"))), expr_mul(&a, k, t)), c);
+        const char* params[3] = {"a", "k", "c"};
+        double p[3] = {0, 0, 0};
+        bool ok = expr_fit(&a, model, params, 3, &set, p, 1e-12);
+        printf("a t^2 + k t + c: ok %d, a = %.6f, k = %.6f, c = %.6f\n", ok, p[0], p[1], p[2]);
+    }
+    {
+        // log(k t) is not finite at t = 0
+        ExprIndex model = expr_func(&a, FUNC_LOG, expr_mul(&a, k, t));
+        const char* params[1] = {"k"};
+        double p[1] = {1};
+        printf("log(k t) with a row at t = 0: ok %d\n", expr_fit(&a, model, params, 1, &set, p, 1e-10));
+    }
+
+    return 0;
+}
@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <stdlib.h>
+#define CYMCALC_GMP_POOL
+#define CYMCALC_IMPLEMENTATION
+#include "..\cymcalc.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+void setup_utf8_console() {
+#ifdef _WIN32
+    SetConsoleOutputCP(CP_UTF8);
+#endif
+}
+
+// Counts what the arena takes through its allocator
+typedef struct {
+    size_t calls;
+    size_t live;
+} Counter;
+
+static void* counting_alloc(void* ctx, size_t size) {
+    Counter* c = (Counter*)ctx;
+    c->calls++;
+    c->live += size;
+    return malloc(size);
+}
+
+static void counting_free(void* ctx, void* p, size_t size) {
+    Counter* c = (Counter*)ctx;
+    c->live -= size;
+    free(p);
+}
+
+// 1/1! + 1/2! + ... + 1/n!, with the factorials kept as number nodes
+static ExprIndex exp_partial_sum(ExprArena* a, int n) {
+    char num[16];
+    ExprIndex fact = expr_number(a, "1");
+    ExprIndex sum = expr_number(a, "0");
+    for (int i = 1; i <= n; i++) {
+        sprintf(num, "%d", i);
+        fact = expr_simplify(a, expr_mul(a, fact, expr_number(a, num)));
+        sum = expr_simplify(a, expr_add(a, sum, expr_div(a, expr_number(a, "1"), fact)));
+    }
+    return sum;
+}
+
+int main() {
+
+    setup_utf8_console();
+
+    // Before any other GMP allocation
+    expr_gmp_pool_install();
+
+    Counter counter = {0, 0};
+    ExprAllocator allocator = {counting_alloc, counting_free, &counter};
+    ExprArena* a = (ExprArena*)malloc(sizeof(ExprArena));
+    if (!a) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    expr_arena_init(a);
+    expr_arena_set_allocator(a, &allocator);
+    printf("----------------------------------------------------\n");
+    printf(" Example: Number limbs from the arena\n");
+    printf("----------------------------------------------------\n");
+    {
+        char* first = NULL;
+        for (int round = 0; round < 3; round++) {
+            ExprIndex s = exp_partial_sum(a, 60);
+            char* text = expr_to_string(a, s);
+            if (!first) {
+                printf("sum 1/k!, k = 1..60 = %s\n", text);
+                printf("approx %.15f\n", expr_value_d(a, s));
+                first = text;
+            } else {
+                printf("round %d gives the same value: %d\n", round + 1, strcmp(first, text) == 0);
+                free(text);
+            }
+            // Every limb goes back to the arena's pools at once
+            expr_arena_clear(a);
+        }
+        free(first);
+        printf("limb chunks came from the allocator: %d\n", counter.calls > 0);
+    }
+    expr_arena_destroy(a);
+    printf("all returned after destroy: %d\n", counter.live == 0);
+    free(a);
+
+    return 0;
+}
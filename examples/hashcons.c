@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <stdlib.h>
+#define CYMCALC_THREADS
+#define CYMCALC_IMPLEMENTATION
+#include "..\cymcalc.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+void setup_utf8_console() {
+#ifdef _WIN32
+    SetConsoleOutputCP(CP_UTF8);
+#endif
+}
+
+#define THREADS 4
+
+static ExprArena a;
+static ExprHashCons table;
+
+typedef struct {
+    int offset;
+    ExprIndex root;
+} Builder;
+
+// sum_{i=1..40} (x+i)*(y+i), each thread making the terms in a different
+// order so that they race for different entries of the table
+static void* build_sum(void* arg) {
+    Builder* b = (Builder*)arg;
+    char num[8];
+    ExprIndex x = expr_symbol(&a, "x");
+    ExprIndex y = expr_symbol(&a, "y");
+    ExprIndex terms[40];
+    for (int k = 0; k < 40; k++) {
+        int i = (k + b->offset) % 40 + 1;
+        sprintf(num, "%d", i);
+        ExprIndex n = expr_number(&a, num);
+        terms[i - 1] = expr_mul(&a, expr_add(&a, x, n), expr_add(&a, y, n));
+    }
+    ExprIndex sum = terms[0];
+    for (int i = 1; i < 40; i++) sum = expr_add(&a, sum, terms[i]);
+    b->root = sum;
+    return NULL;
+}
+
+static int nodes_used(void) {
+    return MAX_EXPR_COUNT - a.free_count;
+}
+
+int main() {
+
+    setup_utf8_console();
+
+    expr_arena_init(&a);
+    expr_hashcons_init(&table);
+    expr_arena_share(&a, &table);
+    printf("----------------------------------------------------\n");
+    printf(" Example: Hash-consing\n");
+    printf("----------------------------------------------------\n");
+    {
+        ExprIndex x = expr_symbol(&a, "x");
+        ExprIndex p = expr_add(&a, x, expr_number(&a, "1"));
+        ExprIndex q = expr_add(&a, expr_symbol(&a, "x"), expr_number(&a, "1"));
+        printf("x + 1 built twice, same index: %d\n", p == q);
+        printf("nodes used: %d\n", nodes_used());
+
+        ExprIndex sq = expr_mul(&a, p, q);
+        expr_print(&a, sq);
+        printf(", nodes used: %d\n", nodes_used());
+
+        // A freed node leaves the table; building it again makes a new one
+        expr_arena_free(&a, sq);
+        printf("after free, nodes used: %d\n", nodes_used());
+        ExprIndex again = expr_mul(&a, p, p);
+        printf("rebuilt, nodes used: %d\n", nodes_used());
+
+        ExprIndex d = expr_simplify(&a, expr_diff(&a, again, "x"));
+        printf("d/dx ");
+        expr_print(&a, again);
+        printf(" = ");
+        expr_print(&a, d);
+        printf("\n");
+    }
+
+    printf("----------------------------------------------------\n");
+    printf(" Example: Building one arena from several threads\n");
+    printf("----------------------------------------------------\n");
+    {
+        pthread_t threads[THREADS];
+        Builder builders[THREADS];
+        for (int t = 0; t < THREADS; t++) {
+            builders[t].offset = t * 10;
+            pthread_create(&threads[t], NULL, build_sum, &builders[t]);
+        }
+        for (int t = 0; t < THREADS; t++) pthread_join(threads[t], NULL);
+
+        ExprIndex root = builders[0].root;
+        int same = 1;
+        for (int t = 1; t < THREADS; t++) same &= builders[t].root == root;
+        printf("every thread got the same root: %d\n", same);
+        expr_arena_share(&a, NULL);
+        ExprIndex s = expr_simplify(&a, root);
+        expr_print(&a, s);
+        printf("\n");
+    }
+
+    expr_hashcons_free(&table);
+    return 0;
+}
@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#define CYMCALC_STATS
+#define CYMCALC_PROFILE_RULES
+#define CYMCALC_TRACE
+#define CYMCALC_IMPLEMENTATION
+#include "..\cymcalc.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+void setup_utf8_console() {
+#ifdef _WIN32
+    SetConsoleOutputCP(CP_UTF8);
+#endif
+}
+
+#define REPORT_PATH "instrumentation.report.txt"
+#define TRACE_PATH "instrumentation.trace.json"
+
+static ExprArena a;
+
+static FILE* open_report(void) {
+    FILE* report = fopen(REPORT_PATH, "w+");
+    if (!report) {
+        fprintf(stderr, "Could not open %s\n", REPORT_PATH);
+        exit(1);
+    }
+    return report;
+}
+
+// Copies a report to stdout without the lines starting with skip, which
+// depend on the GMP build or the clock
+static void print_report(FILE* report, const char* skip) {
+    char line[256];
+    rewind(report);
+    while (fgets(line, sizeof(line), report)) {
+        if (strncmp(line, skip, strlen(skip)) != 0) fputs(line, stdout);
+    }
+    fclose(report);
+    remove(REPORT_PATH);
+}
+
+// Same order as ExprRule
+static const char* rule_names[EXPR_RULE_COUNT] = {
+    "add numbers", "add zero", "add swap", "add collect",
+    "mul numbers", "mul one", "mul zero", "mul swap", "mul coefficients", "mul distribute",
+    "mul square", "mul power merge",
+    "pow zero", "pow one", "pow zero base", "pow one base",
+    "expand", "diff", "int"
+};
+
+static int count_lines(FILE* report) {
+    char line[256];
+    int n = 0;
+    rewind(report);
+    while (fgets(line, sizeof(line), report)) n++;
+    fclose(report);
+    remove(REPORT_PATH);
+    return n;
+}
+
+// Begin and end events of one name in a trace
+typedef struct {
+    char name[32];
+    int begins;
+    int ends;
+} TraceCount;
+
+// Counts the events of a trace written by expr_trace_stop, one per line,
+// by name in order of first appearance. Returns the number of names.
+static int count_trace(const char* path, TraceCount* counts, int max, int* threads) {
+    FILE* in = fopen(path, "r");
+    if (!in) return -1;
+    char line[256];
+    int n = 0;
+    unsigned max_tid = 0;
+    while (fgets(line, sizeof(line), in)) {
+        char* name = strstr(line, "\"name\": \"");
+        char* ph = strstr(line, "\"ph\": \"");
+        char* tid = strstr(line, "\"tid\": ");
+        if (!name || !ph || !tid) continue;
+        name += strlen("\"name\": \"");
+        size_t len = strcspn(name, "\"");
+        int i = 0;
+        while (i < n && (strlen(counts[i].name) != len || strncmp(counts[i].name, name, len) != 0)) i++;
+        if (i == n) {
+            if (n == max || len >= sizeof(counts[i].name)) continue;
+            memcpy(counts[i].name, name, len);
+            counts[i].name[len] = '\0';
+            counts[i].begins = counts[i].ends = 0;
+            n++;
+        }
+        if (ph[strlen("\"ph\": \"")] == 'B') counts[i].begins++;
+        else counts[i].ends++;
+        unsigned t = (unsigned)strtoul(tid + strlen("\"tid\": "), NULL, 10);
+        if (t > max_tid) max_tid = t;
+    }
+    fclose(in);
+    *threads = (int)max_tid;
+    return n;
+}
+
+// Differentiates, simplifies, expands and evaluates a small model
+static void workload(void) {
+    ExprIndex x = expr_symbol(&a, "x");
+    ExprIndex y = expr_symbol(&a, "y");
+    ExprIndex p = expr_pow(&a, expr_add(&a, x, expr_add(&a, y, expr_number(&a, "1"))), expr_number(&a, "4"));
+    ExprIndex f = expr_add(&a, p, expr_mul(&a, expr_func(&a, FUNC_SIN, x), expr_func(&a, FUNC_EXP, y)));
+    ExprIndex df = expr_simplify(&a, expr_diff(&a, f, "x"));
+    expr_expand(&a, p);
+    ExprIndex at = expr_substitute(&a, expr_substitute(&a, df, "x", "1/2"), "y", "-1");
+    printf("df/dx at (1/2, -1) = %.6f\n", expr_eval_numeric(&a, at));
+    ExprIndex n = expr_number(&a, "3/7");
+    printf("3/7 = %.6f, again %.6f\n", expr_value_d(&a, n), expr_value_d(&a, n));
+}
+
+int main() {
+
+    setup_utf8_console();
+
+    expr_arena_init(&a);
+    printf("----------------------------------------------------\n");
+    printf(" Example: Arena and algorithm counters\n");
+    printf("----------------------------------------------------\n");
+    {
+        workload();
+        FILE* report = open_report();
+        expr_stats_print(&a, report);
+        print_report(report, "gmp bytes");
+
+        expr_arena_clear(&a);
+        expr_stats_reset(&a);
+        printf("after clear and reset: %zu allocated, gmp bytes %zu\n", a.stats.nodes_allocated, a.stats.gmp_bytes);
+    }
+
+    printf("----------------------------------------------------\n");
+    printf(" Example: Rule profiler\n");
+    printf("----------------------------------------------------\n");
+    {
+        expr_arena_clear(&a);
+        expr_rules_reset(&a);
+        workload();
+        // Timings vary from run to run, so only hits and nodes are shown
+        int fired = 0;
+        printf("%-18s %6s %6s\n", "rule", "hits", "nodes");
+        for (int i = 0; i < EXPR_RULE_COUNT; i++) {
+            if (!a.rules.hits[i]) continue;
+            printf("%-18s %6zu %6zu\n", rule_names[i], a.rules.hits[i], a.rules.nodes[i]);
+            fired++;
+        }
+        FILE* report = open_report();
+        expr_rules_print(&a, report);
+        printf("report has a row per rule that fired: %d\n", count_lines(report) == fired + 1);
+
+        expr_rules_reset(&a);
+        size_t hits = 0;
+        for (int i = 0; i < EXPR_RULE_COUNT; i++) hits += a.rules.hits[i];
+        printf("hits after reset: %zu\n", hits);
+    }
+
+    printf("----------------------------------------------------\n");
+    printf(" Example: Trace events\n");
+    printf("----------------------------------------------------\n");
+    {
+        expr_arena_clear(&a);
+        expr_trace_start(TRACE_PATH);
+        workload();
+        expr_trace_stop();
+        // Not recorded once stopped
+        workload();
+
+        TraceCount counts[16];
+        int threads = 0;
+        int n = count_trace(TRACE_PATH, counts, 16, &threads);
+        int balanced = n > 0;
+        for (int i = 0; i < n; i++) {
+            printf("%-18s %d begin, %d end\n", counts[i].name, counts[i].begins, counts[i].ends);
+            balanced &= counts[i].begins == counts[i].ends;
+        }
+        printf("balanced: %d, threads: %d\n", balanced, threads);
+        remove(TRACE_PATH);
+    }
+
+    return 0;
+}
@@ -47,5 +47,38 @@ int main() {
         printf("\n");
     }
 
+    printf("----------------------------------------------------\n");
+    printf(" Scratch temporaries\n");
+    printf("----------------------------------------------------\n");
+    {
+        // 2^-k for k = 0..19 all borrowed at once, past EXPR_SCRATCH_COUNT
+        mpq_ptr q[20];
+        for (int k = 0; k < 20; k++) {
+            q[k] = expr_scratch_q(&a);
+            mpq_set_ui(q[k], 1, 1ul << k);
+        }
+        mpq_ptr sum = expr_scratch_q(&a);
+        mpq_set_ui(sum, 0, 1);
+        for (int k = 0; k < 20; k++) mpq_add(sum, sum, q[k]);
+        ExprIndex s = expr_number_mpq(&a, sum);
+        expr_scratch_q_release(&a, sum);
+        for (int k = 20; k-- > 0;) expr_scratch_q_release(&a, q[k]);
+        printf("sum of 2^-k, k = 0..19 = ");
+        expr_print(&a, s);
+        printf("\n");
+
+        mpz_ptr z = expr_scratch_z(&a);
+        mpz_fac_ui(z, 30);
+        mpq_ptr r = expr_scratch_q(&a);
+        mpq_set_z(r, z);
+        ExprIndex f = expr_number_mpq(&a, r);
+        expr_scratch_q_release(&a, r);
+        expr_scratch_z_release(&a, z);
+        printf("30! = ");
+        expr_print(&a, f);
+        printf("\n");
+        printf("all handed back: %d\n", a.scratch_q_top == 0 && a.scratch_z_top == 0);
+    }
+
     return 0;
 }
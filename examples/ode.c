@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#define CYMCALC_IMPLEMENTATION
+#include "..\cymcalc.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+void setup_utf8_console() {
+#ifdef _WIN32
+    SetConsoleOutputCP(CP_UTF8);
+#endif
+}
+
+static ExprArena a;
+
+int main() {
+
+    setup_utf8_console();
+
+    expr_arena_init(&a);
+    ExprIndex minus_one = expr_number(&a, "-1");
+    printf("----------------------------------------------------\n");
+    printf(" Example: Ordinary differential equations\n");
+    printf("----------------------------------------------------\n");
+    {
+        // y'' = -y as u' = v, v' = -u, one period from (1, 0)
+        const char* states[2] = {"u", "v"};
+        ExprIndex rhs[2] = {expr_symbol(&a, "v"), expr_mul(&a, minus_one, expr_symbol(&a, "u"))};
+        ExprODE ode;
+        expr_ode_init(&ode, &a, rhs, states, 2, NULL);
+        double y[2] = {1, 0};
+        bool ok = expr_ode_rk45(&ode, 0, 2 * M_PI, y, 1e-10, 1e-12);
+        printf("rk45 u'=v, v'=-u over one period: ok %d, u = %.6f, v = %.6f\n", ok, y[0], fabs(y[1]));
+        ok = expr_ode_rk45(&ode, 2 * M_PI, 0, y, 1e-10, 1e-12);
+        printf("and back: ok %d, u = %.6f, v = %.6f\n", ok, y[0], fabs(y[1]));
+        expr_ode_clear(&ode);
+    }
+    {
+        // y' = t y, y(0) = 1, so y(1) = e^(1/2)
+        const char* states[1] = {"y"};
+        ExprIndex rhs[1] = {expr_mul(&a, expr_symbol(&a, "t"), expr_symbol(&a, "y"))};
+        ExprODE ode;
+        expr_ode_init(&ode, &a, rhs, states, 1, "t");
+        double y[1] = {1};
+        bool ok = expr_ode_rk45(&ode, 0, 1, y, 1e-10, 1e-12);
+        printf("rk45 y'=ty: ok %d, y(1) = %.6f, exact %.6f\n", ok, y[0], exp(0.5));
+        y[0] = 1;
+        ok = expr_ode_rosenbrock(&ode, 0, 1, y, 1e-8, 1e-10);
+        printf("rosenbrock y'=ty: ok %d, y(1) = %.5f\n", ok, y[0]);
+        expr_ode_clear(&ode);
+    }
+    {
+        // Stiff: y' = -1000 (y - cos(t)), y(0) = 0. The solution follows cos(t)
+        // after a fast transient; at loose tolerances rk45 is held back by
+        // stability, rosenbrock only by accuracy.
+        const char* states[1] = {"y"};
+        ExprIndex t = expr_symbol(&a, "t");
+        ExprIndex diff = expr_add(&a, expr_symbol(&a, "y"), expr_mul(&a, minus_one, expr_func(&a, FUNC_COS, t)));
+        ExprIndex rhs[1] = {expr_mul(&a, expr_number(&a, "-1000"), diff)};
+        ExprODE ode;
+        expr_ode_init(&ode, &a, rhs, states, 1, "t");
+        double y[1] = {0};
+        bool ok = expr_ode_rosenbrock(&ode, 0, 10, y, 1e-3, 1e-3);
+        size_t implicit_steps = ode.steps;
+        printf("rosenbrock stiff: ok %d, y(10) = %.3f\n", ok, y[0]);
+        y[0] = 0;
+        ok = expr_ode_rk45(&ode, 0, 10, y, 1e-3, 1e-3);
+        printf("rk45 stiff: ok %d, y(10) = %.3f\n", ok, y[0]);
+        printf("rosenbrock took fewer steps: %d\n", implicit_steps < ode.steps);
+        expr_ode_clear(&ode);
+    }
+    {
+        // Four trajectories of y' = -y stepped together
+        const char* states[1] = {"y"};
+        ExprIndex rhs[1] = {expr_mul(&a, minus_one, expr_symbol(&a, "y"))};
+        ExprODE ode;
+        expr_ode_init(&ode, &a, rhs, states, 1, NULL);
+        double y[4] = {1, 2, 3, 4};
+        bool ok = expr_ode_rk45_batch(&ode, 0, 1, y, 4, 1e-10, 1e-12);
+        printf("rk45 batch y'=-y: ok %d, y(1) = %.6f %.6f %.6f %.6f\n", ok, y[0], y[1], y[2], y[3]);
+        expr_ode_clear(&ode);
+    }
+
+    return 0;
+}
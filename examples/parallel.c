@@ -0,0 +1,73 @@
+#include <stdio.h>
+#include <stdlib.h>
+#define CYMCALC_THREADS
+#define CYMCALC_IMPLEMENTATION
+#include "..\cymcalc.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+void setup_utf8_console() {
+#ifdef _WIN32
+    SetConsoleOutputCP(CP_UTF8);
+#endif
+}
+
+static ExprArena a;
+static ExprPool pool;
+
+int main() {
+
+    setup_utf8_console();
+
+    expr_arena_init(&a);
+    expr_pool_init(&pool, 4);
+    printf("----------------------------------------------------\n");
+    printf(" Example: Parallel simplification\n");
+    printf("----------------------------------------------------\n");
+    {
+        // sum_{i=1..60} (x+i)(y+i), large enough to be split over the pool
+        char num[8];
+        ExprIndex x = expr_symbol(&a, "x");
+        ExprIndex y = expr_symbol(&a, "y");
+        ExprIndex m = expr_number(&a, "0");
+        for (int i = 1; i <= 60; i++) {
+            sprintf(num, "%d", i);
+            ExprIndex term = expr_mul(&a, expr_add(&a, x, expr_number(&a, num)), expr_add(&a, y, expr_number(&a, num)));
+            m = expr_add(&a, m, term);
+        }
+        ExprIndex sequential = expr_simplify(&a, m);
+        ExprIndex parallel = expr_simplify_parallel(&pool, &a, m);
+        expr_print(&a, sequential);
+        printf("\n");
+        expr_print(&a, parallel);
+        printf("\n");
+        printf("equal: %d\n", expr_equal(&a, sequential, parallel));
+    }
+    {
+        // sum_{i=1..16} (sin((x+i)(x-i)) + exp(i x + i x)), not a polynomial
+        char num[8];
+        ExprIndex x = expr_symbol(&a, "x");
+        ExprIndex m = expr_number(&a, "0");
+        for (int i = 1; i <= 16; i++) {
+            sprintf(num, "-%d", i);
+            ExprIndex k = expr_number(&a, num + 1);
+            ExprIndex arg = expr_mul(&a, expr_add(&a, x, k), expr_add(&a, x, expr_number(&a, num)));
+            ExprIndex kx = expr_mul(&a, k, x);
+            ExprIndex term = expr_add(&a, expr_func(&a, FUNC_SIN, arg), expr_func(&a, FUNC_EXP, expr_add(&a, kx, kx)));
+            m = expr_add(&a, m, term);
+        }
+        printf("above threshold: %d\n", expr_size(&a, m) >= EXPR_PARALLEL_THRESHOLD);
+        ExprIndex sequential = expr_simplify(&a, m);
+        ExprIndex parallel = expr_simplify_parallel(&pool, &a, m);
+        expr_print(&a, sequential);
+        printf("\n");
+        expr_print(&a, parallel);
+        printf("\n");
+        printf("equal: %d\n", expr_equal(&a, sequential, parallel));
+    }
+
+    expr_pool_destroy(&pool);
+    return 0;
+}
@@ -0,0 +1,172 @@
+#include <stdio.h>
+#include <stdlib.h>
+#define CYMCALC_IMPLEMENTATION
+#include "..\cymcalc.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+void setup_utf8_console() {
+#ifdef _WIN32
+    SetConsoleOutputCP(CP_UTF8);
+#endif
+}
+
+static ExprArena a;
+
+static void print_poly(const ExprPoly* p) {
+    expr_print(&a, expr_from_poly(&a, p, "x"));
+    printf("\n");
+}
+
+static int poly_equal(const ExprPoly* p, const ExprPoly* q) {
+    ExprPoly d;
+    expr_poly_init(&d);
+    expr_poly_sub(&d, p, q);
+    int equal = expr_poly_degree(&d) < 0;
+    expr_poly_clear(&d);
+    return equal;
+}
+
+int main() {
+
+    setup_utf8_console();
+
+    expr_arena_init(&a);
+    ExprIndex x = expr_symbol(&a, "x");
+    printf("----------------------------------------------------\n");
+    printf(" Example: Dense univariate polynomials\n");
+    printf("----------------------------------------------------\n");
+    {
+        // Short operands: schoolbook
+        ExprPoly p, q, r, rem;
+        expr_poly_init(&p);
+        expr_poly_init(&q);
+        expr_poly_init(&r);
+        expr_poly_init(&rem);
+        expr_to_poly(&p, &a, expr_add(&a, expr_pow(&a, x, expr_number(&a, "3")), expr_mul(&a, expr_number(&a, "1/2"), x)), "x");
+        expr_to_poly(&q, &a, expr_add(&a, x, expr_number(&a, "-2")), "x");
+        printf("p = ");
+        print_poly(&p);
+        printf("q = ");
+        print_poly(&q);
+        expr_poly_mul(&r, &p, &q);
+        printf("p q = ");
+        print_poly(&r);
+        expr_poly_divrem(&r, &rem, &p, &q);
+        printf("p = q (");
+        expr_print(&a, expr_from_poly(&a, &r, "x"));
+        printf(") + ");
+        print_poly(&rem);
+        expr_poly_clear(&p);
+        expr_poly_clear(&q);
+        expr_poly_clear(&r);
+        expr_poly_clear(&rem);
+    }
+    {
+        // Long operands: Kronecker substitution for the product and the
+        // exact quotient. (x+1)^150 (x-1)^150 = (x^2-1)^150
+        ExprPoly p, q, r, s;
+        expr_poly_init(&p);
+        expr_poly_init(&q);
+        expr_poly_init(&r);
+        expr_poly_init(&s);
+        expr_to_poly(&p, &a, expr_add(&a, x, expr_number(&a, "1")), "x");
+        expr_to_poly(&q, &a, expr_add(&a, x, expr_number(&a, "-1")), "x");
+        expr_poly_pow_ui(&p, &p, 150);
+        expr_poly_pow_ui(&q, &q, 150);
+        expr_poly_mul(&r, &p, &q);
+        expr_to_poly(&s, &a, expr_add(&a, expr_pow(&a, x, expr_number(&a, "2")), expr_number(&a, "-1")), "x");
+        expr_poly_pow_ui(&s, &s, 150);
+        printf("deg (x+1)^150 (x-1)^150 = %ld, equals (x^2-1)^150: %d\n", expr_poly_degree(&r), poly_equal(&r, &s));
+
+        mpq_t c;
+        mpq_init(c);
+        expr_poly_get_coeff(c, &p, 75);
+        gmp_printf("coefficient of x^75 in (x+1)^150: %Qd\n", c);
+        mpq_clear(c);
+
+        ExprPoly quo;
+        expr_poly_init(&quo);
+        printf("divexact by (x-1)^150: %d", expr_poly_divexact(&quo, &r, &q));
+        printf(", gives (x+1)^150: %d\n", poly_equal(&quo, &p));
+        mpq_t two;
+        mpq_init(two);
+        mpq_set_ui(two, 2, 1);
+        expr_poly_set_coeff(&r, 0, two);
+        mpq_clear(two);
+        printf("divexact after changing the constant term: %d\n", expr_poly_divexact(&quo, &r, &q));
+        expr_poly_clear(&quo);
+        expr_poly_clear(&p);
+        expr_poly_clear(&q);
+        expr_poly_clear(&r);
+        expr_poly_clear(&s);
+    }
+    {
+        ExprPoly p;
+        expr_poly_init(&p);
+        printf("sin(x) is a polynomial: %d\n", expr_to_poly(&p, &a, expr_func(&a, FUNC_SIN, x), "x"));
+        expr_poly_clear(&p);
+    }
+
+    printf("----------------------------------------------------\n");
+    printf(" Example: Sparse multivariate polynomials\n");
+    printf("----------------------------------------------------\n");
+    {
+        const char* vars[3] = {"x", "y", "z"};
+        ExprMPolyRing ring;
+        expr_mpoly_ring_init(&ring, vars, 3);
+        ExprIndex y = expr_symbol(&a, "y");
+        ExprIndex z = expr_symbol(&a, "z");
+        ExprMPoly p, q, r, quo;
+        expr_mpoly_init(&p, &ring);
+        expr_mpoly_init(&q, &ring);
+        expr_mpoly_init(&r, &ring);
+        expr_mpoly_init(&quo, &ring);
+
+        // (x + y z + 1)(x - y z + 2/3), a heap merge of the partial products
+        ExprIndex yz = expr_mul(&a, y, z);
+        expr_to_mpoly(&p, &a, expr_add(&a, expr_add(&a, x, yz), expr_number(&a, "1")));
+        expr_to_mpoly(&q, &a, expr_add(&a, expr_add(&a, x, expr_mul(&a, expr_number(&a, "-1"), yz)), expr_number(&a, "2/3")));
+        expr_mpoly_mul(&r, &p, &q);
+        printf("(x + y z + 1)(x - y z + 2/3) = ");
+        expr_print(&a, expr_from_mpoly(&a, &r));
+        printf("\n");
+        printf("divexact by x + y z + 1: %d, quotient ", expr_mpoly_divexact(&quo, &r, &p));
+        expr_print(&a, expr_from_mpoly(&a, &quo));
+        printf("\n");
+        printf("divexact by x + y: ");
+        expr_to_mpoly(&q, &a, expr_add(&a, x, y));
+        printf("%d\n", expr_mpoly_divexact(&quo, &r, &q));
+
+        // (x + y + z)^12 has C(14, 2) = 91 terms
+        expr_to_mpoly(&p, &a, expr_add(&a, expr_add(&a, x, y), z));
+        expr_mpoly_pow_ui(&r, &p, 12);
+        printf("terms of (x + y + z)^12: %zu\n", r.len);
+        expr_mpoly_pow_ui(&q, &p, 5);
+        expr_mpoly_divexact(&quo, &r, &q);
+        expr_mpoly_pow_ui(&q, &p, 7);
+        expr_mpoly_sub(&q, &q, &quo);
+        printf("(x + y + z)^12 / (x + y + z)^5 = (x + y + z)^7: %d\n", q.len == 0);
+
+        // Exponents are 15 bits wide; x^20000 squared does not fit
+        expr_to_mpoly(&p, &a, expr_pow(&a, x, expr_number(&a, "20000")));
+        printf("x^20000 * x^20000 fits: %d\n", expr_mpoly_mul(&r, &p, &p));
+
+        ExprIndex e = expr_mul(&a, expr_add(&a, x, y), expr_add(&a, expr_add(&a, x, expr_mul(&a, expr_number(&a, "-1"), y)), z));
+        printf("expand ");
+        expr_print(&a, e);
+        printf(" = ");
+        expr_print(&a, expr_expand(&a, e));
+        printf("\n");
+
+        expr_mpoly_clear(&p);
+        expr_mpoly_clear(&q);
+        expr_mpoly_clear(&r);
+        expr_mpoly_clear(&quo);
+        expr_mpoly_ring_clear(&ring);
+    }
+
+    return 0;
+}
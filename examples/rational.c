@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <stdlib.h>
+#define CYMCALC_IMPLEMENTATION
+#include "..\cymcalc.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+void setup_utf8_console() {
+#ifdef _WIN32
+    SetConsoleOutputCP(CP_UTF8);
+#endif
+}
+
+static ExprArena a;
+
+static void print_normal(ExprIndex e) {
+    expr_print(&a, e);
+    printf(" = ");
+    ExprIndex n = expr_normal(&a, e);
+    if (n == INVALID_INDEX) printf("not a rational function");
+    else expr_print(&a, n);
+    printf("\n");
+}
+
+static void print_gcd(ExprIndex p, ExprIndex q) {
+    ExprIndex both = expr_add(&a, p, q);
+    ExprMPolyRing ring;
+    expr_mpoly_ring_from_expr(&ring, &a, both);
+    ExprMPoly mp, mq, g;
+    expr_mpoly_init(&mp, &ring);
+    expr_mpoly_init(&mq, &ring);
+    expr_mpoly_init(&g, &ring);
+    printf("gcd(");
+    expr_print(&a, p);
+    printf(", ");
+    expr_print(&a, q);
+    printf(") = ");
+    if (expr_to_mpoly(&mp, &a, p) && expr_to_mpoly(&mq, &a, q) && expr_mpoly_gcd(&g, &mp, &mq)) {
+        expr_print(&a, expr_from_mpoly(&a, &g));
+    } else {
+        printf("unknown");
+    }
+    printf("\n");
+    expr_mpoly_clear(&mp);
+    expr_mpoly_clear(&mq);
+    expr_mpoly_clear(&g);
+    expr_mpoly_ring_clear(&ring);
+}
+
+int main() {
+
+    setup_utf8_console();
+
+    expr_arena_init(&a);
+    ExprIndex x = expr_symbol(&a, "x");
+    ExprIndex y = expr_symbol(&a, "y");
+    ExprIndex one = expr_number(&a, "1");
+    ExprIndex minus_one = expr_number(&a, "-1");
+    ExprIndex two = expr_number(&a, "2");
+    ExprIndex x2 = expr_pow(&a, x, two);
+    ExprIndex y2 = expr_pow(&a, y, two);
+
+    printf("----------------------------------------------------\n");
+    printf(" Example: Rational normal form\n");
+    printf("----------------------------------------------------\n");
+    {
+        // (x-1)/(x^2-1)
+        ExprIndex num = expr_add(&a, x, minus_one);
+        ExprIndex den = expr_add(&a, x2, minus_one);
+        print_normal(expr_mul(&a, num, expr_pow(&a, den, minus_one)));
+        // (x^2-1)/(x-1)
+        print_normal(expr_mul(&a, den, expr_pow(&a, num, minus_one)));
+    }
+    {
+        // 1/x + 1/y
+        print_normal(expr_add(&a, expr_pow(&a, x, minus_one), expr_pow(&a, y, minus_one)));
+    }
+    {
+        // 2x/(4xy + 6x)
+        ExprIndex num = expr_mul(&a, two, x);
+        ExprIndex den = expr_add(&a, expr_mul(&a, expr_number(&a, "4"), expr_mul(&a, x, y)), expr_mul(&a, expr_number(&a, "6"), x));
+        print_normal(expr_mul(&a, num, expr_pow(&a, den, minus_one)));
+    }
+    {
+        print_normal(expr_add(&a, expr_func(&a, FUNC_SIN, x), one));
+    }
+
+    printf("----------------------------------------------------\n");
+    printf(" Example: Polynomial gcd\n");
+    printf("----------------------------------------------------\n");
+    {
+        // x^2 - y^2 and x^2 + 2xy + y^2
+        ExprIndex p = expr_add(&a, x2, expr_mul(&a, minus_one, y2));
+        ExprIndex q = expr_add(&a, expr_add(&a, x2, expr_mul(&a, two, expr_mul(&a, x, y))), y2);
+        print_gcd(p, q);
+    }
+    {
+        // 6x^2 + 6x and 4x + 4
+        ExprIndex six = expr_number(&a, "6");
+        ExprIndex p = expr_add(&a, expr_mul(&a, six, x2), expr_mul(&a, six, x));
+        ExprIndex q = expr_add(&a, expr_mul(&a, expr_number(&a, "4"), x), expr_number(&a, "4"));
+        print_gcd(p, q);
+    }
+    {
+        // x^2 + 1 and x + 1
+        print_gcd(expr_add(&a, x2, one), expr_add(&a, x, one));
+    }
+
+    return 0;
+}
@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#define CYMCALC_IMPLEMENTATION
+#include "..\cymcalc.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+void setup_utf8_console() {
+#ifdef _WIN32
+    SetConsoleOutputCP(CP_UTF8);
+#endif
+}
+
+// More than two blocks of EXPR_TAPE_LANES, the last one partial
+#define POINTS 150
+
+static ExprArena a;
+
+int main() {
+
+    setup_utf8_console();
+
+    expr_arena_init(&a);
+    ExprIndex x = expr_symbol(&a, "x");
+    ExprIndex y = expr_symbol(&a, "y");
+    printf("----------------------------------------------------\n");
+    printf(" Example: Compiled evaluation\n");
+    printf("----------------------------------------------------\n");
+    {
+        // f = sin(x) y^3 + exp(x y) / 2 and df/dx share x y and sin(x)
+        ExprIndex f = expr_add(&a, expr_mul(&a, expr_func(&a, FUNC_SIN, x), expr_pow(&a, y, expr_number(&a, "3"))),
+                               expr_mul(&a, expr_number(&a, "1/2"), expr_func(&a, FUNC_EXP, expr_mul(&a, x, y))));
+        ExprIndex outputs[2] = {f, expr_simplify(&a, expr_diff(&a, f, "x"))};
+        const char* vars[2] = {"x", "y"};
+        ExprTape tape = {0};
+        expr_tape_compile(&tape, &a, outputs, 2, vars, 2);
+
+        double point[2] = {0.5, -1.5};
+        double out[2];
+        expr_tape_eval(&tape, point, out);
+        printf("f, df/dx at (0.5, -1.5) = %.6f, %.6f\n", out[0], out[1]);
+
+        double xs[2 * POINTS];
+        double batch[2 * POINTS];
+        for (int j = 0; j < POINTS; j++) {
+            xs[j] = -1.0 + 2.0 * j / POINTS;
+            xs[POINTS + j] = 0.25 * j / POINTS;
+        }
+        expr_tape_eval_batch(&tape, xs, POINTS, batch);
+        int same = 1;
+        for (int j = 0; j < POINTS; j++) {
+            double p[2] = {xs[j], xs[POINTS + j]};
+            expr_tape_eval(&tape, p, out);
+            same &= fabs(out[0] - batch[j]) <= 1e-12 * (1 + fabs(out[0])) &&
+                    fabs(out[1] - batch[POINTS + j]) <= 1e-12 * (1 + fabs(out[1]));
+        }
+        printf("batch of %d points matches point by point: %d\n", POINTS, same);
+
+        expr_tape_clear(&tape);
+
+        const char* only_x[1] = {"x"};
+        ExprTape partial = {0};
+        printf("compiles without y: %d\n", expr_tape_compile(&partial, &a, outputs, 2, only_x, 1));
+        expr_tape_clear(&partial);
+    }
+
+    printf("----------------------------------------------------\n");
+    printf(" Example: Root finding\n");
+    printf("----------------------------------------------------\n");
+    {
+        double root;
+        // x^2 - 2 by Newton from 1
+        ExprIndex f = expr_add(&a, expr_pow(&a, x, expr_number(&a, "2")), expr_number(&a, "-2"));
+        bool ok = expr_find_root(&a, f, "x", 1.0, NULL, 1e-12, &root);
+        printf("x^2 - 2 from 1: ok %d, x = %.10f\n", ok, root);
+
+        // cos(x) - x on [0, 1]
+        ExprIndex g = expr_add(&a, expr_func(&a, FUNC_COS, x), expr_mul(&a, expr_number(&a, "-1"), x));
+        double bracket[2] = {0.0, 1.0};
+        ok = expr_find_root(&a, g, "x", 0.5, bracket, 1e-12, &root);
+        printf("cos(x) - x on [0, 1]: ok %d, x = %.10f\n", ok, root);
+
+        // x^3 - 2x + 2 cycles between 0 and 1 under plain Newton; the
+        // bracket [-3, 0] steers it to the real root
+        ExprIndex h = expr_add(&a, expr_add(&a, expr_pow(&a, x, expr_number(&a, "3")), expr_mul(&a, expr_number(&a, "-2"), x)),
+                               expr_number(&a, "2"));
+        double wide[2] = {-3.0, 0.0};
+        ok = expr_find_root(&a, h, "x", 0.0, wide, 1e-12, &root);
+        printf("x^3 - 2x + 2 on [-3, 0] from 0: ok %d, x = %.10f\n", ok, root);
+
+        // No real root
+        ExprIndex k = expr_add(&a, expr_pow(&a, x, expr_number(&a, "2")), expr_number(&a, "1"));
+        printf("x^2 + 1 from 1: ok %d\n", expr_find_root(&a, k, "x", 1.0, NULL, 1e-12, &root));
+
+        // x^3 = c for several c, compiled once
+        ExprIndex c = expr_symbol(&a, "c");
+        ExprIndex cube = expr_add(&a, expr_pow(&a, x, expr_number(&a, "3")), expr_mul(&a, expr_number(&a, "-1"), c));
+        double cs[4] = {1, 8, 27, 2};
+        double roots[4];
+        size_t n = expr_find_roots(&a, cube, "x", "c", cs, 4, 1.0, NULL, 1e-12, roots);
+        printf("cube roots of 1, 8, 27, 2: %zu converged, %.10f %.10f %.10f %.10f\n", n, roots[0], roots[1], roots[2], roots[3]);
+    }
+
+    return 0;
+}
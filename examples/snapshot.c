@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <stdlib.h>
+#define CYMCALC_THREADS
+#define CYMCALC_IMPLEMENTATION
+#include "..\cymcalc.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+void setup_utf8_console() {
+#ifdef _WIN32
+    SetConsoleOutputCP(CP_UTF8);
+#endif
+}
+
+#define THREADS 3
+
+static ExprSnapshot* model;
+static ExprIndex f;
+
+typedef struct {
+    const char* var;
+    char* result;
+} Reader;
+
+// Each reader differentiates the shared model in its own overlay
+static void* read_model(void* arg) {
+    Reader* r = (Reader*)arg;
+    ExprArena* overlay = (ExprArena*)malloc(sizeof(ExprArena));
+    if (!overlay) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    expr_arena_init_overlay(overlay, model);
+    ExprIndex df = expr_simplify(overlay, expr_diff(overlay, f, r->var));
+    r->result = expr_to_string(overlay, df);
+    expr_arena_destroy(overlay);
+    free(overlay);
+    return NULL;
+}
+
+int main() {
+
+    setup_utf8_console();
+
+    ExprArena* a = (ExprArena*)malloc(sizeof(ExprArena));
+    if (!a) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    expr_arena_init(a);
+    printf("----------------------------------------------------\n");
+    printf(" Example: Frozen snapshots\n");
+    printf("----------------------------------------------------\n");
+    {
+        // f = x^2 y + sin(x z) + 3 z
+        ExprIndex x = expr_symbol(a, "x");
+        ExprIndex y = expr_symbol(a, "y");
+        ExprIndex z = expr_symbol(a, "z");
+        f = expr_add(a, expr_add(a, expr_mul(a, expr_pow(a, x, expr_number(a, "2")), y),
+                                 expr_func(a, FUNC_SIN, expr_mul(a, x, z))),
+                     expr_mul(a, expr_number(a, "3"), z));
+        printf("f = ");
+        expr_print(a, f);
+        printf("\n");
+
+        model = expr_snapshot_freeze(a);
+        // The arena can go on; the snapshot keeps the nodes as they were
+        expr_arena_clear(a);
+
+        pthread_t threads[THREADS];
+        Reader readers[THREADS] = {{"x", NULL}, {"y", NULL}, {"z", NULL}};
+        for (int t = 0; t < THREADS; t++) pthread_create(&threads[t], NULL, read_model, &readers[t]);
+        for (int t = 0; t < THREADS; t++) pthread_join(threads[t], NULL);
+        for (int t = 0; t < THREADS; t++) {
+            printf("df/d%s = %s\n", readers[t].var, readers[t].result);
+            free(readers[t].result);
+        }
+    }
+    {
+        // Overlay nodes may point into the snapshot, and numbers there come
+        // with their double precomputed
+        ExprArena* overlay = (ExprArena*)malloc(sizeof(ExprArena));
+        if (!overlay) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        expr_arena_init_overlay(overlay, model);
+        ExprIndex g = expr_mul(overlay, f, expr_symbol(overlay, "w"));
+        printf("g = ");
+        expr_print(overlay, g);
+        printf("\n");
+        ExprIndex at = expr_substitute(overlay, expr_substitute(overlay, expr_substitute(overlay,
+                           expr_substitute(overlay, g, "x", "0"), "y", "2"), "z", "1/3"), "w", "2");
+        printf("g(0, 2, 1/3, 2) = %.6f\n", expr_eval_numeric(overlay, at));
+        expr_arena_destroy(overlay);
+        free(overlay);
+    }
+
+    expr_snapshot_free(model);
+    expr_arena_destroy(a);
+    free(a);
+    return 0;
+}
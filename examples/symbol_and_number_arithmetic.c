@@ -39,6 +39,25 @@ int main() {
         expr_print(&a, ms);
         printf("\n");
     }
+    {
+        // A compact power whose expansion would not fit in the arena stays as it is
+        char name[8];
+        ExprIndex sum = expr_symbol(&a, "v0");
+        for (int i = 1; i < 8; i++) {
+            sprintf(name, "v%d", i);
+            sum = expr_add(&a, sum, expr_symbol(&a, name));
+        }
+        ExprIndex m = expr_pow(&a, sum, expr_number(&a, "8"));
+        for (int i = 0; i < 30; i++) {
+            sprintf(name, "w%d", i);
+            m = expr_add(&a, m, expr_symbol(&a, name));
+        }
+        expr_print(&a, m);
+        printf(" = ");
+        ExprIndex ms = expr_simplify(&a, m);
+        expr_print(&a, ms);
+        printf("\n");
+    }
 
     return 0;
 }
@@ -0,0 +1,112 @@
+#include <cstdio>
+#include <iostream>
+#include "..\cymcalc.hpp"
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+void setup_utf8_console() {
+#ifdef _WIN32
+    SetConsoleOutputCP(CP_UTF8);
+#endif
+}
+
+using namespace cymcalc;
+
+#ifdef CYMCALC_HAS_PMR
+// Counts what the arena takes from the resource
+class CountingResource : public std::pmr::memory_resource {
+public:
+    size_t allocations = 0;
+    size_t live = 0;
+
+private:
+    void* do_allocate(size_t bytes, size_t align) override {
+        allocations++;
+        live += bytes;
+        return std::pmr::new_delete_resource()->allocate(bytes, align);
+    }
+    void do_deallocate(void* p, size_t bytes, size_t align) override {
+        live -= bytes;
+        std::pmr::new_delete_resource()->deallocate(p, bytes, align);
+    }
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override { return this == &other; }
+};
+#endif
+
+int main() {
+
+    setup_utf8_console();
+
+    std::cout << "----------------------------------------------------\n";
+    std::cout << " Example: C++ wrapper\n";
+    std::cout << "----------------------------------------------------\n";
+    {
+        Arena arena;
+        Expression x = arena.symbol("x");
+        Expression y = arena.symbol("y");
+        Expression f = (x^2) + 3*sin(x) - y/2;
+        std::cout << "f = " << f << "\n";
+        Expression df = f.diff("x").simplify();
+        std::cout << "df/dx = " << df << "\n";
+        std::printf("df/dx at x = 0 is %.6f\n", df.substitute("x", "0").eval());
+        Expression g = (x + arena.number(1, 2)) * (x - 1);
+        std::cout << "expand " << g << " = " << g.expand() << "\n";
+        Expression r = 1/x + 1/y;
+        std::cout << "normal " << r << " = " << r.normal() << "\n";
+        std::printf("eval %s = %.6f\n", (exp(arena.number(0.5)) * 4).str().c_str(), (exp(arena.number(0.5)) * 4).eval());
+
+        // No rule for x sin(x) exp(x); the invalid handle carries through
+        Expression h = (x * sin(x) * exp(x)).integrate("x");
+        std::cout << "integrate x sin(x) exp(x): " << h << ", valid " << h.valid() << "\n";
+        std::cout << "then simplify: " << h.simplify() << "\n";
+
+        Expression a = x + 1;
+        Expression b = x + 1;
+        std::cout << "equals " << a.equals(b) << ", same handle " << (a == a) << "\n";
+    }
+
+    std::cout << "----------------------------------------------------\n";
+    std::cout << " Example: Compile-time expressions\n";
+    std::cout << "----------------------------------------------------\n";
+    {
+        constexpr ct::Sym<'x'> x{};
+        constexpr auto f = (x^ct::num<3>) + ct::num<2>*ct::sin(x);
+        constexpr auto df = ct::diff(f, x);
+        std::printf("f'(1/2) = %.6f\n", ct::eval(df, ct::bind(x, 0.5)));
+        auto k = ct::kernel(df, x);
+        std::printf("kernel at 0, 1: %.6f %.6f\n", k(0.0), k(1.0));
+
+        constexpr ct::Sym<'y'> y{};
+        constexpr auto p = x*y + (y^ct::num<2>);
+        auto kp = ct::kernel(ct::diff(p, y), x, y);
+        std::printf("d/dy (xy + y^2) at (3, 4) = %.6f\n", kp(3.0, 4.0));
+
+        Arena arena;
+        Expression e = ct::to_expr(arena, df);
+        std::cout << "to_expr: " << e << "\n";
+        std::cout << "matches the runtime derivative: "
+                  << e.simplify().equals(ct::to_expr(arena, f).diff("x").simplify()) << "\n";
+    }
+
+#ifdef CYMCALC_HAS_PMR
+    std::cout << "----------------------------------------------------\n";
+    std::cout << " Example: Arena on a memory resource\n";
+    std::cout << "----------------------------------------------------\n";
+    {
+        CountingResource resource;
+        {
+            Arena arena(&resource);
+            Expression x = arena.symbol("x");
+            Expression s = arena.number(0L);
+            for (long i = 1; i <= 5; i++) s += i * (x^i);
+            std::cout << "d/dx " << s << " = " << s.diff("x").simplify() << "\n";
+            std::cout << "allocated from the resource: " << (resource.allocations > 0) << "\n";
+        }
+        std::cout << "returned to the resource: " << (resource.live == 0) << "\n";
+    }
+#endif
+
+    return 0;
+}
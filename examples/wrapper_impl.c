@@ -0,0 +1,3 @@
+// The engine is C only; wrapper.cpp links it from here.
+#define CYMCALC_IMPLEMENTATION
+#include "..\cymcalc.h"
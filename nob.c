@@ -1,7 +1,178 @@
 #define NOB_IMPLEMENTATION
 #include "nob.h"
 
-#define REGRESSION_COUNT 4
+#define REGRESSION_COUNT 16
+
+// The C++ example; the engine itself only compiles as C, so it is linked
+// in from a C translation unit
+#define CPP_REGRESSION "wrapper"
+#define CPP_IMPL_SRC "examples\\wrapper_impl.c"
+#define CPP_IMPL_OBJ "examples\\wrapper_impl.o"
+#define CPP_SRC "examples\\wrapper.cpp"
+#define CPP_EXEC "examples\\wrapper.exe"
+
+static bool build_cpp_example(Nob_Cmd *cmd) {
+    nob_cmd_append(cmd,
+        "gcc", "-g", "-w", "-c", CPP_IMPL_SRC,
+        "-I", "C:/vcpkg/installed/x64-mingw-static/include",
+        "-o", CPP_IMPL_OBJ
+    );
+    if (!nob_cmd_run_sync_and_reset(cmd)) return false;
+    nob_cmd_append(cmd,
+        "g++", "-g", "-w", "-std=c++17", CPP_SRC, CPP_IMPL_OBJ,
+        "-I", "C:/vcpkg/installed/x64-mingw-static/include",
+        "-L", "C:/vcpkg/installed/x64-mingw-static/lib",
+        "-lgmp", "-lpthread", "-static",
+        "-o", CPP_EXEC
+    );
+    if (!nob_cmd_run_sync_and_reset(cmd)) return false;
+    nob_log(NOB_INFO, "Build Sucessful: %s", CPP_SRC);
+    return true;
+}
+
+// Benchmarks build on Linux against the system GMP
+#define BENCH_SRC "examples/bench.c"
+#define BENCH_EXEC "examples/bench"
+#define BENCH_OUTPUT "examples/bench.output.json"
+
+static bool build_bench(Nob_Cmd *cmd) {
+    nob_cmd_append(cmd, "cc", "-O2", "-o", BENCH_EXEC, BENCH_SRC, "-lgmp", "-lm");
+    if (!nob_cmd_run_sync_and_reset(cmd)) return false;
+    nob_log(NOB_INFO, "Build Sucessful: %s", BENCH_SRC);
+    return true;
+}
+
+// Runs every workload once and writes one JSON record per operation.
+// seconds is the time spent per operation, NULL for the default.
+static bool run_bench(Nob_Cmd *cmd, const char *output_file, const char *seconds) {
+    nob_cmd_append(cmd, "./" BENCH_EXEC, output_file);
+    if (seconds) nob_cmd_append(cmd, seconds);
+    return nob_cmd_run_sync_and_reset(cmd);
+}
+
+//-----------------------------------------------
+// Performance regression check
+//-----------------------------------------------
+
+#define BENCH_BASELINE "examples/bench.baseline.json"
+#define PERF_RUN_OUTPUT "examples/bench.run.json"
+#define PERF_RUNS 7
+#define PERF_SECONDS "0.1"
+// Allowed drop of ops/sec below the baseline median
+#define PERF_THRESHOLD 0.10
+
+typedef struct {
+    char name[160];            // workload/op
+    double samples[PERF_RUNS]; // ops/sec of each run
+    size_t count;
+    double median, low, high;  // median and its confidence interval
+} Perf_Entry;
+
+typedef struct {
+    Perf_Entry *items;
+    size_t count;
+    size_t capacity;
+} Perf_Entries;
+
+static Perf_Entry *perf_find(Perf_Entries *entries, const char *name) {
+    for (size_t i = 0; i < entries->count; i++) {
+        if (strcmp(entries->items[i].name, name) == 0) return &entries->items[i];
+    }
+    return NULL;
+}
+
+// Adds the ops/sec of every record in a bench output file. Records are one
+// per line, as examples/bench.c writes them.
+static bool perf_load(Perf_Entries *entries, const char *path) {
+    Nob_String_Builder sb = {0};
+    if (!nob_read_entire_file(path, &sb)) return false;
+    nob_sb_append_null(&sb);
+
+    for (char *line = sb.items; line && *line; ) {
+        char *next = strchr(line, '\n');
+        if (next) *next++ = '\0';
+
+        char workload[80], op[64];
+        char *w = strstr(line, "\"workload\": \"");
+        char *o = strstr(line, "\"op\": \"");
+        char *v = strstr(line, "\"ops_per_sec\": ");
+        double ops;
+        if (w && o && v &&
+            sscanf(w, "\"workload\": \"%79[^\"]", workload) == 1 &&
+            sscanf(o, "\"op\": \"%63[^\"]", op) == 1 &&
+            sscanf(v, "\"ops_per_sec\": %lf", &ops) == 1) {
+            char name[160];
+            snprintf(name, sizeof(name), "%s/%s", workload, op);
+            Perf_Entry *e = perf_find(entries, name);
+            if (!e) {
+                Perf_Entry fresh = {0};
+                strcpy(fresh.name, name);
+                nob_da_append(entries, fresh);
+                e = &entries->items[entries->count - 1];
+            }
+            if (e->count < PERF_RUNS) e->samples[e->count++] = ops;
+        }
+        line = next;
+    }
+    nob_sb_free(sb);
+    return true;
+}
+
+static int perf_compare(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Median with a distribution-free confidence interval from order statistics:
+// the narrowest symmetric pair of ranks whose binomial coverage is >= 95%,
+// or the full range when there are too few samples for that.
+static void perf_summarize(Perf_Entry *e) {
+    size_t n = e->count;
+    qsort(e->samples, n, sizeof(double), perf_compare);
+    e->median = n % 2 ? e->samples[n/2] : 0.5*(e->samples[n/2 - 1] + e->samples[n/2]);
+
+    // tail = P(B <= j) * 2^n for B ~ Bin(n, 1/2), binom = C(n, j)
+    double total = 1.0, tail = 1.0, binom = 1.0;
+    for (size_t i = 0; i < n; i++) total *= 2.0;
+    size_t j = 0;
+    while (2*(j + 1) < n) {
+        binom = binom*(double)(n - j)/(double)(j + 1);
+        if (1.0 - 2.0*(tail + binom)/total < 0.95) break;
+        tail += binom;
+        j++;
+    }
+    e->low = e->samples[j];
+    e->high = e->samples[n - 1 - j];
+}
+
+// Runs the suite PERF_RUNS times into entries
+static bool perf_collect(Nob_Cmd *cmd, Perf_Entries *entries) {
+    for (size_t run = 0; run < PERF_RUNS; run++) {
+        nob_log(NOB_INFO, "Benchmark run %zu/%d", run + 1, PERF_RUNS);
+        if (!run_bench(cmd, PERF_RUN_OUTPUT, PERF_SECONDS)) return false;
+        if (!perf_load(entries, PERF_RUN_OUTPUT)) return false;
+    }
+    for (size_t i = 0; i < entries->count; i++) perf_summarize(&entries->items[i]);
+    return true;
+}
+
+// The baseline keeps the bench record format with the median as ops_per_sec
+static bool perf_record(Perf_Entries *entries, const char *path) {
+    Nob_String_Builder sb = {0};
+    nob_sb_appendf(&sb, "{\"runs\": %d, \"results\": [\n", PERF_RUNS);
+    for (size_t i = 0; i < entries->count; i++) {
+        Perf_Entry *e = &entries->items[i];
+        char *slash = strchr(e->name, '/');
+        nob_sb_appendf(&sb, "%s  {\"workload\": \"%.*s\", \"op\": \"%s\", \"ops_per_sec\": %.6g, "
+                       "\"ci_low\": %.6g, \"ci_high\": %.6g}",
+                       i ? ",\n" : "", (int)(slash - e->name), e->name, slash + 1, e->median, e->low, e->high);
+    }
+    nob_sb_appendf(&sb, "\n]}\n");
+    bool ok = nob_write_entire_file(path, sb.items, sb.count);
+    nob_sb_free(sb);
+    return ok;
+}
+
 int main(int argc, char **argv) {
     NOB_GO_REBUILD_URSELF(argc, argv);
 
@@ -11,7 +182,7 @@ int main(int argc, char **argv) {
     const char *regression_path = "examples\\";
     const char *output_path = "examples\\";
     
-    const char *regression_files[REGRESSION_COUNT] = {"number_arithmetic","symbol_and_number_arithmetic","calculus","evaluation"};
+    const char *regression_files[REGRESSION_COUNT] = {"number_arithmetic","symbol_and_number_arithmetic","calculus","evaluation","parallel","batch","rational","ode","hashcons","snapshot","polynomial","roots","fit","gmp_pool","instrumentation",CPP_REGRESSION};
     const char *regression_str = ".regression";
     const char *output_str = ".output";
     const char *err_str = ".err";
@@ -21,14 +192,77 @@ int main(int argc, char **argv) {
     Nob_Fd fdout = NOB_INVALID_FD;
 
     if (argc < 2) {
-        nob_log(NOB_ERROR, "Usage: nob <build|run|record|test>");
+        nob_log(NOB_ERROR, "Usage: nob <build|run|record|test|bench|bench-record|perfcheck>");
         return 1;
     }
 
     const char *mode = argv[1];
 
+    // Bench
+    if (strcmp(mode, "bench") == 0) {
+        if (!build_bench(&cmd)) return 1;
+        if (!run_bench(&cmd, BENCH_OUTPUT, NULL)) return 1;
+        nob_log(NOB_INFO, "Benchmark results written to %s", BENCH_OUTPUT);
+        return 0;
+    }
+
+    // Record the performance baseline (rebase)
+    if (strcmp(mode, "bench-record") == 0) {
+        Perf_Entries current = {0};
+        if (!build_bench(&cmd)) return 1;
+        if (!perf_collect(&cmd, &current)) return 1;
+        if (!perf_record(&current, BENCH_BASELINE)) return 1;
+        nob_log(NOB_INFO, "Baseline of %zu measurements written to %s", current.count, BENCH_BASELINE);
+        nob_da_free(current);
+        return 0;
+    }
+
+    // Perfcheck: fail when a median drops below the baseline beyond the
+    // threshold, and the whole confidence interval with it
+    if (strcmp(mode, "perfcheck") == 0) {
+        Perf_Entries baseline = {0};
+        Perf_Entries current = {0};
+        if (!perf_load(&baseline, BENCH_BASELINE)) {
+            nob_log(NOB_ERROR, "No baseline, run `nob bench-record` first.");
+            return 1;
+        }
+        if (!build_bench(&cmd)) return 1;
+        if (!perf_collect(&cmd, &current)) return 1;
+
+        size_t regressions = 0;
+        for (size_t i = 0; i < baseline.count; i++) {
+            Perf_Entry *base = &baseline.items[i];
+            Perf_Entry *now = perf_find(&current, base->name);
+            if (!now) {
+                nob_log(NOB_WARNING, "%s: missing from this run", base->name);
+                continue;
+            }
+            double ref = base->samples[0];
+            double change = now->median/ref - 1.0;
+            if (now->high < ref*(1.0 - PERF_THRESHOLD)) {
+                nob_log(NOB_ERROR, "%s: %.6g ops/sec [%.6g, %.6g] vs baseline %.6g (%+.1f%%)",
+                        base->name, now->median, now->low, now->high, ref, 100.0*change);
+                regressions++;
+            } else {
+                nob_log(NOB_INFO, "%s: %.6g ops/sec (%+.1f%%)", base->name, now->median, 100.0*change);
+            }
+        }
+        nob_da_free(baseline);
+        nob_da_free(current);
+        if (regressions) {
+            nob_log(NOB_ERROR, "Performance check failed. %zu regressions.", regressions);
+            return 1;
+        }
+        nob_log(NOB_INFO, "Performance check passed. No regressions.");
+        return 0;
+    }
+
     // Compile
     for(size_t i =0; i<REGRESSION_COUNT;i++) {
+        if (strcmp(regression_files[i], CPP_REGRESSION) == 0) {
+            if (!build_cpp_example(&cmd)) return 1;
+            continue;
+        }
         char src_file[256];
         sprintf(src_file, "%s%s%s",regression_path,regression_files[i],extension_src);
         char exec_file[256];
@@ -37,7 +271,7 @@ int main(int argc, char **argv) {
             "gcc", "-g", "-w", src_file,
             "-I", "C:/vcpkg/installed/x64-mingw-static/include",
             "-L", "C:/vcpkg/installed/x64-mingw-static/lib",
-            "-lgmp", "-static",
+            "-lgmp", "-lpthread", "-static",
             "-o", exec_file
         );
 